@@ -0,0 +1,372 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "bench.hpp"
+
+#include "output.hpp"
+#include "build.hpp"
+#include "search.hpp"
+#include "files.hpp"
+#include "fileutil.hpp"
+#include "filestream.hpp"
+#include "constants.hpp"
+#include "stringutil.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <stdarg.h>
+
+enum BenchCommand
+{
+	BC_SEARCH,
+	BC_FILES
+};
+
+struct BenchQuery
+{
+	const char* name;
+	BenchCommand command;
+	unsigned int options;
+	const char* query;
+};
+
+// The suite is fixed so that results of different runs can be compared; queries only use words that are common in source code,
+// and the synthetic corpus is generated to contain all of them
+static const BenchQuery kBenchQueries[] =
+{
+	{ "literal", BC_SEARCH, SO_LITERAL, "return" },
+	{ "literal-rare", BC_SEARCH, SO_LITERAL, "file0123" },
+	{ "literal-missing", BC_SEARCH, SO_LITERAL, "qgrep_bench_missing" },
+	{ "ignorecase", BC_SEARCH, SO_LITERAL | SO_IGNORECASE, "error" },
+	{ "ignorecase-highlight", BC_SEARCH, SO_LITERAL | SO_IGNORECASE | SO_HIGHLIGHT, "error" },
+	{ "ignorecase-json", BC_SEARCH, SO_LITERAL | SO_IGNORECASE | SO_JSON, "error" },
+	{ "regex", BC_SEARCH, 0, "(get|set)[A-Z]\\w+\\(" },
+	{ "regex-class", BC_SEARCH, 0, "\\w+_t\\s+\\w+ =" },
+	{ "bruteforce", BC_SEARCH, SO_LITERAL | SO_BRUTEFORCE, "return" },
+	{ "files", BC_FILES, SO_FILE_PATHREGEX, "mod0[0-3]/.*\\.hpp$" },
+	{ "fuzzy", BC_FILES, SO_FILE_FUZZY, "m1f12" },
+};
+
+struct BenchQueryResult
+{
+	unsigned int matches;
+
+	std::vector<double> latencies;
+
+	// totals over all timed runs
+	uint64_t prefilterTime;
+	uint64_t readTime;
+	uint64_t decompressTime;
+	uint64_t searchTime;
+	uint64_t outputTime;
+
+	uint64_t chunksSearched;
+	uint64_t bytesSearched;
+};
+
+static std::string formatString(const char* format, ...)
+{
+	std::string result;
+
+	va_list l;
+	va_start(l, format);
+	strprintf(result, format, l);
+	va_end(l);
+
+	return result;
+}
+
+// Deterministic generator so that synthetic corpora are identical on all platforms
+struct BenchRandom
+{
+	uint64_t state;
+
+	unsigned int next()
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		return static_cast<unsigned int>(state >> 32);
+	}
+
+	unsigned int range(unsigned int count)
+	{
+		return next() % count;
+	}
+
+	// skewed towards small values, similar to how word frequencies are distributed
+	unsigned int skewed(unsigned int count)
+	{
+		double r = double(next()) / 4294967296.0;
+
+		return static_cast<unsigned int>(r * r * r * count);
+	}
+};
+
+static std::vector<std::string> generateWords(BenchRandom& rng, size_t count)
+{
+	static const char* syllables[] = { "buf", "chunk", "data", "file", "index", "item", "key", "list", "map", "node", "path", "pool", "queue", "read", "size", "text", "tree", "write" };
+	const size_t syllableCount = sizeof(syllables) / sizeof(syllables[0]);
+
+	std::vector<std::string> result;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		std::string word = syllables[rng.range(syllableCount)];
+		std::string next = syllables[rng.range(syllableCount)];
+
+		next[0] = static_cast<char>(next[0] - 'a' + 'A');
+		word += next;
+
+		if (i % 3 == 0)
+			word += formatString("%d", int(i));
+
+		result.push_back(word);
+	}
+
+	return result;
+}
+
+static std::string generateFile(BenchRandom& rng, const std::vector<std::string>& words, unsigned int fileCount, unsigned int moduleCount)
+{
+	auto word = [&]() -> const std::string& { return words[rng.skewed(words.size())]; };
+
+	std::string result = "// This file is generated by qgrep bench\n\n";
+
+	for (unsigned int i = rng.range(6) + 1; i > 0; --i)
+		result += formatString("#include \"mod%02d/file%04d.hpp\"\n", rng.range(moduleCount), rng.range(fileCount));
+
+	for (unsigned int f = rng.range(16) + 4; f > 0; --f)
+	{
+		const std::string& name = word();
+
+		result += formatString("\n// %s %s for %s\n", word().c_str(), word().c_str(), word().c_str());
+		result += formatString("static int %s%s(%s_t %s, const char* %s)\n{\n", (f % 2) ? "get" : "set", name.c_str(), word().c_str(), word().c_str(), word().c_str());
+
+		for (unsigned int l = rng.range(12) + 2; l > 0; --l)
+		{
+			switch (rng.range(6))
+			{
+			case 0:
+				result += formatString("\t%s_t %s = %s(%s);\n", word().c_str(), word().c_str(), word().c_str(), word().c_str());
+				break;
+			case 1:
+				result += formatString("\tif (%s == %s)\n\t\treturn %s;\n", word().c_str(), word().c_str(), word().c_str());
+				break;
+			case 2:
+				result += formatString("\tfor (size_t i = 0; i < %s.size(); ++i)\n\t\t%s[i] += %s;\n", word().c_str(), word().c_str(), word().c_str());
+				break;
+			case 3:
+				result += formatString("\tif (!%s)\n\t\tERROR(\"%s failed\");\n", word().c_str(), word().c_str());
+				break;
+			case 4:
+				result += formatString("\t%s->set%s(%s);\n", word().c_str(), word().c_str(), word().c_str());
+				break;
+			default:
+				result += formatString("\t// %s %s %s\n", word().c_str(), word().c_str(), word().c_str());
+			}
+		}
+
+		result += formatString("\treturn %s;\n}\n", word().c_str());
+	}
+
+	return result;
+}
+
+static bool generateCorpus(Output* output, const std::string& path)
+{
+	BenchRandom rng = { 0x9e3779b97f4a7c15ull };
+
+	std::vector<std::string> words = generateWords(rng, kBenchCorpusWords);
+
+	for (unsigned int i = 0; i < kBenchCorpusFiles; ++i)
+	{
+		unsigned int module = i % kBenchCorpusModules;
+		std::string filePath = path + formatString("/mod%02d/file%04d.%s", module, i, (i % 4 == 0) ? "hpp" : "cpp");
+		std::string contents = generateFile(rng, words, kBenchCorpusFiles, kBenchCorpusModules);
+
+		createPathForFile(filePath.c_str());
+
+		FileStream out(filePath.c_str(), "wb");
+		if (!out)
+		{
+			output->error("Error opening file %s for writing\n", filePath.c_str());
+			return false;
+		}
+
+		out.write(contents.data(), contents.size());
+	}
+
+	// minified files have very long lines with many matches; highlighting and JSON output find all matches in the line
+	std::string longLinePath = path + "/mod00/generated.min.cpp";
+	std::string longLine;
+
+	while (longLine.size() < kBenchLongLineSize)
+		longLine += generateFile(rng, words, kBenchCorpusFiles, kBenchCorpusModules);
+
+	std::replace(longLine.begin(), longLine.end(), '\n', ' ');
+
+	FileStream out(longLinePath.c_str(), "wb");
+	if (!out)
+	{
+		output->error("Error opening file %s for writing\n", longLinePath.c_str());
+		return false;
+	}
+
+	out.write(longLine.data(), longLine.size());
+
+	return true;
+}
+
+static uint64_t getFileSize(const std::string& path)
+{
+	uint64_t mtime, size;
+
+	return getFileAttributes(path.c_str(), &mtime, &size) ? size : 0;
+}
+
+static double getPercentile(std::vector<double> values, double percentile)
+{
+	if (values.empty())
+		return 0;
+
+	std::sort(values.begin(), values.end());
+
+	// nearest rank
+	size_t rank = static_cast<size_t>(percentile / 100 * values.size() + 0.5);
+
+	return values[std::min(values.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+static BenchQueryResult runQuery(Output* output, const char* path, const BenchQuery& query)
+{
+	ErrorOutput silentOutput(output);
+
+	BenchQueryResult result = {};
+
+	for (int run = -kBenchWarmupRuns; run < kBenchRuns; ++run)
+	{
+		SearchStatistics statistics;
+
+		auto start = std::chrono::high_resolution_clock::now();
+
+		unsigned int matches = (query.command == BC_SEARCH)
+			? searchProject(&silentOutput, path, query.query, query.options, ~0u, nullptr, nullptr, nullptr, &statistics)
+			: searchFiles(&silentOutput, path, query.query, query.options, ~0u, nullptr, nullptr);
+
+		double time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		if (run < 0)
+			continue;
+
+		result.matches = matches;
+		result.latencies.push_back(time);
+
+		result.prefilterTime += statistics.prefilterTime;
+		result.readTime += statistics.readTime;
+		result.decompressTime += statistics.decompressTime;
+		result.searchTime += statistics.searchTime;
+		result.outputTime += statistics.outputTime;
+		result.chunksSearched += statistics.chunksSearched;
+		result.bytesSearched += statistics.bytesSearched;
+	}
+
+	return result;
+}
+
+static std::string escapeJson(const char* value)
+{
+	std::string result;
+
+	for (const char* s = value; *s; ++s)
+	{
+		if (*s == '"' || *s == '\\')
+			result += '\\';
+
+		result += *s;
+	}
+
+	return result;
+}
+
+void benchProject(Output* output, const char* path, const char* corpusPath)
+{
+	std::string cwd = getCurrentDirectory();
+	std::string benchPath = normalizePath(cwd.c_str(), path);
+	std::string corpus = corpusPath ? normalizePath(cwd.c_str(), corpusPath) : benchPath + "/corpus";
+
+	if (!corpusPath && !generateCorpus(output, corpus))
+		return;
+
+	std::string projectPath = benchPath + "/bench.cfg";
+
+	{
+		createPathForFile(projectPath.c_str());
+
+		FileStream out(projectPath.c_str(), "wb");
+		if (!out)
+		{
+			output->error("Error opening project file %s for writing\n", projectPath.c_str());
+			return;
+		}
+
+		std::string contents = "path " + corpus + "\n";
+		out.write(contents.data(), contents.size());
+	}
+
+	ErrorOutput silentOutput(output);
+
+	auto buildStartTime = std::chrono::high_resolution_clock::now();
+
+	buildProject(&silentOutput, projectPath.c_str());
+
+	double buildTime = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - buildStartTime).count();
+
+	std::vector<BenchQueryResult> results;
+
+	for (auto& q: kBenchQueries)
+		results.push_back(runQuery(output, projectPath.c_str(), q));
+
+	// bruteforce search scans all chunks, so it gives the total amount of data
+	uint64_t dataSize = 0;
+
+	for (size_t i = 0; i < results.size(); ++i)
+		if (kBenchQueries[i].options & SO_BRUTEFORCE)
+			dataSize = results[i].bytesSearched / kBenchRuns;
+
+	output->print("{\n");
+	output->print("  \"corpus\": {\"path\": \"%s\", \"generated\": %s, \"bytes\": %llu},\n", escapeJson(corpus.c_str()).c_str(), corpusPath ? "false" : "true",
+		static_cast<unsigned long long>(dataSize));
+	output->print("  \"build\": {\"time\": %.3f, \"dataSize\": %llu, \"filesSize\": %llu},\n", buildTime,
+		static_cast<unsigned long long>(getFileSize(replaceExtension(projectPath.c_str(), ".qgd"))),
+		static_cast<unsigned long long>(getFileSize(replaceExtension(projectPath.c_str(), ".qgf"))));
+	output->print("  \"runs\": %d,\n", kBenchRuns);
+	output->print("  \"queries\": [\n");
+
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const BenchQuery& q = kBenchQueries[i];
+		const BenchQueryResult& r = results[i];
+
+		double p50 = getPercentile(r.latencies, 50);
+
+		// stage times are in milliseconds per run; search time excludes the time to format output
+		auto stage = [](uint64_t total) { return double(total) / 1e6 / kBenchRuns; };
+
+		output->print("    {\"name\": \"%s\", \"command\": \"%s\", \"query\": \"%s\", \"matches\": %u,\n", q.name, q.command == BC_SEARCH ? "search" : "files",
+			escapeJson(q.query).c_str(), r.matches);
+		output->print("     \"latency\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n",
+			getPercentile(r.latencies, 0) * 1e3, p50 * 1e3, getPercentile(r.latencies, 90) * 1e3, getPercentile(r.latencies, 99) * 1e3, getPercentile(r.latencies, 100) * 1e3);
+		output->print("     \"throughput\": %.1f,\n", p50 > 0 ? double(dataSize) / (1024 * 1024) / p50 : 0.0);
+		output->print("     \"stages\": {\"prefilter\": %.3f, \"read\": %.3f, \"decompress\": %.3f, \"search\": %.3f, \"output\": %.3f},\n",
+			stage(r.prefilterTime), stage(r.readTime), stage(r.decompressTime), stage(r.searchTime - std::min(r.searchTime, r.outputTime)), stage(r.outputTime));
+		output->print("     \"chunks\": %llu, \"bytes\": %llu}%s\n", static_cast<unsigned long long>(r.chunksSearched / kBenchRuns),
+			static_cast<unsigned long long>(r.bytesSearched / kBenchRuns), i + 1 < results.size() ? "," : "");
+	}
+
+	output->print("  ]\n");
+	output->print("}\n");
+}
@@ -0,0 +1,7 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+class Output;
+
+// Builds a project for the corpus (a synthetic corpus is generated in path if corpusPath is null), runs a fixed query suite and prints the results as JSON
+void benchProject(Output* output, const char* path, const char* corpusPath);
@@ -3,6 +3,22 @@
 
 #include "blockpool.hpp"
 
+#include "constants.hpp"
+
+#include <algorithm>
+#include <new>
+
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	include <Windows.h>
+#else
+#	include <sys/mman.h>
+#	include <unistd.h>
+#	ifdef __linux__
+#		include <sys/syscall.h>
+#	endif
+#endif
+
 static char* pop(std::vector<char*>& v)
 {
 	char* r = v.back();
@@ -10,36 +26,217 @@ static char* pop(std::vector<char*>& v)
 	return r;
 }
 
-BlockPool::BlockPool(size_t blockSize): blockSize(blockSize), liveBlocks(0)
+#ifdef __linux__
+static const int kMpolPreferred = 1;
+
+static bool setMemoryNode(void* data, size_t size, int node)
 {
+	// glibc doesn't provide mbind without libnuma; the node mask has to be large enough for any node number
+	unsigned long mask[1024 / (sizeof(unsigned long) * 8)] = {};
+
+	if (node < 0 || size_t(node) >= sizeof(mask) * 8)
+		return false;
+
+	mask[node / (sizeof(unsigned long) * 8)] |= 1ul << (node % (sizeof(unsigned long) * 8));
+
+	return syscall(SYS_mbind, data, size, kMpolPreferred, mask, sizeof(mask) * 8 + 1, 0) == 0;
+}
+#endif
+
+// Allocates memory directly from the system, optionally placed on a NUMA node (-1 for any node)
+// Large pages need special privileges on Windows and reserved pages on Linux, so regular pages are used if they can't be allocated
+static char* allocatePages(size_t& size, bool largePages, int node)
+{
+#if defined(_WIN32)
+	size_t pageSize = largePages ? GetLargePageMinimum() : 0;
+	void* result = nullptr;
+
+	for (int attempt = pageSize ? 0 : 1; attempt < 2 && !result; ++attempt)
+	{
+		DWORD type = MEM_RESERVE | MEM_COMMIT | (attempt == 0 ? MEM_LARGE_PAGES : 0);
+		size_t allocSize = attempt == 0 ? (size + pageSize - 1) & ~(pageSize - 1) : size;
+
+		result = node >= 0
+			? VirtualAllocExNuma(GetCurrentProcess(), nullptr, allocSize, type, PAGE_READWRITE, DWORD(node))
+			: VirtualAlloc(nullptr, allocSize, type, PAGE_READWRITE);
+
+		if (result)
+			size = allocSize;
+	}
+
+	return static_cast<char*>(result);
+#else
+	void* result = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (largePages)
+		result = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+	// transparent huge pages don't need to be reserved, but the kernel only uses them for mappings that ask for it
+	if (result == MAP_FAILED)
+	{
+		result = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	#ifdef MADV_HUGEPAGE
+		if (largePages && result != MAP_FAILED)
+			madvise(result, size, MADV_HUGEPAGE);
+	#endif
+	}
+
+	if (result == MAP_FAILED)
+		return nullptr;
+
+	// pages are only placed when they are touched, so the policy applies to the entire slab
+#ifdef __linux__
+	if (node >= 0)
+		setMemoryNode(result, size, node);
+#else
+	(void)node;
+#endif
+
+	return static_cast<char*>(result);
+#endif
+}
+
+static void freePages(char* data, size_t size)
+{
+#ifdef _WIN32
+	VirtualFree(data, 0, MEM_RELEASE);
+#else
+	munmap(data, size);
+#endif
+}
+
+BlockPool::BlockPool(size_t blockSize, bool largePages, int numaNode)
+	: largePages(largePages), numaNode(numaNode), liveBlocks(0), liveSize(0), slabSize(0), allocations(0), heapAllocations(0)
+{
+	// sizes alternate between powers of two and 1.5x powers of two
+	for (size_t size = kBlockPoolMinBlockSize; size < blockSize * kBlockPoolMaxBlockRatio; size = (classSizes.size() % 2) ? size * 3 / 2 : size * 4 / 3)
+		classSizes.push_back(size);
+
+	classSizes.push_back(blockSize * kBlockPoolMaxBlockRatio);
+
+	blocks.resize(classSizes.size());
 }
 
 BlockPool::~BlockPool()
 {
 	assert(liveBlocks == 0);
 
-	for (size_t i = 0; i < blocks.size(); ++i)
-		delete[] blocks[i];
+	for (auto& s: slabs)
+	{
+		if (s.second.pages)
+			freePages(s.second.data, s.second.size);
+		else
+			delete[] s.second.data;
+	}
+}
+
+void BlockPool::allocateSlab(size_t sizeClass)
+{
+	size_t classSize = classSizes[sizeClass];
+	size_t blockCount = std::max<size_t>(1, std::min(kBlockPoolSlabBlocks, kBlockPoolSlabSize / classSize));
+
+	Slab slab = { nullptr, classSize * blockCount, false, sizeClass, 0 };
+
+	bool slabLargePages = largePages && slab.size >= kLargePageSize;
+
+	// the heap can't place memory on a node, so slabs of pools that have one are always allocated from the system
+	if (slabLargePages || numaNode >= 0)
+	{
+		if (slabLargePages)
+			slab.size = (slab.size + kLargePageSize - 1) & ~(kLargePageSize - 1);
+
+		slab.data = allocatePages(slab.size, slabLargePages, numaNode);
+		slab.pages = slab.data != nullptr;
+	}
+
+	if (!slab.data)
+		slab.data = new char[slab.size];
+
+	slabs[slab.data] = slab;
+	slabSize += slab.size;
+
+	for (size_t offset = 0; offset + classSize <= slab.size; offset += classSize)
+		blocks[sizeClass].push_back(slab.data + offset);
+}
+
+void BlockPool::freeSlab(Slab& slab)
+{
+	assert(slab.liveBlocks == 0);
+
+	std::vector<char*>& free = blocks[slab.sizeClass];
+	char* begin = slab.data;
+	char* end = slab.data + slab.size;
+
+	free.erase(std::remove_if(free.begin(), free.end(), [&](char* block) { return block >= begin && block < end; }), free.end());
+
+	slabSize -= slab.size;
+
+	if (slab.pages)
+		freePages(slab.data, slab.size);
+	else
+		delete[] slab.data;
+
+	slabs.erase(begin);
+}
+
+BlockPool::Slab& BlockPool::getSlab(char* block)
+{
+	auto it = slabs.upper_bound(block);
+	assert(it != slabs.begin());
+
+	--it;
+	assert(block >= it->second.data && block < it->second.data + it->second.size);
+
+	return it->second;
+}
+
+void BlockPool::release(char* block, size_t sizeClass)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	assert(liveBlocks > 0);
+	liveBlocks--;
+	liveSize -= classSizes[sizeClass];
+
+	blocks[sizeClass].push_back(block);
+
+	Slab& slab = getSlab(block);
+
+	if (--slab.liveBlocks == 0 && slabSize - liveSize > kBlockPoolMaxFreeSize)
+		freeSlab(slab);
 }
 
 std::shared_ptr<char> BlockPool::allocate(size_t size)
 {
-	if (size > blockSize)
+	size_t sizeClass = std::lower_bound(classSizes.begin(), classSizes.end(), size) - classSizes.begin();
+
+	if (sizeClass == classSizes.size())
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		heapAllocations++;
+
 		return std::shared_ptr<char>(new char[size], std::default_delete<char[]>());
+	}
 
 	std::lock_guard<std::mutex> lock(mutex);
 
-	char* block = blocks.empty() ? new char[blockSize] : pop(blocks);
+	if (blocks[sizeClass].empty())
+		allocateSlab(sizeClass);
 
-	liveBlocks++;
+	char* block = pop(blocks[sizeClass]);
 
-	return std::shared_ptr<char>(block, [this](char* block) {
-		std::lock_guard<std::mutex> lock(this->mutex);
+	getSlab(block).liveBlocks++;
 
-		assert(liveBlocks > 0);
-		liveBlocks--;
+	liveBlocks++;
+	liveSize += classSizes[sizeClass];
+	allocations++;
 
-		blocks.push_back(block);
+	return std::shared_ptr<char>(block, [this, sizeClass](char* block) {
+		this->release(block, sizeClass);
 	});
 }
 
@@ -54,3 +251,19 @@ std::shared_ptr<char> BlockPool::allocate(size_t size, std::nothrow_t)
 		return std::shared_ptr<char>();
 	}
 }
+
+BlockPool::Statistics BlockPool::getStatistics()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	Statistics result = {};
+	result.liveBlocks = liveBlocks;
+	result.slabSize = slabSize;
+	result.allocations = allocations;
+	result.heapAllocations = heapAllocations;
+
+	for (auto& b: blocks)
+		result.freeBlocks += b.size();
+
+	return result;
+}
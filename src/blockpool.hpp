@@ -3,21 +3,65 @@
 
 #include <mutex>
 #include <vector>
+#include <map>
 #include <memory>
 
+// Pool of chunk buffers; blocks come in several size classes up to a few times the block size, and are carved out of slabs that
+// can use large pages and be placed on a NUMA node if requested. Blocks that are larger than the largest size class are allocated on the heap.
+// Slabs without blocks in use are freed when the pool keeps too much unused memory, so a burst of large allocations isn't retained forever.
 class BlockPool
 {
 public:
-    BlockPool(size_t blockSize);
+	struct Statistics
+	{
+		size_t liveBlocks;
+		size_t freeBlocks;
+		size_t slabSize;
+
+		unsigned long long allocations;
+		unsigned long long heapAllocations;
+	};
+
+	BlockPool(size_t blockSize, bool largePages = false, int numaNode = -1);
 	~BlockPool();
 
 	std::shared_ptr<char> allocate(size_t size);
 	std::shared_ptr<char> allocate(size_t size, std::nothrow_t);
 
+	Statistics getStatistics();
+
 private:
-    size_t blockSize;
+	struct Slab
+	{
+		char* data;
+		size_t size;
+		bool pages;
+
+		size_t sizeClass;
+		size_t liveBlocks;
+	};
+
+	bool largePages;
+	int numaNode;
+
+	std::vector<size_t> classSizes;
 
 	std::mutex mutex;
-	std::vector<char*> blocks;
+	std::vector<std::vector<char*>> blocks;
+
+	// slabs are keyed by address so that blocks can find their slab
+	std::map<char*, Slab> slabs;
+
 	size_t liveBlocks;
-};
\ No newline at end of file
+	size_t liveSize;
+	size_t slabSize;
+
+	unsigned long long allocations;
+	unsigned long long heapAllocations;
+
+	void allocateSlab(size_t sizeClass);
+	void freeSlab(Slab& slab);
+
+	Slab& getSlab(char* block);
+	void release(char* block, size_t sizeClass);
+};
@@ -6,6 +6,25 @@ inline unsigned int ngram(char a, char b, char c, char d)
     return (static_cast<unsigned char>(a) << 24) + (static_cast<unsigned char>(b) << 16) + (static_cast<unsigned char>(c) << 8) + static_cast<unsigned char>(d);
 }
 
+// Bigram filter is an exact bitmap of byte pairs; the high bit of each byte is dropped to keep the bitmap small,
+// which only merges non-ASCII bytes with ASCII ones
+const unsigned int kBigramFilterSize = 2048;
+
+inline unsigned int bigram(char a, char b)
+{
+    return ((static_cast<unsigned char>(a) & 0x7f) << 7) + (static_cast<unsigned char>(b) & 0x7f);
+}
+
+inline void bigramFilterUpdate(unsigned char* data, unsigned int value)
+{
+    data[value / 8] |= 1 << (value % 8);
+}
+
+inline bool bigramFilterExists(const unsigned char* data, unsigned int value)
+{
+    return (data[value / 8] & (1 << (value % 8))) != 0;
+}
+
 // 6-shift variant from http://burtleburtle.net/bob/hash/integer.html
 inline unsigned int bloomHash1(unsigned int v)
 {
@@ -62,3 +81,60 @@ inline bool bloomFilterExists(const unsigned char* data, unsigned int size, unsi
 
     return true;
 }
+
+// Blocked variant keeps all probes for a value within one cache line
+const unsigned int kBloomBlockSize = 64;
+
+inline unsigned char* bloomBlockedFilterBlock(unsigned char* data, unsigned int size, unsigned int h)
+{
+    // multiply-shift maps the hash to [0..blockCount) without a division
+    return data + static_cast<unsigned int>((static_cast<uint64_t>(h) * (size / kBloomBlockSize)) >> 32) * kBloomBlockSize;
+}
+
+inline const unsigned char* bloomBlockedFilterBlock(const unsigned char* data, unsigned int size, unsigned int h)
+{
+    return data + static_cast<unsigned int>((static_cast<uint64_t>(h) * (size / kBloomBlockSize)) >> 32) * kBloomBlockSize;
+}
+
+inline void bloomBlockedFilterUpdate(unsigned char* data, unsigned int size, unsigned int value, unsigned int iterations)
+{
+    assert(size >= kBloomBlockSize && size % kBloomBlockSize == 0);
+
+    unsigned int h1 = bloomHash1(value);
+    unsigned int h2 = bloomHash2(value);
+    unsigned int hv = h1;
+
+    unsigned char* block = bloomBlockedFilterBlock(data, size, h1);
+
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+        hv += h2;
+        unsigned int h = hv >> 23; // 9 bits select a bit in a 512-bit block
+
+        block[h / 8] |= 1 << (h % 8);
+    }
+}
+
+inline bool bloomBlockedFilterExists(const unsigned char* data, unsigned int size, unsigned int value, unsigned int iterations)
+{
+    assert(size >= kBloomBlockSize && size % kBloomBlockSize == 0);
+
+    unsigned int h1 = bloomHash1(value);
+    unsigned int h2 = bloomHash2(value);
+    unsigned int hv = h1;
+
+    const unsigned char* block = bloomBlockedFilterBlock(data, size, h1);
+
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+        hv += h2;
+        unsigned int h = hv >> 23;
+
+        if (block[h / 8] & (1 << (h % 8)))
+            ;
+        else
+            return false;
+    }
+
+    return true;
+}
@@ -7,6 +7,7 @@
 #include "fileutil.hpp"
 #include "filestream.hpp"
 #include "constants.hpp"
+#include "changes.hpp"
 #include "project.hpp"
 #include "encoding.hpp"
 #include "files.hpp"
@@ -15,14 +16,20 @@
 #include "compression.hpp"
 #include "workqueue.hpp"
 #include "blockingqueue.hpp"
+#include "postings.hpp"
+#include "stringutil.hpp"
+#include "datafile.hpp"
 
 #include <algorithm>
 #include <vector>
-#include <list>
 #include <numeric>
 #include <string>
 #include <memory>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <future>
 
 #include <string.h>
 
@@ -44,7 +51,11 @@ struct Blob
 	{
 	}
 
-	Blob(std::vector<char> storage): offset(0), count(storage.size()), storage(new std::vector<char>(std::move(storage)))
+	Blob(std::vector<char> storage): offset(0), count(storage.size()), storage(std::make_shared<std::vector<char>>(std::move(storage)))
+	{
+	}
+
+	Blob(const std::shared_ptr<std::vector<char>>& storage, size_t offset, size_t count): offset(offset), count(count), storage(storage)
 	{
 	}
 
@@ -58,11 +69,67 @@ struct Blob
 	{
 		return count;
 	}
+
+	std::string str() const
+	{
+		return std::string(data(), count);
+	}
+
+	bool operator==(const char* value) const
+	{
+		return strncmp(data(), value, count) == 0 && value[count] == 0;
+	}
+};
+
+// Pending files that don't come with their own buffers are packed into large blocks, together with the names of all pending files;
+// a block is released when the last chunk that refers to it is prepared, which replaces individual allocations with one per block
+struct BuildArena
+{
+	std::shared_ptr<std::vector<char>> block;
+
+	Blob allocate(const char* data, size_t size, size_t capacity = 0)
+	{
+		capacity = std::max(capacity, size);
+
+		// blocks never grow past their reserved capacity so that the blobs that point into them stay valid
+		if (!block || block->capacity() - block->size() < capacity)
+		{
+			block = std::make_shared<std::vector<char>>();
+			block->reserve(std::max(capacity, kBuildArenaBlockSize));
+		}
+
+		Blob result(block, block->size(), size);
+
+		block->insert(block->end(), data, data + size);
+
+		return result;
+	}
+
+	// Appends data to the blob in place if it ends its block and there's room, otherwise moves it to a new location with some room to grow
+	void append(Blob& blob, const char* data, size_t size)
+	{
+		std::vector<char>& storage = *blob.storage;
+
+		if (blob.offset + blob.count == storage.size() && storage.capacity() - storage.size() >= size)
+		{
+			storage.insert(storage.end(), data, data + size);
+			blob.count += size;
+		}
+		else
+		{
+			Blob result = allocate(blob.data(), blob.size(), (blob.size() + size) * 2);
+
+			result.storage->insert(result.storage->end(), data, data + size);
+			result.count += size;
+
+			blob = result;
+		}
+	}
 };
 
 struct File
 {
-	std::string name;
+	Blob name;
 	Blob contents;
 
 	uint32_t startLine;
@@ -94,8 +161,9 @@ struct ChunkIndex
 	std::unique_ptr<char[]> data;
 	size_t size;
 	unsigned int iterations;
+	unsigned int type;
 
-	ChunkIndex(): size(0), iterations(0)
+	ChunkIndex(): size(0), iterations(0), type(IT_BLOOMBLOCKED)
 	{
 	}
 };
@@ -108,27 +176,96 @@ struct ChunkFileData
 	std::unique_ptr<char[]> compressedData;
 	std::unique_ptr<char[]> index;
 	std::unique_ptr<char[]> extra;
+	std::string firstFile;
 	bool firstFileIsSuffix;
+
+	// newline-terminated paths of all files in the chunk
+	std::string paths;
+
+	std::vector<unsigned int> ngrams;
+
+	// offset of compressed data in the output file if the chunk is already stored there; 0 if the data has to be written
+	uint64_t dataOffset;
+};
+
+struct ChunkTableData
+{
+	uint64_t dataOffset;
+
+	std::vector<char> index;
+	std::vector<char> paths;
+	PostingIndexBuilder postings;
+	std::vector<DataChunkTableEntry> entries;
+	std::vector<char> names;
+
+	ChunkTableData(): dataOffset(0)
+	{
+	}
+};
+
+struct FileReadResult
+{
+	enum Status
+	{
+		Status_Ok,
+		Status_OpenError,
+		Status_OutOfMemory
+	};
+
+	Status status;
+	std::vector<char> contents;
+};
+
+struct FileRead
+{
+	std::string path;
+	uint64_t timeStamp;
+	uint64_t fileSize;
+
+	std::future<FileReadResult> result;
 };
 
 struct BuildContext
 {
 	Output* output;
+	ProjectOptions options;
 	size_t fileCount;
 
-	std::list<File> pendingFiles;
+	std::deque<File> pendingFiles;
 	size_t pendingSize;
+	BuildArena pendingArena;
+
+	std::deque<FileRead> pendingReads;
+	uint64_t pendingReadSize;
 
 	FileStream outData;
+	uint64_t outDataOffset;
+	bool aborted;
+
+	// generation of the header that is written when the build finishes; appending to a file writes the slot that isn't current
+	uint32_t headerGeneration;
+	bool appending;
+
+	// chunks are compressed with the dictionary if the project uses CC_LZ4DICT codec and the dictionary is not empty
+	std::string dictionary;
+	uint64_t dictionaryOffset;
 
 	unsigned int chunkOrder;
+
+	// chunk and file count of the hot tier; both are 0 until the tier ends
+	unsigned int hotChunkCount;
+	unsigned int hotFileCount;
+
 	WorkQueue prepareChunkQueue;
 	BlockingQueue<ChunkFileData> writeChunkQueue;
 	std::thread writeChunkThread;
 
-	BuildContext(Output* output, size_t fileCount)
-		: output(output), fileCount(fileCount), pendingSize(0), chunkOrder(0)
+	WorkQueue readFileQueue;
+
+	BuildContext(Output* output, const ProjectOptions& options, size_t fileCount)
+		: output(output), options(options), fileCount(fileCount), pendingSize(0), pendingReadSize(0), outDataOffset(kDataFileHeaderSlots * sizeof(DataFileHeader)), aborted(false), headerGeneration(1), appending(false), dictionaryOffset(0), chunkOrder(0), hotChunkCount(0), hotFileCount(0)
 		, prepareChunkQueue(std::max(WorkQueue::getIdealWorkerCount(), 2u) - 1, kMaxQueuedChunkData)
+		, readFileQueue(WorkQueue::getIdealWorkerCount(), 0)
 	{
 	}
 };
@@ -140,50 +277,93 @@ static void printStatistics(Output* output, const BuildStatistics& stats, unsign
 		stats.fileCount, (int)(stats.fileSize / 1024 / 1024), (int)(stats.resultSize / 1024 / 1024));
 }
 
-static size_t normalizeEOL(char* data, size_t size)
+// Reads the file directly into the result; the size is a hint from the file list, the file can be larger or smaller than that
+static std::vector<char> readFile(FileStream& in, size_t sizeHint = 0)
 {
-	// fast path: no \r in the file
-	if (memchr(data, '\r', size) == nullptr)
-		return size;
+	std::vector<char> result;
 
-	// replace \r\n with \n, replace stray \r with \n
-	size_t result = 0;
+	// read file as is; one extra byte lets the first read detect the end of file if the hint is exact
+	size_t size = 0;
 
-	for (size_t i = 0; i < size; ++i)
+	do
 	{
-		if (data[i] == '\r')
-		{
-			data[result++] = '\n';
-			if (i + 1 < size && data[i + 1] == '\n') i++;
-		}
-		else
-			data[result++] = data[i];
+		result.resize(result.empty() ? sizeHint + 1 : std::max(size + 65536, result.size() * 2));
+		size += in.read(&result[size], result.size() - size);
+	}
+	while (size == result.size());
+
+	// normalize new lines in a cross-platform way (don't rely on text-mode file I/O)
+	if (size > 0)
+	{
+		size = normalizeEOL(&result[0], size);
+		assert(size <= result.size());
 	}
 
+	result.resize(size);
+
 	return result;
 }
 
-static std::vector<char> readFile(FileStream& in)
+std::string buildDictionary(const std::vector<FileInfo>& files)
 {
-	std::vector<char> result;
+	std::unordered_map<std::string, unsigned int> lines;
 
-	// read file as is
-	char buffer[65536];
-	size_t readsize;
+	size_t step = std::max<size_t>(1, files.size() / kDictionarySampleFiles);
 
-	while ((readsize = in.read(buffer, sizeof(buffer))) > 0)
+	for (size_t i = 0; i < files.size(); i += step)
 	{
-		result.insert(result.end(), buffer, buffer + readsize);
-	}
+		FileStream in(files[i].path.c_str(), "rb");
+		if (!in) continue;
 
-	// normalize new lines in a cross-platform way (don't rely on text-mode file I/O)
-	if (!result.empty())
-	{
-		size_t size = normalizeEOL(&result[0], result.size());
-		assert(size <= result.size());
-		result.resize(size);
+		std::vector<char> data = readFile(in);
+		size_t size = std::min(data.size(), kDictionarySampleFileSize);
+
+		// lines are counted once per file so that the dictionary gets the contents that are shared between files
+		std::unordered_set<std::string> fileLines;
+
+		for (size_t offset = 0; offset < size; )
+		{
+			const char* line = &data[offset];
+			const char* end = static_cast<const char*>(memchr(line, '\n', size - offset));
+			size_t length = end ? end - line + 1 : size - offset;
+
+			if (length >= kDictionaryMinLineLength && length <= kDictionaryMaxLineLength)
+				fileLines.insert(std::string(line, length));
+
+			offset += length;
+		}
+
+		for (auto& l: fileLines)
+			lines[l]++;
 	}
 
+	// every repetition of the line saves roughly its length
+	std::vector<std::pair<size_t, const std::string*>> candidates;
+
+	for (auto& l: lines)
+		if (l.second > 1)
+			candidates.emplace_back((l.second - 1) * l.first.size(), &l.first);
+
+	std::sort(candidates.begin(), candidates.end(), [](const std::pair<size_t, const std::string*>& l, const std::pair<size_t, const std::string*>& r) {
+		return l.first != r.first ? l.first > r.first : *l.second < *r.second;
+	});
+
+	std::vector<const std::string*> selected;
+	size_t resultSize = 0;
+
+	for (auto& c: candidates)
+		if (resultSize + c.second->size() <= kMaxCompressionDictionarySize)
+		{
+			selected.push_back(c.second);
+			resultSize += c.second->size();
+		}
+
+	// the most valuable lines go last, which keeps them close to the data
+	std::string result;
+
+	for (auto it = selected.rbegin(); it != selected.rend(); ++it)
+		result += **it;
+
 	return result;
 }
 
@@ -253,10 +433,11 @@ static void appendChunkFilePrefix(Chunk& chunk, File& file, size_t remainingSize
 	}
 }
 
-static void writeChunk(BuildContext* context, unsigned int order, const DataChunkHeader& header, std::unique_ptr<char[]> compressedData, std::unique_ptr<char[]> index, std::unique_ptr<char[]> extra, bool firstFileIsSuffix)
+static void writeChunk(BuildContext* context, unsigned int order, const DataChunkHeader& header, std::unique_ptr<char[]> compressedData, std::unique_ptr<char[]> index, std::unique_ptr<char[]> extra,
+	std::string firstFile, bool firstFileIsSuffix, std::string paths, std::vector<unsigned int> ngrams)
 {
 	assert(compressedData);
-	ChunkFileData chunk = { order, header, std::move(compressedData), std::move(index), std::move(extra), firstFileIsSuffix };
+	ChunkFileData chunk = { order, header, std::move(compressedData), std::move(index), std::move(extra), std::move(firstFile), firstFileIsSuffix, std::move(paths), std::move(ngrams), 0 };
 
 	context->writeChunkQueue.push(std::move(chunk));
 }
@@ -271,22 +452,99 @@ static size_t getChunkNameTotalSize(const Chunk& chunk)
 	return result;
 }
 
-static size_t getChunkDataTotalSize(const Chunk& chunk)
+// MurmurHash64A
+static uint64_t getContentHash(const char* data, size_t size)
+{
+	const uint64_t m = 0xc6a4a7935bd1e995ull;
+	uint64_t h = size * m;
+
+	for (size_t i = 0; i + 8 <= size; i += 8)
+	{
+		uint64_t k;
+		memcpy(&k, data + i, 8);
+
+		k *= m;
+		k ^= k >> 47;
+		k *= m;
+
+		h ^= k;
+		h *= m;
+	}
+
+	if (size % 8)
+	{
+		uint64_t k = 0;
+		memcpy(&k, data + size / 8 * 8, size % 8);
+
+		h ^= k;
+		h *= m;
+	}
+
+	h ^= h >> 47;
+	h *= m;
+	h ^= h >> 47;
+
+	return h;
+}
+
+// Finds files with the same contents as an earlier file in the chunk; their data is only stored once
+static size_t getChunkDataTotalSize(const Chunk& chunk, std::vector<uint64_t>& hashes, std::vector<size_t>& originals)
 {
 	size_t result = 0;
 
+	std::unordered_map<uint64_t, size_t> files;
+
+	hashes.resize(chunk.files.size());
+	originals.resize(chunk.files.size());
+
 	for (size_t i = 0; i < chunk.files.size(); ++i)
-		result += chunk.files[i].contents.size();
+	{
+		const Blob& contents = chunk.files[i].contents;
+
+		hashes[i] = getContentHash(contents.data(), contents.size());
+		originals[i] = i;
+
+		auto it = files.find(hashes[i]);
+
+		if (it != files.end() && chunk.files[it->second].contents.size() == contents.size() && memcmp(chunk.files[it->second].contents.data(), contents.data(), contents.size()) == 0)
+		{
+			originals[i] = it->second;
+			continue;
+		}
+
+		files.insert(std::make_pair(hashes[i], i));
+		result += contents.size();
+	}
 
 	return result;
 }
 
-static ChunkData prepareChunkData(const Chunk& chunk)
+static size_t getFileSummarySize(size_t dataSize)
+{
+	// use the same ratio as chunk index; summaries only make sense for files that are large enough to make scanning visible
+	size_t summarySize = dataSize / 50 / kBloomBlockSize * kBloomBlockSize;
+
+	return summarySize == 0 ? 0 : sizeof(DataChunkFileSummary) + summarySize;
+}
+
+static ChunkData prepareChunkData(const Chunk& chunk, bool summaries)
 {
 	size_t headerSize = sizeof(DataChunkFileHeader) * chunk.files.size();
 	size_t nameSize = getChunkNameTotalSize(chunk);
-	size_t dataSize = getChunkDataTotalSize(chunk);
-	size_t totalSize = headerSize + nameSize + dataSize;
+
+	std::vector<uint64_t> hashes;
+	std::vector<size_t> originals;
+	size_t dataSize = getChunkDataTotalSize(chunk, hashes, originals);
+
+	size_t summaryOffset = (headerSize + nameSize + dataSize + 7) & ~7; // make sure summaries are aligned
+	size_t summarySize = 0;
+
+	if (summaries)
+		for (size_t i = 0; i < chunk.files.size(); ++i)
+			if (originals[i] == i)
+				summarySize += getFileSummarySize(chunk.files[i].contents.size());
+
+	size_t totalSize = summarySize ? summaryOffset + summarySize : headerSize + nameSize + dataSize;
 
 	ChunkData result;
 	result.data.reset(new char[totalSize]);
@@ -301,9 +559,7 @@ static ChunkData prepareChunkData(const Chunk& chunk)
 	{
 		const File& f = chunk.files[i];
 
-		memcpy(result.data.get() + nameOffset, f.name.c_str(), f.name.length());
-		if (f.contents.size())
-			memcpy(result.data.get() + dataOffset, f.contents.data(), f.contents.size());
+		memcpy(result.data.get() + nameOffset, f.name.data(), f.name.size());
 
 		DataChunkFileHeader& h = reinterpret_cast<DataChunkFileHeader*>(result.data.get())[i];
 
@@ -313,26 +569,58 @@ static ChunkData prepareChunkData(const Chunk& chunk)
 		h.dataSize = f.contents.size();
 
 		h.startLine = f.startLine;
-		h.reserved = 0;
+		h.summaryOffset = 0;
 
 		h.fileSize = f.fileSize;
 		h.timeStamp = f.timeStamp;
+		h.contentHash = hashes[i];
 
 		nameOffset += f.name.size();
+
+		// copies of earlier files share their data and summary
+		if (originals[i] != i)
+		{
+			const DataChunkFileHeader& original = reinterpret_cast<DataChunkFileHeader*>(result.data.get())[originals[i]];
+
+			h.dataOffset = original.dataOffset;
+			h.summaryOffset = original.summaryOffset;
+			continue;
+		}
+
+		if (f.contents.size())
+			memcpy(result.data.get() + dataOffset, f.contents.data(), f.contents.size());
+
 		dataOffset += f.contents.size();
+
+		// summary contents are filled later in prepareFileSummaries
+		if (size_t size = summaries ? getFileSummarySize(f.contents.size()) : 0)
+		{
+			h.summaryOffset = summaryOffset;
+
+			DataChunkFileSummary summary = {};
+			summary.size = size - sizeof(DataChunkFileSummary);
+
+			memcpy(result.data.get() + summaryOffset, &summary, sizeof(summary));
+			summaryOffset += size;
+		}
 	}
 
-	assert(nameOffset == headerSize + nameSize && dataOffset == totalSize);
+	assert(nameOffset == headerSize + nameSize && dataOffset == headerSize + nameSize + dataSize);
+	assert(summarySize == 0 || summaryOffset == totalSize);
+
+	// clear alignment padding
+	memset(result.data.get() + dataOffset, 0, (summarySize ? totalSize - summarySize : totalSize) - dataOffset);
 
 	return result;
 }
 
-static size_t getChunkIndexSize(size_t dataSize)
+static size_t getChunkIndexSize(size_t dataSize, unsigned int indexRatio)
 {
-	// data compression ratio is ~5x
-	// we want the index to be ~10% of the compressed data
-	// so index is ~50x smaller than the original data
-	size_t indexSize = dataSize / 50;
+	if (indexRatio == 0)
+		return 0;
+
+	// blocked bloom filter needs the size to be a multiple of the block size
+	size_t indexSize = dataSize / indexRatio / kBloomBlockSize * kBloomBlockSize;
 
 	// don't bother storing tiny indices
 	return indexSize < 1024 ? 0 : indexSize;
@@ -418,16 +706,36 @@ struct IntSet
 	}
 };
 
-static ChunkIndex prepareChunkIndex(const char* data, size_t size)
+static std::vector<unsigned int> prepareChunkPostings(const char* data, size_t size)
 {
-	// estimate index size
-	size_t indexSize = getChunkIndexSize(size);
+	// collect trigram data; assume ~5% trigrams are unique
+	IntSet ngrams(IntSet::optimalCapacity(size / 20));
 
-	if (indexSize == 0) return ChunkIndex();
+	for (size_t i = 2; i < size; ++i)
+	{
+		char a = data[i - 2], b = data[i - 1], c = data[i];
 
-	// collect ngram data; assume ~10% ngrams are unique
-	IntSet ngrams(IntSet::optimalCapacity(size / 10));
+		// don't waste postings on ngrams that cross lines
+		if (a != '\n' && b != '\n' && c != '\n')
+		{
+			unsigned int n = trigram(casefold(a), casefold(b), casefold(c));
+			if (n != 0)
+				ngrams.insert(n);
+		}
+	}
+
+	std::vector<unsigned int> result;
+	result.reserve(ngrams.size);
+
+	for (size_t i = 0; i < ngrams.capacity; ++i)
+		if (unsigned int n = ngrams.data[i])
+			result.push_back(n);
+
+	return result;
+}
 
+static void collectChunkNgrams(IntSet& ngrams, const char* data, size_t size)
+{
 	for (size_t i = 3; i < size; ++i)
 	{
 		char a = data[i - 3], b = data[i - 2], c = data[i - 1], d = data[i];
@@ -440,45 +748,120 @@ static ChunkIndex prepareChunkIndex(const char* data, size_t size)
 				ngrams.insert(n);
 		}
 	}
+}
 
-	// estimate iteration count
-	unsigned int iterations = getIndexHashIterations(indexSize, ngrams.size);
+static void fillBigramFilter(unsigned char* filter, const char* data, size_t size)
+{
+	memset(filter, 0, kBigramFilterSize);
 
-	// fill bloom filter
-	ChunkIndex result;
-	result.data.reset(new char[indexSize]);
-	result.size = indexSize;
-	result.iterations = iterations;
+	for (size_t i = 1; i < size; ++i)
+	{
+		char a = data[i - 1], b = data[i];
 
-	unsigned char* index = reinterpret_cast<unsigned char*>(result.data.get());
+		if (a != '\n' && b != '\n')
+			bigramFilterUpdate(filter, bigram(casefold(a), casefold(b)));
+	}
+}
+
+static unsigned int fillBloomFilter(unsigned char* index, size_t indexSize, const IntSet& ngrams)
+{
+	// estimate iteration count
+	unsigned int iterations = getIndexHashIterations(indexSize, ngrams.size);
 
 	memset(index, 0, indexSize);
 
 	for (size_t i = 0; i < ngrams.capacity; ++i)
 		if (unsigned int n = ngrams.data[i])
-			bloomFilterUpdate(index, indexSize, n, iterations);
+			bloomBlockedFilterUpdate(index, indexSize, n, iterations);
+
+	return iterations;
+}
+
+static ChunkIndex prepareChunkIndex(const char* data, size_t size, unsigned int indexRatio)
+{
+	// estimate index size
+	size_t indexSize = getChunkIndexSize(size, indexRatio);
+
+	if (indexSize == 0) return ChunkIndex();
+
+	// collect ngram data; assume ~10% ngrams are unique
+	IntSet ngrams(IntSet::optimalCapacity(size / 10));
+
+	collectChunkNgrams(ngrams, data, size);
+
+	// fill bloom filter, followed by bigram filter for short queries
+	ChunkIndex result;
+	result.data.reset(new char[indexSize + kBigramFilterSize]);
+	result.size = indexSize + kBigramFilterSize;
+	result.iterations = fillBloomFilter(reinterpret_cast<unsigned char*>(result.data.get()), indexSize, ngrams);
+	result.type = IT_BLOOMBLOCKED_BIGRAMS;
+
+	fillBigramFilter(reinterpret_cast<unsigned char*>(result.data.get() + indexSize), data, size);
 
 	return result;
 }
 
+static void prepareFileSummaries(char* data, size_t fileCount)
+{
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+
+	for (size_t i = 0; i < fileCount; ++i)
+	{
+		const DataChunkFileHeader& f = files[i];
+		if (f.summaryOffset == 0) continue;
+
+		DataChunkFileSummary summary;
+		memcpy(&summary, data + f.summaryOffset, sizeof(summary));
+
+		IntSet ngrams(IntSet::optimalCapacity(f.dataSize / 10));
+
+		collectChunkNgrams(ngrams, data + f.dataOffset, f.dataSize);
+
+		summary.type = IT_BLOOMBLOCKED;
+		summary.hashIterations = fillBloomFilter(reinterpret_cast<unsigned char*>(data + f.summaryOffset + sizeof(summary)), summary.size, ngrams);
+
+		memcpy(data + f.summaryOffset, &summary, sizeof(summary));
+	}
+}
+
 static void storeChunk(BuildContext* context, const Chunk& chunk)
 {
 	if (chunk.files.empty()) return;
 
-	ChunkData data = prepareChunkData(chunk);
+	ChunkData data = prepareChunkData(chunk, context->options.summaries);
 	unsigned int order = context->chunkOrder++;
 
 	size_t fileCount = chunk.files.size();
 	bool firstFileIsSuffix = !chunk.files.empty() && chunk.files[0].startLine != 0;
-	std::string lastFile = chunk.files.empty() ? "" : chunk.files.back().name;
+	std::string firstFile = chunk.files.empty() ? "" : chunk.files.front().name.str();
+	std::string lastFile = chunk.files.empty() ? "" : chunk.files.back().name.str();
+
+	std::string paths;
+
+	for (auto& f: chunk.files)
+	{
+		paths.append(f.name.data(), f.name.size());
+		paths += '\n';
+	}
 
 	// workaround for lack of generalized capture
 	std::shared_ptr<ChunkData> sdata(new ChunkData(std::move(data)));
+	bool postings = context->options.postings;
+	unsigned int indexRatio = context->options.indexRatio;
+	int compressionLevel = context->options.compressionLevel;
+	unsigned int codec = (context->options.codec == CC_LZ4DICT && !context->dictionary.empty()) ? CC_LZ4DICT : CC_LZ4;
+	const std::string* dictionary = &context->dictionary;
 
 	context->prepareChunkQueue.push([=] {
-		ChunkIndex index = prepareChunkIndex(sdata->data.get() + sdata->dataOffset, sdata->dataSize);
+		ChunkIndex index = prepareChunkIndex(sdata->data.get() + sdata->dataOffset, sdata->dataSize, indexRatio);
 
-		std::pair<std::unique_ptr<char[]>, size_t> cdata = compress(sdata->data.get(), sdata->size, kFileDataCompressionLevel);
+		std::vector<unsigned int> ngrams;
+		if (postings)
+			ngrams = prepareChunkPostings(sdata->data.get() + sdata->dataOffset, sdata->dataSize);
+
+		prepareFileSummaries(sdata->data.get(), fileCount);
+
+		std::pair<std::unique_ptr<char[]>, size_t> cdata = compress(sdata->data.get(), sdata->size, compressionLevel, codec, dictionary->data(), dictionary->size());
 
 		std::unique_ptr<char[]> extra(new char[lastFile.size()]);
 		memcpy(extra.get(), lastFile.data(), lastFile.size());
@@ -490,9 +873,11 @@ static void storeChunk(BuildContext* context, const Chunk& chunk)
 		header.uncompressedSize = sdata->size;
 		header.indexSize = index.size;
 		header.indexHashIterations = index.iterations;
+		header.indexType = index.type;
 		header.extraSize = lastFile.size();
+		header.codec = codec;
 
-		writeChunk(context, order, header, std::move(cdata.first), std::move(index.data), std::move(extra), firstFileIsSuffix);
+		writeChunk(context, order, header, std::move(cdata.first), std::move(index.data), std::move(extra), firstFile, firstFileIsSuffix, paths, std::move(ngrams));
 	}, sdata->size);
 }
 
@@ -535,11 +920,145 @@ static void flushChunk(BuildContext* context, size_t size)
 	storeChunk(context, chunk);
 }
 
+// FNV-1a
+static unsigned int getPathHash(const char* path, size_t length)
+{
+	unsigned int result = 2166136261u;
+
+	for (size_t i = 0; i < length; ++i)
+		result = (result ^ static_cast<unsigned char>(path[i])) * 16777619u;
+
+	return result;
+}
+
+static bool isContentChunkBoundary(const File& file, size_t chunkSize)
+{
+	// every byte past the minimum chunk size ends the chunk with the same probability, so larger files are more likely to end it;
+	// the decision only depends on the file itself, so once chunks end after the same file, the following boundaries match
+	double probability = double(file.contents.size()) / double(chunkSize - chunkSize / kContentChunkMinRatio);
+	double value = double(bloomHash1(getPathHash(file.name.data(), file.name.size()))) / 4294967296.0;
+
+	return value < probability;
+}
+
+// Returns the size of the next chunk that ends after a boundary file, or 0 if pending files aren't enough to fill it
+// If final is set, all pending files can go into the chunk, and the chunk is only rejected if it's too small
+static size_t getContentChunkSize(const std::deque<File>& files, size_t chunkSize, bool final)
+{
+	size_t minSize = chunkSize / kContentChunkMinRatio;
+	size_t maxSize = chunkSize * kContentChunkMaxRatio;
+	size_t size = 0;
+
+	for (auto& f: files)
+	{
+		// flushChunk splits the file that goes over the maximum size
+		if (size + f.contents.size() > maxSize)
+			return maxSize;
+
+		size += f.contents.size();
+
+		if (size >= minSize && isContentChunkBoundary(f, chunkSize))
+			return size;
+	}
+
+	return (final && size >= minSize) ? size : 0;
+}
+
+static void appendChunkTable(ChunkTableData& table, const ChunkFileData& chunk)
+{
+	const DataChunkHeader& header = chunk.header;
+
+	DataChunkTableEntry entry = {};
+	entry.header = header;
+	entry.firstNameLength = chunk.firstFile.size();
+	entry.dataOffset = chunk.dataOffset ? chunk.dataOffset : table.dataOffset;
+	entry.indexOffset = table.index.size();
+	entry.pathOffset = table.paths.size();
+	entry.pathSize = chunk.paths.size();
+	entry.nameOffset = table.names.size();
+
+	table.postings.append(table.entries.size(), chunk.ngrams);
+	table.entries.push_back(entry);
+
+	table.index.insert(table.index.end(), chunk.index.get(), chunk.index.get() + header.indexSize);
+	table.paths.insert(table.paths.end(), chunk.paths.begin(), chunk.paths.end());
+	table.names.insert(table.names.end(), chunk.firstFile.begin(), chunk.firstFile.end());
+	table.names.insert(table.names.end(), chunk.extra.get(), chunk.extra.get() + header.extraSize);
+
+	if (!chunk.dataOffset)
+		table.dataOffset += header.compressedSize;
+}
+
+static void writeChunkTable(BuildContext* context, ChunkTableData& table)
+{
+	DataFileHeader header = {};
+	memcpy(header.magic, kDataFileHeaderMagic, sizeof(header.magic));
+
+	// align the index block so that bloom filter blocks don't straddle cache lines when the file is mapped
+	char padding[kBloomBlockSize] = {};
+	size_t paddingSize = (kBloomBlockSize - table.dataOffset % kBloomBlockSize) % kBloomBlockSize;
+
+	header.chunkCount = table.entries.size();
+	header.chunkSize = context->options.chunkSize;
+	header.compressionLevel = context->options.compressionLevel;
+	header.indexRatio = context->options.indexRatio;
+	header.codec = context->options.codec;
+	header.maxFileSize = context->options.maxFileSize;
+	header.maxLineLength = context->options.maxLineLength;
+	header.skipBinary = context->options.skipBinary;
+	header.dictionaryOffset = context->dictionaryOffset;
+	header.dictionarySize = context->dictionary.size();
+	header.hotChunkCount = context->hotChunkCount;
+	header.hotFileCount = context->hotFileCount;
+	header.generation = context->headerGeneration;
+
+	std::vector<char> postings = table.postings.serialize();
+
+	header.indexOffset = table.dataOffset + paddingSize;
+	header.indexSize = table.index.size();
+	header.pathOffset = header.indexOffset + header.indexSize;
+	header.pathSize = table.paths.size();
+	header.postingOffset = header.pathOffset + header.pathSize;
+	header.postingSize = postings.size();
+	header.tableOffset = header.postingOffset + header.postingSize;
+	header.tableSize = table.entries.size() * sizeof(DataChunkTableEntry) + table.names.size();
+
+	// index and path offsets are relative to their blocks until the blocks are placed in the file
+	for (auto& e: table.entries)
+	{
+		e.indexOffset += header.indexOffset;
+		e.pathOffset += header.pathOffset;
+	}
+
+	context->outData.write(padding, paddingSize);
+	context->outData.write(table.index.data(), table.index.size());
+	context->outData.write(table.paths.data(), table.paths.size());
+	context->outData.write(postings.data(), postings.size());
+	context->outData.write(table.entries.data(), table.entries.size() * sizeof(DataChunkTableEntry));
+	context->outData.write(table.names.data(), table.names.size());
+
+	// readers may use the file while it's appended to, and the current header slot must stay valid if the new table doesn't reach the disk
+	if (context->appending && !context->outData.sync())
+	{
+		context->output->error("Error writing data file: data couldn't be flushed, keeping the previous chunk table\n");
+		return;
+	}
+
+	header.checksum = getDataFileHeaderChecksum(header);
+
+	context->outData.seek((header.generation % kDataFileHeaderSlots) * sizeof(header));
+	context->outData.write(&header, sizeof(header));
+}
+
 static void writeChunkThreadFun(BuildContext* context)
 {
 	unsigned int order = 0;
 	std::map<unsigned int, ChunkFileData> chunks;
 
+	// chunk data goes right after the file header (or after existing data when appending); everything else is stored after all chunks
+	ChunkTableData table;
+	table.dataOffset = context->outDataOffset;
+
 	BuildStatistics stats = {};
 
 	printStatistics(context->output, stats, context->fileCount);
@@ -556,19 +1075,25 @@ static void writeChunkThreadFun(BuildContext* context)
 			const ChunkFileData& chunk = chunks.begin()->second;
 			const DataChunkHeader& header = chunk.header;
 
-			// empty compressed data acts as a terminator flag
-			if (!chunk.compressedData)
+			// empty compressed data acts as a terminator flag; chunks that are already stored in the file may not have it
+			if (!chunk.compressedData && !chunk.dataOffset)
+			{
+				if (!context->aborted)
+					writeChunkTable(context, table);
 				return;
+			}
+
+			if (!chunk.dataOffset)
+			{
+				context->outData.write(chunk.compressedData.get(), header.compressedSize);
+				stats.resultSize += header.compressedSize;
+			}
 
-			context->outData.write(&header, sizeof(header));
-			context->outData.write(chunk.extra.get(), header.extraSize);
-			context->outData.write(chunk.index.get(), header.indexSize);
-			context->outData.write(chunk.compressedData.get(), header.compressedSize);
+			appendChunkTable(table, chunk);
 
 			stats.chunkCount++;
 			stats.fileCount += header.fileCount - chunk.firstFileIsSuffix;
 			stats.fileSize += header.uncompressedSize;
-			stats.resultSize += header.compressedSize;
 
 			chunks.erase(chunks.begin());
 			order++;
@@ -578,9 +1103,9 @@ static void writeChunkThreadFun(BuildContext* context)
 	}
 }
 
-BuildContext* buildStart(Output* output, const char* path, unsigned int fileCount)
+BuildContext* buildStart(Output* output, const char* path, const ProjectOptions& options, unsigned int fileCount, const std::string& dictionary)
 {
-	std::unique_ptr<BuildContext> context(new BuildContext(output, fileCount));
+	std::unique_ptr<BuildContext> context(new BuildContext(output, options, fileCount));
 
 	createPathForFile(path);
 
@@ -591,10 +1116,52 @@ BuildContext* buildStart(Output* output, const char* path, unsigned int fileCoun
 		return 0;
 	}
 
-	DataFileHeader header = {};
-	memcpy(header.magic, kDataFileHeaderMagic, sizeof(header.magic));
+	// header slots don't have a valid magic until the chunk table is written
+	DataFileHeader headers[kDataFileHeaderSlots] = {};
 
-	context->outData.write(&header, sizeof(header));
+	context->outData.write(headers, sizeof(headers));
+
+	// dictionary is placed before all chunks so that appending chunks to the file keeps it in place
+	context->dictionary = dictionary;
+	context->dictionaryOffset = context->outDataOffset;
+	context->outData.write(dictionary.data(), dictionary.size());
+	context->outDataOffset += dictionary.size();
+
+	std::thread(std::bind(writeChunkThreadFun, context.get())).swap(context->writeChunkThread);
+
+	return context.release();
+}
+
+BuildContext* buildStartAppend(Output* output, const char* path, const ProjectOptions& options, unsigned int fileCount, uint64_t dataSize)
+{
+	std::unique_ptr<BuildContext> context(new BuildContext(output, options, fileCount));
+
+	// new chunks are compressed with the dictionary that is already stored in the file
+	{
+		DataFileReader in;
+		if (!in.open(path) || in.readTable() != DataFileReader::Table_Ok)
+		{
+			output->error("Error reading data file %s\n", path);
+			return 0;
+		}
+
+		if (in.getDictionarySize())
+			context->dictionary.assign(in.getDictionary(), in.getDictionarySize());
+
+		context->dictionaryOffset = in.getHeader().dictionaryOffset;
+		context->headerGeneration = in.getHeader().generation + 1;
+		context->appending = true;
+	}
+
+	// existing header stays valid until the new chunk table is written after all new chunks
+	context->outData.open(path, "r+b");
+	if (!context->outData || !context->outData.seek(dataSize))
+	{
+		output->error("Error opening data file %s for writing\n", path);
+		return 0;
+	}
+
+	context->outDataOffset = dataSize;
 
 	std::thread(std::bind(writeChunkThreadFun, context.get())).swap(context->writeChunkThread);
 
@@ -609,10 +1176,8 @@ static void appendFilePart(BuildContext* context, const char* path, unsigned int
 
 		assert(file.startLine < startLine);
 		assert(file.timeStamp == timeStamp && file.fileSize == fileSize);
-		assert(file.contents.offset + file.contents.count == file.contents.storage->size());
 
-		file.contents.storage->insert(file.contents.storage->end(), data, data + dataSize);
-		file.contents.count += dataSize;
+		context->pendingArena.append(file.contents, data, dataSize);
 
 		context->pendingSize += dataSize;
 	}
@@ -620,88 +1185,217 @@ static void appendFilePart(BuildContext* context, const char* path, unsigned int
 	{
 		File file;
 
-		file.name = path;
+		file.name = context->pendingArena.allocate(path, strlen(path));
 		file.startLine = startLine;
 		file.timeStamp = timeStamp;
 		file.fileSize = fileSize;
-		file.contents = dataSource ? std::move(*dataSource) : std::vector<char>(data, data + dataSize);
+		file.contents = dataSource ? Blob(std::move(*dataSource)) : context->pendingArena.allocate(data, dataSize);
 
 		context->pendingFiles.emplace_back(file);
 		context->pendingSize += dataSize;
 	}
 
 	// We try to maintain a small pending set; this makes sure we have at most 2 chunk sizes worth of data
-	// It's possible in theory to flush chunks earlier (when we reach kChunkSize), but this means that if we
+	// It's possible in theory to flush chunks earlier (when we reach the chunk size), but this means that if we
 	// see an already compressed chunk (buildAppendChunk), we may not be able to rebalance chunk sizes and will
 	// be forced to recompress.
-	while (context->pendingSize >= kChunkSize * 2)
+	if (context->options.contentChunks)
 	{
-		flushChunk(context, kChunkSize);
+		while (context->pendingSize >= context->options.chunkSize * kContentChunkMaxRatio)
+			flushChunk(context, getContentChunkSize(context->pendingFiles, context->options.chunkSize, false));
+	}
+	else
+	{
+		while (context->pendingSize >= context->options.chunkSize * 2)
+		{
+			flushChunk(context, context->options.chunkSize);
+		}
 	}
 }
 
-void buildAppendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize)
+static bool isBinaryFile(const std::vector<char>& contents)
 {
-	appendFilePart(context, path, startLine, data, dataSize, timeStamp, fileSize, nullptr);
+	size_t size = std::min(contents.size(), kBinaryDetectionSize);
+
+	if (size == 0)
+		return false;
+
+	if (memchr(&contents[0], 0, size))
+		return true;
+
+	return countInvalidUTF8(&contents[0], size) * 100 > size * kBinaryMaxInvalidUTF8Percent;
 }
 
-bool buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize)
+static bool hasLongLines(const std::vector<char>& contents, size_t maxLineLength)
 {
-	FileStream in(path, "rb");
+	const char* data = contents.empty() ? nullptr : &contents[0];
+	const char* end = data + contents.size();
+
+	while (data < end)
+	{
+		const char* eol = static_cast<const char*>(memchr(data, '\n', std::min<size_t>(end - data, maxLineLength + 1)));
+
+		if (!eol)
+			return size_t(end - data) > maxLineLength;
+
+		data = eol + 1;
+	}
+
+	return false;
+}
+
+static bool isFileExcluded(const std::vector<char>& contents, const ProjectOptions& options)
+{
+	return (options.skipBinary && isBinaryFile(contents)) || (options.maxLineLength && hasLongLines(contents, options.maxLineLength));
+}
+
+static FileReadResult readFileContents(const std::string& path, uint64_t fileSize, const ProjectOptions& options)
+{
+	FileReadResult result = { FileReadResult::Status_Ok };
+
+	// files that are too large are not read at all; the size is the one from the file list
+	if (options.maxFileSize && fileSize > options.maxFileSize)
+		return result;
+
+	FileStream in(path.c_str(), "rb");
 	if (!in)
 	{
-		context->output->error("Error reading file %s\n", path);
-		return false;
+		result.status = FileReadResult::Status_OpenError;
+		return result;
 	}
 
 	try
 	{
-		std::vector<char> contents = convertToUTF8(readFile(in));
+		result.contents = convertToUTF8(readFile(in, fileSize));
+	}
+	catch (const std::bad_alloc&)
+	{
+		result.status = FileReadResult::Status_OutOfMemory;
+		result.contents = std::vector<char>();
+	}
 
-		appendFilePart(context, path, 0, contents.empty() ? 0 : &contents[0], contents.size(), timeStamp, fileSize, &contents);
+	// excluded files are stored without contents so that updates still see them as current
+	if (result.status == FileReadResult::Status_Ok && isFileExcluded(result.contents, options))
+		result.contents = std::vector<char>();
 
-		return true;
+	return result;
+}
+
+// Files that can't be read are reported and left out of the data file; the build goes on with the remaining files
+static void consumeFileRead(BuildContext* context)
+{
+	assert(!context->pendingReads.empty());
+
+	FileRead read = std::move(context->pendingReads.front());
+	context->pendingReads.pop_front();
+
+	assert(context->pendingReadSize >= read.fileSize);
+	context->pendingReadSize -= read.fileSize;
+
+	FileReadResult result = read.result.get();
+
+	switch (result.status)
+	{
+	case FileReadResult::Status_Ok:
+		appendFilePart(context, read.path.c_str(), 0, result.contents.empty() ? 0 : &result.contents[0], result.contents.size(), read.timeStamp, read.fileSize, &result.contents);
+		break;
+
+	case FileReadResult::Status_OpenError:
+		context->output->error("Error reading file %s\n", read.path.c_str());
+		break;
+
+	case FileReadResult::Status_OutOfMemory:
+		context->output->error("Error reading file %s: out of memory\n", read.path.c_str());
+		break;
+
+	default:
+		assert(false);
 	}
-	catch (const std::bad_alloc&)
+}
+
+static void flushFileReads(BuildContext* context)
+{
+	// Files are read out of order but consumed in order, so everything that's been queued has to go first
+	while (!context->pendingReads.empty())
+		consumeFileRead(context);
+}
+
+void buildAppendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize)
+{
+	flushFileReads(context);
+
+	appendFilePart(context, path, startLine, data, dataSize, timeStamp, fileSize, nullptr);
+}
+
+void buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize)
+{
+	// Reading, decoding and normalizing files is done on worker threads; results are consumed in submission order
+	// We limit the read-ahead window by file count and by the expected amount of data; the latter uses the file
+	// size from the file list, which is exact unless the file changed since scanning (or needs to be re-encoded)
+	while (!context->pendingReads.empty() &&
+		(context->pendingReads.size() >= kMaxQueuedReadFiles || context->pendingReadSize + fileSize > kMaxQueuedReadData))
 	{
-		context->output->error("Error reading file %s: out of memory\n", path);
-		return false;
+		consumeFileRead(context);
+	}
+
+	std::shared_ptr<std::promise<FileReadResult>> promise(new std::promise<FileReadResult>());
+	std::string spath = path;
+	const ProjectOptions* options = &context->options;
+
+	FileRead read = { spath, timeStamp, fileSize, promise->get_future() };
+
+	context->readFileQueue.push([=] {
+		promise->set_value(readFileContents(spath, fileSize, *options));
+	});
+
+	context->pendingReads.emplace_back(std::move(read));
+	context->pendingReadSize += fileSize;
+
+	// Opportunistically consume files that are already read to keep pending chunks flowing to compression
+	while (!context->pendingReads.empty() && context->pendingReads.front().result.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+	{
+		consumeFileRead(context);
 	}
 }
 
-static size_t getOptimalChunkSize(size_t pendingSize)
+static size_t getOptimalChunkSize(size_t pendingSize, size_t chunkSize)
 {
 	// This function returns a size in [0.75x .. 1.5x] range (or 0)
-	const size_t kChunkMaxSize = kChunkSize * 3 / 2;
-	const size_t kChunkMinSize = kChunkMaxSize / 2;
+	const size_t chunkMaxSize = chunkSize * 3 / 2;
+	const size_t chunkMinSize = chunkMaxSize / 2;
 
 	// Never store chunks smaller than 0.75x
-	if (pendingSize < kChunkMinSize)
+	if (pendingSize < chunkMinSize)
 		return 0;
 
 	// If we have at least 2 chunks worth of data, it's safe to store a full chunk
-	if (pendingSize >= kChunkSize * 2)
-		return kChunkSize;
+	if (pendingSize >= chunkSize * 2)
+		return chunkSize;
 
 	// If we have less than 1.5x chunks, we need to store the entire set in one go
-	if (pendingSize < kChunkMaxSize)
+	if (pendingSize < chunkMaxSize)
 		return pendingSize;
 
 	// Otherwise we should split the chunk in half; the reason why it's important to not just
-	// return kChunkSize here is that if we have, say, 1.6x chunks to store, splitting into 1x and 0.6x
+	// return chunkSize here is that if we have, say, 1.6x chunks to store, splitting into 1x and 0.6x
 	// leaves us with a chunk that's smaller than 0.75x
-	// Splitting in half makes sure that both halves are at least kChunkMinSize
+	// Splitting in half makes sure that both halves are at least chunkMinSize
 	return pendingSize / 2;
 }
 
-bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, std::unique_ptr<char[]>& compressedData, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra, bool firstFileIsSuffix)
+bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, std::unique_ptr<char[]>& compressedData, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra, const std::string& firstFile, bool firstFileIsSuffix,
+	const std::string& paths, uint64_t dataOffset)
 {
+	flushFileReads(context);
+
 	// In order to maintain file order, we need to flush pending files before writing the chunk.
 	// To balance the cost of chunk recompression with chunk sizes, we flush all files but instead of
 	// using a fixed chunk size, we use a balanced chunk size computed in getOptimalChunkSize
 	while (!context->pendingFiles.empty())
 	{
-		size_t chunkSize = getOptimalChunkSize(context->pendingSize);
+		size_t chunkSize = context->options.contentChunks
+			? getContentChunkSize(context->pendingFiles, context->options.chunkSize, true)
+			: getOptimalChunkSize(context->pendingSize, context->options.chunkSize);
 
 		if (chunkSize == 0)
 			return false;
@@ -713,20 +1407,70 @@ bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, std:
 	assert(context->pendingSize == 0 && context->pendingFiles.empty());
 
 	unsigned int order = context->chunkOrder++;
-	writeChunk(context, order, header, std::move(compressedData), std::move(index), std::move(extra), firstFileIsSuffix);
+
+	if (context->options.postings)
+	{
+		// Postings for the chunk are not stored separately so we need to decompress the chunk to rebuild them; this is still much faster than recompression
+		std::shared_ptr<ChunkFileData> chunk(new ChunkFileData { order, header, std::move(compressedData), std::move(index), std::move(extra), firstFile, firstFileIsSuffix, paths, std::vector<unsigned int>(), dataOffset });
+
+		context->prepareChunkQueue.push([=] {
+			std::unique_ptr<char[]> data(new char[header.uncompressedSize]);
+			decompress(data.get(), header.uncompressedSize, chunk->compressedData.get(), header.compressedSize, header.codec, context->dictionary.data(), context->dictionary.size());
+
+			// file data is contiguous and may be followed by file summaries that should not contribute to postings; copies of files share data
+			// with earlier files, so the last file doesn't necessarily end the data
+			const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data.get());
+			size_t dataEnd = header.fileTableSize;
+
+			for (size_t i = 0; i < header.fileCount; ++i)
+				dataEnd = std::max<size_t>(dataEnd, files[i].dataOffset + files[i].dataSize);
+
+			chunk->ngrams = prepareChunkPostings(data.get() + header.fileTableSize, dataEnd - header.fileTableSize);
+
+			context->writeChunkQueue.push(std::move(*chunk));
+		}, header.compressedSize + header.uncompressedSize);
+	}
+	else
+	{
+		ChunkFileData chunk = { order, header, std::move(compressedData), std::move(index), std::move(extra), firstFile, firstFileIsSuffix, paths, std::vector<unsigned int>(), dataOffset };
+
+		context->writeChunkQueue.push(std::move(chunk));
+	}
 
 	return true;
 }
 
+static void flushPendingFiles(BuildContext* context)
+{
+	flushFileReads(context);
+
+	// Write all remaining files (usually just flushes a single chunk)
+	while (!context->pendingFiles.empty())
+	{
+		size_t chunkSize = context->options.contentChunks ? getContentChunkSize(context->pendingFiles, context->options.chunkSize, true) : 0;
+
+		flushChunk(context, chunkSize ? chunkSize : context->options.chunkSize);
+	}
+}
+
+uint64_t buildGetHotTierTime(const ProjectOptions& options)
+{
+	return options.hotTierDays ? getFileTimeAgo(uint64_t(options.hotTierDays) * 24 * 3600) : UINT64_MAX;
+}
+
+void buildEndHotTier(BuildContext* context, unsigned int fileCount)
+{
+	flushPendingFiles(context);
+
+	context->hotChunkCount = context->chunkOrder;
+	context->hotFileCount = fileCount;
+}
+
 unsigned int buildFinish(BuildContext* context)
 {
 	if (context->writeChunkThread.joinable())
 	{
-		// Write all remaining files (usually just flushes a single chunk)
-		while (!context->pendingFiles.empty())
-		{
-			flushChunk(context, kChunkSize);
-		}
+		flushPendingFiles(context);
 
 		ChunkFileData chunkDummy = { context->chunkOrder };
 		context->writeChunkQueue.push(std::move(chunkDummy));
@@ -740,6 +1484,13 @@ unsigned int buildFinish(BuildContext* context)
 	return result;
 }
 
+void buildAbort(BuildContext* context)
+{
+	context->aborted = true;
+
+	buildFinish(context);
+}
+
 void buildProject(Output* output, const char* path)
 {
 	output->print("Building %s:\n", path);
@@ -748,11 +1499,11 @@ void buildProject(Output* output, const char* path)
 	if (!group)
 		return;
 
-	removeFile(replaceExtension(path, ".qgc").c_str());
+	removeChanges(path);
 
 	output->print("Scanning project...\r");
 
-	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get());
+	std::vector<FileInfo> files = getProjectFiles(output, path, group.get(), false);
 
 	output->print("Building file table...\r");
 
@@ -763,13 +1514,23 @@ void buildProject(Output* output, const char* path)
 	std::string tempPath = targetPath + "_";
 
 	{
-		BuildContext* builder = buildStart(output, tempPath.c_str(), files.size());
+		std::string dictionary = (group->options.codec == CC_LZ4DICT) ? buildDictionary(files) : std::string();
+
+		BuildContext* builder = buildStart(output, tempPath.c_str(), group->options, files.size(), dictionary);
 		if (!builder) return;
 
-		for (auto& f: files)
-		{
-			buildAppendFile(builder, f.path.c_str(), f.timeStamp, f.fileSize);
-		}
+		// files of the hot tier go first; both tiers stay sorted by path
+		uint64_t hotTierTime = buildGetHotTierTime(group->options);
+		auto cold = std::stable_partition(files.begin(), files.end(), [&](const FileInfo& f) { return f.timeStamp >= hotTierTime; });
+
+		for (auto it = files.begin(); it != cold; ++it)
+			buildAppendFile(builder, it->path.c_str(), it->timeStamp, it->fileSize);
+
+		if (group->options.hotTierDays)
+			buildEndHotTier(builder, cold - files.begin());
+
+		for (auto it = cold; it != files.end(); ++it)
+			buildAppendFile(builder, it->path.c_str(), it->timeStamp, it->fileSize);
 
 		buildFinish(builder);
 	}
@@ -2,18 +2,44 @@
 #pragma once
 
 #include <memory>
+#include <string>
+#include <vector>
 
 class Output;
 struct DataChunkHeader;
+struct ProjectOptions;
+struct FileInfo;
 
 struct BuildContext;
 
-BuildContext* buildStart(Output* output, const char* path, unsigned int fileCount = 0);
+// Builds a dictionary for the CC_LZ4DICT codec from lines that are repeated in a sample of the files
+std::string buildDictionary(const std::vector<FileInfo>& files);
+
+BuildContext* buildStart(Output* output, const char* path, const ProjectOptions& options, unsigned int fileCount = 0, const std::string& dictionary = std::string());
+
+// Appends new chunks to an existing data file after dataSize bytes; the file is switched to the new chunk table only when the build finishes
+// New chunks use the dictionary of the existing file
+BuildContext* buildStartAppend(Output* output, const char* path, const ProjectOptions& options, unsigned int fileCount, uint64_t dataSize);
 
 void buildAppendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize);
-bool buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize);
-bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, std::unique_ptr<char[]>& compressedData, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra, bool firstFileIsSuffix);
+
+// Files are read on worker threads, so read errors are reported through the output when the file is added to a chunk, which may be
+// during a later call; files that couldn't be read are left out of the data file
+void buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize);
+
+// If dataOffset is not 0, chunk data is already stored in the output file at this offset and isn't written again
+bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, std::unique_ptr<char[]>& compressedData, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra, const std::string& firstFile, bool firstFileIsSuffix,
+	const std::string& paths, uint64_t dataOffset = 0);
+
+// Returns the oldest modification time of files that go to the hot tier when the project is built now (UINT64_MAX if it doesn't use tiers)
+uint64_t buildGetHotTierTime(const ProjectOptions& options);
+
+// Ends the hot tier after fileCount files; all files appended after this go to the cold tier
+void buildEndHotTier(BuildContext* context, unsigned int fileCount);
 
 unsigned int buildFinish(BuildContext* context);
 
+// Stops the build without writing the chunk table; data files that were appended to keep their previous contents
+void buildAbort(BuildContext* context);
+
 void buildProject(Output* output, const char* path);
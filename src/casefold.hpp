@@ -1,10 +1,6 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
-#if defined(USE_SSE2) || defined(USE_NEON)
-#include "charsimd.hpp"
-#endif
-
 const unsigned char kCaseFoldASCII[] =
 {
 	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
@@ -29,42 +25,3 @@ inline char casefold(char ch)
 {
 	return kCaseFoldASCII[static_cast<unsigned char>(ch)];
 }
-
-#if defined(USE_SSE2) || defined(USE_NEON)
-inline void casefoldRange(char* dest, const char* begin, const char* end)
-{
-	if (end - begin < 64)
-	{
-		// short string, don't bother optimizing
-		for (const char* i = begin; i != end; ++i)
-			*dest++ = casefold(*i);
-	}
-	else
-	{
-		// Shift 'A'..'Z' range ([65..90]) to [102..127] to use one signed comparison insn
-		simd16 shiftAmount = simd_dup(127 - 'Z');
-		simd16 lowerBound = simd_dup(127 - ('Z' - 'A') - 1);
-		simd16 upperBit = simd_dup(0x20);
-
-		const char* i = begin;
-
-		for (; i + 16 < end; i += 16)
-		{
-			simd16 v = simd_load(i);
-			simd16 upperMask = simd_cmpgt(simd_add(v, shiftAmount), lowerBound);
-			simd16 cfv = simd_or(v, simd_and(upperMask, upperBit));
-			simd_store(dest, cfv);
-			dest += 16;
-		}
-
-		for (; i != end; ++i)
-			*dest++ = casefold(*i);
-	}
-}
-#else
-inline void casefoldRange(char* dest, const char* begin, const char* end)
-{
-	for (const char* i = begin; i != end; ++i)
-		*dest++ = casefold(*i);
-}
-#endif
@@ -6,6 +6,9 @@
 #include "filestream.hpp"
 #include "output.hpp"
 #include "project.hpp"
+#include "build.hpp"
+#include "resultcache.hpp"
+#include "stringutil.hpp"
 
 #include <algorithm>
 #include <fstream>
@@ -42,6 +45,48 @@ bool writeChanges(const char* path, const std::vector<std::string>& files)
 		}
 	}
 
+	if (!renameFile(tempPath.c_str(), targetPath.c_str()))
+		return false;
+
+	removeResultCache(path);
+	return true;
+}
+
+void removeChanges(const char* path)
+{
+	removeFile(replaceExtension(path, ".qgs").c_str());
+	removeFile(replaceExtension(path, ".qgc").c_str());
+	removeResultCache(path);
+}
+
+bool writeSidePack(Output* output, const char* path, const ProjectOptions& options, const std::vector<std::string>& files)
+{
+	std::string targetPath = replaceExtension(path, ".qgs");
+	std::string tempPath = targetPath + "_";
+
+	// removed files are not stored; searches skip change list entries that are not in the side pack and can't be opened
+	std::vector<FileInfo> existing;
+
+	for (auto& f: files)
+	{
+		uint64_t mtime, size;
+
+		if (getFileAttributes(f.c_str(), &mtime, &size))
+			existing.push_back({ f, mtime, size });
+	}
+
+	// side packs are rebuilt frequently while watching, so build progress is not printed
+	ErrorOutput sideOutput(output);
+
+	BuildContext* builder = buildStart(&sideOutput, tempPath.c_str(), options, existing.size());
+	if (!builder)
+		return false;
+
+	for (auto& f: existing)
+		buildAppendFile(builder, f.path.c_str(), f.timeStamp, f.fileSize);
+
+	buildFinish(builder);
+
 	return renameFile(tempPath.c_str(), targetPath.c_str());
 }
 
@@ -84,6 +129,9 @@ void appendChanges(Output* output, const char* path, const std::vector<std::stri
 		std::sort(changes.begin(), changes.end());
 		changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
 
+		// side pack doesn't have contents of the new files
+		removeFile(replaceExtension(path, ".qgs").c_str());
+
 		if (!writeChanges(path, changes))
 			output->error("Error writing changes for project %s\n", path);
 	}
@@ -5,8 +5,16 @@
 #include <string>
 
 class Output;
+struct ProjectOptions;
 
 std::vector<std::string> readChanges(const char* path);
 bool writeChanges(const char* path, const std::vector<std::string>& files);
 
+// Removes the change list along with the side pack
+void removeChanges(const char* path);
+
+// Side pack is a small data file with contents of changed files; searches use it instead of reading files in the change list from disk
+// It has to be written before the change list it corresponds to, and removed whenever the change list is modified without rewriting it
+bool writeSidePack(Output* output, const char* path, const ProjectOptions& options, const std::vector<std::string>& files);
+
 void appendChanges(Output* output, const char* path, const std::vector<std::string>& files);
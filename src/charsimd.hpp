@@ -3,6 +3,22 @@
 
 #include <stdint.h>
 
+#ifdef _MSC_VER
+#   include <intrin.h>
+#   pragma intrinsic(_BitScanForward)
+#endif
+
+inline int countTrailingZeros(int value)
+{
+#ifdef _MSC_VER
+	unsigned long r;
+	_BitScanForward(&r, value);
+	return r;
+#else
+	return __builtin_ctz(value);
+#endif
+}
+
 #ifdef USE_SSE2
 #include <emmintrin.h>
 
@@ -0,0 +1,67 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+
+#include "chunkcache.hpp"
+
+ChunkCache::ChunkCache(size_t sizeLimit): size(0), sizeLimit(sizeLimit), hits(0), misses(0), evictions(0)
+{
+}
+
+std::shared_ptr<char> ChunkCache::find(uint64_t generation, uint64_t offset)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto it = index.find(Key(generation, offset));
+
+	if (it == index.end())
+	{
+		misses++;
+		return std::shared_ptr<char>();
+	}
+
+	hits++;
+
+	entries.splice(entries.begin(), entries, it->second);
+
+	return it->second->data;
+}
+
+void ChunkCache::insert(uint64_t generation, uint64_t offset, std::shared_ptr<char> data, size_t dataSize)
+{
+	if (dataSize > sizeLimit)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	Key key(generation, offset);
+
+	if (index.count(key))
+		return;
+
+	while (!entries.empty() && size + dataSize > sizeLimit)
+	{
+		Entry& e = entries.back();
+
+		size -= e.size;
+		index.erase(e.key);
+		entries.pop_back();
+
+		evictions++;
+	}
+
+	Entry e = { key, std::move(data), dataSize };
+
+	entries.push_front(std::move(e));
+	index[key] = entries.begin();
+
+	size += dataSize;
+}
+
+ChunkCache::Statistics ChunkCache::getStatistics()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	Statistics result = { entries.size(), size, sizeLimit, hits, misses, evictions };
+
+	return result;
+}
@@ -0,0 +1,53 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <mutex>
+#include <list>
+#include <map>
+#include <memory>
+#include <utility>
+
+// Size-bounded LRU cache of decompressed chunk data; chunks are identified by data file generation and chunk offset
+class ChunkCache
+{
+public:
+	struct Statistics
+	{
+		size_t count;
+		size_t size;
+		size_t sizeLimit;
+
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long evictions;
+	};
+
+	explicit ChunkCache(size_t sizeLimit);
+
+	std::shared_ptr<char> find(uint64_t generation, uint64_t offset);
+	void insert(uint64_t generation, uint64_t offset, std::shared_ptr<char> data, size_t size);
+
+	Statistics getStatistics();
+
+private:
+	typedef std::pair<uint64_t, uint64_t> Key;
+
+	struct Entry
+	{
+		Key key;
+		std::shared_ptr<char> data;
+		size_t size;
+	};
+
+	std::mutex mutex;
+
+	std::list<Entry> entries; // most recently used entries first
+	std::map<Key, std::list<Entry>::iterator> index;
+
+	size_t size;
+	size_t sizeLimit;
+
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+};
@@ -2,10 +2,40 @@
 #include "common.hpp"
 #include "compression.hpp"
 
+#include "format.hpp"
+
 #include "lz4.h"
 #include "lz4hc.h"
 
-std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dataSize, int level)
+static int compressDictionary(const char* data, char* dest, size_t dataSize, int destSize, int level, const char* dictionary, size_t dictionarySize)
+{
+	// streams only keep a reference to the dictionary, so it has to be loaded for every block
+	if (level == 0)
+	{
+		LZ4_stream_t* stream = LZ4_createStream();
+		if (!stream) return 0;
+
+		LZ4_loadDict(stream, dictionary, dictionarySize);
+		int result = LZ4_compress_fast_continue(stream, data, dest, dataSize, destSize, 1);
+
+		LZ4_freeStream(stream);
+		return result;
+	}
+	else
+	{
+		LZ4_streamHC_t* stream = LZ4_createStreamHC();
+		if (!stream) return 0;
+
+		LZ4_resetStreamHC_fast(stream, level);
+		LZ4_loadDictHC(stream, dictionary, dictionarySize);
+		int result = LZ4_compress_HC_continue(stream, data, dest, dataSize, destSize);
+
+		LZ4_freeStreamHC(stream);
+		return result;
+	}
+}
+
+std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dataSize, int level, unsigned int codec, const char* dictionary, size_t dictionarySize)
 {
 	if (dataSize == 0) return std::make_pair(std::unique_ptr<char[]>(), 0);
 
@@ -13,7 +43,9 @@ std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dat
 
 	std::unique_ptr<char[]> cdata(new char[csizeBound]);
 	
-	int csize = (level == 0)
+	int csize = (codec == CC_LZ4DICT)
+		? compressDictionary(static_cast<const char*>(data), cdata.get(), dataSize, csizeBound, level, dictionary, dictionarySize)
+		: (level == 0)
 		? LZ4_compress_default(static_cast<const char*>(data), cdata.get(), dataSize, csizeBound)
 		: LZ4_compress_HC(static_cast<const char*>(data), cdata.get(), dataSize, csizeBound, level);
 	assert(csize >= 0 && csize <= csizeBound);
@@ -21,21 +53,25 @@ std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dat
 	return std::make_pair(std::move(cdata), csize);
 }
 
-void decompress(void* dest, size_t destSize, const void* source, size_t sourceSize)
+void decompress(void* dest, size_t destSize, const void* source, size_t sourceSize, unsigned int codec, const char* dictionary, size_t dictionarySize)
 {
 	if (sourceSize == 0 && destSize == 0) return;
 
-	int result = LZ4_decompress_safe(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, destSize);
+	int result = (codec == CC_LZ4DICT)
+		? LZ4_decompress_safe_usingDict(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, destSize, dictionary, dictionarySize)
+		: LZ4_decompress_safe(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, destSize);
 	assert(result >= 0);
 	assert(static_cast<size_t>(result) == destSize);
 }
 
-void decompressPartial(void* dest, size_t destSize, const void* source, size_t sourceSize, size_t targetSize)
+void decompressPartial(void* dest, size_t destSize, const void* source, size_t sourceSize, size_t targetSize, unsigned int codec, const char* dictionary, size_t dictionarySize)
 {
 	assert(targetSize <= destSize);
 	if (sourceSize == 0 && destSize == 0) return;
 
-	int result = LZ4_decompress_safe_partial(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, targetSize, destSize);
+	int result = (codec == CC_LZ4DICT)
+		? LZ4_decompress_safe_partial_usingDict(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, targetSize, destSize, dictionary, dictionarySize)
+		: LZ4_decompress_safe_partial(static_cast<const char*>(source), static_cast<char*>(dest), sourceSize, targetSize, destSize);
 	assert(result >= 0);
 	assert(static_cast<size_t>(result) >= targetSize);
 	assert(static_cast<size_t>(result) <= destSize);
@@ -4,7 +4,8 @@
 #include <memory>
 #include <utility>
 
-std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dataSize, int level);
+// codec is one of ChunkCodec values; CC_LZ4DICT needs the dictionary that the data was compressed with
+std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dataSize, int level, unsigned int codec = 0, const char* dictionary = nullptr, size_t dictionarySize = 0);
 
-void decompress(void* dest, size_t destSize, const void* source, size_t sourceSize);
-void decompressPartial(void* dest, size_t destSize, const void* source, size_t sourceSize, size_t targetSize);
+void decompress(void* dest, size_t destSize, const void* source, size_t sourceSize, unsigned int codec = 0, const char* dictionary = nullptr, size_t dictionarySize = 0);
+void decompressPartial(void* dest, size_t destSize, const void* source, size_t sourceSize, size_t targetSize, unsigned int codec = 0, const char* dictionary = nullptr, size_t dictionarySize = 0);
@@ -4,32 +4,160 @@
 #define Kb *1024
 #define Mb Kb Kb
 
-// Approximate uncompressed total size of the chunk
+// Approximate uncompressed total size of the chunk; default for chunksize option
 const size_t kChunkSize = 512 Kb;
 
+// Content-defined chunks are cut after a file once they have chunk size / N data, and have at most chunk size * N data
+const size_t kContentChunkMinRatio = 4;
+const size_t kContentChunkMaxRatio = 2;
+
+// With skipbinary, files are binary if the first N bytes after decoding contain a NUL byte or too many bytes that aren't valid UTF-8
+const size_t kBinaryDetectionSize = 64 Kb;
+const size_t kBinaryMaxInvalidUTF8Percent = 10;
+
 // Total amount of chunk data in flight
 const size_t kMaxQueuedChunkData = 256 Mb;
 
+// Total amount of compressed chunk data that searches ask the OS to prefetch ahead of the chunk being read; the chunks that are
+// queued for searching hold at most kMaxQueuedChunkData, so the data that is prefetched for them is limited as well
+const size_t kMaxPrefetchedChunkData = 64 Mb;
+
+// Total amount of decompressed chunk data kept between searches by long-running processes
+const size_t kChunkCacheSize = 256 Mb;
+
+// Chunk buffers come in size classes from the minimum size up to N times the pool block size, with steps of 1.5x and 1.33x;
+// blocks are allocated in slabs of up to N blocks that take at most the slab size unless a single block is larger, and slabs that are at
+// least as large as a large page can use large pages
+const size_t kBlockPoolMinBlockSize = 4 Kb;
+const size_t kBlockPoolMaxBlockRatio = 4;
+const size_t kBlockPoolSlabBlocks = 16;
+const size_t kBlockPoolSlabSize = 4 Mb;
+const size_t kLargePageSize = 2 Mb;
+
+// Slabs that have no blocks in use are returned to the system once the pool keeps more than this amount of memory that isn't in use
+const size_t kBlockPoolMaxFreeSize = 32 Mb;
+
+// Pending file names and contents that aren't stored in their own buffers during build are packed into blocks of this size
+const size_t kBuildArenaBlockSize = 1 Mb;
+
+// Total amount of file data being read ahead during build
+const size_t kMaxQueuedReadData = 64 Mb;
+
+// Total number of files being read ahead during build
+const size_t kMaxQueuedReadFiles = 1024;
+
 // Total amount of buffered output in flight
 const size_t kMaxBufferedOutput = 32 Mb;
 
 // Flush buffered output from the current chunk after reaching this threshold, if possible
 const size_t kBufferedOutputFlushThreshold = 32 Kb;
 
-// File list compression level, 0-9
-const int kFileListCompressionLevel = 1;
+// Server checks whether the client closed the connection at most this often (in milliseconds) while a command is running
+const unsigned int kServerDisconnectCheckInterval = 10;
+
+// Maximum number of chunks that can be searched ahead of the chunk that's being printed
+const unsigned int kBufferedOutputWindow = 1024;
+
+// Total size of the search result cache of a project, and the largest output of one search that is cached
+const size_t kResultCacheSize = 16 Mb;
+const size_t kMaxCachedResultSize = 1 Mb;
+
+// Search output isn't cached if any file it depends on was modified in the last N seconds; file times have a resolution of 1-2 seconds
+const unsigned int kResultCacheMinFileAge = 2;
+
+// Searches remember hashes of up to this many file contents without matches, so that copies of the same file are only scanned once
+const size_t kSearchContentSetSize = 65536;
+
+// With match windows, lines longer than the window are cut to N bytes of context around the match; long matches are cut as well
+const size_t kMatchWindowContext = 80;
+const size_t kMatchWindowMaxMatch = 256;
+
+// Shorter prefilter atoms make the prefilter accept all chunks; two-character atoms can be checked against chunk bigram filters
+const int kMinPrefilterAtomLength = 2;
+
+// Regexes are copied for up to N threads so that threads don't contend on one DFA cache; threads beyond that share copies, and all copies of
+// a regex split one memory budget instead of each getting the default RE2 limit
+const unsigned int kRegexMaxInstances = 8;
+const size_t kRegexMemoryBudget = 64 Mb;
+
+// Regexes without a literal prefix are matched line by line around the occurrences of a required inner literal (or one of a few alternatives)
+const size_t kMaxInnerLiterals = 4;
+const size_t kMinInnerLiteralLength = 3;
 
-// File data compression level, 0-9
+// Fuzzy file searches are split between threads in blocks of this many entries
+const size_t kFuzzyFilterBlockSize = 16384;
+
+// Piped filter input is split into line-aligned blocks of this size that are filtered on worker threads as they arrive
+const size_t kFilterStreamBlockSize = 1 Mb;
+
+// Total amount of piped filter input queued for worker threads
+const size_t kMaxQueuedFilterData = 64 Mb;
+
+// Regex file searches only match individual entries found via postings if there are fewer than 1/N of all entries; otherwise the whole buffer is scanned
+const unsigned int kFilterPostingsCandidateRatio = 8;
+
+// Incremental updates append changed chunks to the data file; the file is rewritten once unused space takes more than this share of it
+const unsigned int kDataFileMaxUnusedPercent = 50;
+
+// Files that got older than the hot tier age limit stay in the hot tier until they make up this share of its data
+const unsigned int kHotTierMaxStalePercent = 50;
+
+// Directory traversal uses at least this many threads since it's bound by file system latency rather than CPU
+const unsigned int kMinDirectoryTraversalThreads = 8;
+
+// File data compression level, 0-12 (0 uses the fast compressor); default for compression option
 const int kFileDataCompressionLevel = 3;
 
+// LZ4 can only refer to the last 64 Kb of the dictionary; dictionaries are trained on lines that are repeated in many of the sampled files
+const size_t kMaxCompressionDictionarySize = 64 Kb;
+const size_t kDictionarySampleFiles = 1024;
+const size_t kDictionarySampleFileSize = 64 Kb;
+const size_t kDictionaryMinLineLength = 8;
+const size_t kDictionaryMaxLineLength = 256;
+
+// Data compression ratio is ~5x and we want the index to be ~10% of the compressed data, so index is ~50x smaller than the original data; default for indexratio option
+const unsigned int kChunkIndexRatio = 50;
+
 // Wait for several seconds before writing changes to amortize writes when many changes are done at once
 const int kWatchWriteDeadline = 1;
 
-// Wait for many seconds before launching an update to minimize the chance of concurrent work
+// Wait for many seconds before launching an update to minimize the chance of concurrent work (default for watchupdatedelay option)
 const int kWatchUpdateTimeout = 60;
 
-// When we're above a certain threshold of changed files, automatically update
+// File change notifications that arrive within this many milliseconds of each other are processed in one batch, up to a batch size limit
+const int kWatchBatchTimeout = 50;
+const size_t kWatchBatchMaxFiles = 4096;
+
+// When we're above a certain threshold of changed files, automatically update (default for watchupdatefiles option)
 const int kWatchUpdateThresholdFiles = 100;
 
+// Automatic updates run in the background with a few threads to avoid competing with other work (default for watchupdatethreads option)
+const int kWatchUpdateThreads = 2;
+
+// Tuning builds sample packs from files that add up to approximately this size
+const size_t kTuneSampleSize = 32 Mb;
+
+// Tuning searches for this many identifiers from sampled files; each set of searches is repeated and the fastest run is reported
+const size_t kTuneQueryCount = 16;
+const size_t kTuneQueryMinLength = 6;
+const size_t kTuneQueryMaxLength = 32;
+const int kTuneSearchRuns = 3;
+
+// Number of chunks that info analyzes in sample mode unless specified, and the seed that picks them
+const unsigned int kInfoSampleChunks = 256;
+const unsigned int kInfoSampleSeed = 1;
+
+// Synthetic benchmark corpus has this many files in several directories, with words taken from a fixed size vocabulary
+const unsigned int kBenchCorpusFiles = 4096;
+const unsigned int kBenchCorpusModules = 32;
+const size_t kBenchCorpusWords = 4096;
+
+// The corpus also has one file that consists of a single line of this size
+const size_t kBenchLongLineSize = 2 Mb;
+
+// Every benchmark query is run several times after a few warmup runs that are not measured
+const int kBenchRuns = 10;
+const int kBenchWarmupRuns = 2;
+
 #undef Mb
 #undef Kb
\ No newline at end of file
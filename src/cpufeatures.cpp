@@ -0,0 +1,47 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "cpufeatures.hpp"
+
+#ifdef _MSC_VER
+#   include <intrin.h>
+#endif
+
+static CpuFeatures detectCpuFeatures()
+{
+	CpuFeatures result = {};
+
+#if defined(USE_SSE2) && defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+
+	if (maxLeaf >= 7 && osxsave)
+	{
+		// the OS has to save the extended register state on context switches
+		unsigned long long xcr0 = _xgetbv(0);
+
+		__cpuidex(info, 7, 0);
+
+		result.avx2 = (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0;
+		result.avx512bw = (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 30)) != 0;
+	}
+#elif defined(USE_SSE2)
+	__builtin_cpu_init();
+
+	result.avx2 = __builtin_cpu_supports("avx2") != 0;
+	result.avx512bw = __builtin_cpu_supports("avx512f") != 0 && __builtin_cpu_supports("avx512bw") != 0;
+#endif
+
+	return result;
+}
+
+const CpuFeatures& getCpuFeatures()
+{
+	static const CpuFeatures features = detectCpuFeatures();
+
+	return features;
+}
@@ -0,0 +1,24 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+struct CpuFeatures
+{
+	bool avx2;
+	bool avx512bw;
+};
+
+// Returns instruction set extensions supported by the CPU and the OS; all features are false on non-x86 platforms
+const CpuFeatures& getCpuFeatures();
+
+#if defined(USE_SSE2) && (defined(__x86_64__) || defined(_M_X64))
+#   define USE_AVX512
+#endif
+
+// Code for wider instruction sets is compiled per function so that the rest of the binary runs on any x86 CPU
+#if defined(USE_SSE2) && !defined(_MSC_VER)
+#   define TARGET_AVX2 __attribute__((target("avx2")))
+#   define TARGET_AVX512 __attribute__((target("avx2,avx512f,avx512bw")))
+#else
+#   define TARGET_AVX2
+#   define TARGET_AVX512
+#endif
@@ -0,0 +1,215 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "datafile.hpp"
+
+#include "fileutil.hpp"
+#include "constants.hpp"
+
+#include <algorithm>
+
+#include <string.h>
+
+// FNV-1a
+uint32_t getDataFileHeaderChecksum(const DataFileHeader& header)
+{
+	DataFileHeader copy = header;
+	copy.checksum = 0;
+
+	const unsigned char* data = reinterpret_cast<const unsigned char*>(&copy);
+	uint32_t result = 2166136261u;
+
+	for (size_t i = 0; i < sizeof(copy); ++i)
+		result = (result ^ data[i]) * 16777619u;
+
+	return result;
+}
+
+static bool isHeaderValid(const DataFileHeader& header)
+{
+	return memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) == 0 && header.checksum == getDataFileHeaderChecksum(header);
+}
+
+static bool isRangeInSection(uint64_t offset, uint64_t size, uint64_t sectionOffset, uint64_t sectionSize)
+{
+	return offset >= sectionOffset && offset - sectionOffset <= sectionSize && size <= sectionSize - (offset - sectionOffset);
+}
+
+DataFileReader::DataFileReader(): streamOffset(0), data(nullptr), size(0), header(), dictionary(nullptr)
+{
+}
+
+DataFileReader::~DataFileReader()
+{
+	if (data) unmapFile(data, size);
+}
+
+bool DataFileReader::open(const char* path)
+{
+	assert(!data && !stream);
+
+	data = mapFile(path, &size);
+
+	return data ? true : stream.open(path, "rb");
+}
+
+DataFileReader::operator bool() const
+{
+	return data || stream;
+}
+
+bool DataFileReader::isMapped() const
+{
+	return data != nullptr;
+}
+
+DataFileReader::TableStatus DataFileReader::readTable()
+{
+	DataFileHeader slots[kDataFileHeaderSlots];
+	if (!read(0, slots, sizeof(slots)))
+		return Table_OutOfDate;
+
+	const DataFileHeader* current = nullptr;
+
+	for (auto& slot: slots)
+		if (isHeaderValid(slot) && (!current || slot.generation > current->generation))
+			current = &slot;
+
+	if (!current)
+		return Table_OutOfDate;
+
+	header = *current;
+
+	size_t entrySize = sizeof(DataChunkTableEntry) * header.chunkCount;
+
+	if (header.tableOffset < sizeof(slots) || header.tableSize < entrySize || header.tableSize > static_cast<size_t>(-1) || header.hotChunkCount > header.chunkCount)
+		return Table_Malformed;
+
+	try
+	{
+		chunks.resize(header.chunkCount);
+		names.resize(header.tableSize - entrySize);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return Table_Malformed;
+	}
+
+	if ((entrySize && !read(header.tableOffset, &chunks[0], entrySize)) ||
+		(!names.empty() && !read(header.tableOffset + entrySize, &names[0], names.size())))
+		return Table_Malformed;
+
+	// offsets come from the file, so chunks have to stay within their sections for readers to trust them
+	for (auto& chunk: chunks)
+		if (!isRangeInSection(chunk.nameOffset, uint64_t(chunk.firstNameLength) + chunk.header.extraSize, 0, names.size()) ||
+			!isRangeInSection(chunk.pathOffset, chunk.pathSize, header.pathOffset, header.pathSize) ||
+			!isRangeInSection(chunk.indexOffset, chunk.header.indexSize, header.indexOffset, header.indexSize))
+			return Table_Malformed;
+
+	if (header.dictionarySize)
+	{
+		if (header.dictionarySize > kMaxCompressionDictionarySize)
+			return Table_Malformed;
+
+		dictionary = read(header.dictionaryOffset, header.dictionarySize, dictionaryStorage);
+
+		if (!dictionary)
+			return Table_Malformed;
+	}
+
+	return Table_Ok;
+}
+
+const DataFileHeader& DataFileReader::getHeader() const
+{
+	return header;
+}
+
+size_t DataFileReader::getChunkCount() const
+{
+	return chunks.size();
+}
+
+const DataChunkTableEntry& DataFileReader::getChunk(size_t index) const
+{
+	assert(index < chunks.size());
+	return chunks[index];
+}
+
+const char* DataFileReader::getDictionary() const
+{
+	return dictionary;
+}
+
+size_t DataFileReader::getDictionarySize() const
+{
+	return header.dictionarySize;
+}
+
+const char* DataFileReader::getChunkFirstName(size_t index) const
+{
+	assert(index < chunks.size());
+	return names.data() + chunks[index].nameOffset;
+}
+
+const char* DataFileReader::getChunkLastName(size_t index) const
+{
+	assert(index < chunks.size());
+	return names.data() + chunks[index].nameOffset + chunks[index].firstNameLength;
+}
+
+const char* DataFileReader::view(uint64_t offset, size_t size)
+{
+	if (!data || offset > this->size || size > this->size - offset)
+		return nullptr;
+
+	return data + offset;
+}
+
+bool DataFileReader::read(uint64_t offset, void* data, size_t size)
+{
+	if (this->data)
+	{
+		const char* result = view(offset, size);
+		if (!result) return false;
+
+		memcpy(data, result, size);
+		return true;
+	}
+
+	// avoid seeking for sequential reads since it discards stream buffers
+	if (streamOffset != offset && !stream.seek(offset))
+		return false;
+
+	size_t result = stream.read(data, size);
+	streamOffset = offset + result;
+
+	return result == size;
+}
+
+void DataFileReader::prefetch(uint64_t offset, uint64_t size)
+{
+	if (data)
+	{
+		if (offset < this->size)
+			prefetchMapping(data + offset, std::min<uint64_t>(size, this->size - offset));
+	}
+	else if (stream)
+		stream.prefetch(offset, size);
+}
+
+const char* DataFileReader::read(uint64_t offset, size_t size, std::vector<char>& storage)
+{
+	if (data)
+		return view(offset, size);
+
+	try
+	{
+		storage.resize(size);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return nullptr;
+	}
+
+	return (size == 0 || read(offset, &storage[0], size)) ? storage.data() : nullptr;
+}
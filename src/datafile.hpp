@@ -0,0 +1,75 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include "filestream.hpp"
+#include "format.hpp"
+
+#include <vector>
+
+// Returns the checksum of a header slot; slots with a checksum that doesn't match are ignored by readers
+uint32_t getDataFileHeaderChecksum(const DataFileHeader& header);
+
+// Reader for data files; uses a read-only mapping of the entire file when possible so that
+// chunk contents can be accessed without copying, and falls back to regular file reads otherwise
+class DataFileReader
+{
+public:
+	enum TableStatus
+	{
+		Table_Ok,
+		Table_OutOfDate,
+		Table_Malformed
+	};
+
+	DataFileReader();
+	~DataFileReader();
+
+	DataFileReader(const DataFileReader&) = delete;
+	DataFileReader& operator=(const DataFileReader&) = delete;
+
+	bool open(const char* path);
+
+	operator bool() const;
+
+	bool isMapped() const;
+
+	// Reads file header and chunk table; this has to be called before accessing chunks
+	TableStatus readTable();
+
+	const DataFileHeader& getHeader() const;
+
+	size_t getChunkCount() const;
+	const DataChunkTableEntry& getChunk(size_t index) const;
+
+	// Returns the compression dictionary of the file; chunks with CC_LZ4DICT codec are compressed with it
+	const char* getDictionary() const;
+	size_t getDictionarySize() const;
+
+	const char* getChunkFirstName(size_t index) const;
+	const char* getChunkLastName(size_t index) const;
+
+	// Returns a pointer to the range in the mapping; only works for mapped files
+	const char* view(uint64_t offset, size_t size);
+
+	bool read(uint64_t offset, void* data, size_t size);
+
+	// Starts reading the range in the background so that a later read or access through the mapping doesn't have to wait for it
+	void prefetch(uint64_t offset, uint64_t size);
+
+	// Returns a pointer to the range in the mapping if possible, otherwise reads data into storage
+	const char* read(uint64_t offset, size_t size, std::vector<char>& storage);
+
+private:
+	FileStream stream;
+	uint64_t streamOffset;
+
+	const char* data;
+	size_t size;
+
+	DataFileHeader header;
+	std::vector<DataChunkTableEntry> chunks;
+	std::vector<char> names;
+
+	std::vector<char> dictionaryStorage;
+	const char* dictionary;
+};
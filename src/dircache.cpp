@@ -0,0 +1,224 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "dircache.hpp"
+
+#include "fileutil.hpp"
+#include "filestream.hpp"
+#include "format.hpp"
+
+#include <string.h>
+
+static std::string getDirectoryKey(const char* path, const char* relpath)
+{
+	// the same directory can be listed from different roots, and names in the listing are relative to the root
+	std::string result = path;
+	result += '\n';
+	result += relpath;
+
+	return result;
+}
+
+template <typename T> static bool readCache(const std::vector<char>& data, size_t& offset, T& value)
+{
+	if (data.size() - offset < sizeof(T))
+		return false;
+
+	memcpy(&value, &data[offset], sizeof(T));
+	offset += sizeof(T);
+
+	return true;
+}
+
+static bool readCacheString(const std::vector<char>& data, size_t& offset, size_t length, std::string& value)
+{
+	if (data.size() - offset < length)
+		return false;
+
+	value.assign(data.data() + offset, length);
+	offset += length;
+
+	return true;
+}
+
+static void writeCacheString(FileStream& out, const std::string& value)
+{
+	uint32_t length = value.size();
+
+	out.write(&length, sizeof(length));
+	out.write(value.data(), value.size());
+}
+
+DirectoryCache::DirectoryCache(): previousScanTimeStamp(0), scanTimeStamp(0)
+{
+}
+
+void DirectoryCache::load(const char* path)
+{
+	std::string cachePath = replaceExtension(path, ".qgt");
+
+	FileStream in(cachePath.c_str(), "rb");
+	if (!in)
+		return;
+
+	std::vector<char> data;
+	char buffer[65536];
+
+	while (size_t size = in.read(buffer, sizeof(buffer)))
+		data.insert(data.end(), buffer, buffer + size);
+
+	size_t offset = 0;
+
+	DirectoryCacheHeader header;
+	if (!readCache(data, offset, header) || memcmp(header.magic, kDirectoryCacheHeaderMagic, strlen(kDirectoryCacheHeaderMagic)) != 0)
+		return;
+
+	std::unordered_map<std::string, Directory> result;
+	std::string key;
+
+	for (uint32_t i = 0; i < header.directoryCount; ++i)
+	{
+		DirectoryCacheEntry entry;
+		if (!readCache(data, offset, entry) || !readCacheString(data, offset, entry.keyLength, key))
+			return;
+
+		Directory& dir = result[key];
+
+		dir.timeStamp = entry.timeStamp;
+		dir.size = entry.size;
+
+		for (uint32_t j = 0; j < entry.fileCount; ++j)
+		{
+			DirectoryCacheFile file;
+			std::string name;
+
+			if (!readCache(data, offset, file) || !readCacheString(data, offset, file.nameLength, name))
+				return;
+
+			dir.files.push_back({ name, file.timeStamp, file.fileSize });
+		}
+
+		for (uint32_t j = 0; j < entry.directoryCount; ++j)
+		{
+			uint32_t length;
+			std::string name;
+
+			if (!readCache(data, offset, length) || !readCacheString(data, offset, length, name))
+				return;
+
+			dir.directories.push_back(name);
+		}
+	}
+
+	previousScanTimeStamp = header.scanTimeStamp;
+	previous.swap(result);
+}
+
+bool DirectoryCache::start(const char* path)
+{
+	std::string tempPath = replaceExtension(path, ".qgt") + "_";
+
+	{
+		FileStream out(tempPath.c_str(), "wb");
+		if (!out)
+			return false;
+	}
+
+	// modification times of the cache file and of directories come from the same clock, which might not match the system clock
+	uint64_t size;
+	return getFileAttributes(tempPath.c_str(), &scanTimeStamp, &size);
+}
+
+bool DirectoryCache::save(const char* path)
+{
+	std::string targetPath = replaceExtension(path, ".qgt");
+	std::string tempPath = targetPath + "_";
+
+	{
+		FileStream out(tempPath.c_str(), "wb");
+		if (!out)
+			return false;
+
+		DirectoryCacheHeader header = {};
+		memcpy(header.magic, kDirectoryCacheHeaderMagic, sizeof(header.magic));
+		header.directoryCount = current.size();
+		header.scanTimeStamp = scanTimeStamp;
+
+		out.write(&header, sizeof(header));
+
+		for (auto& p: current)
+		{
+			const Directory& dir = p.second;
+
+			DirectoryCacheEntry entry = {};
+			entry.timeStamp = dir.timeStamp;
+			entry.size = dir.size;
+			entry.keyLength = p.first.size();
+			entry.fileCount = dir.files.size();
+			entry.directoryCount = dir.directories.size();
+
+			out.write(&entry, sizeof(entry));
+			out.write(p.first.data(), p.first.size());
+
+			for (auto& f: dir.files)
+			{
+				DirectoryCacheFile file = {};
+				file.timeStamp = f.timeStamp;
+				file.fileSize = f.fileSize;
+				file.nameLength = f.name.size();
+
+				out.write(&file, sizeof(file));
+				out.write(f.name.data(), f.name.size());
+			}
+
+			for (auto& d: dir.directories)
+				writeCacheString(out, d);
+		}
+	}
+
+	return renameFile(tempPath.c_str(), targetPath.c_str());
+}
+
+bool DirectoryCache::readDirectory(const char* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback)
+{
+	std::string dirpath;
+	joinPaths(dirpath, path, relpath);
+
+	Directory dir = {};
+
+	if (!getFileAttributes(dirpath.c_str(), &dir.timeStamp, &dir.size))
+		return false;
+
+	std::string key = getDirectoryKey(path, relpath);
+
+	// listings of directories that were modified after the previous scan started might be incomplete
+	auto it = previous.find(key);
+
+	if (it != previous.end() && it->second.timeStamp == dir.timeStamp && it->second.size == dir.size && dir.timeStamp < previousScanTimeStamp)
+	{
+		dir.files = it->second.files;
+		dir.directories = it->second.directories;
+	}
+	else
+	{
+		bool result = ::readDirectory(path, relpath, [&](const char* name, uint64_t mtime, uint64_t size) {
+			dir.files.push_back({ name, mtime, size });
+		}, [&](const char* name) {
+			dir.directories.push_back(name);
+		});
+
+		if (!result)
+			return false;
+	}
+
+	for (auto& f: dir.files)
+		fileCallback(f.name.c_str(), f.timeStamp, f.fileSize);
+
+	for (auto& d: dir.directories)
+		directoryCallback(d.c_str());
+
+	std::unique_lock<std::mutex> lock(currentMutex);
+
+	current[key] = std::move(dir);
+
+	return true;
+}
@@ -0,0 +1,51 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+
+// Directory listings recorded during a scan, keyed by directory path; the next scan reuses the listing of a directory
+// instead of reading it and getting attributes of every file if the directory modification time and size didn't change
+// Note that this misses files that were modified in place, since that doesn't update the directory modification time
+class DirectoryCache
+{
+public:
+	DirectoryCache();
+
+	// Loads listings saved by the previous scan; missing or malformed cache files are ignored
+	void load(const char* path);
+
+	// Has to be called before the scan; remembers the scan start time so that the next scan can tell which listings are reliable
+	bool start(const char* path);
+	bool save(const char* path);
+
+	// Same as readDirectory but uses the previous listing if possible; records the listing for saving
+	bool readDirectory(const char* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback);
+
+private:
+	struct File
+	{
+		std::string name;
+		uint64_t timeStamp;
+		uint64_t fileSize;
+	};
+
+	struct Directory
+	{
+		uint64_t timeStamp;
+		uint64_t size;
+
+		std::vector<File> files;
+		std::vector<std::string> directories;
+	};
+
+	uint64_t previousScanTimeStamp;
+	std::unordered_map<std::string, Directory> previous;
+
+	uint64_t scanTimeStamp;
+	std::unordered_map<std::string, Directory> current;
+	std::mutex currentMutex;
+};
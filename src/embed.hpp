@@ -0,0 +1,41 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+// C API for editors that embed qgrep as a shared library. Queries run on a background thread of the session, one at a time in the
+// order they were started; search and files queries share project data and the chunk cache of the session between queries.
+// Query arguments are the command line arguments without the executable name, separated with newlines, optionally followed by
+// \2 and the input of the filter command, as in qgrepVim.
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct QgrepSession QgrepSession;
+
+QgrepSession* qgrepSessionOpen();
+
+// Cancels all queries and waits for the running one to stop
+void qgrepSessionClose(QgrepSession* session);
+
+// Returns the query id (never 0)
+unsigned int qgrepQueryStart(QgrepSession* session, const char* args);
+
+// Waits for up to timeout milliseconds for more output and returns the output that has been produced since the last call
+// Once the query finishes and all its output has been returned, done is set to 1 and the id becomes invalid
+// The string is valid until the next call of qgrepQueryPoll for the same session
+const char* qgrepQueryPoll(QgrepSession* session, unsigned int query, unsigned int timeout, int* done);
+
+// Stops the query as soon as possible and discards its output; it still has to be polled until it's done
+void qgrepQueryCancel(QgrepSession* session, unsigned int query);
+
+// Runs the query on the calling thread and returns all of its output; the string is valid until the next call
+const char* qgrepVim(const char* args);
+
+// Vim can only call functions with one argument via libcall/libcallnr, so these use a session that lives until the process exits
+// qgrepVimStart returns the query id as a string; qgrepVimPoll doesn't wait, and returns the output prefixed with '1' if done, '0' otherwise
+const char* qgrepVimStart(const char* args);
+const char* qgrepVimPoll(int query);
+int qgrepVimCancel(int query);
+
+#ifdef __cplusplus
+}
+#endif
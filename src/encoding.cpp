@@ -4,6 +4,10 @@
 
 #include <string.h>
 
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
+
 inline uint16_t endianSwap(uint16_t value)
 {
 	return static_cast<uint16_t>(((value & 0xff) << 8) | (value >> 8));
@@ -66,75 +70,218 @@ struct UTF8Writer
 	}
 };
 
+#ifdef USE_SSE2
+inline int countBits(unsigned int value)
+{
+	value = value - ((value >> 1) & 0x55555555);
+	value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+	return (((value + (value >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+// Comparisons are signed in SSE2, so code units are compared with zero after masking off the bits that are allowed to be set
+inline int maskEqual16(__m128i value, uint16_t mask, uint16_t expected)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(value, _mm_set1_epi16(static_cast<short>(mask))), _mm_set1_epi16(static_cast<short>(expected))));
+}
+
+inline int maskEqual32(__m128i value, uint32_t mask, uint32_t expected)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(value, _mm_set1_epi32(static_cast<int>(mask))), _mm_set1_epi32(static_cast<int>(expected))));
+}
+#endif
+
+// Decoders process one code point at a time, but blocks of code units can be counted or converted at once if they satisfy decoder-specific
+// conditions (i.e. only contain ASCII characters); countBlock and writeBlock return false for blocks that have to be processed one code point at a time
 template <bool swap> struct UTF16Decoder
 {
 	typedef uint16_t Element;
 
-	template <typename State, typename Pred> static State decode(const uint16_t* data, size_t size, State result, Pred pred)
+	template <typename State, typename Pred> static const uint16_t* step(const uint16_t* data, const uint16_t* end, State& result, Pred& pred)
 	{
-		const uint16_t* end = data + size;
+		uint16_t lead = swap ? endianSwap(*data) : *data;
 
-		while (data < end)
+		// U+0000..U+D7FF
+		if (lead < 0xD800)
+		{
+			result = pred(result, lead);
+			return data + 1;
+		}
+		// U+E000..U+FFFF
+		else if (static_cast<unsigned int>(lead - 0xE000) < 0x2000)
 		{
-			uint16_t lead = swap ? endianSwap(*data) : *data;
+			result = pred(result, lead);
+			return data + 1;
+		}
+		// surrogate pair lead
+		else if (static_cast<unsigned int>(lead - 0xD800) < 0x400 && data + 1 < end)
+		{
+			uint16_t next = swap ? endianSwap(data[1]) : data[1];
 
-			// U+0000..U+D7FF
-			if (lead < 0xD800)
-			{
-				result = pred(result, lead);
-				data += 1;
-			}
-			// U+E000..U+FFFF
-			else if (static_cast<unsigned int>(lead - 0xE000) < 0x2000)
-			{
-				result = pred(result, lead);
-				data += 1;
-			}
-			// surrogate pair lead
-			else if (static_cast<unsigned int>(lead - 0xD800) < 0x400 && data + 1 < end)
+			if (static_cast<unsigned int>(next - 0xDC00) < 0x400)
 			{
-				uint16_t next = swap ? endianSwap(data[1]) : data[1];
-
-				if (static_cast<unsigned int>(next - 0xDC00) < 0x400)
-				{
-					result = pred(result, 0x10000 + ((lead & 0x3ff) << 10) + (next & 0x3ff));
-					data += 2;
-				}
-				else
-				{
-					data += 1;
-				}
+				result = pred(result, 0x10000 + ((lead & 0x3ff) << 10) + (next & 0x3ff));
+				return data + 2;
 			}
 			else
 			{
-				data += 1;
+				return data + 1;
 			}
 		}
+		else
+		{
+			return data + 1;
+		}
+	}
+
+#ifdef USE_SSE2
+	static const size_t kBlockSize = 8;
 
-		return result;
+	static __m128i load(const uint16_t* data)
+	{
+		__m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+
+		return swap ? _mm_or_si128(_mm_slli_epi16(value, 8), _mm_srli_epi16(value, 8)) : value;
+	}
+
+	// Blocks without surrogates are counted at once: every unit takes 1 byte, plus 1 byte if it's U+0080 or above, plus 1 byte if it's U+0800 or above
+	static bool countBlock(const uint16_t* data, size_t& result)
+	{
+		__m128i value = load(data);
+
+		if (maskEqual16(value, 0xF800, 0xD800) != 0)
+			return false;
+
+		int ascii = maskEqual16(value, 0xFF80, 0);
+		int narrow = maskEqual16(value, 0xF800, 0);
+
+		result += kBlockSize * 3 - (countBits(ascii) + countBits(narrow)) / 2;
+		return true;
 	}
+
+	static bool writeBlock(const uint16_t* data, uint8_t*& result)
+	{
+		__m128i value = load(data);
+
+		if (maskEqual16(value, 0xFF80, 0) != 0xFFFF)
+			return false;
+
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(result), _mm_packus_epi16(value, value));
+		result += kBlockSize;
+		return true;
+	}
+#endif
 };
 
 template <bool swap> struct UTF32Decoder
 {
 	typedef uint32_t Element;
 
-	template <typename State, typename Pred> static State decode(const uint32_t* data, size_t size, State result, Pred pred)
+	template <typename State, typename Pred> static const uint32_t* step(const uint32_t* data, const uint32_t* end, State& result, Pred& pred)
 	{
-		const uint32_t* end = data + size;
+		uint32_t lead = swap ? endianSwap(*data) : *data;
 
-		while (data < end)
-		{
-			uint32_t lead = swap ? endianSwap(*data) : *data;
+		result = pred(result, lead);
+		return data + 1;
+	}
 
-			result = pred(result, lead);
-			data += 1;
-		}
+#ifdef USE_SSE2
+	static const size_t kBlockSize = 4;
+
+	static __m128i load(const uint32_t* data)
+	{
+		__m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+
+		if (!swap)
+			return value;
+
+		__m128i outer = _mm_or_si128(_mm_slli_epi32(value, 24), _mm_srli_epi32(value, 24));
+		__m128i inner = _mm_or_si128(_mm_and_si128(_mm_slli_epi32(value, 8), _mm_set1_epi32(0xff0000)), _mm_and_si128(_mm_srli_epi32(value, 8), _mm_set1_epi32(0xff00)));
+
+		return _mm_or_si128(outer, inner);
+	}
+
+	// Every unit takes 1 byte, plus 1 byte for each of U+0080, U+0800 and U+10000 thresholds it's at or above; see UTF8Counter
+	static bool countBlock(const uint32_t* data, size_t& result)
+	{
+		__m128i value = load(data);
+
+		int ascii = maskEqual32(value, 0xFFFFFF80, 0);
+		int narrow = maskEqual32(value, 0xFFFFF800, 0);
+		int basic = maskEqual32(value, 0xFFFF0000, 0);
 
-		return result;
+		result += kBlockSize * 4 - (countBits(ascii) + countBits(narrow) + countBits(basic)) / 4;
+		return true;
 	}
+
+	static bool writeBlock(const uint32_t* data, uint8_t*& result)
+	{
+		__m128i value = load(data);
+
+		if (maskEqual32(value, 0xFFFFFF80, 0) != 0xFFFF)
+			return false;
+
+		__m128i packed = _mm_packs_epi32(value, value);
+		int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+
+		memcpy(result, &bytes, kBlockSize);
+		result += kBlockSize;
+		return true;
+	}
+#endif
 };
 
+template <typename Decoder, typename State, typename Pred> inline State decode(const typename Decoder::Element* data, size_t size, State result, Pred pred)
+{
+	const typename Decoder::Element* end = data + size;
+
+	while (data < end)
+		data = Decoder::step(data, end, result, pred);
+
+	return result;
+}
+
+// Blocks that can't be processed at once are decoded one code point at a time; a surrogate pair can extend decoding past the end of the block
+template <typename Decoder> inline size_t countUTF8(const typename Decoder::Element* data, size_t size)
+{
+	const typename Decoder::Element* end = data + size;
+	size_t result = 0;
+
+#ifdef USE_SSE2
+	UTF8Counter counter;
+
+	while (size_t(end - data) >= Decoder::kBlockSize)
+	{
+		if (Decoder::countBlock(data, result))
+			data += Decoder::kBlockSize;
+		else
+			for (const typename Decoder::Element* next = data + Decoder::kBlockSize; data < next; )
+				data = Decoder::step(data, end, result, counter);
+	}
+#endif
+
+	return decode<Decoder>(data, end - data, result, UTF8Counter());
+}
+
+template <typename Decoder> inline uint8_t* writeUTF8(const typename Decoder::Element* data, size_t size, uint8_t* result)
+{
+	const typename Decoder::Element* end = data + size;
+
+#ifdef USE_SSE2
+	UTF8Writer writer;
+
+	while (size_t(end - data) >= Decoder::kBlockSize)
+	{
+		if (Decoder::writeBlock(data, result))
+			data += Decoder::kBlockSize;
+		else
+			for (const typename Decoder::Element* next = data + Decoder::kBlockSize; data < next; )
+				data = Decoder::step(data, end, result, writer);
+	}
+#endif
+
+	return decode<Decoder>(data, end - data, result, UTF8Writer());
+}
+
 template <typename Decoder> inline std::vector<char> convertToUTF8Impl(const char* data, size_t size)
 {
 	typedef typename Decoder::Element T;
@@ -142,13 +289,13 @@ template <typename Decoder> inline std::vector<char> convertToUTF8Impl(const cha
 	const T* source = reinterpret_cast<const T*>(data);
 	size_t count = size / sizeof(T);
 
-	size_t utf8Length = Decoder::decode(source, count, static_cast<size_t>(0), UTF8Counter());
+	size_t utf8Length = countUTF8<Decoder>(source, count);
 	std::vector<char> result(utf8Length);
 
 	if (utf8Length > 0)
 	{
 		uint8_t* beg = reinterpret_cast<uint8_t*>(&result[0]);
-		uint8_t* end = Decoder::decode(source, count, beg, UTF8Writer());
+		uint8_t* end = writeUTF8<Decoder>(source, count, beg);
 		assert(beg + utf8Length == end);
 	}
 
@@ -164,7 +311,48 @@ std::vector<char> convertToUTF8(std::vector<char> data)
 	if (size >= 4 && *reinterpret_cast<const uint32_t*>(contents) == 0xfffe0000) return convertToUTF8Impl<UTF32Decoder<true>>(contents + 4, size - 4);
 	if (size >= 2 && *reinterpret_cast<const uint16_t*>(contents) == 0xfeff) return convertToUTF8Impl<UTF16Decoder<false>>(contents + 2, size - 2);
 	if (size >= 2 && *reinterpret_cast<const uint16_t*>(contents) == 0xfffe) return convertToUTF8Impl<UTF16Decoder<true>>(contents + 2, size - 2);
-	if (size >= 3 && memcmp(contents, "\xef\xbb\xbf", 3) == 0) return std::vector<char>(contents + 3, contents + size);
+
+	// UTF-8 files only need the BOM removed, which can be done in place
+	if (size >= 3 && memcmp(contents, "\xef\xbb\xbf", 3) == 0)
+	{
+		data.erase(data.begin(), data.begin() + 3);
+		return data;
+	}
 
 	return data;
 }
+
+size_t countInvalidUTF8(const char* data, size_t size)
+{
+	const uint8_t* source = reinterpret_cast<const uint8_t*>(data);
+	size_t result = 0;
+	size_t offset = 0;
+
+	while (offset < size)
+	{
+		uint8_t lead = source[offset];
+
+		size_t length =
+			(lead < 0x80) ? 1 :
+			(lead >= 0xC2 && lead < 0xE0) ? 2 :
+			(lead >= 0xE0 && lead < 0xF0) ? 3 :
+			(lead >= 0xF0 && lead < 0xF5) ? 4 : 0;
+
+		bool valid = length > 0 && offset + length <= size;
+
+		for (size_t i = 1; valid && i < length; ++i)
+			valid = (source[offset + i] & 0xC0) == 0x80;
+
+		if (valid)
+		{
+			offset += length;
+		}
+		else
+		{
+			result++;
+			offset++;
+		}
+	}
+
+	return result;
+}
@@ -4,3 +4,6 @@
 #include <vector>
 
 std::vector<char> convertToUTF8(std::vector<char> data);
+
+// Returns the number of bytes that are not part of valid UTF-8 sequences
+size_t countInvalidUTF8(const char* data, size_t size);
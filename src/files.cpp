@@ -7,11 +7,14 @@
 #include "fileutil.hpp"
 #include "filestream.hpp"
 #include "format.hpp"
-#include "compression.hpp"
+#include "datafile.hpp"
+#include "postings.hpp"
 #include "filter.hpp"
 #include "constants.hpp"
+#include "search.hpp"
 
 #include <memory>
+#include <algorithm>
 
 #include <string.h>
 
@@ -31,61 +34,50 @@ static std::vector<const char*> getFileNames(const char** files, unsigned int co
 	return result;
 }
 
-static size_t getStringBufferSize(const std::vector<const char*>& strings)
+static void appendStrings(std::vector<char>& buffer, std::vector<FileFileEntry>& entries, const std::vector<const char*>& strings)
 {
-	size_t result = 0;
+	entries.resize(strings.size());
 
 	for (size_t i = 0; i < strings.size(); ++i)
-		result += strlen(strings[i]) + 1;
+	{
+		size_t length = strlen(strings[i]);
 
-	return result;
-}
+		entries[i].offset = buffer.size();
+		entries[i].length = length;
 
-typedef std::pair<unsigned int, unsigned int> BufferOffsetLength;
+		buffer.insert(buffer.end(), strings[i], strings[i] + length);
+		buffer.push_back('\n');
+	}
+}
 
-static std::pair<std::vector<char>, std::pair<BufferOffsetLength, BufferOffsetLength>> prepareFileData(const std::vector<FileInfo>& files)
+static std::vector<char> prepareNamePostings(const std::vector<const char*>& names)
 {
-	size_t count = files.size();
-
-	std::vector<const char*> paths(count);
-	for (size_t i = 0; i < count; ++i)
-		paths[i] = files[i].path.c_str();
-
-	std::vector<const char*> names = getFileNames(paths.data(), count);
+	PostingIndexBuilder builder;
+	std::vector<unsigned int> ngrams;
 
-	size_t entrySize = sizeof(FileFileEntry) * count;
-	size_t nameSize = getStringBufferSize(names);
-	size_t pathSize = getStringBufferSize(paths);
-	size_t totalSize = entrySize + nameSize + pathSize;
-
-	std::vector<char> data(totalSize);
-
-	size_t nameOffset = entrySize;
-	size_t pathOffset = entrySize + nameSize;
-	
-	for (unsigned int i = 0; i < count; ++i)
+	for (size_t i = 0; i < names.size(); ++i)
 	{
-		size_t nameLength = strlen(names[i]);
-		size_t pathLength = strlen(paths[i]);
-
-		std::copy(names[i], names[i] + nameLength, data.begin() + nameOffset);
-		data[nameOffset + nameLength] = '\n';
+		ngrams = trigramExtract(names[i]);
+		builder.append(i, ngrams);
+	}
 
-		std::copy(paths[i], paths[i] + pathLength, data.begin() + pathOffset);
-		data[pathOffset + pathLength] = '\n';
+	return builder.serialize();
+}
 
-		FileFileEntry& e = reinterpret_cast<FileFileEntry*>(&data[0])[i];
+static void writeSection(FileStream& out, uint64_t& offset, uint64_t& sectionOffset, const void* data, size_t size)
+{
+	static const char kPadding[8] = {};
 
-		e.nameOffset = nameOffset;
-		e.pathOffset = pathOffset;
+	// sections are aligned so that entry tables can be used in place
+	size_t padding = -offset & 7;
 
-		nameOffset += nameLength + 1;
-		pathOffset += pathLength + 1;
-	}
+	out.write(kPadding, padding);
+	offset += padding;
 
-	assert(nameOffset == entrySize + nameSize && pathOffset == totalSize);
+	sectionOffset = offset;
 
-	return std::make_pair(data, std::make_pair(BufferOffsetLength(entrySize, nameSize), BufferOffsetLength(entrySize + nameSize, pathSize)));
+	if (size) out.write(data, size);
+	offset += size;
 }
 
 bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& files)
@@ -103,23 +95,46 @@ bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& f
 			return false;
 		}
 
-		std::pair<std::vector<char>, std::pair<BufferOffsetLength, BufferOffsetLength>> data = prepareFileData(files);
-		std::pair<std::unique_ptr<char[]>, size_t> compressed = compress(data.first.data(), data.first.size(), kFileListCompressionLevel);
+		size_t count = files.size();
 
-		FileFileHeader header;
-		memcpy(header.magic, kFileFileHeaderMagic, sizeof(header.magic));
+		std::vector<const char*> paths(count);
+		for (size_t i = 0; i < count; ++i)
+			paths[i] = files[i].path.c_str();
 
-		header.fileCount = files.size();
-		header.compressedSize = compressed.second;
-		header.uncompressedSize = data.first.size();
+		std::vector<const char*> names = getFileNames(paths.data(), count);
 
-		header.nameBufferOffset = data.second.first.first;
-		header.nameBufferLength = data.second.first.second;
-		header.pathBufferOffset = data.second.second.first;
-		header.pathBufferLength = data.second.second.second;
+		std::vector<char> pathBuffer, nameBuffer;
+		std::vector<FileFileEntry> pathEntries, nameEntries;
+
+		appendStrings(pathBuffer, pathEntries, paths);
+		appendStrings(nameBuffer, nameEntries, names);
+
+		std::vector<char> postings = prepareNamePostings(names);
+
+		FileFileHeader header = {};
+		memcpy(header.magic, kFileFileHeaderMagic, sizeof(header.magic));
+
+		header.fileCount = count;
+		header.pathBufferLength = pathBuffer.size();
+		header.nameBufferLength = nameBuffer.size();
+		header.postingSize = postings.size();
 
 		out.write(&header, sizeof(header));
-		if (compressed.first) out.write(compressed.first.get(), compressed.second);
+
+		uint64_t offset = sizeof(header);
+
+		writeSection(out, offset, header.pathBufferOffset, pathBuffer.data(), pathBuffer.size());
+		writeSection(out, offset, header.nameBufferOffset, nameBuffer.data(), nameBuffer.size());
+		writeSection(out, offset, header.pathEntryOffset, pathEntries.data(), pathEntries.size() * sizeof(FileFileEntry));
+		writeSection(out, offset, header.nameEntryOffset, nameEntries.data(), nameEntries.size() * sizeof(FileFileEntry));
+		writeSection(out, offset, header.postingOffset, postings.data(), postings.size());
+
+		// section offsets are only known after writing all sections
+		if (!out.seek(0) || out.write(&header, sizeof(header)) != sizeof(header))
+		{
+			output->error("Error saving data file %s\n", tempPath.c_str());
+			return false;
+		}
 	}
 
 	if (!renameFile(tempPath.c_str(), targetPath.c_str()))
@@ -131,66 +146,228 @@ bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& f
 	return true;
 }
 
-template <typename ExtractOffset>
-static void buildFilterEntries(FilterEntries& result, std::unique_ptr<FilterEntry[]>& entryptr,
-    const FileFileHeader& header, const char* data, unsigned int bufferOffset, unsigned int bufferLength, ExtractOffset extractOffset)
+// Entries point into a buffer of newline-terminated strings, so every entry has to end before the end of the buffer
+static bool isFileEntryTableValid(const char* data, unsigned int count, uint64_t bufferSize)
 {
-    const FileFileEntry* entries = reinterpret_cast<const FileFileEntry*>(data);
+	const FileFileEntry* entries = reinterpret_cast<const FileFileEntry*>(data);
 
-    entryptr.reset(new FilterEntry[header.fileCount]);
+	for (unsigned int i = 0; i < count; ++i)
+		if (entries[i].offset >= bufferSize || entries[i].length >= bufferSize - entries[i].offset)
+			return false;
 
-    result.buffer = data + bufferOffset;
-    result.bufferSize = bufferLength;
+	return true;
+}
 
-    result.entries = entryptr.get();
-    result.entryCount = header.fileCount;
+static const FilterEntry* getFilterEntries(const char* data, unsigned int count, std::unique_ptr<FilterEntry[]>& storage)
+{
+	const FileFileEntry* entries = reinterpret_cast<const FileFileEntry*>(data);
+
+	// on 64-bit platforms file entries have the same layout as filter entries
+	if (sizeof(FilterEntry) == sizeof(FileFileEntry))
+		return reinterpret_cast<const FilterEntry*>(entries);
 
-    for (size_t i = 0; i < header.fileCount; ++i)
-    {
-        FilterEntry& e = result.entries[i];
+	storage.reset(new FilterEntry[count]);
 
-        size_t offset = extractOffset(entries[i]);
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		storage[i].offset = entries[i].offset;
+		storage[i].length = entries[i].length;
+	}
 
-        e.offset = offset - bufferOffset;
-        e.length = (i + 1 < header.fileCount ? extractOffset(entries[i + 1]) : bufferOffset + bufferLength) - offset - 1;
-    }
+	return storage.get();
 }
 
-unsigned int searchFiles(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude)
+struct FilesProjectData
 {
+	std::pair<uint64_t, uint64_t> dataStamp;
+
+	// Buffers and entry tables point into the file mapping; sections are only copied if the file can't be mapped
+	DataFileReader in;
+	std::vector<char> storage[5];
+
+	FilterEntries paths;
+	std::unique_ptr<FilterEntry[]> pathEntries;
+
+	FilterEntries names;
+	std::unique_ptr<FilterEntry[]> nameEntries;
+
+	PostingIndex namePostings;
+
+	// Entries that matched the last search in this project; used to narrow down searches for refined queries
+	struct LastSearch
+	{
+		bool valid;
+		std::string query;
+		unsigned int options;
+		std::vector<unsigned int> entries;
+	};
+
+	LastSearch lastSearch;
+};
+
+struct FilterEntriesSubset
+{
+	FilterEntries entries;
+
+	std::unique_ptr<FilterEntry[]> entryStorage;
+	std::unique_ptr<char[]> bufferStorage;
+};
+
+// Regex filters use entry offsets to locate entries in the buffer, so the subset has to be packed into a separate buffer
+static void buildFilterEntriesSubset(FilterEntriesSubset& result, const FilterEntries& entries, const std::vector<unsigned int>& indices)
+{
+	size_t bufferSize = 0;
+
+	for (size_t i = 0; i < indices.size(); ++i)
+		bufferSize += entries.entries[indices[i]].length + 1;
+
+	result.entryStorage.reset(new FilterEntry[indices.size()]);
+	result.bufferStorage.reset(new char[bufferSize]);
+
+	size_t offset = 0;
+
+	for (size_t i = 0; i < indices.size(); ++i)
+	{
+		const FilterEntry& e = entries.entries[indices[i]];
+		FilterEntry& r = result.entryStorage[i];
+
+		r.offset = offset;
+		r.length = e.length;
+
+		memcpy(result.bufferStorage.get() + offset, entries.buffer + e.offset, e.length);
+		result.bufferStorage[offset + e.length] = '\n';
+
+		offset += e.length + 1;
+	}
+
+	result.entries.buffer = result.bufferStorage.get();
+	result.entries.bufferSize = bufferSize;
+	result.entries.entries = result.entryStorage.get();
+	result.entries.entryCount = indices.size();
+	result.entries.postings = nullptr;
+}
+
+static std::shared_ptr<FilesProjectData> openFiles(Output* output, const char* file)
+{
+	std::shared_ptr<FilesProjectData> project(new FilesProjectData());
+
+	project->lastSearch.valid = false;
+
 	std::string dataPath = replaceExtension(file, ".qgf");
-	FileStream in(dataPath.c_str(), "rb");
-	if (!in)
+
+	project->dataStamp = SearchContext::getFileStamp(dataPath);
+
+	DataFileReader& in = project->in;
+	if (!in.open(dataPath.c_str()))
 	{
 		output->error("Error reading data file %s\n", dataPath.c_str());
-		return 0;
+		return std::shared_ptr<FilesProjectData>();
 	}
 	
-	FileFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kFileFileHeaderMagic, strlen(kFileFileHeaderMagic)) != 0)
+	FileFileHeader header = {};
+	if (!in.read(0, &header, sizeof(header)) || memcmp(header.magic, kFileFileHeaderMagic, strlen(kFileFileHeaderMagic)) != 0)
 	{
-		output->error("Error reading data file %s: malformed header\n", dataPath.c_str());
-		return 0;
+		output->error(memcmp(header.magic, kFileFileHeaderMagic, 3) == 0
+			? "Error reading data file %s: file format is out of date, update the project to fix\n"
+			: "Error reading data file %s: malformed header\n", dataPath.c_str());
+		return std::shared_ptr<FilesProjectData>();
+	}
+
+	// entry table size can only overflow on 32-bit platforms; a truncated size would make the entry checks read past the table
+	if (header.fileCount > size_t(-1) / sizeof(FileFileEntry))
+	{
+		output->error("Error reading data file %s: malformed file table\n", dataPath.c_str());
+		return std::shared_ptr<FilesProjectData>();
 	}
 
-	std::unique_ptr<char[]> buffer(new (std::nothrow) char[header.compressedSize + header.uncompressedSize]);
+	size_t entrySize = sizeof(FileFileEntry) * header.fileCount;
+
+	const char* pathBuffer = in.read(header.pathBufferOffset, header.pathBufferLength, project->storage[0]);
+	const char* nameBuffer = in.read(header.nameBufferOffset, header.nameBufferLength, project->storage[1]);
+	const char* pathEntries = in.read(header.pathEntryOffset, entrySize, project->storage[2]);
+	const char* nameEntries = in.read(header.nameEntryOffset, entrySize, project->storage[3]);
 
-	if (!buffer || !read(in, buffer.get(), header.compressedSize))
+	if (!pathBuffer || !nameBuffer || !pathEntries || !nameEntries || (header.pathEntryOffset | header.nameEntryOffset) % 8 != 0 ||
+		!isFileEntryTableValid(pathEntries, header.fileCount, header.pathBufferLength) || !isFileEntryTableValid(nameEntries, header.fileCount, header.nameBufferLength))
 	{
-		output->error("Error reading data file %s: malformed header\n", dataPath.c_str());
-		return 0;
+		output->error("Error reading data file %s: malformed file table\n", dataPath.c_str());
+		return std::shared_ptr<FilesProjectData>();
+	}
+
+	project->paths.buffer = pathBuffer;
+	project->paths.bufferSize = header.pathBufferLength;
+	project->paths.entries = getFilterEntries(pathEntries, header.fileCount, project->pathEntries);
+	project->paths.entryCount = header.fileCount;
+	project->paths.postings = nullptr;
+
+	project->names.buffer = nameBuffer;
+	project->names.bufferSize = header.nameBufferLength;
+	project->names.entries = getFilterEntries(nameEntries, header.fileCount, project->nameEntries);
+	project->names.entryCount = header.fileCount;
+	project->names.postings = nullptr;
+
+	// Name postings are optional; without them name regex searches scan all names
+	if (header.postingSize)
+	{
+		const char* postingData = in.read(header.postingOffset, header.postingSize, project->storage[4]);
+
+		if (postingData && project->namePostings.open(postingData, header.postingSize))
+			project->names.postings = &project->namePostings;
 	}
 
-	char* data = buffer.get() + header.compressedSize;
-	decompress(data, header.uncompressedSize, buffer.get(), header.compressedSize);
+	return project;
+}
+
+std::shared_ptr<FilesProjectData> SearchContext::getFiles(Output* output, const char* file)
+{
+	std::shared_ptr<FilesProjectData>& project = files[file];
+
+	if (!project || project->dataStamp != getFileStamp(replaceExtension(file, ".qgf")))
+		project = openFiles(output, file);
+
+	return project;
+}
+
+unsigned int searchFiles(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchContext* context)
+{
+	std::shared_ptr<FilesProjectData> project = context ? context->getFiles(output, file) : openFiles(output, file);
+	if (!project)
+		return 0;
 
-    FilterEntries paths;
-    std::unique_ptr<FilterEntry[]> pathEntries;
-    buildFilterEntries(paths, pathEntries, header, data, header.pathBufferOffset, header.pathBufferLength, [](const FileFileEntry& e) { return e.pathOffset; });
+	if (!context)
+		return filter(output, string, options, limit, project->paths, &project->names);
 
-    FilterEntries names;
-    std::unique_ptr<FilterEntry[]> nameEntries;
-    buildFilterEntries(names, nameEntries, header, data, header.nameBufferOffset, header.nameBufferLength, [](const FileFileEntry& e) { return e.nameOffset; });
+	// If the query is a refinement of the last one, only entries that matched last time can match
+	FilesProjectData::LastSearch& lastSearch = project->lastSearch;
 
-    return filter(output, string, options, limit, paths, &names);
+	bool refine = lastSearch.valid && lastSearch.options == options && isFilterRefinement(lastSearch.query.c_str(), string, options);
+
+	std::vector<unsigned int> matches;
+	unsigned int result;
+
+	if (refine)
+	{
+		FilterEntriesSubset paths, names;
+		buildFilterEntriesSubset(paths, project->paths, lastSearch.entries);
+		buildFilterEntriesSubset(names, project->names, lastSearch.entries);
+
+		result = filter(output, string, options, limit, paths.entries, &names.entries, &matches);
+
+		for (size_t i = 0; i < matches.size(); ++i)
+			matches[i] = lastSearch.entries[matches[i]];
+	}
+	else
+	{
+		result = filter(output, string, options, limit, project->paths, &project->names, &matches);
+	}
+
+	// Matched entry list is only complete if the search didn't stop at the limit; fuzzy search outputs entries in rank order
+	std::sort(matches.begin(), matches.end());
+
+	lastSearch.valid = result < limit;
+	lastSearch.query = string;
+	lastSearch.options = options;
+	lastSearch.entries.swap(matches);
+
+	return result;
 }
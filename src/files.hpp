@@ -6,7 +6,8 @@
 
 class Output;
 struct FileInfo;
+class SearchContext;
 
 bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& files);
 
-unsigned int searchFiles(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude);
\ No newline at end of file
+unsigned int searchFiles(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchContext* context = nullptr);
\ No newline at end of file
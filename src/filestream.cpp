@@ -41,12 +41,27 @@ void FileStream::skip(size_t offset)
     fseeko(static_cast<FILE*>(file), offset, SEEK_CUR);
 }
 
+bool FileStream::seek(uint64_t offset)
+{
+    return fseeko(static_cast<FILE*>(file), offset, SEEK_SET) == 0;
+}
+
 size_t FileStream::read(void* data, size_t size)
 {
     return fread(data, 1, size, static_cast<FILE*>(file));
 }
 
+void FileStream::prefetch(uint64_t offset, uint64_t size)
+{
+    prefetchFile(static_cast<FILE*>(file), offset, size);
+}
+
 size_t FileStream::write(const void* data, size_t size)
 {
     return fwrite(data, 1, size, static_cast<FILE*>(file));
 }
+
+bool FileStream::sync()
+{
+    return syncFile(static_cast<FILE*>(file));
+}
@@ -15,8 +15,11 @@ public:
 	operator bool() const;
 
 	void skip(size_t offset);
+	bool seek(uint64_t offset);
 	size_t read(void* data, size_t size);
+	void prefetch(uint64_t offset, uint64_t size);
 	size_t write(const void* data, size_t size);
+	bool sync();
 
 private:
 	void* file;
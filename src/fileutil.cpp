@@ -2,6 +2,16 @@
 #include "common.hpp"
 #include "fileutil.hpp"
 
+#include "constants.hpp"
+#include "dircache.hpp"
+#include "workqueue.hpp"
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
 #include <string.h>
 
 static bool isSeparator(char ch)
@@ -63,6 +73,132 @@ bool traverseFileNeeded(const char* name)
 	return true;
 }
 
+struct TraverseFile
+{
+	std::string name;
+	uint64_t mtime;
+	uint64_t size;
+};
+
+struct TraverseState
+{
+	const char* path;
+	const std::function<void (const char* name, uint64_t mtime, uint64_t size)>* callback;
+	const std::function<bool (const char* name)>* directoryFilter;
+	DirectoryCache* cache;
+
+	std::mutex mutex;
+	std::condition_variable directoriesAvailable;
+
+	std::vector<std::string> directories;
+	size_t activeWorkers;
+};
+
+// Lists the directory and passes results to callbacks in one go so that the lock is only taken once per directory
+static void traverseDirectoryOne(TraverseState& state, const std::string& relpath, std::vector<TraverseFile>& files, std::vector<std::string>& directories)
+{
+	files.clear();
+	directories.clear();
+
+	auto fileCallback = [&](const char* name, uint64_t mtime, uint64_t size) {
+		files.push_back({ name, mtime, size });
+	};
+
+	auto directoryCallback = [&](const char* name) {
+		directories.push_back(name);
+	};
+
+	if (state.cache)
+		state.cache->readDirectory(state.path, relpath.c_str(), fileCallback, directoryCallback);
+	else
+		readDirectory(state.path, relpath.c_str(), fileCallback, directoryCallback);
+
+	std::unique_lock<std::mutex> lock(state.mutex);
+
+	for (auto& f: files)
+		(*state.callback)(f.name.c_str(), f.mtime, f.size);
+
+	size_t pending = state.directories.size();
+
+	for (auto& d: directories)
+		if ((*state.directoryFilter)(d.c_str()))
+			state.directories.emplace_back(std::move(d));
+
+	if (state.directories.size() > pending)
+		state.directoriesAvailable.notify_all();
+}
+
+static void traverseDirectoryWorker(TraverseState& state)
+{
+	std::vector<TraverseFile> files;
+	std::vector<std::string> directories;
+
+	std::unique_lock<std::mutex> lock(state.mutex);
+
+	for (;;)
+	{
+		state.directoriesAvailable.wait(lock, [&]() { return !state.directories.empty() || state.activeWorkers == 0; });
+
+		if (state.directories.empty())
+			break;
+
+		std::string relpath = std::move(state.directories.back());
+		state.directories.pop_back();
+
+		state.activeWorkers++;
+		lock.unlock();
+
+		traverseDirectoryOne(state, relpath, files, directories);
+
+		lock.lock();
+		state.activeWorkers--;
+
+		// traversal is complete once no directories are queued and no worker can queue more
+		if (state.directories.empty() && state.activeWorkers == 0)
+			state.directoriesAvailable.notify_all();
+	}
+}
+
+bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter, DirectoryCache* cache)
+{
+	TraverseState state;
+	state.path = path;
+	state.callback = &callback;
+	state.directoryFilter = &directoryFilter;
+	state.cache = cache;
+	state.activeWorkers = 0;
+
+	auto rootFileCallback = [&](const char* name, uint64_t mtime, uint64_t size) {
+		callback(name, mtime, size);
+	};
+
+	auto rootDirectoryCallback = [&](const char* name) {
+		if (directoryFilter(name))
+			state.directories.push_back(name);
+	};
+
+	// read the root directly so that failures can be reported and trees without subdirectories don't need threads
+	bool result = cache
+		? cache->readDirectory(path, "", rootFileCallback, rootDirectoryCallback)
+		: readDirectory(path, "", rootFileCallback, rootDirectoryCallback);
+
+	if (!result || state.directories.empty())
+		return result;
+
+	// Directory reads spend most of the time waiting for the file system, so it's worth using more threads than cores unless the thread count is limited
+	unsigned int threadCount = WorkQueue::getWorkerLimit() ? WorkQueue::getWorkerLimit() : std::max(std::thread::hardware_concurrency(), kMinDirectoryTraversalThreads);
+
+	std::vector<std::thread> threads;
+
+	for (unsigned int i = 0; i < threadCount; ++i)
+		threads.emplace_back(traverseDirectoryWorker, std::ref(state));
+
+	for (auto& t: threads)
+		t.join();
+
+	return true;
+}
+
 bool passthroughDirectoryFilter(const char* name)
 {
 	return true;
@@ -2,11 +2,19 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <functional>
 
 #include <stdio.h>
 
-bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter);
+class DirectoryCache;
+
+// Traverses the directory tree on multiple threads; callbacks are serialized but are called in no particular order
+// If cache is specified, unchanged directories are listed from the cache instead of the file system
+bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter, DirectoryCache* cache = nullptr);
+
+// Lists files and subdirectories of path/relpath without recursing into subdirectories; names are relative to path
+bool readDirectory(const char* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback);
 bool traverseFileNeeded(const char* name);
 bool passthroughDirectoryFilter(const char* name);
 
@@ -17,6 +25,9 @@ void createPathForFile(const char* path);
 bool renameFile(const char* oldpath, const char* newpath);
 bool removeFile(const char* path);
 
+// Returns a path for a temporary file that replaces the given file once it's written; every call in every process gets a different path
+std::string getTempPath(const char* path);
+
 std::string getCurrentDirectory();
 
 std::string replaceExtension(const char* path, const char* ext);
@@ -25,6 +36,20 @@ std::string normalizePath(const char* base, const char* path);
 
 bool getFileAttributes(const char* path, uint64_t* mtime, uint64_t* size);
 
+// Returns the modification time of a file that was written the given number of seconds ago, in the units of getFileAttributes
+uint64_t getFileTimeAgo(uint64_t seconds);
+
 FILE* openFile(const char* path, const char* mode);
 
-bool watchDirectory(const char* path, const std::function<void (const char* name)>& callback);
+const char* mapFile(const char* path, size_t* size);
+void unmapFile(const char* data, size_t size);
+
+// Asks the OS to start reading a range of a mapped file or an open file in the background; does nothing where this isn't supported
+void prefetchMapping(const char* data, size_t size);
+void prefetchFile(FILE* file, uint64_t offset, uint64_t size);
+
+// Writes buffered data of an open file and waits until the OS has stored it on disk, so later writes can't reach the disk before it
+bool syncFile(FILE* file);
+
+// Calls the callback with batches of names of changed files relative to path; names in a batch are unique
+bool watchDirectory(const char* path, const std::function<void (const std::vector<std::string>& names)>& callback);
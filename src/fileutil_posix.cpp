@@ -4,33 +4,53 @@
 #include "common.hpp"
 #include "fileutil.hpp"
 
+#include "constants.hpp"
+
 #include <string>
 #include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
 #include <dirent.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __linux__
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <poll.h>
+#include <limits.h>
 #endif
 
 #ifdef __APPLE__
 #include <CoreServices/CoreServices.h>
 #endif
 
-static bool traverseDirectoryRec(const char* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+bool readDirectory(const char* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback)
 {
-	int fd = open(path, O_DIRECTORY);
+	std::string dirpath;
+	joinPaths(dirpath, path, relpath);
+
+	int fd = open(dirpath.c_str(), O_DIRECTORY);
 	DIR* dir = fdopendir(fd);
 
 	if (!dir)
+	{
+		if (fd >= 0) close(fd);
 		return false;
+	}
 
 	std::string buf, relbuf;
 
+	// readdir fetches entries in batches (via getdents64 on Linux), so the syscall cost is dominated by stat calls for files
 	while (dirent* entry = readdir(dir))
 	{
 		const dirent& data = *entry;
@@ -38,7 +58,6 @@ static bool traverseDirectoryRec(const char* path, const char* relpath, const st
 		if (traverseFileNeeded(data.d_name))
 		{
 			joinPaths(relbuf, relpath, data.d_name);
-			joinPaths(buf, path, data.d_name);
 
 			struct stat st = {};
 			int type = data.d_type;
@@ -49,6 +68,7 @@ static bool traverseDirectoryRec(const char* path, const char* relpath, const st
 			#ifdef _ATFILE_SOURCE
 				int rc = fstatat(fd, data.d_name, &st, 0);
 			#else
+				joinPaths(buf, dirpath.c_str(), data.d_name);
 				int rc = lstat(buf.c_str(), &st);
 			#endif
 
@@ -65,12 +85,11 @@ static bool traverseDirectoryRec(const char* path, const char* relpath, const st
 
 			if (type == DT_DIR)
 			{
-				if (directoryFilter(relbuf.c_str()))
-					traverseDirectoryRec(buf.c_str(), relbuf.c_str(), callback, directoryFilter);
+				directoryCallback(relbuf.c_str());
 			}
 			else if (type == DT_REG)
 			{
-				callback(relbuf.c_str(), st.st_mtime, st.st_size);
+				fileCallback(relbuf.c_str(), st.st_mtime, st.st_size);
 			}
 			else if (type == DT_LNK)
 			{
@@ -84,11 +103,6 @@ static bool traverseDirectoryRec(const char* path, const char* relpath, const st
 	return true;
 }
 
-bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool(const char* name)>& directoryFilter)
-{
-	return traverseDirectoryRec(path, "", callback, directoryFilter);
-}
-
 bool renameFile(const char* oldpath, const char* newpath)
 {
 	return rename(oldpath, newpath) == 0;
@@ -113,6 +127,23 @@ bool getFileAttributes(const char* path, uint64_t* mtime, uint64_t* size)
 	return false;
 }
 
+std::string getTempPath(const char* path)
+{
+	static std::atomic<unsigned int> counter;
+
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), "_%u_%u", unsigned(getpid()), counter++);
+
+	return path + std::string(suffix);
+}
+
+uint64_t getFileTimeAgo(uint64_t seconds)
+{
+	uint64_t now = time(nullptr);
+
+	return now > seconds ? now - seconds : 0;
+}
+
 void createDirectory(const char* path)
 {
 	mkdir(path, 0755);
@@ -139,7 +170,109 @@ FILE* openFile(const char* path, const char* mode)
 	return fopen(path, mode);
 }
 
+const char* mapFile(const char* path, size_t* size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat st;
+	void* result = MAP_FAILED;
+
+	// empty files can't be mapped; files that don't fit into address space have to be read instead
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && static_cast<uint64_t>(st.st_size) <= static_cast<size_t>(-1))
+	{
+		result = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+
+	// the mapping keeps a reference to the file
+	close(fd);
+
+	if (result == MAP_FAILED)
+		return nullptr;
+
+	*size = st.st_size;
+	return static_cast<const char*>(result);
+}
+
+void unmapFile(const char* data, size_t size)
+{
+	munmap(const_cast<char*>(data), size);
+}
+
+void prefetchMapping(const char* data, size_t size)
+{
+	// madvise needs a page-aligned start address
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t alignment = reinterpret_cast<uintptr_t>(data) & (pageSize - 1);
+
+	madvise(const_cast<char*>(data - alignment), size + alignment, MADV_WILLNEED);
+}
+
+void prefetchFile(FILE* file, uint64_t offset, uint64_t size)
+{
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fileno(file), offset, size, POSIX_FADV_WILLNEED);
+#else
+	(void)file;
+	(void)offset;
+	(void)size;
+#endif
+}
+
+bool syncFile(FILE* file)
+{
+	return fflush(file) == 0 && fsync(fileno(file)) == 0;
+}
+
 #ifdef __linux__
+static void addDirectoryFiles(const char* path, const char* relpath, std::vector<std::string>& names)
+{
+	std::vector<std::string> directories;
+
+	readDirectory(path, relpath, [&](const char* name, uint64_t, uint64_t) {
+		names.push_back(name);
+	}, [&](const char* name) {
+		directories.push_back(name);
+	});
+
+	for (auto& d: directories)
+		addDirectoryFiles(path, d.c_str(), names);
+}
+
+// Reads events until the descriptor fails; events that arrive shortly after each other are passed to the callback in one batch
+template <typename F> static void readWatchEvents(int fd, char* buf, size_t bufsize, const std::function<void (const std::vector<std::string>& names)>& callback, F parse)
+{
+	std::vector<std::string> names;
+
+	for (;;)
+	{
+		ssize_t size = read(fd, buf, bufsize);
+
+		if (size > 0)
+		{
+			parse(buf, size_t(size), names);
+
+			pollfd pfd = { fd, POLLIN, 0 };
+
+			if (names.size() < kWatchBatchMaxFiles && poll(&pfd, 1, kWatchBatchTimeout) > 0)
+				continue;
+		}
+
+		if (!names.empty())
+		{
+			std::sort(names.begin(), names.end());
+			names.erase(std::unique(names.begin(), names.end()), names.end());
+
+			callback(names);
+			names.clear();
+		}
+
+		if (size <= 0)
+			break;
+	}
+}
+
 static void addWatchRec(int fd, const char* path, const char* relpath, std::vector<std::string>& paths)
 {
 	DIR* dir = opendir(path);
@@ -147,7 +280,7 @@ static void addWatchRec(int fd, const char* path, const char* relpath, std::vect
 	if (!dir)
 		return;
 
-    int wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO);
+    int wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
 
     if (wd >= 0)
     {
@@ -175,7 +308,7 @@ static void addWatchRec(int fd, const char* path, const char* relpath, std::vect
     closedir(dir);
 }
 
-static bool watchDirectoryInotify(const char* path, const std::function<void (const char* name)>& callback)
+static bool watchDirectoryInotify(const char* path, const std::function<void (const std::vector<std::string>& names)>& callback)
 {
     int fd = inotify_init();
     if (fd < 0)
@@ -184,37 +317,301 @@ static bool watchDirectoryInotify(const char* path, const std::function<void (co
 	std::vector<std::string> paths;
     addWatchRec(fd, path, "", paths);
 
-	std::string relbuf;
+	std::string buf, relbuf;
 
-    for (;;)
-    {
-        alignas(inotify_event) char buf[4096];
-        ssize_t bufsize = read(fd, buf, sizeof(buf));
+	alignas(inotify_event) char events[4096];
+
+	readWatchEvents(fd, events, sizeof(events), callback, [&](const char* data, size_t size, std::vector<std::string>& names) {
+		size_t offset = 0;
 
-        if (bufsize <= 0)
-            break;
+		while (offset + sizeof(inotify_event) <= size)
+		{
+			const inotify_event* e = reinterpret_cast<const inotify_event*>(data + offset);
 
-        size_t offset = 0;
-        inotify_event* e = reinterpret_cast<inotify_event*>(buf);
+			if (offset + sizeof(inotify_event) + e->len > size)
+				break;
 
-        while (offset + sizeof(inotify_event) + e->len <= size_t(bufsize))
-        {
-            if (traverseFileNeeded(e->name) && (e->mask & IN_ISDIR) == 0 && size_t(e->wd) < paths.size())
-            {
+			if (traverseFileNeeded(e->name) && size_t(e->wd) < paths.size())
+			{
 				joinPaths(relbuf, paths[e->wd].c_str(), e->name);
 
-				callback(relbuf.c_str());
-            }
+				if ((e->mask & IN_ISDIR) == 0)
+				{
+					if ((e->mask & IN_CREATE) == 0)
+						names.push_back(relbuf);
+				}
+				else if (e->mask & (IN_CREATE | IN_MOVED_TO))
+				{
+					// new directories need their own watches; files that were created before the watch was added only show up in the listing
+					joinPaths(buf, path, relbuf.c_str());
 
-            offset += sizeof(inotify_event) + e->len;
-            e = reinterpret_cast<inotify_event*>(buf + offset);
-        }
-    }
+					addWatchRec(fd, buf.c_str(), relbuf.c_str(), paths);
+					addDirectoryFiles(path, relbuf.c_str(), names);
+				}
+			}
+
+			offset += sizeof(inotify_event) + e->len;
+		}
+	});
 
     close(fd);
 
 	return true;
 }
+
+#ifdef FAN_REPORT_DFID_NAME
+static bool isWatchedPath(const char* path)
+{
+	std::string buf = path;
+	char* state = nullptr;
+
+	for (char* component = strtok_r(&buf[0], "/", &state); component; component = strtok_r(nullptr, "/", &state))
+		if (!traverseFileNeeded(component))
+			return false;
+
+	return true;
+}
+
+static const char* getRelativePath(const std::string& path, const char* root)
+{
+	size_t length = strlen(root);
+
+	if (path.compare(0, length, root) != 0)
+		return nullptr;
+
+	if (path.size() == length || root[length - 1] == '/')
+		return path.c_str() + length;
+
+	return path[length] == '/' ? path.c_str() + length + 1 : nullptr;
+}
+
+static bool getHandlePath(int mountfd, file_handle* handle, std::string& result)
+{
+	int fd = open_by_handle_at(mountfd, handle, O_PATH);
+	if (fd < 0)
+		return false;
+
+	char link[64];
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+
+	char buf[PATH_MAX];
+	ssize_t length = readlink(link, buf, sizeof(buf));
+
+	close(fd);
+
+	if (length <= 0 || size_t(length) >= sizeof(buf))
+		return false;
+
+	result.assign(buf, length);
+	return true;
+}
+
+static bool canResolveHandles(int mountfd)
+{
+	alignas(file_handle) char buf[sizeof(file_handle) + MAX_HANDLE_SZ];
+	file_handle* handle = reinterpret_cast<file_handle*>(buf);
+	handle->handle_bytes = MAX_HANDLE_SZ;
+
+	int mountId;
+	if (name_to_handle_at(mountfd, "", handle, &mountId, AT_EMPTY_PATH) < 0)
+		return false;
+
+	std::string path;
+	return getHandlePath(mountfd, handle, path);
+}
+
+// A file system mark delivers every event on the file system to its group, so roots on the same file system share a group instead of
+// waking a thread per root for each change; the thread that creates the group reads events, other threads wait until it's closed
+struct FanotifyRoot
+{
+	std::string root;
+
+	const std::function<void (const std::vector<std::string>& names)>* callback;
+};
+
+struct FanotifyGroup
+{
+	dev_t device;
+	bool closed;
+
+	std::vector<FanotifyRoot> roots;
+	std::condition_variable closedChanged;
+};
+
+struct FanotifyGroups
+{
+	std::mutex mutex;
+	std::vector<std::shared_ptr<FanotifyGroup>> groups;
+};
+
+static FanotifyGroups& getFanotifyGroups()
+{
+	static FanotifyGroups groups;
+	return groups;
+}
+
+static bool isWatchedRootPath(const FanotifyGroup& group, const std::string& path)
+{
+	std::unique_lock<std::mutex> lock(getFanotifyGroups().mutex);
+
+	for (auto& r: group.roots)
+	{
+		const char* relpath = getRelativePath(path, r.root.c_str());
+
+		if (relpath && isWatchedPath(relpath))
+			return true;
+	}
+
+	return false;
+}
+
+// Watches the entire file system that contains the path with a single mark, so there are no per-directory watches to add
+// and new directories are covered immediately; this needs CAP_SYS_ADMIN to create the mark and CAP_DAC_READ_SEARCH to resolve directories
+// Note that file systems mounted inside the tree are not watched
+static bool watchDirectoryFanotify(const char* path, const std::function<void (const std::vector<std::string>& names)>& callback)
+{
+	char root[PATH_MAX];
+	if (!realpath(path, root))
+		return false;
+
+	struct stat st;
+	if (stat(root, &st) < 0)
+		return false;
+
+	FanotifyGroups& groups = getFanotifyGroups();
+	std::unique_lock<std::mutex> lock(groups.mutex);
+
+	for (auto& g: groups.groups)
+		if (g->device == st.st_dev)
+		{
+			std::shared_ptr<FanotifyGroup> group = g;
+
+			FanotifyRoot r = { root, &callback };
+			group->roots.push_back(r);
+
+			group->closedChanged.wait(lock, [&] { return group->closed; });
+
+			return true;
+		}
+
+	int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return false;
+
+	int mountfd = open(root, O_DIRECTORY | O_RDONLY);
+
+	if (mountfd < 0 || fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_CLOSE_WRITE | FAN_MOVED_TO | FAN_ONDIR, AT_FDCWD, root) < 0)
+	{
+		if (mountfd >= 0) close(mountfd);
+		close(fd);
+		return false;
+	}
+
+	// events are useless if directory handles can't be resolved, so check that before committing to fanotify
+	if (!canResolveHandles(mountfd))
+	{
+		close(mountfd);
+		close(fd);
+		return false;
+	}
+
+	std::shared_ptr<FanotifyGroup> group = std::make_shared<FanotifyGroup>();
+	group->device = st.st_dev;
+	group->closed = false;
+
+	FanotifyRoot self = { root, &callback };
+	group->roots.push_back(self);
+
+	groups.groups.push_back(group);
+
+	lock.unlock();
+
+	// a batch usually has many events from the same directories; the cache is reset between batches since directories might be renamed
+	std::unordered_map<std::string, std::string> directories;
+	std::string buf;
+	std::vector<std::string> names;
+
+	alignas(fanotify_event_metadata) char events[65536];
+
+	// events are collected as absolute paths and split between roots once per batch
+	readWatchEvents(fd, events, sizeof(events), [&](const std::vector<std::string>& paths) {
+		directories.clear();
+
+		std::unique_lock<std::mutex> rootsLock(groups.mutex);
+
+		for (auto& r: group->roots)
+		{
+			names.clear();
+
+			for (auto& p: paths)
+			{
+				const char* relpath = getRelativePath(p, r.root.c_str());
+
+				if (relpath && *relpath && isWatchedPath(relpath))
+					names.push_back(relpath);
+			}
+
+			if (!names.empty())
+				(*r.callback)(names);
+		}
+	}, [&](const char* data, size_t size, std::vector<std::string>& paths) {
+		const fanotify_event_metadata* e = reinterpret_cast<const fanotify_event_metadata*>(data);
+		ssize_t length = size;
+
+		for (; FAN_EVENT_OK(e, length); e = FAN_EVENT_NEXT(e, length))
+		{
+			if (e->vers != FANOTIFY_METADATA_VERSION || (e->mask & FAN_Q_OVERFLOW) || e->event_len < sizeof(*e) + sizeof(fanotify_event_info_fid))
+				continue;
+
+			const fanotify_event_info_fid* info = reinterpret_cast<const fanotify_event_info_fid*>(e + 1);
+
+			if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+				continue;
+
+			file_handle* handle = const_cast<file_handle*>(reinterpret_cast<const file_handle*>(info->handle));
+			const char* name = reinterpret_cast<const char*>(handle->f_handle + handle->handle_bytes);
+
+			auto p = directories.insert(std::make_pair(std::string(reinterpret_cast<const char*>(handle->f_handle), handle->handle_bytes), std::string()));
+
+			if (p.second && !getHandlePath(mountfd, handle, p.first->second))
+				p.first->second.clear();
+
+			// the mark covers the entire file system, so most events come from outside of the watched trees
+			if (p.first->second.empty() || !traverseFileNeeded(name) || !isWatchedRootPath(*group, p.first->second))
+				continue;
+
+			if ((e->mask & FAN_ONDIR) == 0)
+			{
+				joinPaths(buf, p.first->second.c_str(), name);
+				paths.push_back(buf);
+			}
+			else if (e->mask & FAN_MOVED_TO)
+			{
+				// directory contents are listed relative to the file system root and made absolute again
+				joinPaths(buf, p.first->second.c_str() + 1, name);
+
+				size_t first = paths.size();
+				addDirectoryFiles("/", buf.c_str(), paths);
+
+				for (size_t i = first; i < paths.size(); ++i)
+					paths[i].insert(0, "/");
+			}
+		}
+	});
+
+	close(mountfd);
+	close(fd);
+
+	lock.lock();
+
+	group->closed = true;
+	group->closedChanged.notify_all();
+
+	groups.groups.erase(std::find(groups.groups.begin(), groups.groups.end(), group));
+
+	return true;
+}
+#endif
 #endif
 
 #ifdef __APPLE__
@@ -222,13 +619,15 @@ struct WatchContext
 {
 	std::string rootPath;
 
-	std::function<void (const char* name)> callback;
+	std::function<void (const std::vector<std::string>& names)> callback;
 };
 
 static void watchCallback(ConstFSEventStreamRef streamRef, void* callbackContext, size_t numEvents, void* eventPaths, const FSEventStreamEventFlags eventFlags[], const FSEventStreamEventId eventIds[])
 {
 	WatchContext* context = static_cast<WatchContext*>(callbackContext);
 
+	std::vector<std::string> names;
+
     for (size_t i = 0; i < numEvents; ++i)
     {
         const char* path = static_cast<char**>(eventPaths)[i];
@@ -242,14 +641,18 @@ static void watchCallback(ConstFSEventStreamRef streamRef, void* callbackContext
 				{
 					const char* relativePath = path + context->rootPath.size();
 
-					context->callback(relativePath);
+					names.push_back(relativePath);
 				}
             }
         }
     }
+
+	// the stream already coalesces events over its latency period
+	if (!names.empty())
+		context->callback(names);
 }
 
-static bool watchDirectoryFSEvent(const char* path, const std::function<void (const char* name)>& callback)
+static bool watchDirectoryFSEvent(const char* path, const std::function<void (const std::vector<std::string>& names)>& callback)
 {
     CFStringRef cpath = CFStringCreateWithCString(nullptr, path, kCFStringEncodingUTF8);
     CFArrayRef cpaths = CFArrayCreate(nullptr, reinterpret_cast<const void**>(&cpath), 1, nullptr);
@@ -281,9 +684,15 @@ static bool watchDirectoryFSEvent(const char* path, const std::function<void (co
 
 #endif
 
-bool watchDirectory(const char* path, const std::function<void (const char* name)>& callback)
+bool watchDirectory(const char* path, const std::function<void (const std::vector<std::string>& names)>& callback)
 {
 #if defined(__linux__)
+#ifdef FAN_REPORT_DFID_NAME
+	// fanotify is only available with elevated privileges; inotify needs a watch per directory but works everywhere
+	if (watchDirectoryFanotify(path, callback))
+		return true;
+#endif
+
 	return watchDirectoryInotify(path, callback);
 #elif defined(__APPLE__)
 	return watchDirectoryFSEvent(path, callback);
@@ -7,10 +7,13 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <atomic>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+#include <io.h>
+
 const size_t kMaxPathLength = 32768;
 
 static std::wstring fromUtf8(const char* path)
@@ -41,17 +44,20 @@ static uint64_t combine(uint32_t hi, uint32_t lo)
 	return (static_cast<uint64_t>(hi) << 32) | lo;
 }
 
-static bool traverseDirectoryRec(const wchar_t* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+bool readDirectory(const char* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& fileCallback, const std::function<void (const char* name)>& directoryCallback)
 {
-	std::wstring query = path + std::wstring(L"/*");
+	std::string dirpath;
+	joinPaths(dirpath, path, relpath);
+
+	std::wstring query = fromUtf8(dirpath.c_str()) + std::wstring(L"/*");
 
+	// large fetch makes FindNextFile return entries in big batches, similar to NtQueryDirectoryFile with a large buffer
 	WIN32_FIND_DATAW data;
 	HANDLE h = FindFirstFileExW(query.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
 
 	if (h == INVALID_HANDLE_VALUE)
 		return false;
 
-	std::wstring buf;
 	std::string relbuf;
 
 	do
@@ -69,19 +75,14 @@ static bool traverseDirectoryRec(const wchar_t* path, const char* relpath, const
 			}
 			else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
 			{
-				buf = path;
-				buf += '/';
-				buf += data.cFileName;
-
-				if (directoryFilter(relbuf.c_str()))
-					traverseDirectoryRec(buf.c_str(), relbuf.c_str(), callback, directoryFilter);
+				directoryCallback(relbuf.c_str());
 			}
 			else
 			{
 				uint64_t mtime = combine(data.ftLastWriteTime.dwHighDateTime, data.ftLastWriteTime.dwLowDateTime);
 				uint64_t size = combine(data.nFileSizeHigh, data.nFileSizeLow);
 
-				callback(relbuf.c_str(), mtime, size);
+				fileCallback(relbuf.c_str(), mtime, size);
 			}
 		}
 	}
@@ -92,11 +93,6 @@ static bool traverseDirectoryRec(const wchar_t* path, const char* relpath, const
 	return true;
 }
 
-bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
-{
-	return traverseDirectoryRec(fromUtf8(path).c_str(), "", callback, directoryFilter);
-}
-
 bool renameFile(const char* oldpath, const char* newpath)
 {
 	return !!MoveFileExW(fromUtf8(oldpath).c_str(), fromUtf8(newpath).c_str(), MOVEFILE_REPLACE_EXISTING);
@@ -121,6 +117,28 @@ bool getFileAttributes(const char* path, uint64_t* mtime, uint64_t* size)
 	return false;
 }
 
+std::string getTempPath(const char* path)
+{
+	static std::atomic<unsigned int> counter;
+
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), "_%u_%u", unsigned(GetCurrentProcessId()), counter++);
+
+	return path + std::string(suffix);
+}
+
+uint64_t getFileTimeAgo(uint64_t seconds)
+{
+	FILETIME time;
+	GetSystemTimeAsFileTime(&time);
+
+	// file times are in 100 ns units
+	uint64_t now = combine(time.dwHighDateTime, time.dwLowDateTime);
+	uint64_t delta = seconds * 10000000;
+
+	return now > delta ? now - delta : 0;
+}
+
 void createDirectory(const char* path)
 {
     CreateDirectoryW(fromUtf8(path).c_str(), NULL);
@@ -145,7 +163,7 @@ static bool isFullPath(const char* path)
 	return false; // path relative to current directory
 }
 
-FILE* openFile(const char* path, const char* mode)
+static std::wstring getFullPathW(const char* path)
 {
 	// we need to get a full path to the file for relative paths (normalizePath will always work, isFullPath is an optimization)
 	std::wstring wpath = fromUtf8(isFullPath(path) ? path : normalizePath(getCurrentDirectory().c_str(), path).c_str());
@@ -154,6 +172,13 @@ FILE* openFile(const char* path, const char* mode)
 	wpath.insert(0, L"\\\\?\\");
 	std::replace(wpath.begin(), wpath.end(), '/', '\\');
 
+	return wpath;
+}
+
+FILE* openFile(const char* path, const char* mode)
+{
+	std::wstring wpath = getFullPathW(path);
+
 	// convert file mode, assume short ASCII literal string
 	wchar_t wmode[8] = {};
 	assert(strlen(mode) < ARRAYSIZE(wmode));
@@ -162,7 +187,69 @@ FILE* openFile(const char* path, const char* mode)
 	return _wfopen(wpath.c_str(), wmode);
 }
 
-bool watchDirectory(const char* path, const std::function<void (const char* name)>& callback)
+const char* mapFile(const char* path, size_t* size)
+{
+	HANDLE file = CreateFileW(getFullPathW(path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	LARGE_INTEGER fileSize;
+	void* result = nullptr;
+
+	// empty files can't be mapped; files that don't fit into address space have to be read instead
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && static_cast<uint64_t>(fileSize.QuadPart) <= static_cast<size_t>(-1))
+	{
+		if (HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL))
+		{
+			result = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+			// the view keeps a reference to the mapping
+			CloseHandle(mapping);
+		}
+	}
+
+	CloseHandle(file);
+
+	if (!result)
+		return nullptr;
+
+	*size = static_cast<size_t>(fileSize.QuadPart);
+	return static_cast<const char*>(result);
+}
+
+void unmapFile(const char* data, size_t size)
+{
+	UnmapViewOfFile(data);
+}
+
+void prefetchMapping(const char* data, size_t size)
+{
+	// PrefetchVirtualMemory is only available on Windows 8 and later
+	typedef BOOL (WINAPI *PrefetchVirtualMemoryFunc)(HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+
+	static PrefetchVirtualMemoryFunc prefetchVirtualMemory =
+		reinterpret_cast<PrefetchVirtualMemoryFunc>(GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory"));
+
+	if (prefetchVirtualMemory)
+	{
+		WIN32_MEMORY_RANGE_ENTRY range = { const_cast<char*>(data), size };
+
+		prefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+	}
+}
+
+void prefetchFile(FILE* file, uint64_t offset, uint64_t size)
+{
+	// stdio streams don't expose overlapped I/O; data files are normally mapped on Windows
+}
+
+bool syncFile(FILE* file)
+{
+	return fflush(file) == 0 && _commit(_fileno(file)) == 0;
+}
+
+bool watchDirectory(const char* path, const std::function<void (const std::vector<std::string>& names)>& callback)
 {
 	HANDLE h = CreateFileW(fromUtf8(path).c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
 
@@ -174,6 +261,8 @@ bool watchDirectory(const char* path, const std::function<void (const char* name
 
 	unsigned int filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_CREATION;
 
+	std::vector<std::string> names;
+
 	while (ReadDirectoryChangesW(h, buf, sizeof(buf), true, filter, &bufsize, NULL, NULL))
 	{
 		if (bufsize == 0)
@@ -193,7 +282,7 @@ bool watchDirectory(const char* path, const std::function<void (const char* name
 
 				std::replace(fp.begin(), fp.end(), '\\', '/');
 
-				callback(fp.c_str());
+				names.push_back(fp);
 			}
 
 			if (!file->NextEntryOffset)
@@ -201,6 +290,15 @@ bool watchDirectory(const char* path, const std::function<void (const char* name
 
 			offset += file->NextEntryOffset;
 		}
+
+		// all changes accumulated since the last call arrive in one buffer; a file often gets several notifications per save
+		std::sort(names.begin(), names.end());
+		names.erase(std::unique(names.begin(), names.end()), names.end());
+
+		if (!names.empty())
+			callback(names);
+
+		names.clear();
 	}
 
 	CloseHandle(h);
@@ -8,6 +8,9 @@
 #include "stringutil.hpp"
 #include "highlight.hpp"
 #include "fuzzymatch.hpp"
+#include "workqueue.hpp"
+#include "constants.hpp"
+#include "postings.hpp"
 
 #include <memory>
 #include <algorithm>
@@ -15,15 +18,23 @@
 
 struct FilterOutput
 {
-	FilterOutput(Output* output, unsigned int options, unsigned int limit): output(output), options(options), limit(limit)
+	FilterOutput(Output* output, unsigned int options, unsigned int limit, std::vector<unsigned int>* matches): output(output), options(options), limit(limit), matches(matches)
 	{
 	}
 
 	Output* output;
 	unsigned int options;
 	unsigned int limit;
+
+	std::vector<unsigned int>* matches;
 };
 
+static void recordMatch(unsigned int index, FilterOutput* output)
+{
+	if (output->matches)
+		output->matches->push_back(index);
+}
+
 struct FilterHighlightBuffer
 {
 	std::vector<int> posbuf;
@@ -55,7 +66,10 @@ static unsigned int dumpEntries(const FilterEntries& entries, FilterOutput* outp
 	unsigned int count = std::min(output->limit, entries.entryCount);
 
 	for (unsigned int i = 0; i < count; ++i)
+	{
 		processMatch(entries.entries[i], entries.buffer, output);
+		recordMatch(i, output);
+	}
 
 	return count;
 }
@@ -97,6 +111,40 @@ template <typename Pred> static void filterRegex(const FilterEntries& entries, R
 	re->rangeFinalize(range);
 }
 
+// Matches entries that may contain a match according to postings; returns false if postings don't narrow the search enough
+template <typename Pred> static bool filterRegexPostings(const FilterEntries& entries, Regex* re, unsigned int limit, Pred pred)
+{
+	std::vector<std::string> atomstr = re->prefilterPrepare();
+	if (atomstr.empty()) return false;
+
+	std::vector<std::vector<unsigned int>> atoms;
+	for (size_t i = 0; i < atomstr.size(); ++i)
+		atoms.push_back(trigramExtract(atomstr[i]));
+
+	std::vector<bool> candidates;
+	if (!entries.postings->match(re, atoms, entries.entryCount, candidates))
+		return false;
+
+	if (static_cast<size_t>(std::count(candidates.begin(), candidates.end(), true)) > entries.entryCount / kFilterPostingsCandidateRatio)
+		return false;
+
+	unsigned int matches = 0;
+
+	for (unsigned int i = 0; i < entries.entryCount && matches < limit; ++i)
+		if (candidates[i])
+		{
+			const FilterEntry& e = entries.entries[i];
+
+			if (re->search(entries.buffer + e.offset, e.length))
+			{
+				pred(i);
+				matches++;
+			}
+		}
+
+	return true;
+}
+
 static void processMatchHighlightRegex(Regex* re, FilterHighlightBuffer& hlbuf, const FilterEntry& entry, size_t offset, const char* buffer, FilterOutput* output)
 {
     const char* data = entry.offset + buffer;
@@ -118,17 +166,20 @@ static unsigned int filterRegex(const FilterEntries& entries, const FilterEntrie
 
 	FilterHighlightBuffer hlbuf;
 
-	filterRegex(matchEntries, re.get(), output->limit,
-		[&](unsigned int i) {
-            const FilterEntry& e = entries.entries[i];
+	auto pred = [&](unsigned int i) {
+        const FilterEntry& e = entries.entries[i];
+
+		if (output->options & SO_HIGHLIGHT_MATCHES)
+			processMatchHighlightRegex(re.get(), hlbuf, e, e.length - matchEntries.entries[i].length, entries.buffer, output);
+		else
+			processMatch(e, entries.buffer, output);
 
-			if (output->options & SO_HIGHLIGHT_MATCHES)
-				processMatchHighlightRegex(re.get(), hlbuf, e, e.length - matchEntries.entries[i].length, entries.buffer, output);
-			else
-				processMatch(e, entries.buffer, output);
+		recordMatch(i, output);
+		result++;
+	};
 
-			result++;
-		});
+	if (!matchEntries.postings || !filterRegexPostings(matchEntries, re.get(), output->limit, pred))
+		filterRegex(matchEntries, re.get(), output->limit, pred);
 
 	return result;
 }
@@ -211,6 +262,8 @@ static unsigned int filterVisualAssist(const FilterEntries& entries, const Filte
 			processMatchHighlightVisualAssist(fragments, hlbuf, e, entries.buffer, names.entries[i], names.buffer, output);
 		else
 			processMatch(e, entries.buffer, output);
+
+		recordMatch(i, output);
 	}
 
 	return results.size();
@@ -237,16 +290,29 @@ static void processMatchHighlightFuzzy(FuzzyMatcher& matcher, bool ranked, Filte
 	processMatch(hlbuf.result.c_str(), hlbuf.result.size(), output);
 }
 
-static unsigned int filterFuzzy(const FilterEntries& entries, const char* string, FilterOutput* output)
+typedef std::pair<int, const FilterEntry*> FuzzyMatch;
+
+static bool compareFuzzyMatches(const FuzzyMatch& l, const FuzzyMatch& r)
 {
-	FuzzyMatcher matcher(string);
+	return l.first == r.first ? l.second < r.second : l.first < r.first;
+}
 
-	typedef std::pair<int, const FilterEntry*> Match;
+static void sortFuzzyMatches(std::vector<FuzzyMatch>& matches, unsigned int limit)
+{
+	if (matches.size() <= limit)
+		std::sort(matches.begin(), matches.end(), compareFuzzyMatches);
+	else
+	{
+		std::partial_sort(matches.begin(), matches.begin() + limit, matches.end(), compareFuzzyMatches);
+		matches.resize(limit);
+	}
+}
 
-	std::vector<Match> matches;
+static void rankFuzzy(std::vector<FuzzyMatch>& matches, FuzzyMatcher& matcher, const FilterEntries& entries, size_t begin, size_t end, unsigned int limit)
+{
 	unsigned int perfectMatches = 0;
 
-	for (size_t i = 0; i < entries.entryCount; ++i)
+	for (size_t i = begin; i < end; ++i)
 	{
 		const FilterEntry& e = entries.entries[i];
 		const char* data = entries.buffer + e.offset;
@@ -258,22 +324,47 @@ static unsigned int filterFuzzy(const FilterEntries& entries, const char* string
 
 			matches.push_back(std::make_pair(score, &e));
 
+			// perfect matches sort by entry order, so the remaining entries can't make it into the result
 			if (score == 0)
 			{
 				perfectMatches++;
-				if (perfectMatches >= output->limit) break;
+				if (perfectMatches >= limit) break;
 			}
 		}
 	}
 
-	auto compareMatches = [](const Match& l, const Match& r) { return l.first == r.first ? l.second < r.second : l.first < r.first; };
+	sortFuzzyMatches(matches, limit);
+}
 
-	if (matches.size() <= output->limit)
-		std::sort(matches.begin(), matches.end(), compareMatches);
+static unsigned int filterFuzzy(const FilterEntries& entries, const char* string, FilterOutput* output)
+{
+	FuzzyMatcher matcher(string);
+
+	std::vector<FuzzyMatch> matches;
+
+	if (entries.entryCount <= kFuzzyFilterBlockSize)
+		rankFuzzy(matches, matcher, entries, 0, entries.entryCount, output->limit);
 	else
 	{
-		std::partial_sort(matches.begin(), matches.begin() + output->limit, matches.end(), compareMatches);
-		matches.resize(output->limit);
+		// every block keeps its own best matches; the best matches overall are among them
+		size_t blockCount = (entries.entryCount + kFuzzyFilterBlockSize - 1) / kFuzzyFilterBlockSize;
+		std::vector<std::vector<FuzzyMatch>> blockMatches(blockCount);
+
+		{
+			WorkQueue queue(WorkQueue::getIdealWorkerCount(), 0);
+
+			for (size_t i = 0; i < blockCount; ++i)
+				queue.push([&, i]() {
+					FuzzyMatcher blockMatcher(string);
+
+					rankFuzzy(blockMatches[i], blockMatcher, entries, i * kFuzzyFilterBlockSize, std::min<size_t>((i + 1) * kFuzzyFilterBlockSize, entries.entryCount), output->limit);
+				});
+		}
+
+		for (size_t i = 0; i < blockCount; ++i)
+			matches.insert(matches.end(), blockMatches[i].begin(), blockMatches[i].end());
+
+		sortFuzzyMatches(matches, output->limit);
 	}
 
 	FilterHighlightBuffer hlbuf;
@@ -286,11 +377,70 @@ static unsigned int filterFuzzy(const FilterEntries& entries, const char* string
 			processMatchHighlightFuzzy(matcher, /* ranked= */ true, hlbuf, e, entries.buffer, output);
 		else
 			processMatch(e, entries.buffer, output);
+
+		recordMatch(&e - entries.entries, output);
 	}
 
 	return matches.size();
 }
 
+std::vector<std::pair<int, unsigned int>> rankFilterFuzzy(const char* string, unsigned int limit, const FilterEntries& entries)
+{
+	FuzzyMatcher matcher(string);
+
+	std::vector<FuzzyMatch> matches;
+	rankFuzzy(matches, matcher, entries, 0, entries.entryCount, limit);
+
+	std::vector<std::pair<int, unsigned int>> result;
+	result.reserve(matches.size());
+
+	for (auto& m: matches)
+		result.push_back(std::make_pair(m.first, static_cast<unsigned int>(m.second - entries.entries)));
+
+	return result;
+}
+
+static bool isSubsequence(const char* previous, const char* string)
+{
+	for (; *string && *previous; ++string)
+		if (*string == *previous)
+			previous++;
+
+	return *previous == 0;
+}
+
+static bool isVisualAssistRefinement(const char* previous, const char* string)
+{
+	auto fragments = split(string, [](char ch) { return isspace(ch); });
+
+	// every previous fragment has to be contained in a new fragment of the same kind
+	for (auto& p: split(previous, [](char ch) { return isspace(ch); }))
+	{
+		bool ispath = p.find_first_of("/\\") != std::string::npos;
+
+		if (std::find_if(fragments.begin(), fragments.end(), [&](const std::string& f) {
+				return (f.find_first_of("/\\") != std::string::npos) == ispath && f.find(p) != std::string::npos;
+			}) == fragments.end())
+			return false;
+	}
+
+	return true;
+}
+
+bool isFilterRefinement(const char* previous, const char* string, unsigned int options)
+{
+	if (*previous == 0)
+		return true;
+	else if (options & (SO_FILE_NAMEREGEX | SO_FILE_PATHREGEX))
+		return isQueryRefinement(previous, string, options);
+	else if (options & SO_FILE_VISUALASSIST)
+		return isVisualAssistRefinement(previous, string);
+	else if (options & SO_FILE_FUZZY)
+		return isSubsequence(previous, string);
+	else
+		return false;
+}
+
 static void buildNameBuffer(FilterEntries& names, const FilterEntries& entries, std::unique_ptr<FilterEntry[]>& entryptr, std::unique_ptr<char[]>& bufferptr)
 {
     // fill entries
@@ -310,7 +460,7 @@ static void buildNameBuffer(FilterEntries& names, const FilterEntries& entries,
 
         while (name > path && name[-1] != '/' && name[-1] != '\\') name--;
 
-        FilterEntry& n = names.entries[i];
+        FilterEntry& n = entryptr[i];
 
         n.offset = offset;
         n.length = path + e.length - name;
@@ -345,7 +495,7 @@ static const FilterEntries& getNameBuffer(const FilterEntries* namesOpt, FilterE
     return names;
 }
 
-unsigned int filter(Output* output_, const char* string, unsigned int options, unsigned int limit, const FilterEntries& entries, const FilterEntries* namesOpt)
+unsigned int filter(Output* output_, const char* string, unsigned int options, unsigned int limit, const FilterEntries& entries, const FilterEntries* namesOpt, std::vector<unsigned int>* matches)
 {
     assert(!namesOpt || namesOpt->entryCount == entries.entryCount);
 
@@ -353,7 +503,7 @@ unsigned int filter(Output* output_, const char* string, unsigned int options, u
     std::unique_ptr<FilterEntry[]> nameEntries;
     std::unique_ptr<char[]> nameBuffer;
 
-	FilterOutput output(output_, options, limit);
+	FilterOutput output(output_, options, limit, matches);
 
 	if (*string == 0)
 		return dumpEntries(entries, &output);
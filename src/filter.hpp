@@ -1,7 +1,10 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
+#include <vector>
+
 class Output;
+class PostingIndex;
 
 struct FilterEntry
 {
@@ -14,9 +17,18 @@ struct FilterEntries
     const char* buffer;
     size_t bufferSize;
 
-    FilterEntry* entries;
+    const FilterEntry* entries;
     unsigned int entryCount;
+
+    // Optional trigram postings indexed by entry number; used to find regex match candidates without scanning the buffer
+    const PostingIndex* postings;
 };
 
-unsigned int filter(Output* output, const char* string, unsigned int options, unsigned int limit, const FilterEntries& entries, const FilterEntries* names = 0);
+// Returns true if every entry that matches the query is guaranteed to match the previous query
+bool isFilterRefinement(const char* previous, const char* string, unsigned int options);
+
+// Optionally returns indices of printed entries in matches
+unsigned int filter(Output* output, const char* string, unsigned int options, unsigned int limit, const FilterEntries& entries, const FilterEntries* names = 0, std::vector<unsigned int>* matches = 0);
 
+// Ranks entries by fuzzy match quality; returns up to limit (score, entry index) pairs, best matches first
+std::vector<std::pair<int, unsigned int>> rankFilterFuzzy(const char* string, unsigned int limit, const FilterEntries& entries);
@@ -5,18 +5,21 @@
 #include "filter.hpp"
 #include "output.hpp"
 #include "search.hpp"
+#include "orderedoutput.hpp"
+#include "workqueue.hpp"
+#include "constants.hpp"
 
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
 
 #include <string.h>
 #include <stdio.h>
 
-unsigned int filterBuffer(Output* output, const char* string, unsigned int options, unsigned int limit, const char* buffer, size_t bufferSize)
+static void splitEntries(std::vector<FilterEntry>& data, FilterEntries& entries, const char* buffer, size_t bufferSize)
 {
-	if (bufferSize == 0) return 0;
-
-	std::vector<FilterEntry> data;
-
 	for (size_t i = 0; i < bufferSize; )
 	{
 		const void* nextptr = memchr(buffer + i, '\n', bufferSize - i);
@@ -31,66 +34,235 @@ unsigned int filterBuffer(Output* output, const char* string, unsigned int optio
 		i = next + 1;
 	}
 
-	FilterEntries entries;
-
 	entries.buffer = buffer;
 	entries.bufferSize = bufferSize;
 
 	entries.entries = data.empty() ? nullptr : &data[0];
 	entries.entryCount = data.size();
-
-	return filter(output, string, options, limit, entries);
+	entries.postings = nullptr;
 }
 
-static std::pair<unsigned int, size_t> filterBufferPartial(Output* output, const char* string, unsigned int options, unsigned int limit,
-	const char* buffer, size_t bufferSize, size_t bufferOffset)
+unsigned int filterBuffer(Output* output, const char* string, unsigned int options, unsigned int limit, const char* buffer, size_t bufferSize)
 {
-	// search for last full line; limit the search to bufferOffset to avoid quadratic behaviour on repeated calls for extremely long lines
-	size_t end = bufferSize;
-	while (end > bufferOffset && buffer[end - 1] != '\n') end--;
+	if (bufferSize == 0) return 0;
 
-	if (end == bufferOffset) return std::make_pair(0, 0);
+	std::vector<FilterEntry> data;
+	FilterEntries entries;
 
-	unsigned int result = filterBuffer(output, string, options, limit, buffer, end);
+	splitEntries(data, entries, buffer, bufferSize);
 
-	return std::make_pair(result, end);
+	return filter(output, string, options, limit, entries);
 }
 
-unsigned int filterStdin(Output* output, const char* string, unsigned int options, unsigned int limit)
+// Collects the output of one input block in an ordered output chunk; filters print every entry with a separate trailing newline
+class FilterBlockOutput: public Output
 {
-	const size_t chunkSize = 1048576;
-	bool allowPartialInput = (options & SO_FILE_FUZZY) == 0;
+public:
+	FilterBlockOutput(Output* output, OrderedOutput& ordered, OrderedOutput::Chunk* chunk): output(output), ordered(ordered), chunk(chunk)
+	{
+	}
+
+	virtual void rawprint(const char* data, size_t size)
+	{
+		chunk->result.append(data, size);
+
+		if (size > 0 && data[size - 1] == '\n')
+			ordered.write(chunk);
+	}
 
-	std::vector<char> buffer;
+	virtual void print(const char* message, ...)
+	{
+		std::string buf;
+
+		va_list l;
+		va_start(l, message);
+		strprintf(buf, message, l);
+		va_end(l);
+
+		rawprint(buf.c_str(), buf.size());
+	}
+
+	virtual void error(const char* message, ...)
+	{
+		std::string buf;
 
-	unsigned int matches = 0;
+		va_list l;
+		va_start(l, message);
+		strprintf(buf, message, l);
+		va_end(l);
+
+		output->error("%s", buf.c_str());
+	}
+
+	virtual bool isTTY() { return output->isTTY(); }
+	virtual bool isInteractive() { return output->isInteractive(); }
+	virtual bool isCancelled() { return output->isCancelled(); }
+
+private:
+	Output* output;
+	OrderedOutput& ordered;
+	OrderedOutput::Chunk* chunk;
+};
+
+// Reads the next line-aligned block from stdin; the incomplete last line is kept in tail and starts the next block
+static bool readBlock(std::vector<char>& block, std::vector<char>& tail)
+{
+	block.swap(tail);
+	tail.clear();
 
 	while (true)
 	{
-		size_t offset = buffer.size();
-		buffer.resize(offset + chunkSize);
+		size_t offset = block.size();
+		block.resize(offset + kFilterStreamBlockSize);
 
-		size_t readsize = fread(&buffer[offset], 1, chunkSize, stdin);
-		buffer.resize(offset + readsize);
+		size_t readsize = fread(&block[offset], 1, kFilterStreamBlockSize, stdin);
+		block.resize(offset + readsize);
 
+		// end-of-input; the last line doesn't need a trailing newline
 		if (readsize == 0)
+			return !block.empty();
+
+		// search for last full line in the new data to avoid quadratic behaviour for extremely long lines
+		size_t end = block.size();
+		while (end > offset && block[end - 1] != '\n') end--;
+
+		if (end > offset)
+		{
+			tail.assign(block.begin() + end, block.end());
+			block.resize(end);
+			return true;
+		}
+	}
+}
+
+static unsigned int filterStdinOrdered(Output* output, const char* string, unsigned int options, unsigned int limit)
+{
+	OrderedOutput ordered(output, kMaxBufferedOutput, kBufferedOutputFlushThreshold, limit, kBufferedOutputWindow);
+
+	{
+		WorkQueue queue(WorkQueue::getIdealWorkerCount(), kMaxQueuedFilterData);
+
+		std::vector<char> tail;
+
+		// blocks print in input order, so reading can stop as soon as the earlier blocks have printed enough entries
+		for (unsigned int id = 0; ordered.getLineCount() < limit && !output->isCancelled(); ++id)
 		{
-			// end-of-input
-			matches += filterBuffer(output, string, options, limit, buffer.empty() ? nullptr : &buffer[0], buffer.size());
-			break;
+			std::shared_ptr<std::vector<char>> block = std::make_shared<std::vector<char>>();
+
+			if (!readBlock(*block, tail))
+				break;
+
+			// waits for the output window, which keeps the reader from getting too far ahead of the output
+			OrderedOutput::Chunk* chunk = ordered.begin(id);
+
+			queue.push([=, &ordered]() {
+				FilterBlockOutput blockOutput(output, ordered, chunk);
+
+				filterBuffer(&blockOutput, string, options, limit, &(*block)[0], block->size());
+
+				ordered.end(chunk);
+			}, block->size());
 		}
-		else if (allowPartialInput)
+	}
+
+	return ordered.getLineCount();
+}
+
+struct FuzzyStreamMatch
+{
+	int score;
+
+	// block id and entry index in the block give the input order of the entry
+	unsigned int block;
+	unsigned int index;
+
+	std::string path;
+};
+
+static bool compareFuzzyStreamMatches(const FuzzyStreamMatch& l, const FuzzyStreamMatch& r)
+{
+	return l.score != r.score ? l.score < r.score : l.block != r.block ? l.block < r.block : l.index < r.index;
+}
+
+static unsigned int filterStdinFuzzy(Output* output, const char* string, unsigned int options, unsigned int limit)
+{
+	// heap of the best matches so far; the worst of them is at the top so that it can be replaced by a better one
+	std::vector<FuzzyStreamMatch> best;
+	std::mutex bestMutex;
+
+	// perfect matches sort by input order, so once all kept matches are perfect the remaining input can't make it into the result
+	std::atomic<bool> bestPerfect(false);
+
+	{
+		WorkQueue queue(WorkQueue::getIdealWorkerCount(), kMaxQueuedFilterData);
+
+		std::vector<char> tail;
+
+		for (unsigned int id = 0; !bestPerfect && !output->isCancelled(); ++id)
 		{
-			auto p = filterBufferPartial(output, string, options, limit, buffer.empty() ? nullptr : &buffer[0], buffer.size(), offset);
+			std::shared_ptr<std::vector<char>> block = std::make_shared<std::vector<char>>();
+
+			if (!readBlock(*block, tail))
+				break;
+
+			queue.push([=, &best, &bestMutex, &bestPerfect]() {
+				std::vector<FilterEntry> data;
+				FilterEntries entries;
 
-			assert(p.first <= limit);
-			limit -= p.first;
-			matches += p.first;
+				splitEntries(data, entries, &(*block)[0], block->size());
 
-			assert(p.second <= buffer.size());
-			buffer.erase(buffer.begin(), buffer.begin() + p.second);
+				auto matches = rankFilterFuzzy(string, limit, entries);
+
+				std::lock_guard<std::mutex> lock(bestMutex);
+
+				for (auto& m: matches)
+				{
+					const FilterEntry& e = data[m.second];
+					FuzzyStreamMatch match = { m.first, id, m.second, std::string(entries.buffer + e.offset, e.length) };
+
+					if (best.size() < limit)
+					{
+						best.push_back(match);
+						std::push_heap(best.begin(), best.end(), compareFuzzyStreamMatches);
+					}
+					else if (compareFuzzyStreamMatches(match, best.front()))
+					{
+						std::pop_heap(best.begin(), best.end(), compareFuzzyStreamMatches);
+						best.back() = match;
+						std::push_heap(best.begin(), best.end(), compareFuzzyStreamMatches);
+					}
+				}
+
+				if (best.size() == limit && best.front().score == 0)
+					bestPerfect = true;
+			}, block->size());
 		}
 	}
 
-	return matches;
-}
\ No newline at end of file
+	// the ranking of the kept entries is the same as the ranking of all input, so filtering them again prints the final result
+	std::sort(best.begin(), best.end(), [](const FuzzyStreamMatch& l, const FuzzyStreamMatch& r) {
+		return l.block != r.block ? l.block < r.block : l.index < r.index;
+	});
+
+	std::string buffer;
+
+	for (auto& m: best)
+	{
+		buffer += m.path;
+		buffer += '\n';
+	}
+
+	return filterBuffer(output, string, options, limit, buffer.c_str(), buffer.size());
+}
+
+unsigned int filterStdin(Output* output, const char* string, unsigned int options, unsigned int limit)
+{
+	if (limit == 0)
+		return 0;
+
+	// ranked fuzzy filtering needs all input to pick the best matches, other filters print matches in input order
+	if (*string && (options & (SO_FILE_NAMEREGEX | SO_FILE_PATHREGEX | SO_FILE_VISUALASSIST)) == 0 && (options & SO_FILE_FUZZY))
+		return filterStdinFuzzy(output, string, options, limit);
+	else
+		return filterStdinOrdered(output, string, options, limit);
+}
@@ -1,34 +1,90 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
-const char kFileFileHeaderMagic[] = "QGF0";
+const char kFileFileHeaderMagic[] = "QGF1";
 
+// File list layout: header, path buffer, name buffer, path entry table, name entry table, optional name posting index
+// Nothing is compressed and all sections start at 8-byte aligned offsets so that a mapped file can be searched in place
+// Buffers have one newline-terminated string per file; entry tables have fileCount FileFileEntry structures each
 struct FileFileHeader
 {
 	char magic[4];
 
 	uint32_t fileCount;
-	uint32_t compressedSize;
-	uint32_t uncompressedSize;
 
-	uint32_t nameBufferOffset;
-	uint32_t nameBufferLength;
+	uint64_t pathBufferOffset;
+	uint64_t pathBufferLength;
+
+	uint64_t nameBufferOffset;
+	uint64_t nameBufferLength;
 
-	uint32_t pathBufferOffset;
-	uint32_t pathBufferLength;
+	uint64_t pathEntryOffset;
+	uint64_t nameEntryOffset;
+
+	// DataPostingHeader followed by trigram postings of file names, indexed by file number; size is 0 if there is no index
+	uint64_t postingOffset;
+	uint64_t postingSize;
 };
 
+// Offset is relative to the start of the corresponding buffer; length excludes the newline
 struct FileFileEntry
 {
-	uint32_t nameOffset;
-	uint32_t pathOffset;
+	uint64_t offset;
+	uint64_t length;
 };
 
-const char kDataFileHeaderMagic[] = "QGD2";
+const char kDataFileHeaderMagic[] = "QGDB";
 
+// Data file starts with this many header slots; the valid slot with the highest generation describes the file
+const size_t kDataFileHeaderSlots = 2;
+
+// Data file layout: header slots, optional compression dictionary, compressed chunk data for all chunks, bloom indices for all chunks, path tables for all chunks, optional posting index, chunk table
+// Chunk table is written last (and a header slot is patched to point to it) so that a partially written file is never valid
+// Updates that append to the file write the new header to the slot that doesn't hold the current one after the appended data is on disk,
+// so a torn header write or a crash leaves the previous header intact
 struct DataFileHeader
 {
 	char magic[4];
+	uint32_t chunkCount;
+
+	uint64_t indexOffset;
+	uint64_t indexSize;
+
+	// paths of all files in every chunk, so that searches with path filters can skip chunks without reading them
+	uint64_t pathOffset;
+	uint64_t pathSize;
+
+	// DataPostingHeader, postingCount DataPostingEntry structures followed by posting data; size is 0 if the project doesn't use postings
+	uint64_t postingOffset;
+	uint64_t postingSize;
+
+	// chunkCount DataChunkTableEntry structures followed by the name buffer
+	uint64_t tableOffset;
+	uint64_t tableSize;
+
+	// settings the file was built with; chunks built with other settings are not reused by updates
+	uint32_t chunkSize;
+	uint32_t compressionLevel;
+	uint32_t indexRatio;
+	uint32_t codec;
+
+	// settings that decide which files are stored without contents; files have to be read again when they change
+	uint64_t maxFileSize;
+	uint32_t maxLineLength;
+	uint32_t skipBinary;
+
+	// dictionary for chunks compressed with CC_LZ4DICT; size is 0 if the file has no dictionary
+	uint64_t dictionaryOffset;
+	uint64_t dictionarySize;
+
+	// the first hotChunkCount chunks hold recently modified files (hot tier) and the rest hold all other files (cold tier); files are
+	// sorted by path within each tier, and a file never spans both tiers; counts are 0 if the project doesn't use tiers
+	uint32_t hotChunkCount;
+	uint32_t hotFileCount;
+
+	// generation is incremented by every update that writes the header; checksum covers the header with checksum set to 0
+	uint32_t generation;
+	uint32_t checksum;
 };
 
 struct DataChunkHeader
@@ -40,9 +96,45 @@ struct DataChunkHeader
 	uint32_t uncompressedSize;
 
 	uint32_t indexSize;
-	uint32_t indexHashIterations;
+	uint16_t indexHashIterations;
+	uint16_t indexType;
 
 	uint32_t extraSize;
+
+	uint32_t codec;
+};
+
+// Compression codec for DataFileHeader::codec (codec option the file was built with) and DataChunkHeader::codec
+enum ChunkCodec
+{
+	CC_LZ4 = 0,
+	CC_LZ4DICT = 1,
+};
+
+// Bloom filter layout for DataChunkHeader::indexType; data files written before blocked filters have 0 here
+enum IndexType
+{
+	IT_BLOOM = 0,
+	IT_BLOOMBLOCKED = 1,
+
+	// blocked bloom filter followed by a kBigramFilterSize bitmap of casefolded bigrams, used by queries that are too short for the filter
+	IT_BLOOMBLOCKED_BIGRAMS = 2,
+};
+
+struct DataChunkTableEntry
+{
+	DataChunkHeader header;
+
+	// name buffer has the first file name followed by the last file name (extra data) for every chunk
+	uint32_t firstNameLength;
+
+	// path table has one newline-terminated path for every file in the chunk, including continued and split files
+	uint32_t pathSize;
+
+	uint64_t dataOffset;
+	uint64_t indexOffset;
+	uint64_t pathOffset;
+	uint64_t nameOffset;
 };
 
 struct DataChunkFileHeader
@@ -53,8 +145,87 @@ struct DataChunkFileHeader
 	uint32_t dataSize;
 
 	uint32_t startLine;
-	uint32_t reserved;
+	uint32_t summaryOffset; // offset of DataChunkFileSummary in uncompressed chunk data; 0 if the file has no summary
 
 	uint64_t fileSize;
 	uint64_t timeStamp;
+
+	// hash of the file data; files with the same data in one chunk share it, and searches only scan the data once
+	uint64_t contentHash;
+};
+
+// Optional ngram summary of the file data, stored after the data of all files in the chunk; followed by a bloom filter of the given type
+struct DataChunkFileSummary
+{
+	uint16_t hashIterations;
+	uint16_t type;
+
+	uint32_t size;
+};
+
+// Posting index maps casefolded trigrams to the sorted list of chunks that contain them
+struct DataPostingHeader
+{
+	uint32_t postingCount;
+	uint32_t reserved;
+};
+
+struct DataPostingEntry
+{
+	uint32_t ngram;
+	uint32_t chunkCount;
+
+	// chunk indices are delta-encoded as varints, relative to the start of posting data
+	uint64_t dataOffset;
+};
+
+const char kDirectoryCacheHeaderMagic[] = "QGT0";
+
+// Directory cache layout: header, directoryCount directories; every directory is a DirectoryCacheEntry followed by the
+// key, fileCount DirectoryCacheFile structures with names and directoryCount subdirectory names (each prefixed with uint32_t length)
+struct DirectoryCacheHeader
+{
+	char magic[4];
+	uint32_t directoryCount;
+
+	// modification time of the cache file at the start of the scan; listings of directories modified later are not reused
+	uint64_t scanTimeStamp;
+};
+
+struct DirectoryCacheEntry
+{
+	uint64_t timeStamp;
+	uint64_t size;
+
+	uint32_t keyLength;
+	uint32_t fileCount;
+	uint32_t directoryCount;
+	uint32_t reserved;
+};
+
+struct DirectoryCacheFile
+{
+	uint64_t timeStamp;
+	uint64_t fileSize;
+
+	uint32_t nameLength;
+	uint32_t reserved;
+};
+
+const char kResultCacheHeaderMagic[] = "QGR0";
+
+// Result cache layout: header, entryCount entries from the oldest to the newest; every entry is a ResultCacheEntry followed by the key
+// and the output. The magic has to change whenever search output format changes, since entries don't expire otherwise
+struct ResultCacheHeader
+{
+	char magic[4];
+	uint32_t entryCount;
+};
+
+struct ResultCacheEntry
+{
+	uint32_t keyLength;
+	uint32_t outputLength;
+	uint32_t matchCount;
+	uint32_t reserved;
 };
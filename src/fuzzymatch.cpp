@@ -7,6 +7,10 @@
 #include <string.h>
 #include <limits.h>
 
+#if defined(USE_SSE2) || defined(USE_NEON)
+#include "charsimd.hpp"
+#endif
+
 struct RankContext
 {
     const RankPathElement* path;
@@ -124,6 +128,27 @@ FuzzyMatcher::FuzzyMatcher(const char* query)
     }
 }
 
+static const char* findCasefolded(const char* begin, const char* end, char ch)
+{
+#if defined(USE_SSE2) || defined(USE_NEON)
+    // ch is casefolded; setting the case bit in the data maps upper case letters to lower case
+    simd16 pattern = simd_dup(ch);
+    simd16 fold = simd_dup((ch >= 'a' && ch <= 'z') ? 0x20 : 0);
+
+    for (; end - begin >= 16; begin += 16)
+    {
+        int mask = simd_movemask(simd_cmpeq(simd_or(simd_load(begin), fold), pattern));
+
+        if (mask != 0)
+            return begin + countTrailingZeros(mask);
+    }
+#endif
+
+    while (begin != end && casefold(*begin) != ch) begin++;
+
+    return begin;
+}
+
 bool FuzzyMatcher::match(const char* data, size_t size, int* positions)
 {
     const char* pattern = cfquery.c_str();
@@ -133,7 +158,7 @@ bool FuzzyMatcher::match(const char* data, size_t size, int* positions)
 
     while (*pattern)
     {
-        while (begin != end && casefold(*begin) != *pattern) begin++;
+        begin = findCasefolded(begin, end, *pattern);
 
         if (begin == end) return false;
 
@@ -0,0 +1,351 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "gitindex.hpp"
+
+#include "fileutil.hpp"
+#include "filestream.hpp"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <string.h>
+
+static const size_t kIndexHeaderSize = 12;
+static const size_t kIndexHashSize = 20;
+static const size_t kIndexEntryPathOffset = 62;
+
+static const unsigned int kIndexFlagExtended = 0x4000;
+static const unsigned int kIndexFlagNameMask = 0xfff;
+static const unsigned int kIndexFlagStageMask = 0x3000;
+static const unsigned int kIndexExtendedFlagSkipWorktree = 0x4000;
+
+static const unsigned int kIndexModeTypeMask = 0170000;
+static const unsigned int kIndexModeRegular = 0100000;
+static const unsigned int kIndexModeGitlink = 0160000;
+
+static uint32_t readBE32(const char* data)
+{
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static unsigned int readBE16(const char* data)
+{
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+
+	return (p[0] << 8) | p[1];
+}
+
+static bool getGitDirectory(const std::string& root, std::string& result)
+{
+	std::string path = root + "/.git";
+
+	uint64_t mtime, size;
+	if (getFileAttributes((path + "/index").c_str(), &mtime, &size))
+	{
+		result = path;
+		return true;
+	}
+
+	// worktrees and submodules have a .git file that points to the git directory
+	FileStream in(path.c_str(), "rb");
+	if (!in)
+		return false;
+
+	char buffer[4096];
+	size_t length = in.read(buffer, sizeof(buffer) - 1);
+	buffer[length] = 0;
+
+	if (strncmp(buffer, "gitdir: ", 8) != 0)
+		return false;
+
+	std::string gitdir(buffer + 8, strcspn(buffer + 8, "\r\n"));
+
+	result = normalizePath(root.c_str(), gitdir.c_str());
+	return getFileAttributes((result + "/index").c_str(), &mtime, &size);
+}
+
+// Finds the closest folder that is a root of a git checkout; path is normalized, so its components are separated with forward slashes
+static bool findGitCheckout(const char* path, std::string& root, std::string& gitdir)
+{
+	root = path;
+
+	while (!root.empty() && root.back() == '/')
+		root.pop_back();
+
+	for (;;)
+	{
+		if (getGitDirectory(root, gitdir))
+			return true;
+
+		std::string::size_type slash = root.find_last_of('/');
+		if (slash == std::string::npos || slash == 0)
+			return false;
+
+		root.erase(slash);
+	}
+}
+
+static bool readVarint(const char* data, size_t size, size_t& offset, size_t& result)
+{
+	if (offset >= size)
+		return false;
+
+	unsigned char ch = data[offset++];
+	result = ch & 127;
+
+	while (ch & 128)
+	{
+		if (offset >= size || result > (~size_t(0) >> 8))
+			return false;
+
+		ch = data[offset++];
+		result = ((result + 1) << 7) | (ch & 127);
+	}
+
+	return true;
+}
+
+// Split indices keep most entries in a separate file, and sparse indices replace parts of the tree with directory entries
+static bool isIndexComplete(const char* data, size_t size, size_t offset)
+{
+	while (offset + 8 <= size - kIndexHashSize)
+	{
+		if (memcmp(data + offset, "link", 4) == 0 || memcmp(data + offset, "sdir", 4) == 0)
+			return false;
+
+		uint32_t length = readBE32(data + offset + 4);
+		if (length > size - kIndexHashSize - offset - 8)
+			break;
+
+		offset += 8 + length;
+	}
+
+	return true;
+}
+
+class GitIndexFilter
+{
+public:
+	GitIndexFilter(const std::function<bool (const char* name)>& directoryFilter): directoryFilter(directoryFilter)
+	{
+	}
+
+	// Matches traversal: VCS folders are skipped and directories are only entered if the filter accepts them
+	bool isFileNeeded(const std::string& name)
+	{
+		std::string::size_type slash = name.find_last_of('/');
+
+		if (!traverseFileNeeded(name.c_str() + (slash == std::string::npos ? 0 : slash + 1)))
+			return false;
+
+		return slash == std::string::npos || isDirectoryNeeded(name.substr(0, slash));
+	}
+
+	bool isDirectoryNeeded(const std::string& name)
+	{
+		auto it = directories.find(name);
+		if (it != directories.end())
+			return it->second;
+
+		std::string::size_type slash = name.find_last_of('/');
+
+		bool result =
+			traverseFileNeeded(name.c_str() + (slash == std::string::npos ? 0 : slash + 1)) &&
+			(slash == std::string::npos || isDirectoryNeeded(name.substr(0, slash))) &&
+			directoryFilter(name.c_str());
+
+		directories[name] = result;
+
+		return result;
+	}
+
+private:
+	const std::function<bool (const char* name)>& directoryFilter;
+	std::unordered_map<std::string, bool> directories;
+};
+
+// Submodules are separate checkouts with their own index; checkouts that aren't initialized or can't use the index are traversed
+static void readGitSubmodule(const char* folder, const std::string& name,
+	const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+{
+	std::string path;
+	joinPaths(path, folder, name.c_str());
+
+	std::string prefix = name + "/";
+	std::string buf;
+
+	auto submoduleCallback = [&](const char* file, uint64_t mtime, uint64_t size) {
+		buf = prefix;
+		buf += file;
+		callback(buf.c_str(), mtime, size);
+	};
+
+	auto submoduleFilter = [&](const char* directory) {
+		return directoryFilter((prefix + directory).c_str());
+	};
+
+	if (!readGitIndex(path.c_str(), submoduleCallback, submoduleFilter))
+		traverseDirectory(path.c_str(), submoduleCallback, submoduleFilter);
+}
+
+static bool readGitIndexData(const char* data, size_t size, const char* folder, const std::string& prefix,
+	const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+{
+	if (size < kIndexHeaderSize + kIndexHashSize || memcmp(data, "DIRC", 4) != 0)
+		return false;
+
+	uint32_t version = readBE32(data + 4);
+	uint32_t entryCount = readBE32(data + 8);
+
+	if (version < 2 || version > 4)
+		return false;
+
+	std::vector<std::string> names;
+	std::vector<std::string> submodules;
+
+	size_t offset = kIndexHeaderSize;
+	size_t dataSize = size - kIndexHashSize;
+
+	std::string path;
+	std::string lastPath;
+
+	for (uint32_t i = 0; i < entryCount; ++i)
+	{
+		if (dataSize - offset < kIndexEntryPathOffset)
+			return false;
+
+		const char* entry = data + offset;
+
+		uint32_t mode = readBE32(entry + 24);
+		unsigned int flags = readBE16(entry + 60);
+		unsigned int extendedFlags = 0;
+
+		size_t pathOffset = offset + kIndexEntryPathOffset;
+
+		if (flags & kIndexFlagExtended)
+		{
+			if (version < 3 || dataSize - pathOffset < 2)
+				return false;
+
+			extendedFlags = readBE16(data + pathOffset);
+			pathOffset += 2;
+		}
+
+		if (version == 4)
+		{
+			// paths are prefix-compressed: the entry removes a number of bytes from the end of the previous path and appends a suffix
+			size_t strip;
+			if (!readVarint(data, dataSize, pathOffset, strip) || strip > path.size())
+				return false;
+
+			const char* suffix = data + pathOffset;
+			const char* end = static_cast<const char*>(memchr(suffix, 0, dataSize - pathOffset));
+			if (!end)
+				return false;
+
+			path.erase(path.size() - strip);
+			path.append(suffix, end);
+
+			offset = end + 1 - data;
+		}
+		else
+		{
+			const char* name = data + pathOffset;
+			const char* end = static_cast<const char*>(memchr(name, 0, dataSize - pathOffset));
+			if (!end)
+				return false;
+
+			path.assign(name, end);
+
+			// entries are padded with 1-8 NUL bytes to a multiple of 8 bytes
+			offset += (pathOffset - offset + path.size() + 8) & ~size_t(7);
+
+			if (offset > dataSize)
+				return false;
+		}
+
+		if ((flags & kIndexFlagNameMask) != kIndexFlagNameMask && (flags & kIndexFlagNameMask) != path.size())
+			return false;
+
+		// unmerged files have an entry per stage, and files outside of sparse checkout are not in the working tree
+		if ((flags & kIndexFlagStageMask) && path == lastPath)
+			continue;
+
+		lastPath = path;
+
+		if (extendedFlags & kIndexExtendedFlagSkipWorktree)
+			continue;
+
+		if (path.compare(0, prefix.size(), prefix) != 0)
+			continue;
+
+		unsigned int type = mode & kIndexModeTypeMask;
+
+		// traversal doesn't follow symbolic links to avoid cycles, so they are skipped here as well to list the same files
+		if (type == kIndexModeRegular)
+			names.push_back(path.substr(prefix.size()));
+		else if (type == kIndexModeGitlink)
+			submodules.push_back(path.substr(prefix.size()));
+	}
+
+	// folders without tracked files are usually ignored by git (i.e. build output), so they have to be traversed
+	if ((names.empty() && submodules.empty()) || !isIndexComplete(data, size, offset))
+		return false;
+
+	GitIndexFilter filter(directoryFilter);
+	std::string buf;
+
+	// attributes in the index are only refreshed for files that git considers unmodified, so they can't be used to find changed files
+	for (auto& name: names)
+	{
+		if (!filter.isFileNeeded(name))
+			continue;
+
+		joinPaths(buf, folder, name.c_str());
+
+		// files that were deleted without updating the index are skipped
+		uint64_t fileTimeStamp, fileSize;
+
+		if (getFileAttributes(buf.c_str(), &fileTimeStamp, &fileSize))
+			callback(name.c_str(), fileTimeStamp, fileSize);
+	}
+
+	for (auto& name: submodules)
+		if (filter.isDirectoryNeeded(name))
+			readGitSubmodule(folder, name, callback, directoryFilter);
+
+	return true;
+}
+
+bool readGitIndex(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+{
+	std::string root, gitdir;
+	if (!findGitCheckout(path, root, gitdir))
+		return false;
+
+	// index paths are relative to the root of the checkout
+	std::string folder = path;
+	std::string prefix = folder.size() > root.size() + 1 ? folder.substr(root.size() + 1) : "";
+
+	while (!prefix.empty() && prefix.back() == '/')
+		prefix.pop_back();
+
+	if (!prefix.empty())
+		prefix += '/';
+
+	std::string indexPath = gitdir + "/index";
+
+	size_t size;
+	const char* data = mapFile(indexPath.c_str(), &size);
+	if (!data)
+		return false;
+
+	bool result = readGitIndexData(data, size, path, prefix, callback, directoryFilter);
+
+	unmapFile(data, size);
+
+	return result;
+}
@@ -0,0 +1,11 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <functional>
+
+// Lists regular files tracked by the git checkout that contains path, using the git index instead of reading every directory; names are
+// relative to path. Returns false if path isn't in a git checkout, has no tracked files or the index can't be used (split and sparse indices
+// are not supported), in which case nothing is listed and the folder has to be traversed.
+// Submodules are listed from their own index, or traversed if they don't have a usable one. Symbolic links are skipped like traversal does.
+// Untracked files are never listed. Attributes of listed files are read from the file system, since the index doesn't keep them current.
+bool readGitIndex(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter);
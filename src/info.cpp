@@ -4,15 +4,26 @@
 
 #include "output.hpp"
 #include "format.hpp"
+#include "bloom.hpp"
 #include "stringutil.hpp"
 #include "fileutil.hpp"
 #include "filestream.hpp"
+#include "datafile.hpp"
 #include "compression.hpp"
+#include "constants.hpp"
+#include "workqueue.hpp"
 
 #include <memory>
+#include <vector>
 #include <string>
 #include <type_traits>
 #include <algorithm>
+#include <deque>
+#include <future>
+#include <map>
+#include <random>
+
+#include <math.h>
 
 template <typename T> struct Statistics
 {
@@ -45,9 +56,25 @@ template <typename T> struct Statistics
 	}
 };
 
+struct IndexClassInfo
+{
+	Statistics<double> filled;
+	Statistics<double> falsePositives;
+};
+
 struct ProjectInfo
 {
+	unsigned int settingsChunkSize;
+	unsigned int settingsCompressionLevel;
+	unsigned int settingsIndexRatio;
+	unsigned int settingsCodec;
+	unsigned long long dictionarySize;
+
+	unsigned int hotChunkCount;
+	unsigned int hotFileCount;
+
 	unsigned int chunkCount;
+	unsigned int sampledChunkCount;
 
 	Statistics<unsigned int> chunkSizeExceptLast;
 	Statistics<unsigned int> chunkSize;
@@ -56,10 +83,17 @@ struct ProjectInfo
 	Statistics<unsigned int> chunkCompressedSize;
 	Statistics<double> chunkCompressionRatio;
 
+	unsigned int postingCount;
+	unsigned long long postingTotalSize;
+
 	unsigned int indexChunkCount;
 	unsigned long long indexTotalSize;
 	Statistics<unsigned int> indexHashIterations;
 	Statistics<double> indexFilled;
+	Statistics<double> indexFalsePositives;
+
+	// chunks are grouped by index type and hash iteration count, which depends on how many ngrams the chunk has per index bit
+	std::map<std::pair<unsigned int, unsigned int>, IndexClassInfo> indexClasses;
 
 	unsigned long long lineCount;
 	unsigned int lineMaxSize;
@@ -75,6 +109,31 @@ struct ProjectInfo
 	unsigned int lastFileLine;
 };
 
+struct ChunkFilePart
+{
+	std::string path;
+	uint64_t fileSize;
+	uint64_t timeStamp;
+	uint32_t startLine;
+	size_t size;
+
+	std::pair<size_t, size_t> lines;
+};
+
+struct ChunkIndexData
+{
+	double filled;
+	double falsePositives;
+};
+
+struct ChunkData
+{
+	bool ok;
+	std::vector<ChunkFilePart> files;
+
+	ChunkIndexData index;
+};
+
 static std::pair<size_t, size_t> getLineStatistics(const char* data, size_t size)
 {
 	size_t count = 0;
@@ -94,19 +153,21 @@ static std::pair<size_t, size_t> getLineStatistics(const char* data, size_t size
 	return std::make_pair(count, maxLength);
 }
 
-static void processFilePart(Output* output, ProjectInfo& info, const char* path, uint64_t fileSize, uint64_t timeStamp, const char* data, size_t size, uint32_t startLine)
+static void processFilePart(Output* output, ProjectInfo& info, const ChunkFilePart& part)
 {
+	const char* path = part.path.c_str();
+
 	if (info.lastFile > path)
 		output->error("Error: file ordering mismatch (%s is before %s)\n", info.lastFile.c_str(), path);
 
-	if (info.lastFile == path && (info.lastFileSize != fileSize || info.lastFileTimeStamp != timeStamp))
-		output->error("Error: file metadata mismatch between chunks (%s: %llx %llx != %llx %llx)\n", path, info.lastFileSize, info.lastFileTimeStamp, fileSize, timeStamp);
+	if (info.lastFile == path && (info.lastFileSize != part.fileSize || info.lastFileTimeStamp != part.timeStamp))
+		output->error("Error: file metadata mismatch between chunks (%s: %llx %llx != %llx %llx)\n", path, info.lastFileSize, info.lastFileTimeStamp, part.fileSize, part.timeStamp);
 
-	if (info.lastFile == path && info.lastFileLine != startLine)
-		output->error("Error: file line data mismatch between chunks (%s: %d != %d)\n", path, info.lastFileLine, startLine);
+	if (info.lastFile == path && info.lastFileLine != part.startLine)
+		output->error("Error: file line data mismatch between chunks (%s: %d != %d)\n", path, info.lastFileLine, part.startLine);
 
 	// update line info
-	std::pair<size_t, size_t> ls = getLineStatistics(data, size);
+	const std::pair<size_t, size_t>& ls = part.lines;
 
 	info.lineCount += ls.first;
 	info.lineMaxSize = std::max<unsigned int>(info.lineMaxSize, ls.second);
@@ -116,12 +177,12 @@ static void processFilePart(Output* output, ProjectInfo& info, const char* path,
 	// update file info
 	info.fileCount += (info.lastFile != path);
 	info.filePartCount++;
-	info.fileTotalSize += size;
+	info.fileTotalSize += part.size;
 
 	info.lastFile = path;
-	info.lastFileSize = fileSize;
-	info.lastFileTimeStamp = timeStamp;
-	info.lastFileLine = startLine + ls.first;
+	info.lastFileSize = part.fileSize;
+	info.lastFileTimeStamp = part.timeStamp;
+	info.lastFileLine = part.startLine + ls.first;
 }
 
 inline unsigned int popcount(unsigned char v)
@@ -137,29 +198,97 @@ inline unsigned int popcount(unsigned char v)
 		((v >> 7) & 1);
 }
 
-static void processChunkIndex(Output* output, ProjectInfo& info, const DataChunkHeader& header, const char* data)
+static unsigned int popcount(const char* data, size_t size)
 {
-	info.indexHashIterations.update(header.indexHashIterations);
+	unsigned int result = 0;
+
+	for (size_t i = 0; i < size; ++i)
+		result += popcount(static_cast<unsigned char>(data[i]));
+
+	return result;
+}
 
-	unsigned int filled = 0;
+// A lookup of an ngram that isn't in the chunk succeeds if all bits it probes are set; probes are treated as independent, which slightly
+// underestimates the rate of blocked filters since probes within a block can collide
+static ChunkIndexData analyzeChunkIndex(const DataChunkHeader& header, const char* data)
+{
+	// bigram filter is not included in the fill ratio since it's not a bloom filter
+	size_t bloomSize = (header.indexType == IT_BLOOMBLOCKED_BIGRAMS && header.indexSize > kBigramFilterSize) ? header.indexSize - kBigramFilterSize : header.indexSize;
+
+	ChunkIndexData result = {};
+
+	result.filled = static_cast<double>(popcount(data, bloomSize)) / static_cast<double>(bloomSize * 8);
+
+	if (header.indexType == IT_BLOOM || bloomSize < kBloomBlockSize)
+		result.falsePositives = pow(result.filled, header.indexHashIterations);
+	else
+	{
+		// every ngram only probes one block, so the rate depends on the fill of each block rather than on the average fill
+		size_t blockCount = bloomSize / kBloomBlockSize;
+		double total = 0;
 
-	for (size_t i = 0; i < header.indexSize; ++i)
-		filled += popcount(static_cast<unsigned char>(data[i]));
+		for (size_t i = 0; i < blockCount; ++i)
+			total += pow(static_cast<double>(popcount(data + i * kBloomBlockSize, kBloomBlockSize)) / (kBloomBlockSize * 8), header.indexHashIterations);
 
-	double filledRatio = static_cast<double>(filled) / static_cast<double>(header.indexSize * 8);
+		result.falsePositives = total / static_cast<double>(blockCount);
+	}
 
-	info.indexFilled.update(filledRatio);
+	return result;
+}
+
+static void processChunkIndex(ProjectInfo& info, const DataChunkHeader& header, const ChunkIndexData& index)
+{
+	info.indexHashIterations.update(header.indexHashIterations);
+	info.indexFilled.update(index.filled);
+	info.indexFalsePositives.update(index.falsePositives);
+
+	IndexClassInfo& indexClass = info.indexClasses[std::make_pair(header.indexType, header.indexHashIterations)];
+
+	indexClass.filled.update(index.filled);
+	indexClass.falsePositives.update(index.falsePositives);
 
 	info.indexTotalSize += header.indexSize;
 
 	info.indexChunkCount++;
 }
 
-static void processChunkData(Output* output, ProjectInfo& info, const DataChunkHeader& header, const char* data)
+static ChunkData analyzeChunkData(const DataChunkHeader& header, const char* compressed, const char* index, const char* dictionary, size_t dictionarySize)
 {
-	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+	ChunkData result = { false };
+
+	if (index)
+		result.index = analyzeChunkIndex(header, index);
+
+	std::unique_ptr<char[]> data(new (std::nothrow) char[header.uncompressedSize]);
+	if (!data) return result;
+
+	decompress(data.get(), header.uncompressedSize, compressed, header.compressedSize, header.codec, dictionary, dictionarySize);
+
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data.get());
+
+	result.files.resize(header.fileCount);
+
+	for (size_t i = 0; i < header.fileCount; ++i)
+	{
+		const DataChunkFileHeader& f = files[i];
+		ChunkFilePart& part = result.files[i];
+
+		part.path.assign(data.get() + f.nameOffset, f.nameLength);
+		part.fileSize = f.fileSize;
+		part.timeStamp = f.timeStamp;
+		part.startLine = f.startLine;
+		part.size = f.dataSize;
+		part.lines = getLineStatistics(data.get() + f.dataOffset, f.dataSize);
+	}
+
+	result.ok = true;
 
-	// update chunk size stats
+	return result;
+}
+
+// Sizes of all chunks are in the chunk table, so chunk size statistics are exact even if only some chunks are analyzed
+static void processChunkHeader(ProjectInfo& info, const DataChunkHeader& header)
+{
 	info.chunkSizeExceptLast = info.chunkSize;
 	info.chunkCompressedSizeExceptLast = info.chunkCompressedSize;
 	info.chunkCompressionRatio.update(static_cast<double>(header.uncompressedSize) / static_cast<double>(header.compressedSize));
@@ -168,67 +297,177 @@ static void processChunkData(Output* output, ProjectInfo& info, const DataChunkH
 	info.chunkCompressedSize.update(header.compressedSize);
 
 	info.chunkCount++;
+}
+
+static void processChunkData(Output* output, ProjectInfo& info, const DataChunkHeader& header, const ChunkData& data)
+{
+	if (header.indexSize)
+		processChunkIndex(info, header, data.index);
 
 	// update file stats
-	for (size_t i = 0; i < header.fileCount; ++i)
+	for (size_t i = 0; i < data.files.size(); ++i)
+		processFilePart(output, info, data.files[i]);
+
+	info.sampledChunkCount++;
+}
+
+struct PendingChunk
+{
+	DataChunkHeader header;
+	size_t index;
+	std::future<ChunkData> data;
+};
+
+static bool processPendingChunk(Output* output, ProjectInfo& info, const char* path, std::deque<PendingChunk>& pending, size_t& nextChunk)
+{
+	DataChunkHeader header = pending.front().header;
+	size_t index = pending.front().index;
+	ChunkData data = pending.front().data.get();
+
+	pending.pop_front();
+
+	if (!data.ok)
 	{
-		const DataChunkFileHeader& f = files[i];
+		output->error("Error reading data file %s: malformed chunk\n", path);
+		return false;
+	}
+
+	// files are only checked for consistency between adjacent chunks of the same tier; chunks that were not sampled are skipped
+	if (index != nextChunk || (index > 0 && index == info.hotChunkCount))
+		info.lastFile.clear();
+
+	processChunkData(output, info, header, data);
+
+	nextChunk = index + 1;
+
+	return true;
+}
+
+// Picks a random subset of chunks with a fixed seed, so that repeated runs on the same data file print the same estimates
+static std::vector<char> getSampledChunks(size_t chunkCount, unsigned int sample)
+{
+	std::vector<char> result(chunkCount, sample == 0 || sample >= chunkCount);
 
-		std::string path(data + f.nameOffset, f.nameLength);
+	if (sample == 0 || sample >= chunkCount)
+		return result;
+
+	std::vector<size_t> order(chunkCount);
+	for (size_t i = 0; i < chunkCount; ++i)
+		order[i] = i;
+
+	std::mt19937 rng(kInfoSampleSeed);
+
+	for (size_t i = 0; i < sample; ++i)
+	{
+		std::swap(order[i], order[i + rng() % (chunkCount - i)]);
 
-		processFilePart(output, info, path.c_str(), f.fileSize, f.timeStamp, data + f.dataOffset, f.dataSize, f.startLine);
+		result[order[i]] = true;
 	}
+
+	return result;
 }
 
-static bool processFile(Output* output, ProjectInfo& info, const char* path)
+static bool processFile(Output* output, ProjectInfo& info, const char* path, unsigned int sample)
 {
-	FileStream in(path, "rb");
-	if (!in)
+	DataFileReader in;
+	if (!in.open(path))
 	{
 		output->error("Error reading data file %s\n", path);
 		return false;
 	}
 
-	DataFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+	if (in.readTable() != DataFileReader::Table_Ok)
 	{
 		output->error("Error reading data file %s: malformed header\n", path);
 		return false;
 	}
 
-	DataChunkHeader chunk;
+	const DataFileHeader& header = in.getHeader();
+
+	info.settingsChunkSize = header.chunkSize;
+	info.settingsCompressionLevel = header.compressionLevel;
+	info.settingsIndexRatio = header.indexRatio;
+	info.settingsCodec = header.codec;
+	info.dictionarySize = header.dictionarySize;
+	info.hotChunkCount = header.hotChunkCount;
+	info.hotFileCount = header.hotFileCount;
 
-	while (read(in, chunk))
+	const char* dictionary = in.getDictionary();
+	size_t dictionarySize = in.getDictionarySize();
+
+	if (header.postingSize)
 	{
-		in.skip(chunk.extraSize);
+		DataPostingHeader postingHeader;
 
-		if (chunk.indexSize)
+		if (header.postingSize < sizeof(postingHeader) || !in.read(header.postingOffset, &postingHeader, sizeof(postingHeader)))
 		{
-			std::unique_ptr<char[]> index(new (std::nothrow) char[chunk.indexSize]);
+			output->error("Error reading data file %s: malformed posting index\n", path);
+			return false;
+		}
 
-			if (!index || !read(in, index.get(), chunk.indexSize))
-			{
-				output->error("Error reading data file %s: malformed chunk\n", path);
-				return false;
-			}
+		info.postingCount = postingHeader.postingCount;
+		info.postingTotalSize = header.postingSize;
+	}
+
+	std::deque<PendingChunk> pending;
+	size_t nextChunk = 0;
+
+	std::vector<char> sampled = getSampledChunks(in.getChunkCount(), sample);
+
+	WorkQueue queue(WorkQueue::getIdealWorkerCount(), kMaxQueuedChunkData);
+
+	for (size_t i = 0; i < in.getChunkCount(); ++i)
+	{
+		const DataChunkTableEntry& entry = in.getChunk(i);
+		const DataChunkHeader& chunk = entry.header;
+
+		processChunkHeader(info, chunk);
 
-			processChunkIndex(output, info, chunk, index.get());
+		if (!sampled[i])
+			continue;
+
+		// chunks and their indices are analyzed on worker threads, and the results are processed in order since file statistics depend on it
+		std::shared_ptr<std::vector<char>> compressedStorage;
+		std::shared_ptr<std::vector<char>> indexStorage;
+
+		const char* compressed = in.isMapped() ? in.view(entry.dataOffset, chunk.compressedSize) : nullptr;
+		const char* index = chunk.indexSize && in.isMapped() ? in.view(entry.indexOffset, chunk.indexSize) : nullptr;
+
+		if (!compressed)
+		{
+			compressedStorage.reset(new (std::nothrow) std::vector<char>());
+			compressed = compressedStorage ? in.read(entry.dataOffset, chunk.compressedSize, *compressedStorage) : nullptr;
 		}
 
-		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.compressedSize + chunk.uncompressedSize]);
+		if (chunk.indexSize && !index)
+		{
+			indexStorage.reset(new (std::nothrow) std::vector<char>());
+			index = indexStorage ? in.read(entry.indexOffset, chunk.indexSize, *indexStorage) : nullptr;
+		}
 
-		if (!data || !read(in, data.get(), chunk.compressedSize))
+		if (!compressed || (chunk.indexSize && !index))
 		{
 			output->error("Error reading data file %s: malformed chunk\n", path);
 			return false;
 		}
 
-		char* uncompressed = data.get() + chunk.compressedSize;
+		std::shared_ptr<std::promise<ChunkData>> promise(new std::promise<ChunkData>());
+
+		queue.push([=] {
+			promise->set_value(analyzeChunkData(chunk, compressedStorage ? compressedStorage->data() : compressed, indexStorage ? indexStorage->data() : index, dictionary, dictionarySize));
+		}, chunk.uncompressedSize + (compressedStorage ? chunk.compressedSize : 0) + (indexStorage ? chunk.indexSize : 0));
+
+		pending.push_back({ chunk, i, promise->get_future() });
 
-		decompress(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize);
-		processChunkData(output, info, chunk, uncompressed);
+		while (!pending.empty() && pending.front().data.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+			if (!processPendingChunk(output, info, path, pending, nextChunk))
+				return false;
 	}
 
+	while (!pending.empty())
+		if (!processPendingChunk(output, info, path, pending, nextChunk))
+			return false;
+
 	return true;
 }
 
@@ -258,7 +497,18 @@ static std::string lastChunkSize(unsigned long long sizeExceptLast, unsigned lon
 	}
 }
 
-void printProjectInfo(Output* output, const char* path)
+static const char* getIndexTypeName(unsigned int type)
+{
+	switch (type)
+	{
+	case IT_BLOOM: return "bloom";
+	case IT_BLOOMBLOCKED: return "blocked bloom";
+	case IT_BLOOMBLOCKED_BIGRAMS: return "blocked bloom with bigrams";
+	default: return "unknown";
+	}
+}
+
+void printProjectInfo(Output* output, const char* path, unsigned int sample)
 {
     output->print("Project %s:\n", path);
 	output->print("Reading project...\r");
@@ -267,7 +517,7 @@ void printProjectInfo(Output* output, const char* path)
 
 	std::string dataPath = replaceExtension(path, ".qgd");
 
-	if (processFile(output, info, dataPath.c_str()))
+	if (processFile(output, info, dataPath.c_str(), sample))
 	{
 		if (info.chunkCount <= 1)
 		{
@@ -275,8 +525,33 @@ void printProjectInfo(Output* output, const char* path)
 			info.chunkCompressedSizeExceptLast = info.chunkCompressedSize;
 		}
 
+		// totals of sampled chunks are extrapolated to the entire data file; minimums, maximums and averages are those of the sample
+		if (info.sampledChunkCount < info.chunkCount)
+		{
+			double scale = info.sampledChunkCount ? static_cast<double>(info.chunkCount) / static_cast<double>(info.sampledChunkCount) : 0;
+
+			info.fileCount = static_cast<unsigned int>(info.fileCount * scale);
+			info.filePartCount = static_cast<unsigned int>(info.filePartCount * scale);
+			info.fileTotalSize = static_cast<unsigned long long>(info.fileTotalSize * scale);
+			info.lineCount = static_cast<unsigned long long>(info.lineCount * scale);
+			info.indexChunkCount = static_cast<unsigned int>(info.indexChunkCount * scale);
+			info.indexTotalSize = static_cast<unsigned long long>(info.indexTotalSize * scale);
+		}
+
 	#define FI(v) formatInteger(v).c_str()
 
+		output->print("Settings: chunk size %s bytes, compression level %d, index ratio %d, codec %s\n", FI(info.settingsChunkSize), info.settingsCompressionLevel, info.settingsIndexRatio,
+			info.settingsCodec == CC_LZ4DICT ? "lz4dict" : "lz4");
+
+		if (info.dictionarySize)
+			output->print("Dictionary: %s bytes\n", FI(info.dictionarySize));
+
+		if (info.hotChunkCount)
+			output->print("Hot tier: %s chunks, %s files\n", FI(info.hotChunkCount), FI(info.hotFileCount));
+
+		if (info.sampledChunkCount < info.chunkCount)
+			output->print("Sample: %s of %s chunks; file, line and index statistics are estimated\n", FI(info.sampledChunkCount), FI(info.chunkCount));
+
 		output->print("Files: %s (%s file parts)\n", FI(info.fileCount), FI(info.filePartCount));
 		output->print("File data: %s bytes\n", FI(info.fileTotalSize));
 		output->print("Lines: %s (longest line: %s bytes in %s)\n", FI(info.lineCount), FI(info.lineMaxSize), info.lineMaxSizeFile.c_str());
@@ -300,6 +575,24 @@ void printProjectInfo(Output* output, const char* path)
 			info.indexHashIterations.min, info.indexHashIterations.max, info.indexHashIterations.average(),
 			info.indexFilled.min * 100, info.indexFilled.max * 100, info.indexFilled.average() * 100);
 
+		if (info.indexChunkCount)
+		{
+			output->print("Index false positive rate: [%.3f%%..%.3f%%] (avg %.3f%%) per ngram\n",
+				info.indexFalsePositives.min * 100, info.indexFalsePositives.max * 100, info.indexFalsePositives.average() * 100);
+
+			for (auto& p: info.indexClasses)
+			{
+				const IndexClassInfo& ic = p.second;
+
+				output->print("  %s, %d hash iterations: %s chunks, filled ratio avg %.1f%%, false positive rate [%.3f%%..%.3f%%] (avg %.3f%%)\n",
+					getIndexTypeName(p.first.first), p.first.second, FI(ic.filled.count),
+					ic.filled.average() * 100, ic.falsePositives.min * 100, ic.falsePositives.max * 100, ic.falsePositives.average() * 100);
+			}
+		}
+
+		if (info.postingTotalSize)
+			output->print("Postings: %s ngrams (%s bytes)\n", FI(info.postingCount), FI(info.postingTotalSize));
+
 	#undef FI
 	}
 }
@@ -3,4 +3,5 @@
 
 class Output;
 
-void printProjectInfo(Output* output, const char* path);
+// With sample set, only that many randomly chosen chunks are decompressed, and file, line and index statistics are estimated from them
+void printProjectInfo(Output* output, const char* path, unsigned int sample = 0);
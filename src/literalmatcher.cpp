@@ -0,0 +1,423 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "literalmatcher.hpp"
+
+#include "casefold.hpp"
+#include "cpufeatures.hpp"
+
+#include <string>
+
+#include <string.h>
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+#include "charsimd.hpp"
+#endif
+
+#ifdef USE_SSE2
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER) && defined(USE_AVX512)
+#   include <intrin.h>
+#   pragma intrinsic(_BitScanForward64)
+#endif
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+// Bit that has to be set in data bytes before comparing them with a pattern letter; patterns are casefolded when ignoring case
+static unsigned char getFoldBit(char ch, bool ignoreCase)
+{
+	return (ignoreCase && ch >= 'a' && ch <= 'z') ? 0x20 : 0;
+}
+
+static bool comparePattern(const char* data, const char* pattern, size_t length, bool ignoreCase)
+{
+	if (!ignoreCase)
+		return memcmp(data, pattern, length) == 0;
+
+	for (size_t i = 0; i < length; ++i)
+		if (casefold(data[i]) != pattern[i])
+			return false;
+
+	return true;
+}
+
+static size_t findMatch(const char* x, size_t m, const char* y, size_t n, size_t start, bool ignoreCase)
+{
+	for (size_t j = start; j + m <= n; ++j)
+		if (comparePattern(y + j, x, m, ignoreCase))
+			return j;
+
+	return n;
+}
+
+static size_t getLeastFrequentLetter(const char* string, size_t length)
+{
+	static const int kFrequencyTable[256] =
+	{
+		0, 1, 0, 0, 0, 0, 0, 0, 0, 10602590, 15871966, 0, 115, 15871967, 0, 0, 
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 20, 0, 0, 0, 0, 
+		137776326, 380531, 2050160, 1390430, 55652, 156711, 622798, 377541, 6347309, 6349017, 15625360, 795950, 19415821, 7560692, 4462299, 7677639, 
+		28564723, 4287685, 3463240, 3246751, 2524164, 2032662, 2395948, 1767308, 2015273, 1511489, 3656040, 5020957, 952959, 3703051, 1709838, 58757, 
+		33589, 4925784, 2109034, 4461995, 3250571, 5025264, 3924677, 1936150, 1023430, 3832789, 193034, 437171, 2790600, 2535084, 2734912, 2410167, 
+		2863507, 180258, 3341306, 4837122, 4450499, 1455744, 1216353, 703917, 784740, 538485, 229684, 898206, 1013666, 897273, 16601, 7723320, 
+		4063, 19048491, 4008087, 10148475, 9126676, 33071235, 7304196, 4732808, 5355028, 17956702, 429890, 1506676, 11310158, 8442069, 17783591, 16421409, 
+		7587849, 310591, 18113867, 15601492, 26260892, 8333809, 2934125, 2055891, 16325891, 3402971, 743219, 1688043, 180102, 1687646, 39011, 0, 
+		195, 316, 835, 1262, 32, 60, 69, 39, 75, 79, 97, 112, 98, 114, 64, 92, 
+		119, 87, 475, 193, 184, 109, 521, 5121, 9, 20, 24, 11, 23, 39, 48, 19, 
+		39, 44, 57, 59, 81, 455, 51, 30, 31, 1126, 86, 54, 39, 93, 39, 29, 
+		110, 38, 46, 104, 69, 193, 85, 8353, 132, 68, 99, 64, 87, 138, 143, 97, 
+		16, 11, 334, 13773, 126, 117, 14, 9, 22, 70, 44, 10, 66, 24, 12, 27, 
+		1254, 50889, 79, 77, 62, 140, 14, 11, 9, 4, 7, 11, 21, 8, 0, 9, 
+		11, 11, 84, 627, 43, 113, 31, 58, 81, 69, 36, 4, 9, 27, 9, 18, 
+		61, 7, 5, 12, 6, 8, 7, 6, 8, 9, 20, 4, 18, 5, 4, 2, 
+	};
+
+	size_t result = 0;
+
+	for (size_t i = 1; i < length; ++i)
+		if (kFrequencyTable[static_cast<unsigned char>(string[i])] < kFrequencyTable[static_cast<unsigned char>(string[result])])
+			result = i;
+		
+	return result;
+}
+
+#ifdef USE_AVX512
+inline int countTrailingZeros64(unsigned long long value)
+{
+#ifdef _MSC_VER
+	unsigned long r;
+	_BitScanForward64(&r, value);
+	return r;
+#else
+	return __builtin_ctzll(value);
+#endif
+}
+#endif
+
+class LiteralMatcher1: public LiteralMatcher
+{
+public:
+	LiteralMatcher1(const char* string, bool ignoreCase): first(string[0]), foldBit(getFoldBit(string[0], ignoreCase))
+	{
+	}
+
+	virtual size_t match(const char* data, size_t size)
+	{
+		simd16 pattern = simd_dup(first);
+		simd16 fold = simd_dup(foldBit);
+
+		size_t offset = 0;
+
+		while (offset + 16 <= size)
+		{
+			simd16 val = simd_or(simd_load(data + offset), fold);
+			simd16 maskv = simd_cmpeq(val, pattern);
+			int mask = simd_movemask(maskv);
+
+			if (mask == 0)
+				;
+			else
+				return offset + countTrailingZeros(mask);
+
+			offset += 16;
+		}
+
+		while (offset < size && static_cast<char>(data[offset] | foldBit) != first)
+			offset++;
+
+		return offset;
+	}
+
+private:
+	char first;
+	char foldBit;
+};
+
+class LiteralMatcher16: public LiteralMatcher
+{
+public:
+	LiteralMatcher16(const char* string, bool ignoreCase)
+	{
+		size_t length = strlen(string);
+
+		size_t firstPos = getLeastFrequentLetter(string, length);
+		size_t dataOffset = firstPos < 16 ? 0 : firstPos - 16;
+
+		for (size_t i = 0; i < 16; ++i)
+		{
+			firstLetter[i] = string[firstPos];
+			firstLetterFold[i] = getFoldBit(string[firstPos], ignoreCase);
+
+			patternData[i] = (dataOffset + i < length) ? string[dataOffset + i] : 0;
+			patternMask[i] = (dataOffset + i < length) ? 0 : 0xff;
+			patternFold[i] = (dataOffset + i < length) ? getFoldBit(string[dataOffset + i], ignoreCase) : 0;
+		}
+
+		firstLetterPos = firstPos;
+		firstLetterOffset = firstPos - dataOffset;
+
+		pattern = string;
+		this->ignoreCase = ignoreCase;
+	}
+
+	virtual size_t match(const char* data, size_t size)
+	{
+		simd16 firstLetter = simd_load(this->firstLetter);
+		simd16 firstLetterFold = simd_load(this->firstLetterFold);
+		simd16 patternData = simd_load(this->patternData);
+		simd16 patternMask = simd_load(this->patternMask);
+		simd16 patternFold = simd_load(this->patternFold);
+
+		size_t offset = firstLetterPos;
+
+		while (offset + 32 <= size)
+		{
+			simd16 value = simd_or(simd_load(data + offset), firstLetterFold);
+			unsigned int mask = simd_movemask(simd_cmpeq(value, firstLetter));
+
+			// advance offset regardless of match results to reduce number of live values
+			offset += 16;
+
+			while (mask != 0)
+			{
+				unsigned int pos = countTrailingZeros(mask);
+				size_t dataOffset = offset - 16 + pos - firstLetterOffset;
+
+				mask &= ~(1 << pos);
+
+				// check if we have a match
+				simd16 patternMatch = simd_or(simd_load(data + dataOffset), patternFold);
+				simd16 matchMask = simd_or(patternMask, simd_cmpeq(patternMatch, patternData));
+
+				if (simd_movemask(matchMask) == 0xffff)
+				{
+					size_t matchOffset = dataOffset + firstLetterOffset - firstLetterPos;
+
+					// final check for full pattern
+					if (matchOffset + pattern.size() <= size && comparePattern(data + matchOffset, pattern.c_str(), pattern.size(), ignoreCase))
+					{
+						return matchOffset;
+					}
+				}
+			}
+		}
+
+		return findMatch(pattern.c_str(), pattern.size(), data, size, offset - firstLetterPos, ignoreCase);
+	}
+
+private:
+	unsigned char firstLetter[16];
+	unsigned char firstLetterFold[16];
+	unsigned char patternData[16];
+	unsigned char patternMask[16];
+	unsigned char patternFold[16];
+	size_t firstLetterPos;
+	size_t firstLetterOffset;
+
+	std::string pattern;
+	bool ignoreCase;
+};
+#endif
+
+#ifdef USE_SSE2
+class LiteralMatcher1AVX2: public LiteralMatcher
+{
+public:
+	LiteralMatcher1AVX2(const char* string, bool ignoreCase): first(string[0]), foldBit(getFoldBit(string[0], ignoreCase))
+	{
+	}
+
+	TARGET_AVX2 virtual size_t match(const char* data, size_t size)
+	{
+		__m256i pattern = _mm256_set1_epi8(first);
+		__m256i fold = _mm256_set1_epi8(foldBit);
+
+		size_t offset = 0;
+
+		while (offset + 32 <= size)
+		{
+			__m256i val = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset)), fold);
+			unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(val, pattern));
+
+			if (mask != 0)
+				return offset + countTrailingZeros(mask);
+
+			offset += 32;
+		}
+
+		while (offset < size && static_cast<char>(data[offset] | foldBit) != first)
+			offset++;
+
+		return offset;
+	}
+
+private:
+	char first;
+	char foldBit;
+};
+
+// Compares two letters of the pattern at once (the least frequent one and the one farthest from it) for 32 positions
+// and only verifies the positions where both match; this rejects most candidates without touching the rest of the pattern
+class LiteralMatcherAVX2: public LiteralMatcher
+{
+public:
+	LiteralMatcherAVX2(const char* string, bool ignoreCase): pattern(string), ignoreCase(ignoreCase)
+	{
+		firstPos = getLeastFrequentLetter(string, pattern.size());
+		secondPos = (firstPos == pattern.size() - 1) ? 0 : pattern.size() - 1;
+	}
+
+	TARGET_AVX2 virtual size_t match(const char* data, size_t size)
+	{
+		__m256i first = _mm256_set1_epi8(pattern[firstPos]);
+		__m256i firstFold = _mm256_set1_epi8(getFoldBit(pattern[firstPos], ignoreCase));
+		__m256i second = _mm256_set1_epi8(pattern[secondPos]);
+		__m256i secondFold = _mm256_set1_epi8(getFoldBit(pattern[secondPos], ignoreCase));
+
+		size_t lastPos = firstPos > secondPos ? firstPos : secondPos;
+		size_t offset = 0;
+
+		while (offset + lastPos + 32 <= size)
+		{
+			__m256i firstBlock = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset + firstPos)), firstFold);
+			__m256i secondBlock = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset + secondPos)), secondFold);
+			unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(firstBlock, first), _mm256_cmpeq_epi8(secondBlock, second)));
+
+			while (mask != 0)
+			{
+				size_t matchOffset = offset + countTrailingZeros(mask);
+
+				mask &= mask - 1;
+
+				if (matchOffset + pattern.size() <= size && comparePattern(data + matchOffset, pattern.c_str(), pattern.size(), ignoreCase))
+					return matchOffset;
+			}
+
+			offset += 32;
+		}
+
+		return findMatch(pattern.c_str(), pattern.size(), data, size, offset, ignoreCase);
+	}
+
+private:
+	std::string pattern;
+	bool ignoreCase;
+	size_t firstPos;
+	size_t secondPos;
+};
+#endif
+
+#ifdef USE_AVX512
+class LiteralMatcher1AVX512: public LiteralMatcher
+{
+public:
+	LiteralMatcher1AVX512(const char* string, bool ignoreCase): first(string[0]), foldBit(getFoldBit(string[0], ignoreCase))
+	{
+	}
+
+	TARGET_AVX512 virtual size_t match(const char* data, size_t size)
+	{
+		__m512i pattern = _mm512_set1_epi8(first);
+		__m512i fold = _mm512_set1_epi8(foldBit);
+
+		size_t offset = 0;
+
+		while (offset + 64 <= size)
+		{
+			__m512i val = _mm512_or_si512(_mm512_loadu_si512(data + offset), fold);
+			unsigned long long mask = _mm512_cmpeq_epi8_mask(val, pattern);
+
+			if (mask != 0)
+				return offset + countTrailingZeros64(mask);
+
+			offset += 64;
+		}
+
+		while (offset < size && static_cast<char>(data[offset] | foldBit) != first)
+			offset++;
+
+		return offset;
+	}
+
+private:
+	char first;
+	char foldBit;
+};
+
+// Same two-letter filter as LiteralMatcherAVX2 for 64 positions at a time
+class LiteralMatcherAVX512: public LiteralMatcher
+{
+public:
+	LiteralMatcherAVX512(const char* string, bool ignoreCase): pattern(string), ignoreCase(ignoreCase)
+	{
+		firstPos = getLeastFrequentLetter(string, pattern.size());
+		secondPos = (firstPos == pattern.size() - 1) ? 0 : pattern.size() - 1;
+	}
+
+	TARGET_AVX512 virtual size_t match(const char* data, size_t size)
+	{
+		__m512i first = _mm512_set1_epi8(pattern[firstPos]);
+		__m512i firstFold = _mm512_set1_epi8(getFoldBit(pattern[firstPos], ignoreCase));
+		__m512i second = _mm512_set1_epi8(pattern[secondPos]);
+		__m512i secondFold = _mm512_set1_epi8(getFoldBit(pattern[secondPos], ignoreCase));
+
+		size_t lastPos = firstPos > secondPos ? firstPos : secondPos;
+		size_t offset = 0;
+
+		while (offset + lastPos + 64 <= size)
+		{
+			__m512i firstBlock = _mm512_or_si512(_mm512_loadu_si512(data + offset + firstPos), firstFold);
+			__m512i secondBlock = _mm512_or_si512(_mm512_loadu_si512(data + offset + secondPos), secondFold);
+			unsigned long long mask = _mm512_cmpeq_epi8_mask(firstBlock, first) & _mm512_cmpeq_epi8_mask(secondBlock, second);
+
+			while (mask != 0)
+			{
+				size_t matchOffset = offset + countTrailingZeros64(mask);
+
+				mask &= mask - 1;
+
+				if (matchOffset + pattern.size() <= size && comparePattern(data + matchOffset, pattern.c_str(), pattern.size(), ignoreCase))
+					return matchOffset;
+			}
+
+			offset += 64;
+		}
+
+		return findMatch(pattern.c_str(), pattern.size(), data, size, offset, ignoreCase);
+	}
+
+private:
+	std::string pattern;
+	bool ignoreCase;
+	size_t firstPos;
+	size_t secondPos;
+};
+#endif
+
+LiteralMatcher* createLiteralMatcher(const char* string, bool ignoreCase)
+{
+	size_t length = strlen(string);
+
+	if (length == 0)
+		return 0;
+
+#ifdef USE_SSE2
+	const CpuFeatures& features = getCpuFeatures();
+
+#ifdef USE_AVX512
+	if (features.avx512bw)
+		return length == 1 ? static_cast<LiteralMatcher*>(new LiteralMatcher1AVX512(string, ignoreCase)) : new LiteralMatcherAVX512(string, ignoreCase);
+#endif
+
+	if (features.avx2)
+		return length == 1 ? static_cast<LiteralMatcher*>(new LiteralMatcher1AVX2(string, ignoreCase)) : new LiteralMatcherAVX2(string, ignoreCase);
+#endif
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+	return length == 1 ? static_cast<LiteralMatcher*>(new LiteralMatcher1(string, ignoreCase)) : new LiteralMatcher16(string, ignoreCase);
+#else
+	(void)length;
+	(void)ignoreCase;
+	return 0;
+#endif
+}
@@ -0,0 +1,17 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <stddef.h>
+
+class LiteralMatcher
+{
+public:
+	virtual ~LiteralMatcher() {}
+
+	// Returns the offset of the first possible match (size if there is none)
+	virtual size_t match(const char* data, size_t size) = 0;
+};
+
+// Selects the widest SIMD implementation supported by the current CPU; returns 0 if there is no SIMD support
+// With ignoreCase the string has to be casefolded, and ASCII letters in the data match regardless of case
+LiteralMatcher* createLiteralMatcher(const char* string, bool ignoreCase);
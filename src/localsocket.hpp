@@ -0,0 +1,22 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <stddef.h>
+
+// Local stream connections used by server mode; these are Unix domain sockets on POSIX and named pipes on Windows
+// Addresses are socket paths on POSIX and pipe names on Windows (\\.\pipe\ prefix is optional)
+struct LocalSocket;
+
+// Fails if another server is listening on the address; a socket that was left behind by a server that didn't exit cleanly is replaced
+LocalSocket* localListen(const char* address);
+LocalSocket* localAccept(LocalSocket* server);
+LocalSocket* localConnect(const char* address);
+
+// Returns the number of bytes read, 0 if the other side closed the connection or -1 on error
+ptrdiff_t localRead(LocalSocket* socket, void* data, size_t size);
+bool localWrite(LocalSocket* socket, const void* data, size_t size);
+
+// Returns true if the other side closed the connection; doesn't wait or consume data, and a client that only stopped sending isn't closed
+bool localIsClosed(LocalSocket* socket);
+
+void localClose(LocalSocket* socket);
@@ -0,0 +1,183 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#ifndef _WIN32
+
+#include "common.hpp"
+#include "localsocket.hpp"
+
+#include <string>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct LocalSocket
+{
+	int fd;
+	std::string path; // only set for listening sockets
+};
+
+static bool getSocketAddress(sockaddr_un& addr, const char* address)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(address) >= sizeof(addr.sun_path))
+		return false;
+
+	strcpy(addr.sun_path, address);
+	return true;
+}
+
+static int createSocket()
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+#ifdef SO_NOSIGPIPE
+	if (fd >= 0)
+	{
+		int value = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(value));
+	}
+#endif
+
+	return fd;
+}
+
+LocalSocket* localListen(const char* address)
+{
+	sockaddr_un addr;
+	if (!getSocketAddress(addr, address))
+		return nullptr;
+
+	int fd = createSocket();
+	if (fd < 0)
+		return nullptr;
+
+	// a socket file is left over if the previous server didn't exit cleanly; it's only removed if no server answers on it
+	if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	struct stat st;
+	if (errno == ECONNREFUSED && lstat(address, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(address);
+
+	// the socket can't be reused after a failed connect
+	close(fd);
+
+	fd = createSocket();
+	if (fd < 0)
+		return nullptr;
+
+	if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	return new LocalSocket { fd, address };
+}
+
+LocalSocket* localAccept(LocalSocket* server)
+{
+	for (;;)
+	{
+		int fd = accept(server->fd, nullptr, nullptr);
+
+		if (fd >= 0)
+		{
+		#ifdef SO_NOSIGPIPE
+			int value = 1;
+			setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(value));
+		#endif
+
+			return new LocalSocket { fd, std::string() };
+		}
+
+		if (errno != EINTR && errno != ECONNABORTED)
+			return nullptr;
+	}
+}
+
+LocalSocket* localConnect(const char* address)
+{
+	sockaddr_un addr;
+	if (!getSocketAddress(addr, address))
+		return nullptr;
+
+	int fd = createSocket();
+	if (fd < 0)
+		return nullptr;
+
+	if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	return new LocalSocket { fd, std::string() };
+}
+
+ptrdiff_t localRead(LocalSocket* socket, void* data, size_t size)
+{
+	for (;;)
+	{
+		ssize_t result = recv(socket->fd, data, size, 0);
+
+		if (result >= 0 || errno != EINTR)
+			return result < 0 ? -1 : result;
+	}
+}
+
+bool localWrite(LocalSocket* socket, const void* data, size_t size)
+{
+#ifdef MSG_NOSIGNAL
+	int flags = MSG_NOSIGNAL;
+#else
+	int flags = 0;
+#endif
+
+	const char* ptr = static_cast<const char*>(data);
+
+	while (size > 0)
+	{
+		ssize_t result = send(socket->fd, ptr, size, flags);
+
+		if (result < 0 && errno == EINTR)
+			continue;
+
+		if (result <= 0)
+			return false;
+
+		ptr += result;
+		size -= result;
+	}
+
+	return true;
+}
+
+bool localIsClosed(LocalSocket* socket)
+{
+	pollfd pfd = { socket->fd, 0, 0 };
+
+	// hangup is reported once both directions are shut down, unlike end of input which is also reported after the client shuts down writing
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)) != 0;
+}
+
+void localClose(LocalSocket* socket)
+{
+	close(socket->fd);
+
+	if (!socket->path.empty())
+		unlink(socket->path.c_str());
+
+	delete socket;
+}
+
+#endif
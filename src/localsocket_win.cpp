@@ -0,0 +1,130 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#ifdef _WIN32
+
+#include "common.hpp"
+#include "localsocket.hpp"
+
+#include <string>
+#include <algorithm>
+
+#include <string.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+struct LocalSocket
+{
+	HANDLE pipe;
+	bool server;
+
+	std::string name; // only set for listening pipes; the handle is the pipe instance for the next client
+};
+
+static std::string getPipeName(const char* address)
+{
+	const char* prefix = "\\\\.\\pipe\\";
+
+	return strncmp(address, prefix, strlen(prefix)) == 0 ? address : prefix + std::string(address);
+}
+
+static HANDLE createPipe(const std::string& name, bool first)
+{
+	return CreateNamedPipeA(name.c_str(), PIPE_ACCESS_DUPLEX | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, PIPE_UNLIMITED_INSTANCES, 65536, 65536, 0, NULL);
+}
+
+LocalSocket* localListen(const char* address)
+{
+	std::string name = getPipeName(address);
+
+	HANDLE pipe = createPipe(name, /* first= */ true);
+	if (pipe == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	return new LocalSocket { pipe, true, name };
+}
+
+LocalSocket* localAccept(LocalSocket* server)
+{
+	if (!ConnectNamedPipe(server->pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED)
+		return nullptr;
+
+	// the connected instance is handed to the caller; future clients will connect to a new instance
+	HANDLE next = createPipe(server->name, /* first= */ false);
+	if (next == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	LocalSocket* result = new LocalSocket { server->pipe, true, std::string() };
+
+	server->pipe = next;
+
+	return result;
+}
+
+LocalSocket* localConnect(const char* address)
+{
+	std::string name = getPipeName(address);
+
+	for (;;)
+	{
+		HANDLE pipe = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+
+		if (pipe != INVALID_HANDLE_VALUE)
+			return new LocalSocket { pipe, false, std::string() };
+
+		// all instances are busy while the server is setting up a new one
+		if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeA(name.c_str(), 1000))
+			return nullptr;
+	}
+}
+
+ptrdiff_t localRead(LocalSocket* socket, void* data, size_t size)
+{
+	DWORD result = 0;
+
+	if (!ReadFile(socket->pipe, data, static_cast<DWORD>(std::min<size_t>(size, 1 << 30)), &result, NULL))
+		return GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1;
+
+	return result;
+}
+
+bool localWrite(LocalSocket* socket, const void* data, size_t size)
+{
+	const char* ptr = static_cast<const char*>(data);
+
+	while (size > 0)
+	{
+		DWORD result = 0;
+
+		if (!WriteFile(socket->pipe, ptr, static_cast<DWORD>(std::min<size_t>(size, 1 << 30)), &result, NULL))
+			return false;
+
+		ptr += result;
+		size -= result;
+	}
+
+	return true;
+}
+
+bool localIsClosed(LocalSocket* socket)
+{
+	DWORD available = 0;
+
+	return !PeekNamedPipe(socket->pipe, NULL, 0, NULL, &available, NULL) && GetLastError() == ERROR_BROKEN_PIPE;
+}
+
+void localClose(LocalSocket* socket)
+{
+	// make sure the client receives all data before the connection is dropped
+	if (socket->server && socket->name.empty())
+	{
+		FlushFileBuffers(socket->pipe);
+		DisconnectNamedPipe(socket->pipe);
+	}
+
+	CloseHandle(socket->pipe);
+
+	delete socket;
+}
+
+#endif
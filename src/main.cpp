@@ -9,11 +9,16 @@
 #include "project.hpp"
 #include "files.hpp"
 #include "info.hpp"
+#include "tune.hpp"
+#include "bench.hpp"
 #include "stringutil.hpp"
 #include "highlight.hpp"
 #include "filterutil.hpp"
 #include "watch.hpp"
 #include "changes.hpp"
+#include "server.hpp"
+#include "embed.hpp"
+#include "constants.hpp"
 
 #include <thread>
 
@@ -34,7 +39,12 @@
 #endif
 
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
 #include <stdexcept>
 
 const char* kVersion = "1.3";
@@ -133,11 +143,107 @@ public:
 		va_end(l);
 	}
 
+	// results are shown in a Vim window
+	virtual bool isInteractive()
+	{
+		return true;
+	}
+
 private:
 	std::string& result;
 	std::mutex mutex;
 };
 
+// Buffers query output until the embedding application polls it; output of cancelled queries is discarded
+class QueryOutput: public Output
+{
+public:
+	QueryOutput(): cancelled(false), done(false)
+	{
+	}
+
+	virtual void rawprint(const char* data, size_t size)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if (!cancelled)
+			result.insert(result.end(), data, data + size);
+
+		changed.notify_all();
+	}
+
+	virtual void print(const char* message, ...)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		va_list l;
+		va_start(l, message);
+		if (!cancelled) strprintf(result, message, l);
+		va_end(l);
+
+		changed.notify_all();
+	}
+
+	virtual void error(const char* message, ...)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		va_list l;
+		va_start(l, message);
+		if (!cancelled) strprintf(result, message, l);
+		va_end(l);
+
+		changed.notify_all();
+	}
+
+	virtual bool isInteractive()
+	{
+		return true;
+	}
+
+	virtual bool isCancelled()
+	{
+		return cancelled;
+	}
+
+	void cancel()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		cancelled = true;
+		result.clear();
+	}
+
+	void finish()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		done = true;
+		changed.notify_all();
+	}
+
+	// Waits for output or for the query to finish, and moves the output to target; returns true once all output was taken
+	bool take(std::string& target, unsigned int timeout)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		changed.wait_for(lock, std::chrono::milliseconds(timeout), [&]() { return done || !result.empty(); });
+
+		target.clear();
+		target.swap(result);
+
+		return done;
+	}
+
+private:
+	std::atomic<bool> cancelled;
+	bool done;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::string result;
+};
+
 
 unsigned int parseSearchFileOption(char opt)
 {
@@ -226,6 +332,16 @@ void parseSearchOptions(const char* opts, unsigned int& options, unsigned int& l
 			else options |= SO_HIGHLIGHT;
 			break;
 
+		case 'W':
+			if (s[1] == 'D')
+			{
+				options &= ~SO_MATCHWINDOW;
+				s++;
+			}
+			else
+				options |= SO_MATCHWINDOW;
+			break;
+
 		case 'L':
 			{
 				char* end = 0;
@@ -238,6 +354,26 @@ void parseSearchOptions(const char* opts, unsigned int& options, unsigned int& l
 			options |= SO_SUMMARY;
 			break;
 
+		case 'P':
+			options |= SO_PATTERNFILE;
+			break;
+
+		case 'J':
+			options |= SO_JSON;
+			break;
+
+		case 'T':
+			options |= SO_STATISTICS;
+			break;
+
+		case 'm':
+			options |= SO_FILESWITHMATCHES;
+			break;
+
+		case 'c':
+			options |= SO_COUNT;
+			break;
+
 		case 'f':
 			s++;
 
@@ -258,9 +394,9 @@ void parseSearchOptions(const char* opts, unsigned int& options, unsigned int& l
 	}
 }
 
-std::tuple<unsigned int, unsigned int, std::string, std::string> getSearchOptions(int argc, const char** argv, int startarg, bool istty)
+std::tuple<unsigned int, unsigned int, std::string, std::string> getSearchOptions(int argc, const char** argv, int startarg, bool istty, bool interactive)
 {
-	unsigned int options = istty ? SO_HIGHLIGHT : 0;
+	unsigned int options = (istty ? SO_HIGHLIGHT : 0) | (interactive ? SO_MATCHWINDOW : 0);
 	unsigned int limit = ~0u;
 	std::string include, exclude;
 
@@ -282,6 +418,17 @@ std::tuple<unsigned int, unsigned int, std::string, std::string> getSearchOption
 	if (options & SO_HIGHLIGHT)
 		options |= SO_HIGHLIGHT_MATCHES;
 
+	// JSON output is meant for tools, and has match ranges instead of highlighting
+	if (options & SO_JSON)
+		options &= ~(SO_HIGHLIGHT | SO_HIGHLIGHT_MATCHES);
+
+	// file lists and counts don't have any lines to highlight matches in
+	if (options & SO_FILESWITHMATCHES)
+		options &= ~SO_COUNT;
+
+	if (options & (SO_FILESWITHMATCHES | SO_COUNT))
+		options &= ~SO_HIGHLIGHT_MATCHES;
+
 	// L0 means "no limit"
 	if (limit == 0)
 		limit = ~0u;
@@ -289,7 +436,30 @@ std::tuple<unsigned int, unsigned int, std::string, std::string> getSearchOption
 	return std::make_tuple(options, limit, include, exclude);
 }
 
-void processSearchCommand(Output* output, int argc, const char** argv, unsigned int (*search)(Output*, const char*, const char*, unsigned int, unsigned int, const char*, const char*))
+// File searches don't read chunks, so only the match count is reported
+static unsigned int searchFilesCommand(Output* output, const std::vector<std::string>& files, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude,
+	SearchContext* context, SearchStatistics* statistics)
+{
+	unsigned int total = 0;
+
+	for (size_t i = 0; limit > 0 && i < files.size(); ++i)
+	{
+		unsigned int result = searchFiles(output, files[i].c_str(), string, options, limit, include, exclude, context);
+
+		assert(result <= limit);
+		limit -= result;
+		total += result;
+	}
+
+	if (statistics)
+		statistics->matches += total;
+
+	return total;
+}
+
+void processSearchCommand(Output* output, int argc, const char** argv,
+	unsigned int (*search)(Output*, const std::vector<std::string>&, const char*, unsigned int, unsigned int, const char*, const char*, SearchContext*, SearchStatistics*),
+	SearchContext* context = nullptr)
 {
 	std::vector<std::string> paths = getProjectPaths(argv[2]);
 
@@ -297,7 +467,7 @@ void processSearchCommand(Output* output, int argc, const char** argv, unsigned
 
 	unsigned int options, limit;
 	std::string include, exclude;
-	std::tie(options, limit, include, exclude) = getSearchOptions(argc, argv, 3, output->isTTY());
+	std::tie(options, limit, include, exclude) = getSearchOptions(argc, argv, 3, output->isTTY(), output->isInteractive());
 
 	if (*query == 0)
 	{
@@ -305,25 +475,24 @@ void processSearchCommand(Output* output, int argc, const char** argv, unsigned
 		options &= ~SO_HIGHLIGHT_MATCHES;
 	}
 
-	unsigned int total = 0;
+	SearchStatistics statistics;
 
 	auto start = std::chrono::high_resolution_clock::now();
 
-	for (size_t i = 0; limit > 0 && i < paths.size(); ++i)
-	{
-		unsigned int result = search(output, paths[i].c_str(), query, options, limit, include.empty() ? 0 : include.c_str(), exclude.empty() ? 0 : exclude.c_str());
+	unsigned int total = search(output, paths, query, options, limit, include.empty() ? 0 : include.c_str(), exclude.empty() ? 0 : exclude.c_str(), context,
+		(options & SO_STATISTICS) ? &statistics : nullptr);
 
-		assert(result <= limit);
-		limit -= result;
-		total += result;
-	}
+	assert(total <= limit);
 
 	if (options & SO_SUMMARY)
 	{
 		auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
 
-		output->print("Search complete, found %d%s matches in %.2f sec\n", total, (limit == 0 ? "+" : ""), static_cast<double>(time.count()) / 1000.0);
+		output->print("Search complete, found %d%s matches in %.2f sec\n", total, (total == limit ? "+" : ""), static_cast<double>(time.count()) / 1000.0);
 	}
+
+	if (options & SO_STATISTICS)
+		printSearchStatistics(output, statistics, options);
 }
 
 void processFilterCommand(Output* output, int argc, const char** argv, const char* input, size_t inputSize)
@@ -332,7 +501,7 @@ void processFilterCommand(Output* output, int argc, const char** argv, const cha
 
 	unsigned int options, limit;
 	std::string include, exclude;
-	std::tie(options, limit, include, exclude) = getSearchOptions(argc, argv, 2, output->isTTY());
+	std::tie(options, limit, include, exclude) = getSearchOptions(argc, argv, 2, output->isTTY(), output->isInteractive());
 
 	if (input)
 		filterBuffer(output, query, options, limit, input, inputSize);
@@ -340,6 +509,33 @@ void processFilterCommand(Output* output, int argc, const char** argv, const cha
 		filterStdin(output, query, options, limit);
 }
 
+void processServerCommand(Output* output, const std::vector<std::string>& args, SearchContext* context)
+{
+	std::vector<const char*> argv;
+	argv.push_back("qgrep");
+
+	for (size_t i = 0; i < args.size(); ++i)
+		argv.push_back(args[i].c_str());
+
+	int argc = argv.size();
+
+	try
+	{
+		if (argc > 3 && strcmp(argv[1], "search") == 0)
+			processSearchCommand(output, argc, &argv[0], searchProjects, context);
+		else if (argc > 2 && strcmp(argv[1], "files") == 0)
+			processSearchCommand(output, argc, &argv[0], searchFilesCommand, context);
+		else if (argc > 1 && strcmp(argv[1], "stats") == 0)
+			context->printStatistics(output);
+		else
+			output->error("Unknown server command %s\n", argc > 1 ? argv[1] : "");
+	}
+	catch (const std::exception& e)
+	{
+		output->error("Uncaught exception: %s\n", e.what());
+	}
+}
+
 void printHelp(Output* output, bool extended)
 {
 	output->print(
@@ -351,6 +547,7 @@ void printHelp(Output* output, bool extended)
 "  qgrep search <project-list> <search-options> <query>\n"
 "  qgrep watch <project-list>\n"
 "  qgrep interactive <project-list>\n"
+"  qgrep server <project-list> <address> [numa] [shard=<index>/<count>]\n"
 "  qgrep help\n", kVersion);
 
     if (extended)
@@ -362,8 +559,13 @@ void printHelp(Output* output, bool extended)
 "  qgrep files <project-list>\n"
 "  qgrep files <project-list> <search-options> <query>\n"
 "  qgrep filter <search-options> <query>\n"
-"  qgrep info <project-list>\n"
-"  qgrep projects\n");
+"  qgrep info <project-list> [sample[=<chunks>]]\n"
+"  qgrep tune <project-list>\n"
+"  qgrep bench <path> [<corpus-path>]\n"
+"  qgrep projects\n"
+"  qgrep client <address> search <project-list> <search-options> <query>\n"
+"  qgrep client <address> files <project-list> <search-options> <query>\n"
+"  qgrep client <address> stats\n");
 
     output->print(
 "\n"
@@ -378,7 +580,11 @@ void printHelp(Output* output, bool extended)
     if (extended)
         output->print(
 "  C - output match column number       CE - output match starting and ending column numbers\n"
+"  m - only print paths of files with matches  c - print the number of matching lines in each file\n"
 "  L<num> - limit output to <num> lines\n"
+"  P - query is a path to a file with patterns to search for, one per line\n"
+"  J - output matches as JSON objects, one per line, with byte ranges of all matches in the line\n"
+"  T - print per-stage search statistics after the results\n"
 "\n"
 "<search-options> can include flags for restricting searches to certain files:\n"
 "  fi<re> - only search in files with paths matching regex <re>\n"
@@ -387,15 +593,28 @@ void printHelp(Output* output, bool extended)
 "<search-options> can include additional options for output highlighting:\n"
 "  H - force enable highlighting        HD - force disable highlighting\n"
 "      (default for TTY output)         HM - only highlight search matches\n"  
+"  W - only print context around the match in long lines  WD - print entire lines\n"
+"      (default for TTY output and Vim)\n"
 "\n"
 "<search-options> can include additional options for files/filter commands:\n"
 "  fp - search in file paths (default)  fn - search in file names\n"
 "  ff - fuzzy search with ranking       fs - search for space-delimited words\n"
 "\n"
-"in interactive mode, you can input 'search' and 'files' commands without a project list.\n");
+"in interactive mode, you can input 'search' and 'files' commands without a project list, or 'stats'\n"
+"to print chunk cache statistics.\n"
+"\n"
+"in server mode, qgrep keeps project data loaded and answers 'search', 'files' and 'stats' commands sent over\n"
+"<address> (a Unix domain socket path, or a named pipe name on Windows). Each connection sends a single\n"
+"line with tab-separated command arguments, and receives command output until the connection is closed.\n"
+"With 'numa', search threads are pinned to NUMA nodes and every node searches chunks read into its own memory.\n"
+"With 'shard=<index>/<count>', the server only searches one of <count> path ranges of every project; 'qgrep client'\n"
+"with a comma-separated list of the shard addresses, in shard order, sends 'search' and 'stats' commands to all\n"
+"of them and prints the results in path order.\n");
 }
 
-void mainImpl(Output* output, int argc, const char** argv, const char* input, size_t inputSize)
+// Returns the process exit code; most commands only report errors through the output, but the server exits with an error code
+// when it can't start or stops accepting connections so that scripts that start it can tell
+int mainImpl(Output* output, int argc, const char** argv, const char* input, size_t inputSize)
 {
 	try
 	{
@@ -419,11 +638,11 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 		}
 		else if (argc > 3 && strcmp(argv[1], "search") == 0)
 		{
-			processSearchCommand(output, argc, argv, searchProject);
+			processSearchCommand(output, argc, argv, searchProjects);
 		}
 		else if (argc > 2 && strcmp(argv[1], "files") == 0)
 		{
-			processSearchCommand(output, argc, argv, searchFiles);
+			processSearchCommand(output, argc, argv, searchFilesCommand);
 		}
 		else if (argc > 1 && strcmp(argv[1], "projects") == 0)
 		{
@@ -436,12 +655,39 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 		{
 			std::vector<std::string> paths = getProjectPaths(argv[2]);
 
+			unsigned int sample = 0;
+
+			for (int i = 3; i < argc; ++i)
+			{
+				if (strcmp(argv[i], "sample") == 0)
+					sample = kInfoSampleChunks;
+				else if (sscanf(argv[i], "sample=%u", &sample) != 1 || sample == 0)
+				{
+					output->error("Unknown info option %s\n", argv[i]);
+					return 0;
+				}
+			}
+
 			for (size_t i = 0; i < paths.size(); ++i)
 			{
 				if (i != 0) output->print("\n");
-				printProjectInfo(output, paths[i].c_str());
+				printProjectInfo(output, paths[i].c_str(), sample);
 			}
 		}
+		else if (argc > 2 && strcmp(argv[1], "tune") == 0)
+		{
+			std::vector<std::string> paths = getProjectPaths(argv[2]);
+
+			for (size_t i = 0; i < paths.size(); ++i)
+			{
+				if (i != 0) output->print("\n");
+				tuneProject(output, paths[i].c_str());
+			}
+		}
+		else if (argc > 2 && strcmp(argv[1], "bench") == 0)
+		{
+			benchProject(output, argv[2], argc > 3 ? argv[3] : nullptr);
+		}
 		else if (argc > 1 && strcmp(argv[1], "filter") == 0)
 		{
 			processFilterCommand(output, argc, argv, input, inputSize);
@@ -475,6 +721,8 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 			for (size_t i = 0; i < paths.size(); ++i)
 				threads.emplace_back([=] { watchProject(output, paths[i].c_str(), /* interactive= */ true); });
 
+			SearchContext context;
+
 			std::vector<const char*> intArgv(argv, argv + argc);
 			std::string intInput;
 			intArgv.push_back(""); // Used later to place the input
@@ -487,20 +735,69 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 					intArgv[1] = "search";
 					intInput = std::string(buf + 7, buf + strlen(buf) - 1);
 					intArgv.back() = intInput.c_str();
-					processSearchCommand(output, intArgv.size(), &intArgv[0], searchProject);
+					processSearchCommand(output, intArgv.size(), &intArgv[0], searchProjects, &context);
 				}
 				else if (strncmp(buf, "files ", 6) == 0)
 				{
 					intArgv[1] = "files";
 					intInput = std::string(buf + 6, buf + strlen(buf) - 1);
 					intArgv.back() = intInput.c_str();
-					processSearchCommand(output, intArgv.size(), &intArgv[0], searchFiles);
+					processSearchCommand(output, intArgv.size(), &intArgv[0], searchFilesCommand, &context);
+				}
+				else if (strcmp(buf, "stats\n") == 0)
+				{
+					context.printStatistics(output);
 				}
 			}
 
 			for (auto& t : threads)
 				t.join();
 		}
+		else if (argc > 3 && strcmp(argv[1], "server") == 0)
+		{
+			std::vector<std::string> paths = getProjectPaths(argv[2]);
+
+			bool numa = false;
+			unsigned int shardIndex = 0, shardCount = 1;
+
+			for (int i = 4; i < argc; ++i)
+			{
+				if (strcmp(argv[i], "numa") == 0)
+					numa = true;
+				else if (sscanf(argv[i], "shard=%u/%u", &shardIndex, &shardCount) != 2 || shardIndex >= shardCount)
+				{
+					output->error("Unknown server option %s\n", argv[i]);
+					return 1;
+				}
+			}
+
+			SearchContext context(numa);
+			context.setShard(shardIndex, shardCount);
+
+			// load project data up front so that the first query doesn't have to
+			for (size_t i = 0; i < paths.size(); ++i)
+			{
+				context.getProject(output, paths[i].c_str());
+				context.getFiles(output, paths[i].c_str());
+			}
+
+			if (!serveCommands(output, argv[3], [&](Output* connection, const std::vector<std::string>& args) { processServerCommand(connection, args, &context); }))
+				return 1;
+		}
+		else if (argc > 3 && strcmp(argv[1], "client") == 0)
+		{
+			std::vector<std::string> addresses = split(argv[2], [](char ch) { return ch == ','; });
+			std::vector<std::string> args(argv + 3, argv + argc);
+
+			if (addresses.size() <= 1)
+				sendCommand(output, argv[2], args);
+			else if (args[0] == "search" && argc > 5)
+				sendShardedCommand(output, addresses, args, std::get<1>(getSearchOptions(argc, argv, 5, /* istty= */ false, /* interactive= */ false)));
+			else if (args[0] == "stats")
+				sendShardedCommand(output, addresses, args, ~0u);
+			else
+				output->error("Error: only search and stats commands can be sent to several shards\n");
+		}
 		else if (argc > 1 && strcmp(argv[1], "version") == 0)
 		{
 			output->print("%s\n", kVersion);
@@ -516,6 +813,8 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 	{
 		output->error("Uncaught exception: %s\n", e.what());
 	}
+
+	return 0;
 }
 
 #ifdef _WIN32
@@ -537,41 +836,261 @@ static void pinModule()
 int main(int argc, const char** argv)
 {
 	StandardOutput output;
-	mainImpl(&output, argc, argv, 0, 0);
+
+	return mainImpl(&output, argc, argv, 0, 0);
 }
 
-extern "C" DLLEXPORT const char* qgrepVim(const char* args)
+// Embedded calls get newline-separated arguments, optionally followed by \2 and the filter input
+struct EmbedArgs
 {
-	// make sure the DLL is not unloaded up until the process exit to speed up calls
-	pinModule();
+	std::string argstr;
+	std::vector<const char*> argv;
+
+	const char* input;
+	size_t inputSize;
+};
 
+static void parseEmbedArgs(EmbedArgs& result, const char* args)
+{
 	size_t argsLength = strlen(args);
 
 	const char* argsInput = strchr(args, '\2');
 	if (argsInput) argsInput++;
 
-	std::vector<const char*> argv;
-	argv.push_back("qgrep");
+	result.argv.clear();
+	result.argv.push_back("qgrep");
+
+	result.argstr.assign(args, argsInput ? argsInput - 1 : args + argsLength);
+	result.argstr += '\n';
+
+	// input is stored after the arguments so that it lives as long as they do
+	size_t argsSize = result.argstr.size();
 
-	std::string argstr(args, argsInput ? argsInput - 1 : args + argsLength);
-	argstr += '\n';
+	if (argsInput)
+		result.argstr.append(argsInput, args + argsLength);
 
 	size_t last = 0;
 
-	for (size_t i = 0; i < argstr.size(); ++i)
-		if (argstr[i] == '\n')
+	for (size_t i = 0; i < argsSize; ++i)
+		if (result.argstr[i] == '\n')
 		{
-			argstr[i] = 0;
-			argv.push_back(argstr.c_str() + last);
+			result.argstr[i] = 0;
+			result.argv.push_back(result.argstr.c_str() + last);
 			last = i + 1;
 		}
 
+	result.input = argsInput ? result.argstr.c_str() + argsSize : nullptr;
+	result.inputSize = argsInput ? result.argstr.size() - argsSize : 0;
+}
+
+extern "C" DLLEXPORT const char* qgrepVim(const char* args)
+{
+	// make sure the DLL is not unloaded up until the process exit to speed up calls
+	pinModule();
+
+	EmbedArgs embedArgs;
+	parseEmbedArgs(embedArgs, args);
+
 	// string contents is preserved until next call
 	static std::string result;
 	result.clear();
 
 	StringOutput output(result);
-	mainImpl(&output, argv.size(), &argv[0], argsInput, args + argsLength - argsInput);
+	mainImpl(&output, embedArgs.argv.size(), &embedArgs.argv[0], embedArgs.input, embedArgs.inputSize);
+
+	return result.c_str();
+}
+
+struct EmbedQuery
+{
+	EmbedArgs args;
+	QueryOutput output;
+};
+
+struct QgrepSession
+{
+	SearchContext context;
+
+	std::mutex mutex;
+	std::condition_variable queued;
+	std::deque<std::shared_ptr<EmbedQuery>> pending;
+	std::map<unsigned int, std::shared_ptr<EmbedQuery>> queries;
+	unsigned int lastQuery;
+	bool closing;
+
+	std::string result;
+
+	std::thread thread;
+};
+
+static void processEmbedQuery(QgrepSession* session, EmbedQuery* query)
+{
+	int argc = query->args.argv.size();
+	const char** argv = &query->args.argv[0];
+
+	// search and files commands reuse project data of the session; the rest run as they do from the command line
+	try
+	{
+		if (argc > 3 && strcmp(argv[1], "search") == 0)
+			processSearchCommand(&query->output, argc, argv, searchProjects, &session->context);
+		else if (argc > 2 && strcmp(argv[1], "files") == 0)
+			processSearchCommand(&query->output, argc, argv, searchFilesCommand, &session->context);
+		else
+			mainImpl(&query->output, argc, argv, query->args.input, query->args.inputSize);
+	}
+	catch (const std::exception& e)
+	{
+		query->output.error("Uncaught exception: %s\n", e.what());
+	}
+}
+
+static void sessionThreadFun(QgrepSession* session)
+{
+	while (true)
+	{
+		std::shared_ptr<EmbedQuery> query;
+
+		{
+			std::unique_lock<std::mutex> lock(session->mutex);
+
+			session->queued.wait(lock, [&]() { return session->closing || !session->pending.empty(); });
+
+			if (session->pending.empty())
+				return;
+
+			query = session->pending.front();
+			session->pending.pop_front();
+		}
+
+		if (!query->output.isCancelled())
+			processEmbedQuery(session, query.get());
+
+		query->output.finish();
+	}
+}
+
+extern "C" DLLEXPORT QgrepSession* qgrepSessionOpen()
+{
+	pinModule();
+
+	QgrepSession* session = new QgrepSession();
+
+	session->lastQuery = 0;
+	session->closing = false;
+	session->thread = std::thread(sessionThreadFun, session);
+
+	return session;
+}
+
+extern "C" DLLEXPORT void qgrepSessionClose(QgrepSession* session)
+{
+	{
+		std::unique_lock<std::mutex> lock(session->mutex);
+
+		for (auto& q: session->queries)
+			q.second->output.cancel();
+
+		session->closing = true;
+		session->queued.notify_one();
+	}
+
+	session->thread.join();
+
+	delete session;
+}
+
+extern "C" DLLEXPORT unsigned int qgrepQueryStart(QgrepSession* session, const char* args)
+{
+	std::shared_ptr<EmbedQuery> query = std::make_shared<EmbedQuery>();
+	parseEmbedArgs(query->args, args);
+
+	std::unique_lock<std::mutex> lock(session->mutex);
+
+	unsigned int id = ++session->lastQuery;
+	if (id == 0) id = ++session->lastQuery;
+
+	session->queries[id] = query;
+	session->pending.push_back(query);
+	session->queued.notify_one();
+
+	return id;
+}
+
+extern "C" DLLEXPORT const char* qgrepQueryPoll(QgrepSession* session, unsigned int query, unsigned int timeout, int* done)
+{
+	std::shared_ptr<EmbedQuery> q;
+
+	{
+		std::unique_lock<std::mutex> lock(session->mutex);
+
+		auto it = session->queries.find(query);
+		if (it != session->queries.end())
+			q = it->second;
+	}
+
+	if (!q)
+	{
+		session->result.clear();
+		*done = 1;
+		return session->result.c_str();
+	}
+
+	*done = q->output.take(session->result, timeout);
+
+	if (*done)
+	{
+		std::unique_lock<std::mutex> lock(session->mutex);
+
+		session->queries.erase(query);
+	}
+
+	return session->result.c_str();
+}
+
+extern "C" DLLEXPORT void qgrepQueryCancel(QgrepSession* session, unsigned int query)
+{
+	std::unique_lock<std::mutex> lock(session->mutex);
+
+	auto it = session->queries.find(query);
+	if (it != session->queries.end())
+		it->second->output.cancel();
+}
+
+static QgrepSession* getVimSession()
+{
+	static QgrepSession* session = qgrepSessionOpen();
+
+	return session;
+}
+
+extern "C" DLLEXPORT const char* qgrepVimStart(const char* args)
+{
+	static std::string result;
+
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%u", qgrepQueryStart(getVimSession(), args));
+
+	result = buf;
 
 	return result.c_str();
 }
+
+extern "C" DLLEXPORT const char* qgrepVimPoll(int query)
+{
+	static std::string result;
+
+	int done = 0;
+	const char* output = qgrepQueryPoll(getVimSession(), query, 0, &done);
+
+	result = done ? "1" : "0";
+	result += output;
+
+	return result.c_str();
+}
+
+extern "C" DLLEXPORT int qgrepVimCancel(int query)
+{
+	qgrepQueryCancel(getVimSession(), query);
+
+	return 0;
+}
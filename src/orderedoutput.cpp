@@ -5,39 +5,23 @@
 #include "output.hpp"
 #include "stringutil.hpp"
 
-#include <functional>
+#include <algorithm>
 
-static void writeThreadFun(Output* output, BlockingQueue<OrderedOutput::Chunk*>& queue, unsigned int limit)
-{
-	unsigned int total = 0;
-
-	while (OrderedOutput::Chunk* chunk = queue.pop())
-	{
-		std::string::size_type pos = 0;
-
-		for (unsigned int i = total; i < limit && pos < chunk->result.length(); ++i)
-		{
-			const char* line = chunk->result.c_str() + pos;
-			size_t length = strlen(line);
-
-			output->rawprint(line, length);
-			total++;
-			pos += length + 1;
-		}
-
-		delete chunk;
-	}
-}
+static const size_t kMaxPooledChunks = 64;
 
 OrderedOutput::Chunk::Chunk(unsigned int id, unsigned int lines): id(id), lines(lines)
 {
 }
 
-OrderedOutput::OrderedOutput(Output* output, size_t memoryLimit, size_t flushThreshold, unsigned int lineLimit):
-	output(output), flushThreshold(flushThreshold), lineLimit(lineLimit), writeQueue(memoryLimit),
-	writeThread(std::bind(writeThreadFun, output, std::ref(writeQueue), lineLimit)),
-	currentChunk(0), currentLine(0)
+OrderedOutput::OrderedOutput(Output* output, size_t memoryLimit, size_t flushThreshold, unsigned int lineLimit, unsigned int windowSize):
+	output(output), flushThreshold(flushThreshold), lineLimit(lineLimit),
+	windowSize(windowSize), slots(new Slot[windowSize]), windowWaiters(0),
+	writeQueue(memoryLimit), draining(false), currentChunk(0), currentLine(0)
 {
+	for (unsigned int i = 0; i < windowSize; ++i)
+		slots[i].sequence = i;
+
+	writeThread = std::thread(&OrderedOutput::writeThreadFun, this);
 }
 
 OrderedOutput::~OrderedOutput()
@@ -45,16 +29,32 @@ OrderedOutput::~OrderedOutput()
 	writeQueue.push(nullptr);
 	writeThread.join();
 
-	assert(chunks.empty());
-
-    (void)output;
+	for (size_t i = 0; i < pool.size(); ++i)
+		delete pool[i];
 }
 
 OrderedOutput::Chunk* OrderedOutput::begin(unsigned int id)
 {
 	assert(id >= currentChunk);
 
-	return new Chunk(id, 0);
+	Slot& slot = getSlot(id);
+
+	if (slot.sequence != id)
+	{
+		windowWaiters++;
+
+		std::unique_lock<std::mutex> lock(windowMutex);
+		windowAvailable.wait(lock, [&]() { return slot.sequence == id; });
+
+		windowWaiters--;
+	}
+
+	assert(!slot.ready && slot.chunk.result.empty() && slot.chunk.lineEnds.empty());
+
+	slot.chunk.id = id;
+	slot.chunk.lines = 0;
+
+	return &slot.chunk;
 }
 
 void OrderedOutput::write(Chunk* chunk, const char* format, ...)
@@ -69,13 +69,14 @@ void OrderedOutput::write(Chunk* chunk, const char* format, ...)
 
 void OrderedOutput::write(Chunk* chunk)
 {
-	chunk->result.push_back(0);
+	chunk->lineEnds.push_back(chunk->result.size());
 	chunk->lines++;
 
 	if (chunk->result.size() > flushThreshold && chunk->id == currentChunk)
 	{
-		Chunk* temp = new Chunk(chunk->id, chunk->lines);
+		Chunk* temp = allocateChunk(chunk->id, chunk->lines);
 		chunk->result.swap(temp->result);
+		chunk->lineEnds.swap(temp->lineEnds);
 		chunk->lines = 0;
 
 		currentLine += temp->lines;
@@ -85,31 +86,140 @@ void OrderedOutput::write(Chunk* chunk)
 
 void OrderedOutput::end(Chunk* chunk)
 {
-	std::lock_guard<std::mutex> lock(mutex);
+	getSlot(chunk->id).ready = true;
+
+	drain();
+}
+
+unsigned int OrderedOutput::getLineCount() const
+{
+	return std::min(currentLine.load(), lineLimit);
+}
+
+OrderedOutput::Slot& OrderedOutput::getSlot(unsigned int id)
+{
+	return slots[id % windowSize];
+}
+
+void OrderedOutput::drain()
+{
+	// Only one thread moves finished chunks to the write queue at a time; a chunk that's published while another thread
+	// is draining is either seen by that thread, or by the publishing thread once the other thread is done
+	while (getSlot(currentChunk).ready)
+	{
+		if (draining.exchange(true))
+			return;
+
+		while (getSlot(currentChunk).ready)
+		{
+			Slot& slot = getSlot(currentChunk);
+			Chunk* chunk = &slot.chunk;
+
+			assert(chunk->id == currentChunk);
+			slot.ready = false;
+
+			// the chunk has to be queued before advancing, otherwise the next chunk could flush its output ahead of this one
+			if (chunk->result.empty())
+			{
+				releaseSlot(chunk);
+			}
+			else
+			{
+				currentLine += chunk->lines;
+				writeQueue.push(chunk, chunk->result.size());
+			}
+
+			currentChunk++;
+		}
 
-	assert(chunks[chunk->id] == 0);
-	chunks[chunk->id] = chunk;
+		draining = false;
+	}
+}
 
-	while (!chunks.empty() && chunks.begin()->first == currentChunk)
+OrderedOutput::Chunk* OrderedOutput::allocateChunk(unsigned int id, unsigned int lines)
+{
 	{
-		Chunk* chunk = chunks.begin()->second;
-		chunks.erase(chunks.begin());
+		std::lock_guard<std::mutex> lock(poolMutex);
 
-		if (chunk->result.empty())
+		if (!pool.empty())
 		{
-			delete chunk;
+			Chunk* chunk = pool.back();
+			pool.pop_back();
+
+			chunk->id = id;
+			chunk->lines = lines;
+
+			return chunk;
 		}
-		else
+	}
+
+	return new Chunk(id, lines);
+}
+
+void OrderedOutput::releaseChunk(Chunk* chunk)
+{
+	if (chunk == &getSlot(chunk->id).chunk)
+	{
+		releaseSlot(chunk);
+		return;
+	}
+
+	// buffers of flushed chunks are slightly over the threshold; don't keep larger buffers around
+	if (chunk->result.capacity() <= flushThreshold * 2)
+	{
+		chunk->result.clear();
+		chunk->lineEnds.clear();
+
+		std::lock_guard<std::mutex> lock(poolMutex);
+
+		if (pool.size() < kMaxPooledChunks)
 		{
-			currentLine += chunk->lines;
-			writeQueue.push(chunk, chunk->result.size());
+			pool.push_back(chunk);
+			return;
 		}
+	}
+
+	delete chunk;
+}
 
-		currentChunk++;
+void OrderedOutput::releaseSlot(Chunk* chunk)
+{
+	// slots keep their buffers, unless the chunk had a lot of output that couldn't be flushed early
+	if (chunk->result.capacity() <= flushThreshold * 2)
+	{
+		chunk->result.clear();
+		chunk->lineEnds.clear();
+	}
+	else
+	{
+		std::string().swap(chunk->result);
+		std::vector<size_t>().swap(chunk->lineEnds);
+	}
+
+	getSlot(chunk->id).sequence = chunk->id + windowSize;
+
+	if (windowWaiters)
+	{
+		std::lock_guard<std::mutex> lock(windowMutex);
+		windowAvailable.notify_all();
 	}
 }
 
-unsigned int OrderedOutput::getLineCount() const
+void OrderedOutput::writeThreadFun()
 {
-	return std::min(currentLine.load(), lineLimit);
+	unsigned int total = 0;
+
+	while (Chunk* chunk = writeQueue.pop())
+	{
+		// print all lines of the chunk that fit into the limit at once
+		size_t count = std::min<size_t>(chunk->lineEnds.size(), lineLimit - total);
+
+		if (count > 0)
+		{
+			output->rawprint(chunk->result.c_str(), chunk->lineEnds[count - 1]);
+			total += count;
+		}
+
+		releaseChunk(chunk);
+	}
 }
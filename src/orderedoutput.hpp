@@ -2,8 +2,10 @@
 #pragma once
 
 #include <string>
-#include <map>
+#include <vector>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <atomic>
 
@@ -20,10 +22,13 @@ public:
 		unsigned int lines;
 		std::string result;
 
+		// end offsets of written lines in result, so that the writer can print whole chunks without scanning them
+		std::vector<size_t> lineEnds;
+
 		Chunk(unsigned int id, unsigned int lines);
 	};
 
-	OrderedOutput(Output* output, size_t memoryLimit, size_t flushThreshold, unsigned int lineLimit);
+	OrderedOutput(Output* output, size_t memoryLimit, size_t flushThreshold, unsigned int lineLimit, unsigned int windowSize);
 	~OrderedOutput();
 
     Chunk* begin(unsigned int id);
@@ -39,11 +44,46 @@ private:
 	size_t flushThreshold;
 	unsigned int lineLimit;
 
+	// Chunk ids map to a ring of slots; the slot for the id becomes available once the chunk that used it windowSize ids
+	// earlier has been printed, so workers can't get more than windowSize chunks ahead of the output
+	struct Slot
+	{
+		// id of the chunk that can use the slot next
+		std::atomic<unsigned int> sequence;
+		std::atomic<bool> ready;
+
+		Chunk chunk;
+
+		Slot(): sequence(0), ready(false), chunk(0, 0)
+		{
+		}
+	};
+
+	unsigned int windowSize;
+	std::unique_ptr<Slot[]> slots;
+
+	std::mutex windowMutex;
+	std::condition_variable windowAvailable;
+	std::atomic<unsigned int> windowWaiters;
+
+	// partially flushed parts of the current chunk use separate chunks that are recycled after printing
+	std::mutex poolMutex;
+	std::vector<Chunk*> pool;
+
 	BlockingQueue<Chunk*> writeQueue;
 	std::thread writeThread;
 
-	std::mutex mutex;
+	std::atomic<bool> draining;
 	std::atomic<unsigned int> currentChunk;
 	std::atomic<unsigned int> currentLine;
-	std::map<unsigned int, Chunk*> chunks;
+
+	Slot& getSlot(unsigned int id);
+
+	void drain();
+
+	Chunk* allocateChunk(unsigned int id, unsigned int lines);
+	void releaseChunk(Chunk* chunk);
+	void releaseSlot(Chunk* chunk);
+
+	void writeThreadFun();
 };
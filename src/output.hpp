@@ -1,6 +1,12 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
+#include "stringutil.hpp"
+
+#include <string>
+
+#include <stdarg.h>
+
 class Output
 {
 public:
@@ -12,4 +18,59 @@ public:
 	virtual void error(const char* message, ...) = 0;
 
 	virtual bool isTTY() { return false; }
+
+	// output is read by a person, either in a terminal or an editor, rather than processed by other tools
+	virtual bool isInteractive() { return isTTY(); }
+
+	// searches stop early once nobody is interested in the rest of the output
+	virtual bool isCancelled() { return false; }
+};
+
+// Discards all output; used for internal work that reports failures through return values
+class NullOutput: public Output
+{
+public:
+	virtual void rawprint(const char* data, size_t size)
+	{
+	}
+
+	virtual void print(const char* message, ...)
+	{
+	}
+
+	virtual void error(const char* message, ...)
+	{
+	}
+};
+
+// Discards regular output and forwards errors to another output; used for internal work that shouldn't print progress or results
+class ErrorOutput: public Output
+{
+public:
+	ErrorOutput(Output* output): output(output)
+	{
+	}
+
+	virtual void rawprint(const char* data, size_t size)
+	{
+	}
+
+	virtual void print(const char* message, ...)
+	{
+	}
+
+	virtual void error(const char* message, ...)
+	{
+		std::string buf;
+
+		va_list l;
+		va_start(l, message);
+		strprintf(buf, message, l);
+		va_end(l);
+
+		output->error("%s", buf.c_str());
+	}
+
+private:
+	Output* output;
 };
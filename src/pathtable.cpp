@@ -0,0 +1,68 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "pathtable.hpp"
+
+static void writeVarInt(std::vector<unsigned char>& data, size_t value)
+{
+	while (value >= 128)
+	{
+		data.push_back(static_cast<unsigned char>(value | 128));
+		value >>= 7;
+	}
+
+	data.push_back(static_cast<unsigned char>(value));
+}
+
+static size_t readVarInt(const unsigned char* data, size_t& offset)
+{
+	size_t result = 0;
+
+	for (unsigned int shift = 0; ; shift += 7)
+	{
+		unsigned char byte = data[offset++];
+
+		result |= static_cast<size_t>(byte & 127) << shift;
+
+		if ((byte & 128) == 0)
+			return result;
+	}
+}
+
+PathTable::PathTable(): count(0)
+{
+}
+
+void PathTable::push_back(const char* path, size_t length)
+{
+	size_t prefix = 0;
+	while (prefix < length && prefix < last.size() && path[prefix] == last[prefix]) prefix++;
+
+	writeVarInt(data, prefix);
+	writeVarInt(data, length - prefix);
+	data.insert(data.end(), path + prefix, path + length);
+
+	last.assign(path, length);
+	count++;
+}
+
+PathTable::Reader::Reader(const PathTable& table): table(table), offset(0)
+{
+}
+
+bool PathTable::Reader::next()
+{
+	if (offset == table.data.size())
+		return false;
+
+	const unsigned char* data = table.data.data();
+
+	size_t prefix = readVarInt(data, offset);
+	size_t suffix = readVarInt(data, offset);
+	assert(prefix <= current.size() && offset + suffix <= table.data.size());
+
+	current.resize(prefix);
+	current.append(reinterpret_cast<const char*>(data + offset), suffix);
+	offset += suffix;
+
+	return true;
+}
@@ -0,0 +1,39 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Sequence of paths stored with front coding: every path keeps the length of the prefix it shares with the previous path and
+// the rest of the path. Sorted lists of paths with long common directory prefixes take several times less memory than strings.
+// Paths are identified by their index in the sequence.
+class PathTable
+{
+public:
+	PathTable();
+
+	void push_back(const char* path, size_t length);
+
+	size_t size() const { return count; }
+
+	// Decodes paths in sequence; the current path is valid until the next call
+	class Reader
+	{
+	public:
+		Reader(const PathTable& table);
+
+		bool next();
+
+		const std::string& path() const { return current; }
+
+	private:
+		const PathTable& table;
+		size_t offset;
+		std::string current;
+	};
+
+private:
+	std::vector<unsigned char> data;
+	std::string last;
+	size_t count;
+};
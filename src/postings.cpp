@@ -0,0 +1,274 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "postings.hpp"
+
+#include "format.hpp"
+#include "regex.hpp"
+#include "casefold.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+#include <string.h>
+
+static void writeVarInt(std::vector<unsigned char>& data, unsigned int value)
+{
+	while (value >= 128)
+	{
+		data.push_back(static_cast<unsigned char>(value | 128));
+		value >>= 7;
+	}
+
+	data.push_back(static_cast<unsigned char>(value));
+}
+
+static const unsigned char* readVarInt(const unsigned char* data, const unsigned char* end, unsigned int& value)
+{
+	unsigned int result = 0;
+
+	for (unsigned int shift = 0; data < end && shift < 32; shift += 7)
+	{
+		unsigned char byte = *data++;
+
+		result |= (byte & 127) << shift;
+
+		if ((byte & 128) == 0)
+		{
+			value = result;
+			return data;
+		}
+	}
+
+	return nullptr;
+}
+
+std::vector<unsigned int> trigramExtract(const std::string& string)
+{
+	std::vector<unsigned int> result;
+
+	for (size_t i = 2; i < string.length(); ++i)
+	{
+		char a = string[i - 2], b = string[i - 1], c = string[i];
+		result.push_back(trigram(casefold(a), casefold(b), casefold(c)));
+	}
+
+	std::sort(result.begin(), result.end());
+	result.erase(std::unique(result.begin(), result.end()), result.end());
+
+	return result;
+}
+
+void PostingIndexBuilder::append(unsigned int chunk, const std::vector<unsigned int>& ngrams)
+{
+	for (unsigned int n: ngrams)
+	{
+		List& list = lists[n];
+
+		assert(list.count == 0 || list.last < chunk);
+		writeVarInt(list.data, list.count == 0 ? chunk : chunk - list.last);
+
+		list.count++;
+		list.last = chunk;
+	}
+}
+
+std::vector<char> PostingIndexBuilder::serialize() const
+{
+	if (lists.empty())
+		return std::vector<char>();
+
+	std::vector<unsigned int> keys;
+	keys.reserve(lists.size());
+
+	for (auto& p: lists)
+		keys.push_back(p.first);
+
+	std::sort(keys.begin(), keys.end());
+
+	size_t headerSize = sizeof(DataPostingHeader) + sizeof(DataPostingEntry) * keys.size();
+	size_t dataSize = 0;
+
+	for (auto& p: lists)
+		dataSize += p.second.data.size();
+
+	std::vector<char> result(headerSize + dataSize);
+
+	DataPostingHeader header = {};
+	header.postingCount = keys.size();
+
+	memcpy(&result[0], &header, sizeof(header));
+
+	DataPostingEntry* entries = reinterpret_cast<DataPostingEntry*>(&result[sizeof(header)]);
+	size_t dataOffset = 0;
+
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		const List& list = lists.find(keys[i])->second;
+
+		entries[i].ngram = keys[i];
+		entries[i].chunkCount = list.count;
+		entries[i].dataOffset = dataOffset;
+
+		memcpy(&result[headerSize + dataOffset], list.data.data(), list.data.size());
+		dataOffset += list.data.size();
+	}
+
+	assert(dataOffset == dataSize);
+
+	return result;
+}
+
+PostingIndex::PostingIndex(): entries(nullptr), entryCount(0), data(nullptr), dataSize(0)
+{
+}
+
+bool PostingIndex::open(const char* data, size_t size)
+{
+	DataPostingHeader header;
+
+	if (size < sizeof(header))
+		return false;
+
+	memcpy(&header, data, sizeof(header));
+
+	size_t headerSize = sizeof(DataPostingHeader) + sizeof(DataPostingEntry) * header.postingCount;
+
+	if (size < headerSize)
+		return false;
+
+	this->entries = reinterpret_cast<const DataPostingEntry*>(data + sizeof(header));
+	this->entryCount = header.postingCount;
+	this->data = reinterpret_cast<const unsigned char*>(data + headerSize);
+	this->dataSize = size - headerSize;
+
+	return true;
+}
+
+bool PostingIndex::empty() const
+{
+	return entryCount == 0;
+}
+
+bool PostingIndex::find(unsigned int ngram, std::vector<unsigned int>& result) const
+{
+	result.clear();
+
+	const DataPostingEntry* entry = std::lower_bound(entries, entries + entryCount, ngram, [](const DataPostingEntry& e, unsigned int n) { return e.ngram < n; });
+
+	if (entry == entries + entryCount || entry->ngram != ngram)
+		return true;
+
+	if (entry->dataOffset > dataSize)
+		return false;
+
+	result.reserve(entry->chunkCount);
+
+	const unsigned char* ptr = data + entry->dataOffset;
+	const unsigned char* end = data + dataSize;
+	unsigned int chunk = 0;
+
+	for (unsigned int i = 0; i < entry->chunkCount; ++i)
+	{
+		unsigned int delta = 0;
+		ptr = readVarInt(ptr, end, delta);
+
+		if (!ptr)
+			return false;
+
+		chunk += delta;
+		result.push_back(chunk);
+	}
+
+	return true;
+}
+
+bool PostingIndex::findAll(const std::vector<unsigned int>& ngrams, std::vector<unsigned int>& result) const
+{
+	result.clear();
+
+	std::vector<std::vector<unsigned int>> lists(ngrams.size());
+
+	for (size_t i = 0; i < ngrams.size(); ++i)
+	{
+		if (!find(ngrams[i], lists[i]))
+			return false;
+
+		// no chunks have this ngram so no chunks have all of them
+		if (lists[i].empty())
+			return true;
+	}
+
+	if (lists.empty())
+		return true;
+
+	// intersect starting from the shortest list to minimize work
+	std::sort(lists.begin(), lists.end(), [](const std::vector<unsigned int>& l, const std::vector<unsigned int>& r) { return l.size() < r.size(); });
+
+	result.swap(lists[0]);
+
+	std::vector<unsigned int> temp;
+
+	for (size_t i = 1; i < lists.size() && !result.empty(); ++i)
+	{
+		temp.clear();
+		std::set_intersection(result.begin(), result.end(), lists[i].begin(), lists[i].end(), std::back_inserter(temp));
+		result.swap(temp);
+	}
+
+	return true;
+}
+
+bool PostingIndex::match(Regex* re, const std::vector<std::vector<unsigned int>>& atoms, size_t chunkCount, std::vector<bool>& candidates) const
+{
+	candidates.assign(chunkCount, false);
+
+	std::vector<int> allAtoms;
+	std::vector<std::pair<unsigned int, int>> chunkAtoms;
+	std::vector<unsigned int> chunks;
+
+	for (size_t i = 0; i < atoms.size(); ++i)
+	{
+		if (atoms[i].empty())
+		{
+			allAtoms.push_back(i);
+			continue;
+		}
+
+		if (!findAll(atoms[i], chunks))
+			return false;
+
+		for (unsigned int chunk: chunks)
+			chunkAtoms.push_back(std::make_pair(chunk, i));
+	}
+
+	// prefilter is monotonic so if chunks with no atoms match, all chunks match
+	if (re->prefilterMatch(allAtoms))
+	{
+		candidates.assign(chunkCount, true);
+		return true;
+	}
+
+	std::sort(chunkAtoms.begin(), chunkAtoms.end());
+
+	std::vector<int> matched;
+
+	for (size_t i = 0; i < chunkAtoms.size(); )
+	{
+		unsigned int chunk = chunkAtoms[i].first;
+
+		matched.clear();
+
+		for (int atom: allAtoms)
+			matched.push_back(atom);
+
+		for (; i < chunkAtoms.size() && chunkAtoms[i].first == chunk; ++i)
+			matched.push_back(chunkAtoms[i].second);
+
+		std::sort(matched.begin(), matched.end());
+
+		if (chunk < chunkCount && re->prefilterMatch(matched))
+			candidates[chunk] = true;
+	}
+
+	return true;
+}
@@ -0,0 +1,64 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+struct DataPostingEntry;
+class Regex;
+
+inline unsigned int trigram(char a, char b, char c)
+{
+	return (static_cast<unsigned char>(a) << 16) + (static_cast<unsigned char>(b) << 8) + static_cast<unsigned char>(c);
+}
+
+// Returns a sorted list of unique casefolded trigrams in the string
+std::vector<unsigned int> trigramExtract(const std::string& string);
+
+class PostingIndexBuilder
+{
+public:
+	// Chunks have to be appended in increasing order; ngrams don't have to be sorted but have to be unique
+	void append(unsigned int chunk, const std::vector<unsigned int>& ngrams);
+
+	std::vector<char> serialize() const;
+
+private:
+	struct List
+	{
+		unsigned int count;
+		unsigned int last;
+		std::vector<unsigned char> data;
+	};
+
+	std::unordered_map<unsigned int, List> lists;
+};
+
+class PostingIndex
+{
+public:
+	PostingIndex();
+
+	// Data has to outlive the index
+	bool open(const char* data, size_t size);
+
+	bool empty() const;
+
+	// Gets a sorted list of chunks that contain the ngram; returns false if posting data is malformed
+	bool find(unsigned int ngram, std::vector<unsigned int>& result) const;
+
+	// Gets a sorted list of chunks that contain all ngrams; returns false if posting data is malformed
+	bool findAll(const std::vector<unsigned int>& ngrams, std::vector<unsigned int>& result) const;
+
+	// Marks chunks that may match the regex; atoms has trigramExtract results for all atoms returned by prefilterPrepare
+	// Returns false if posting data is malformed
+	bool match(Regex* re, const std::vector<std::vector<unsigned int>>& atoms, size_t chunkCount, std::vector<bool>& candidates) const;
+
+private:
+	const DataPostingEntry* entries;
+	size_t entryCount;
+
+	const unsigned char* data;
+	size_t dataSize;
+};
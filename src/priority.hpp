@@ -0,0 +1,7 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+// Lowers CPU and I/O scheduling priority so that background work doesn't compete with interactive work
+// On Linux and macOS this affects the calling thread and threads it starts afterwards; on Windows it affects the entire process
+bool enterBackgroundMode();
+void leaveBackgroundMode();
@@ -0,0 +1,54 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#ifndef _WIN32
+
+#include "common.hpp"
+#include "priority.hpp"
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+
+// glibc doesn't provide ioprio definitions
+static const int kIoprioWhoProcess = 1;
+static const int kIoprioClassShift = 13;
+static const int kIoprioClassNone = 0;
+static const int kIoprioClassIdle = 3;
+
+static bool setIoPriorityClass(int cls)
+{
+	// with who=process and id=0, this refers to the calling thread
+	return syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, cls << kIoprioClassShift) == 0;
+}
+#endif
+
+bool enterBackgroundMode()
+{
+#if defined(__linux__)
+	// scheduler policy and I/O priority are per-thread on Linux and are inherited by new threads
+	sched_param param = {};
+	bool cpu = sched_setscheduler(0, SCHED_IDLE, &param) == 0;
+	bool io = setIoPriorityClass(kIoprioClassIdle);
+
+	return cpu && io;
+#elif defined(__APPLE__)
+	// background threads get lowest CPU priority and throttled I/O
+	return setpriority(PRIO_DARWIN_THREAD, 0, PRIO_DARWIN_BG) == 0;
+#else
+	return false;
+#endif
+}
+
+void leaveBackgroundMode()
+{
+#if defined(__linux__)
+	sched_param param = {};
+	sched_setscheduler(0, SCHED_OTHER, &param);
+	setIoPriorityClass(kIoprioClassNone);
+#elif defined(__APPLE__)
+	setpriority(PRIO_DARWIN_THREAD, 0, 0);
+#endif
+}
+#endif
@@ -0,0 +1,19 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#ifdef _WIN32
+
+#include "common.hpp"
+#include "priority.hpp"
+
+#include <windows.h>
+
+bool enterBackgroundMode()
+{
+	// thread background mode doesn't propagate to new threads, so the entire process has to enter it
+	return SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN) != 0;
+}
+
+void leaveBackgroundMode()
+{
+	SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_END);
+}
+#endif
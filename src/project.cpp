@@ -6,6 +6,10 @@
 #include "fileutil.hpp"
 #include "stringutil.hpp"
 #include "regex.hpp"
+#include "dircache.hpp"
+#include "gitindex.hpp"
+#include "constants.hpp"
+#include "format.hpp"
 
 #include <fstream>
 #include <memory>
@@ -14,6 +18,9 @@
 #include <map>
 #include <string>
 
+#include <limits.h>
+#include <stdlib.h>
+
 static std::string getHomePath()
 {
     char* qghome = getenv("QGREP_HOME");
@@ -87,6 +94,9 @@ static std::vector<std::string> getProjectsByPrefix(const char* prefix)
 				result.push_back(pprefix + std::string(path, dot));
 			}
 		}, passthroughDirectoryFilter);
+
+		// traversal order is not deterministic
+		std::sort(result.begin(), result.end());
 	}
 
 	return result;
@@ -147,6 +157,91 @@ static bool extractSuffix(const std::string& str, const char* prefix, std::strin
 	return false;
 }
 
+ProjectOptions::ProjectOptions()
+	: postings(false), summaries(false), dircache(false), gitIndex(false), contentChunks(false), skipBinary(false), maxFileSize(0), maxLineLength(0)
+	, chunkSize(kChunkSize), compressionLevel(kFileDataCompressionLevel), indexRatio(kChunkIndexRatio), codec(CC_LZ4), hotTierDays(0)
+	, watchUpdateFiles(kWatchUpdateThresholdFiles), watchUpdateDelay(kWatchUpdateTimeout), watchUpdateThreads(kWatchUpdateThreads), watchUpdateBackground(true), resultCache(false)
+{
+}
+
+static unsigned int parseIntOption(const std::string& value, unsigned int min = 0, unsigned int max = UINT_MAX)
+{
+	char* end = nullptr;
+	unsigned long result = strtoul(value.c_str(), &end, 10);
+
+	if (value.empty() || *end != 0 || result < min || result > max)
+		throw std::runtime_error("Invalid option value " + value);
+
+	return result;
+}
+
+static bool parseBoolOption(const std::string& value)
+{
+	if (value.empty() || value == "on" || value == "true" || value == "1")
+		return true;
+	else if (value == "off" || value == "false" || value == "0")
+		return false;
+	else
+		throw std::runtime_error("Invalid option value " + value);
+}
+
+static unsigned int parseCodecOption(const std::string& value)
+{
+	if (value == "lz4")
+		return CC_LZ4;
+	else if (value == "lz4dict")
+		return CC_LZ4DICT;
+	else
+		throw std::runtime_error("Invalid option value " + value);
+}
+
+static void parseOption(ProjectOptions& options, const std::string& option)
+{
+	std::string::size_type space = option.find_first_of(" \t");
+
+	std::string name = option.substr(0, space);
+	std::string value = space == std::string::npos ? "" : trim(option.substr(space));
+
+	if (name == "postings")
+		options.postings = parseBoolOption(value);
+	else if (name == "summaries")
+		options.summaries = parseBoolOption(value);
+	else if (name == "dircache")
+		options.dircache = parseBoolOption(value);
+	else if (name == "gitindex")
+		options.gitIndex = parseBoolOption(value);
+	else if (name == "contentchunks")
+		options.contentChunks = parseBoolOption(value);
+	else if (name == "skipbinary")
+		options.skipBinary = parseBoolOption(value);
+	else if (name == "maxfilesize")
+		options.maxFileSize = uint64_t(parseIntOption(value)) * 1024;
+	else if (name == "maxlinelength")
+		options.maxLineLength = parseIntOption(value);
+	else if (name == "chunksize")
+		options.chunkSize = parseIntOption(value, 16, 64 * 1024) * 1024;
+	else if (name == "compression")
+		options.compressionLevel = parseIntOption(value, 0, 12);
+	else if (name == "indexratio")
+		options.indexRatio = parseIntOption(value);
+	else if (name == "codec")
+		options.codec = parseCodecOption(value);
+	else if (name == "hottier")
+		options.hotTierDays = parseIntOption(value, 0, 36500);
+	else if (name == "watchupdatefiles")
+		options.watchUpdateFiles = parseIntOption(value);
+	else if (name == "watchupdatedelay")
+		options.watchUpdateDelay = parseIntOption(value);
+	else if (name == "watchupdatethreads")
+		options.watchUpdateThreads = parseIntOption(value);
+	else if (name == "watchupdatebackground")
+		options.watchUpdateBackground = parseBoolOption(value);
+	else if (name == "resultcache")
+		options.resultCache = parseBoolOption(value);
+	else
+		throw std::runtime_error("Unknown option " + name);
+}
+
 static std::shared_ptr<Regex> createRegexCached(const std::string& query, std::map<std::string, std::shared_ptr<Regex>>& regexCache)
 {
 	auto p = regexCache.insert(std::make_pair(query, std::shared_ptr<Regex>()));
@@ -215,6 +310,12 @@ static std::unique_ptr<ProjectGroup> parseGroup(std::ifstream& in, const char* f
 			createRegexCached(suffix, regexCache);
 			exclude.push_back(suffix);
 		}
+		else if (extractSuffix(line, "option", suffix))
+		{
+			if (parent) throw std::runtime_error("Options can only be specified outside of groups");
+			if (suffix.empty()) throw std::runtime_error("No option specified");
+			parseOption(result->options, suffix);
+		}
 		else if (extractSuffix(line, "group", suffix))
 			result->groups.push_back(parseGroup(in, file, lineId, result.get(), regexCache, pathBase));
 		else if (extractSuffix(line, "endgroup", suffix))
@@ -297,7 +398,7 @@ bool isDirectoryAcceptable(ProjectGroup* group, const char* path)
 	return true;
 }
 
-static void getProjectGroupFilesRec(Output* output, ProjectGroup* group, std::vector<FileInfo>& files)
+static void getProjectGroupFilesRec(Output* output, ProjectGroup* group, DirectoryCache* cache, bool gitIndex, std::vector<FileInfo>& files)
 {
 	for (auto& path: group->files)
 	{
@@ -313,31 +414,63 @@ static void getProjectGroupFilesRec(Output* output, ProjectGroup* group, std::ve
 	{
 		std::string buf;
 
-		bool result = traverseDirectory(folder.c_str(), [&](const char* path, uint64_t mtime, uint64_t size) {
+		auto fileCallback = [&](const char* path, uint64_t mtime, uint64_t size) {
 			if (isFileAcceptable(group, path))
 			{
 				joinPaths(buf, folder.c_str(), path);
 				files.push_back({ buf, mtime, size });
 			}
-			}, [&](const char* path) {
-				return isDirectoryAcceptable(group, path);
-			});
+		};
+
+		auto directoryFilter = [&](const char* path) {
+			return isDirectoryAcceptable(group, path);
+		};
+
+		// folders that are not in a git checkout, or whose index can't be read, are traversed
+		bool result = (gitIndex && readGitIndex(folder.c_str(), fileCallback, directoryFilter)) || traverseDirectory(folder.c_str(), fileCallback, directoryFilter, cache);
 
 		if (!result) output->error("Error reading folder %s\n", folder.c_str());
 	}
 
 	for (auto& child: group->groups)
-		getProjectGroupFilesRec(output, child.get(), files);
+		getProjectGroupFilesRec(output, child.get(), cache, gitIndex, files);
 }
 
-std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group)
+std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group, DirectoryCache* cache, bool gitIndex)
 {
 	std::vector<FileInfo> files;
 	
-	getProjectGroupFilesRec(output, group, files);
+	getProjectGroupFilesRec(output, group, cache, gitIndex, files);
 
 	std::sort(files.begin(), files.end(), [](const FileInfo& l, const FileInfo& r) { return l.path < r.path; });
 	files.erase(std::unique(files.begin(), files.end(), [](const FileInfo& l, const FileInfo& r) { return l.path == r.path; }), files.end());
 
 	return files;
 }
+
+std::vector<FileInfo> getProjectFiles(Output* output, const char* path, ProjectGroup* group, bool reuseCache)
+{
+	bool gitIndex = group->options.gitIndex;
+
+	if (!group->options.dircache)
+	{
+		removeFile(replaceExtension(path, ".qgt").c_str());
+
+		return getProjectGroupFiles(output, group, nullptr, gitIndex);
+	}
+
+	DirectoryCache cache;
+
+	if (reuseCache)
+		cache.load(path);
+
+	if (!cache.start(path))
+		output->error("Error saving directory cache for %s\n", path);
+
+	std::vector<FileInfo> files = getProjectGroupFiles(output, group, &cache, gitIndex);
+
+	if (!cache.save(path))
+		output->error("Error saving directory cache for %s\n", path);
+
+	return files;
+}
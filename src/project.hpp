@@ -7,6 +7,7 @@
 
 class Output;
 class Regex;
+class DirectoryCache;
 
 std::string getProjectPath(const char* name);
 std::string getProjectName(const char* path);
@@ -14,10 +15,59 @@ std::string getProjectName(const char* path);
 std::vector<std::string> getProjects();
 std::vector<std::string> getProjectPaths(const char* list);
 
+struct ProjectOptions
+{
+	bool postings;
+	bool summaries;
+	bool dircache;
+
+	// folders in git checkouts only contain files tracked by git, which are listed from the git index instead of traversing the folder
+	bool gitIndex;
+
+	// chunks end after files that are picked by a hash of their path unless they get too small or too large, so that adding,
+	// removing or changing a file doesn't move the boundaries of other chunks
+	bool contentChunks;
+
+	// files that look binary, are larger than maxFileSize bytes or have lines longer than maxLineLength bytes (0 = no limit) are stored
+	// without contents, so that they don't take space in the data file or match searches
+	bool skipBinary;
+	uint64_t maxFileSize;
+	unsigned int maxLineLength;
+
+	// data file layout: uncompressed chunk size in bytes, compression level and the ratio of data size to bloom index size (0 = no index)
+	unsigned int chunkSize;
+	int compressionLevel;
+	unsigned int indexRatio;
+
+	// ChunkCodec used to compress chunks; CC_LZ4DICT uses a dictionary that is built from project files
+	unsigned int codec;
+
+	// files modified in the last hotTierDays days (0 = no tiers) are stored in chunks before all other files, so that searches go through them
+	// first and updates mostly rewrite these chunks
+	unsigned int hotTierDays;
+
+	// watch updates the project once the change list has more than watchUpdateFiles files and there were no changes for watchUpdateDelay seconds
+	unsigned int watchUpdateFiles;
+	unsigned int watchUpdateDelay;
+
+	// every worker pool of an update started by watch (file reads, compression, chunk checks, traversal) has at most watchUpdateThreads threads
+	// (0 = no limit), so the update can use a few times as many threads in total; it runs with lower CPU and I/O priority if watchUpdateBackground is set
+	unsigned int watchUpdateThreads;
+	bool watchUpdateBackground;
+
+	// output of searches that are run by scripts is cached in a file next to the data file
+	bool resultCache;
+
+	ProjectOptions();
+};
+
 struct ProjectGroup
 {
 	ProjectGroup* parent;
 
+	// options apply to the entire project and are only specified in the root group
+	ProjectOptions options;
+
 	std::vector<std::string> paths;
 	std::vector<std::string> files;
 	std::shared_ptr<Regex> include;
@@ -36,4 +86,8 @@ struct FileInfo
 	uint64_t fileSize;
 };
 
-std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group);
+// With gitIndex, folders in git checkouts are listed from the git index instead of being traversed
+std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group, DirectoryCache* cache = nullptr, bool gitIndex = false);
+
+// Scans project files, using the directory cache and the git index if the project enables them; without reuseCache the cache is only written
+std::vector<FileInfo> getProjectFiles(Output* output, const char* path, ProjectGroup* group, bool reuseCache);
@@ -3,24 +3,20 @@
 #include "regex.hpp"
 
 #include "casefold.hpp"
+#include "stringutil.hpp"
+#include "literalmatcher.hpp"
+#include "constants.hpp"
 
 #include "re2/re2.h"
+#include "re2/set.h"
 #include "re2/prefilter.h"
 #include "re2/prefilter_tree.h"
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <stdexcept>
-
-#include <string.h>
-
-#if defined(USE_SSE2) || defined(USE_NEON)
-#include "charsimd.hpp"
-#endif
-
-#ifdef _MSC_VER
-#   include <intrin.h>
-#   pragma intrinsic(_BitScanForward)
-#endif
+#include <thread>
 
 static bool transformRegexCasefold(const char* pattern, std::string& res, bool literal)
 {
@@ -49,198 +45,37 @@ static bool transformRegexCasefold(const char* pattern, std::string& res, bool l
 	return true;
 }
 
-class LiteralMatcher
-{
-public:
-	virtual ~LiteralMatcher() {}
-
-	virtual size_t match(const char* data, size_t size) = 0;
-};
-
-#if defined(USE_SSE2) || defined(USE_NEON)
-inline int countTrailingZeros(int value)
+static void setupRegexOptions(RE2::Options& opts, unsigned int options)
 {
-#ifdef _MSC_VER
-	unsigned long r;
-	_BitScanForward(&r, value);
-	return r;
-#else
-	return __builtin_ctz(value);
-#endif
+	opts.set_posix_syntax(true);
+	opts.set_perl_classes(true);
+	opts.set_word_boundary(true);
+	opts.set_one_line(false);
+	opts.set_never_nl(true);
+	opts.set_literal((options & RO_LITERAL) != 0);
+	opts.set_log_errors(false);
 }
 
-class LiteralMatcher1: public LiteralMatcher
+// Identifies the calling thread for picking regex instances; threads are numbered in the order they first use a regex
+static unsigned int getThreadSlot()
 {
-public:
-	LiteralMatcher1(const char* string): first(string[0])
-	{
-	}
-
-	virtual size_t match(const char* data, size_t size)
-	{
-		simd16 pattern = simd_dup(first);
-
-		size_t offset = 0;
+	static std::atomic<unsigned int> nextSlot(0);
+	static thread_local unsigned int slot = nextSlot++;
 
-		while (offset + 16 <= size)
-		{
-			simd16 val = simd_load(data + offset);
-			simd16 maskv = simd_cmpeq(val, pattern);
-			int mask = simd_movemask(maskv);
-
-			if (mask == 0)
-				;
-			else
-				return offset + countTrailingZeros(mask);
-
-			offset += 16;
-		}
-
-		while (offset < size && data[offset] != first)
-			offset++;
-
-		return offset;
-	}
-
-private:
-	char first;
-};
-
-class LiteralMatcher16: public LiteralMatcher
-{
-public:
-	LiteralMatcher16(const char* string)
-	{
-		size_t length = strlen(string);
-
-		size_t firstPos = getLeastFrequentLetter(string, length);
-		size_t dataOffset = firstPos < 16 ? 0 : firstPos - 16;
-
-		for (size_t i = 0; i < 16; ++i)
-		{
-			firstLetter[i] = string[firstPos];
-
-			patternData[i] = (dataOffset + i < length) ? string[dataOffset + i] : 0;
-			patternMask[i] = (dataOffset + i < length) ? 0 : 0xff;
-		}
-
-		firstLetterPos = firstPos;
-		firstLetterOffset = firstPos - dataOffset;
-
-		pattern = string;
-	}
-
-	virtual size_t match(const char* data, size_t size)
-	{
-		simd16 firstLetter = simd_load(this->firstLetter);
-		simd16 patternData = simd_load(this->patternData);
-		simd16 patternMask = simd_load(this->patternMask);
-
-		size_t offset = firstLetterPos;
-
-		while (offset + 32 <= size)
-		{
-			simd16 value = simd_load(data + offset);
-			unsigned int mask = simd_movemask(simd_cmpeq(value, firstLetter));
-
-			// advance offset regardless of match results to reduce number of live values
-			offset += 16;
-
-			while (mask != 0)
-			{
-				unsigned int pos = countTrailingZeros(mask);
-				size_t dataOffset = offset - 16 + pos - firstLetterOffset;
-
-				mask &= ~(1 << pos);
-
-				// check if we have a match
-				simd16 patternMatch = simd_load(data + dataOffset);
-				simd16 matchMask = simd_or(patternMask, simd_cmpeq(patternMatch, patternData));
-
-				if (simd_movemask(matchMask) == 0xffff)
-				{
-					size_t matchOffset = dataOffset + firstLetterOffset - firstLetterPos;
-
-					// final check for full pattern
-					if (matchOffset + pattern.size() <= size && memcmp(data + matchOffset, pattern.c_str(), pattern.size()) == 0)
-					{
-						return matchOffset;
-					}
-				}
-			}
-		}
-
-		return findMatch(pattern.c_str(), pattern.size(), data, size, offset - firstLetterPos);
-	}
-
-private:
-	unsigned char firstLetter[16];
-	unsigned char patternData[16];
-	unsigned char patternMask[16];
-	size_t firstLetterPos;
-	size_t firstLetterOffset;
-
-	std::string pattern;
-
-	static size_t findMatch(const char* x, size_t m, const char* y, size_t n, size_t start)
-	{
-		for (size_t j = start; j + m <= n; ++j)
-		{
-			size_t i = 0;
-			while (i < m && x[i] == y[i + j]) ++i;
-
-			if (i == m) return j;
-		}
-
-		return n;
-	}
-
-	static size_t getLeastFrequentLetter(const char* string, size_t length)
-	{
-		static const int kFrequencyTable[256] =
-		{
-			0, 1, 0, 0, 0, 0, 0, 0, 0, 10602590, 15871966, 0, 115, 15871967, 0, 0, 
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 20, 0, 0, 0, 0, 
-			137776326, 380531, 2050160, 1390430, 55652, 156711, 622798, 377541, 6347309, 6349017, 15625360, 795950, 19415821, 7560692, 4462299, 7677639, 
-			28564723, 4287685, 3463240, 3246751, 2524164, 2032662, 2395948, 1767308, 2015273, 1511489, 3656040, 5020957, 952959, 3703051, 1709838, 58757, 
-			33589, 4925784, 2109034, 4461995, 3250571, 5025264, 3924677, 1936150, 1023430, 3832789, 193034, 437171, 2790600, 2535084, 2734912, 2410167, 
-			2863507, 180258, 3341306, 4837122, 4450499, 1455744, 1216353, 703917, 784740, 538485, 229684, 898206, 1013666, 897273, 16601, 7723320, 
-			4063, 19048491, 4008087, 10148475, 9126676, 33071235, 7304196, 4732808, 5355028, 17956702, 429890, 1506676, 11310158, 8442069, 17783591, 16421409, 
-			7587849, 310591, 18113867, 15601492, 26260892, 8333809, 2934125, 2055891, 16325891, 3402971, 743219, 1688043, 180102, 1687646, 39011, 0, 
-			195, 316, 835, 1262, 32, 60, 69, 39, 75, 79, 97, 112, 98, 114, 64, 92, 
-			119, 87, 475, 193, 184, 109, 521, 5121, 9, 20, 24, 11, 23, 39, 48, 19, 
-			39, 44, 57, 59, 81, 455, 51, 30, 31, 1126, 86, 54, 39, 93, 39, 29, 
-			110, 38, 46, 104, 69, 193, 85, 8353, 132, 68, 99, 64, 87, 138, 143, 97, 
-			16, 11, 334, 13773, 126, 117, 14, 9, 22, 70, 44, 10, 66, 24, 12, 27, 
-			1254, 50889, 79, 77, 62, 140, 14, 11, 9, 4, 7, 11, 21, 8, 0, 9, 
-			11, 11, 84, 627, 43, 113, 31, 58, 81, 69, 36, 4, 9, 27, 9, 18, 
-			61, 7, 5, 12, 6, 8, 7, 6, 8, 9, 20, 4, 18, 5, 4, 2, 
-		};
-
-		size_t result = 0;
-
-		for (size_t i = 1; i < length; ++i)
-			if (kFrequencyTable[static_cast<unsigned char>(string[i])] < kFrequencyTable[static_cast<unsigned char>(string[result])])
-				result = i;
-			
-		return result;
-	}
-};
-#endif
+	return slot;
+}
 
 class RE2Regex: public Regex
 {
 public:
-	RE2Regex(const char* string, unsigned int options): casefold(false)
+	RE2Regex(const char* string, unsigned int options)
+		: casefold(false), instanceCount(std::min(std::thread::hardware_concurrency(), kRegexMaxInstances) + 1), instances(new std::atomic<RE2*>[instanceCount])
 	{
 		RE2::Options opts;
-		opts.set_posix_syntax(true);
-		opts.set_perl_classes(true);
-		opts.set_word_boundary(true);
-		opts.set_one_line(false);
-		opts.set_never_nl(true);
-		opts.set_literal((options & RO_LITERAL) != 0);
-		opts.set_log_errors(false);
+		setupRegexOptions(opts, options);
+
+		// copies are made with the options of the original regex, so they get the same share of the budget
+		opts.set_max_mem(kRegexMemoryBudget / instanceCount);
 		
 		std::string pattern;
 		if ((options & RO_IGNORECASE) && transformRegexCasefold(string, pattern, (options & RO_LITERAL) != 0))
@@ -259,17 +94,31 @@ public:
 
 		std::string prefix = getPrefix(re.get(), 128);
 
-	#if defined(USE_SSE2) || defined(USE_NEON)
-		if (prefix.length() == 1)
-			matcher.reset(new LiteralMatcher1(prefix.c_str()));
-		else if (prefix.length() > 1)
-			matcher.reset(new LiteralMatcher16(prefix.c_str()));
-	#endif
+		if (!prefix.empty())
+			matcher.reset(createLiteralMatcher(prefix.c_str(), casefold));
+		else
+			createInnerMatchers(getInnerLiterals(re.get()));
+
+		// the first instance is the original regex
+		instances[0] = re.get();
+
+		for (size_t i = 1; i < instanceCount; ++i)
+			instances[i] = nullptr;
+	}
+
+	~RE2Regex()
+	{
+		for (size_t i = 1; i < instanceCount; ++i)
+			delete instances[i].load();
 	}
 	
 	virtual const char* rangePrepare(const char* data, size_t size)
 	{
-		if (casefold)
+		// the casefolded line is only reused within one range, since the memory of the previous range might have been reused
+		getLineCache().owner = nullptr;
+
+		// with a literal prefix, casefolded searches scan the original data and only casefold candidate lines
+		if (casefold && !matcher && innerMatchers.empty())
 		{
 			char* temp = new char[size];
 			casefoldRange(temp, data, data + size);
@@ -281,6 +130,9 @@ public:
 
 	virtual RegexMatch rangeSearch(const char* data, size_t size)
 	{
+		if ((casefold && matcher) || !innerMatchers.empty())
+			return rangeSearchLines(data, size);
+
 		size_t offset = 0;
 
 		if (matcher)
@@ -294,7 +146,7 @@ public:
 		re2::StringPiece p(data, size);
 		re2::StringPiece match;
 
-		if (re->Match(p, offset, size, re2::RE2::UNANCHORED, &match, 1))
+		if (getInstance()->Match(p, offset, size, re2::RE2::UNANCHORED, &match, 1))
 			return RegexMatch(match.data(), match.size());
 
 		return RegexMatch();
@@ -302,7 +154,7 @@ public:
 	
 	virtual void rangeFinalize(const char* data)
 	{
-		if (casefold)
+		if (casefold && !matcher && innerMatchers.empty())
 		{
 			delete[] data;
 		}
@@ -323,7 +175,7 @@ public:
 
 		if (prf && prf->op() != re2::Prefilter::NONE)
 		{
-			prefilter.reset(new re2::PrefilterTree());
+			prefilter.reset(new re2::PrefilterTree(kMinPrefilterAtomLength));
 			prefilter->Add(prf.release());
 
 			std::vector<std::string> result;
@@ -355,10 +207,248 @@ private:
 	std::unique_ptr<RE2> re;
 	bool casefold;
 
+	// RE2 objects can be shared between threads, but the lazily built DFA is guarded by a lock, and cache resets under
+	// contention are expensive; threads use separate copies of the regex that have their own DFA and memory budget
+	size_t instanceCount;
+	std::unique_ptr<std::atomic<RE2*>[]> instances;
+
 	std::unique_ptr<LiteralMatcher> matcher;
 
+	// inner literals are taken from the prefilter, which lowercases them, so they are always matched ignoring case
+	std::vector<std::unique_ptr<LiteralMatcher>> innerMatchers;
+	std::vector<size_t> innerLengths;
+
 	std::unique_ptr<re2::PrefilterTree> prefilter;
 
+	RE2* getInstance()
+	{
+		std::atomic<RE2*>& slot = instances[getThreadSlot() % instanceCount];
+
+		if (RE2* result = slot.load(std::memory_order_acquire))
+			return result;
+
+		std::unique_ptr<RE2> instance(new RE2(re->pattern(), re->options()));
+		RE2* expected = nullptr;
+
+		// another thread with the same slot might have created the copy first
+		if (slot.compare_exchange_strong(expected, instance.get(), std::memory_order_acq_rel))
+			return instance.release();
+
+		return expected;
+	}
+
+	// Returns the offset of the first possible match of the prefix or any of the inner literals (size if there is none)
+	size_t findCandidate(const char* data, size_t size)
+	{
+		if (matcher)
+			return matcher->match(data, size);
+
+		size_t result = size;
+
+		// every matcher only scans up to the best candidate so far, so the data is scanned at most once per literal
+		for (size_t i = 0; i < innerMatchers.size(); ++i)
+		{
+			size_t limit = (result == size) ? size : std::min(size, result + innerLengths[i]);
+			size_t offset = innerMatchers[i]->match(data, limit);
+
+			if (offset < limit && offset < result)
+				result = offset;
+		}
+
+		return result;
+	}
+
+	// Bounds and casefolded copy of the last candidate line; highlighting and JSON output search the same line again after
+	// every match, and finding the line end or casefolding the line every time is quadratic in the line length
+	struct LineCache
+	{
+		const RE2Regex* owner;
+		const char* begin;
+		const char* end;
+		bool newline;
+		std::vector<char> buffer;
+	};
+
+	static LineCache& getLineCache()
+	{
+		static thread_local LineCache cache = {};
+
+		return cache;
+	}
+
+	// Returns the end of the line that contains the candidate, reusing the cached line if the candidate is in it
+	const char* findCandidateLineEnd(LineCache& cache, const char* lbeg, const char* candidate, const char* end)
+	{
+		if (cache.owner == this && lbeg >= cache.begin && candidate < cache.end)
+		{
+			// the searched range might end before the line does; if it ends after, the line end has to be a line break
+			if (end <= cache.end)
+				return end;
+
+			if (cache.newline)
+				return cache.end;
+		}
+
+		const char* lend = findLineEnd(candidate, end);
+
+		if (casefold)
+		{
+			if (cache.buffer.size() < size_t(lend - lbeg))
+				cache.buffer.resize(lend - lbeg);
+
+			casefoldRange(cache.buffer.data(), lbeg, lend);
+		}
+
+		cache.owner = this;
+		cache.begin = lbeg;
+		cache.end = lend;
+		cache.newline = lend < end;
+
+		return lend;
+	}
+
+	// Matches never span multiple lines, so only lines with candidates need to be matched
+	RegexMatch rangeSearchLines(const char* data, size_t size)
+	{
+		LineCache& cache = getLineCache();
+
+		RE2* instance = getInstance();
+
+		size_t offset = 0;
+
+		while (offset < size)
+		{
+			offset += findCandidate(data + offset, size - offset);
+			assert(offset <= size);
+
+			if (offset == size) break;
+
+			const char* lbeg = findLineStart(data, data + offset);
+			const char* lend = findCandidateLineEnd(cache, lbeg, data + offset, data + size);
+			size_t lsize = lend - lbeg;
+
+			re2::StringPiece match;
+
+			if (casefold)
+			{
+				const char* folded = cache.buffer.data() + (lbeg - cache.begin);
+
+				re2::StringPiece p(folded, lsize);
+
+				// a prefix match can't start before the candidate, but an inner literal can be anywhere in the match
+				if (instance->Match(p, matcher ? data + offset - lbeg : 0, lsize, re2::RE2::UNANCHORED, &match, 1))
+					return RegexMatch(lbeg + (match.data() - folded), match.size());
+			}
+			else
+			{
+				re2::StringPiece p(data, size);
+
+				if (instance->Match(p, lbeg - data, lend - data, re2::RE2::UNANCHORED, &match, 1))
+					return RegexMatch(match.data(), match.size());
+			}
+
+			offset = lend - data + 1;
+		}
+
+		return RegexMatch();
+	}
+
+	void createInnerMatchers(const std::vector<std::string>& literals)
+	{
+		for (auto& literal: literals)
+		{
+			LiteralMatcher* matcher = createLiteralMatcher(literal.c_str(), /* ignoreCase= */ true);
+
+			// without SIMD support plain regex search is faster than scanning the data several times
+			if (!matcher)
+			{
+				innerMatchers.clear();
+				innerLengths.clear();
+				return;
+			}
+
+			innerMatchers.emplace_back(matcher);
+			innerLengths.push_back(literal.size());
+		}
+	}
+
+	static bool isInnerLiteral(const std::string& literal)
+	{
+		if (literal.size() < kMinInnerLiteralLength)
+			return false;
+
+		// prefilter lowercases Unicode letters, which casefolded literal matching can't handle
+		for (char ch: literal)
+			if (static_cast<unsigned char>(ch) > 0x7f)
+				return false;
+
+		return true;
+	}
+
+	// Collects literals one of which has to be present in every match; returns false if there are none that are worth scanning for
+	static bool getRequiredLiterals(re2::Prefilter* prefilter, std::vector<std::string>& result)
+	{
+		result.clear();
+
+		switch (prefilter->op())
+		{
+		case re2::Prefilter::ATOM:
+			result.push_back(prefilter->atom());
+			return isInnerLiteral(prefilter->atom());
+
+		case re2::Prefilter::OR:
+			if (prefilter->subs()->size() > kMaxInnerLiterals)
+				return false;
+
+			for (re2::Prefilter* sub: *prefilter->subs())
+			{
+				if (sub->op() != re2::Prefilter::ATOM || !isInnerLiteral(sub->atom()))
+					return false;
+
+				result.push_back(sub->atom());
+			}
+
+			return true;
+
+		case re2::Prefilter::AND:
+			{
+				// pick the alternatives with the longest shortest literal; it's likely to produce the fewest candidates
+				std::vector<std::string> best, current;
+				size_t bestLength = 0;
+
+				for (re2::Prefilter* sub: *prefilter->subs())
+					if (getRequiredLiterals(sub, current))
+					{
+						size_t length = std::min_element(current.begin(), current.end(),
+							[](const std::string& l, const std::string& r) { return l.size() < r.size(); })->size();
+
+						if (length > bestLength || (length == bestLength && current.size() < best.size()))
+						{
+							best.swap(current);
+							bestLength = length;
+						}
+					}
+
+				result.swap(best);
+				return !result.empty();
+			}
+
+		default:
+			return false;
+		}
+	}
+
+	static std::vector<std::string> getInnerLiterals(RE2* re)
+	{
+		std::unique_ptr<re2::Prefilter> prefilter(re2::Prefilter::FromRE2(re));
+		std::vector<std::string> result;
+
+		if (!prefilter || !getRequiredLiterals(prefilter.get(), result))
+			return {};
+
+		return result;
+	}
+
 	static std::string getPrefix(RE2* re, size_t maxlen)
 	{
 		std::string min, max;
@@ -392,3 +482,62 @@ Regex* createRegex(const char* pattern, unsigned int options)
 {
 	return new RE2Regex(pattern, options);
 }
+
+class RE2RegexSet: public RegexSet
+{
+public:
+	RE2RegexSet(const std::vector<std::string>& patterns, unsigned int options): set(getOptions(options), RE2::UNANCHORED)
+	{
+		for (size_t i = 0; i < patterns.size(); ++i)
+		{
+			std::string error;
+
+			if (set.Add(patterns[i], &error) < 0)
+				throw std::runtime_error("Error parsing regular expression " + patterns[i] + ": " + error);
+		}
+
+		if (!set.Compile())
+			throw std::runtime_error("Error compiling regular expression set");
+	}
+
+	virtual void match(const char* data, size_t size, std::vector<int>& result)
+	{
+		result.clear();
+		set.Match(re2::StringPiece(data, size), &result);
+
+		std::sort(result.begin(), result.end());
+	}
+
+private:
+	RE2::Set set;
+
+	static RE2::Options getOptions(unsigned int options)
+	{
+		RE2::Options opts;
+		setupRegexOptions(opts, options);
+		opts.set_case_sensitive((options & RO_IGNORECASE) == 0);
+
+		return opts;
+	}
+};
+
+Regex* createRegex(const std::vector<std::string>& patterns, unsigned int options)
+{
+	std::string pattern;
+
+	for (size_t i = 0; i < patterns.size(); ++i)
+	{
+		if (i != 0) pattern += "|";
+
+		pattern += "(";
+		pattern += (options & RO_LITERAL) ? RE2::QuoteMeta(patterns[i]) : patterns[i];
+		pattern += ")";
+	}
+
+	return new RE2Regex(pattern.c_str(), options & ~RO_LITERAL);
+}
+
+RegexSet* createRegexSet(const std::vector<std::string>& patterns, unsigned int options)
+{
+	return new RE2RegexSet(patterns, options);
+}
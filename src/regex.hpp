@@ -36,4 +36,17 @@ public:
 	virtual bool prefilterMatch(const std::vector<int>& matches) = 0;
 };
 
-Regex* createRegex(const char* pattern, unsigned int options);
\ No newline at end of file
+class RegexSet
+{
+public:
+	virtual ~RegexSet() {}
+
+	// Returns sorted indices of all patterns that match the data
+	virtual void match(const char* data, size_t size, std::vector<int>& result) = 0;
+};
+
+Regex* createRegex(const char* pattern, unsigned int options);
+
+// Creates a regex that matches any of the patterns
+Regex* createRegex(const std::vector<std::string>& patterns, unsigned int options);
+RegexSet* createRegexSet(const std::vector<std::string>& patterns, unsigned int options);
\ No newline at end of file
@@ -0,0 +1,231 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "resultcache.hpp"
+
+#include "changes.hpp"
+#include "constants.hpp"
+#include "fileutil.hpp"
+#include "filestream.hpp"
+#include "format.hpp"
+#include "output.hpp"
+#include "project.hpp"
+
+#include <string.h>
+
+static void appendKey(std::string& key, const void* data, size_t size)
+{
+	uint32_t length = size;
+
+	key.append(reinterpret_cast<const char*>(&length), sizeof(length));
+	key.append(static_cast<const char*>(data), size);
+}
+
+static void appendKey(std::string& key, const char* value)
+{
+	appendKey(key, value ? value : "", value ? strlen(value) : 0);
+}
+
+static void appendKeyStamp(std::string& key, const std::string& path, uint64_t recentTime, bool& recent)
+{
+	uint64_t stamp[2] = {};
+
+	if (!getFileAttributes(path.c_str(), &stamp[0], &stamp[1]))
+		stamp[0] = stamp[1] = 0;
+
+	appendKey(key, path.c_str());
+	appendKey(key, stamp, sizeof(stamp));
+
+	recent |= stamp[0] >= recentTime;
+}
+
+bool isResultCacheEnabled(const char* path)
+{
+	NullOutput output;
+	std::unique_ptr<ProjectGroup> group = parseProject(&output, path);
+
+	return group && group->options.resultCache;
+}
+
+std::string getResultCacheKey(const std::vector<std::string>& files, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude,
+	bool& recent)
+{
+	std::string result;
+	uint64_t recentTime = getFileTimeAgo(kResultCacheMinFileAge);
+
+	recent = false;
+
+	appendKey(result, string);
+	appendKey(result, &options, sizeof(options));
+	appendKey(result, &limit, sizeof(limit));
+	appendKey(result, include);
+	appendKey(result, exclude);
+
+	for (auto& file: files)
+	{
+		appendKeyStamp(result, replaceExtension(file.c_str(), ".qgd"), recentTime, recent);
+		appendKeyStamp(result, replaceExtension(file.c_str(), ".qgc"), recentTime, recent);
+		appendKeyStamp(result, replaceExtension(file.c_str(), ".qgs"), recentTime, recent);
+
+		// changed files are read from disk if the side pack is missing or doesn't have them
+		for (auto& change: readChanges(file.c_str()))
+			appendKeyStamp(result, change, recentTime, recent);
+	}
+
+	return result;
+}
+
+struct ResultCacheItem
+{
+	std::string key;
+	std::string output;
+	unsigned int matchCount;
+};
+
+template <typename T> static bool readCache(const std::vector<char>& data, size_t& offset, T& value)
+{
+	if (data.size() - offset < sizeof(T))
+		return false;
+
+	memcpy(&value, &data[offset], sizeof(T));
+	offset += sizeof(T);
+
+	return true;
+}
+
+static bool readCacheString(const std::vector<char>& data, size_t& offset, size_t length, std::string& value)
+{
+	if (data.size() - offset < length)
+		return false;
+
+	value.assign(data.data() + offset, length);
+	offset += length;
+
+	return true;
+}
+
+// Malformed caches are treated as empty; entries that were read successfully before the error are kept
+static std::vector<ResultCacheItem> loadResultCache(const char* path)
+{
+	std::vector<ResultCacheItem> result;
+
+	FileStream in(replaceExtension(path, ".qgr").c_str(), "rb");
+	if (!in)
+		return result;
+
+	std::vector<char> data;
+	char buffer[65536];
+
+	while (size_t size = in.read(buffer, sizeof(buffer)))
+		data.insert(data.end(), buffer, buffer + size);
+
+	size_t offset = 0;
+
+	ResultCacheHeader header;
+	if (!readCache(data, offset, header) || memcmp(header.magic, kResultCacheHeaderMagic, strlen(kResultCacheHeaderMagic)) != 0)
+		return result;
+
+	for (uint32_t i = 0; i < header.entryCount; ++i)
+	{
+		ResultCacheEntry entry;
+		ResultCacheItem item;
+
+		if (!readCache(data, offset, entry) || !readCacheString(data, offset, entry.keyLength, item.key) || !readCacheString(data, offset, entry.outputLength, item.output))
+			break;
+
+		item.matchCount = entry.matchCount;
+
+		result.push_back(std::move(item));
+	}
+
+	return result;
+}
+
+bool readResultCache(const char* path, const std::string& key, std::string& result, unsigned int& matchCount)
+{
+	std::vector<ResultCacheItem> items = loadResultCache(path);
+
+	for (auto& item: items)
+		if (item.key == key)
+		{
+			result.swap(item.output);
+			matchCount = item.matchCount;
+			return true;
+		}
+
+	return false;
+}
+
+bool writeResultCache(const char* path, const std::string& key, const std::string& result, unsigned int matchCount)
+{
+	std::vector<ResultCacheItem> items = loadResultCache(path);
+
+	// the new entry replaces entries with the same key and goes to the end, so that the oldest entries are dropped first
+	size_t totalSize = key.size() + result.size();
+	size_t keep = items.size();
+
+	for (size_t i = items.size(); i > 0; --i)
+	{
+		ResultCacheItem& item = items[i - 1];
+
+		if (item.key == key)
+			item.key.clear();
+		else if (totalSize + item.key.size() + item.output.size() <= kResultCacheSize)
+			totalSize += item.key.size() + item.output.size();
+		else
+			break;
+
+		keep = i - 1;
+	}
+
+	std::string targetPath = replaceExtension(path, ".qgr");
+	// concurrent searches write their own temporary files, and the last one to finish replaces the cache
+	std::string tempPath = getTempPath(targetPath.c_str());
+
+	{
+		FileStream out(tempPath.c_str(), "wb");
+		if (!out)
+			return false;
+
+		uint32_t entryCount = 1;
+
+		for (size_t i = keep; i < items.size(); ++i)
+			entryCount += !items[i].key.empty();
+
+		ResultCacheHeader header = {};
+		memcpy(header.magic, kResultCacheHeaderMagic, sizeof(header.magic));
+		header.entryCount = entryCount;
+
+		out.write(&header, sizeof(header));
+
+		for (size_t i = keep; i <= items.size(); ++i)
+		{
+			const std::string& itemKey = i < items.size() ? items[i].key : key;
+			const std::string& itemOutput = i < items.size() ? items[i].output : result;
+
+			if (itemKey.empty())
+				continue;
+
+			ResultCacheEntry entry = {};
+			entry.keyLength = itemKey.size();
+			entry.outputLength = itemOutput.size();
+			entry.matchCount = i < items.size() ? items[i].matchCount : matchCount;
+
+			out.write(&entry, sizeof(entry));
+			out.write(itemKey.data(), itemKey.size());
+			out.write(itemOutput.data(), itemOutput.size());
+		}
+	}
+
+	if (!renameFile(tempPath.c_str(), targetPath.c_str()))
+	{
+		removeFile(tempPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+void removeResultCache(const char* path)
+{
+	removeFile(replaceExtension(path, ".qgr").c_str());
+}
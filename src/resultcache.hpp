@@ -0,0 +1,20 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Output of repeated searches is cached in a file next to the data file of the first project if the project enables it; entries are keyed by
+// the query and by stamps of all files the output depends on (data files, change lists, side packs and changed files).
+// The cache is removed whenever the project is rebuilt or its change list is written, and old entries are dropped once it grows too large.
+bool isResultCacheEnabled(const char* path);
+
+// Modification times only change once a second or less often, so a file that changes again right after the search keeps its stamp;
+// recent is set if any of the files was modified too recently to tell, and the output shouldn't be cached then
+std::string getResultCacheKey(const std::vector<std::string>& files, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude,
+	bool& recent);
+
+bool readResultCache(const char* path, const std::string& key, std::string& result, unsigned int& matchCount);
+bool writeResultCache(const char* path, const std::string& key, const std::string& result, unsigned int matchCount);
+
+void removeResultCache(const char* path);
@@ -6,6 +6,7 @@
 #include "format.hpp"
 #include "fileutil.hpp"
 #include "filestream.hpp"
+#include "datafile.hpp"
 #include "workqueue.hpp"
 #include "regex.hpp"
 #include "orderedoutput.hpp"
@@ -17,31 +18,182 @@
 #include "highlight.hpp"
 #include "compression.hpp"
 #include "changes.hpp"
+#include "postings.hpp"
+#include "chunkcache.hpp"
+#include "resultcache.hpp"
 
 #include <algorithm>
+#include <iterator>
 #include <memory>
+#include <atomic>
+#include <chrono>
+
+SearchStatistics::SearchStatistics()
+	: prefilterTime(0), readTime(0), decompressTime(0), searchTime(0), outputTime(0), changeReadTime(0), queueWaitTime(0)
+	, chunksSkipped(0), chunksCached(0), chunksDecompressed(0), chunksSearched(0), bytesSearched(0)
+	, filesSearched(0), filesSkipped(0), filesDeduplicated(0), changesRead(0), changeBytesRead(0), regexCalls(0), matches(0)
+{
+}
+
+// Adds the lifetime of the timer to one of the statistics counters; does nothing if statistics are not collected
+struct SearchTimer
+{
+	SearchTimer(SearchStatistics* statistics, std::atomic<uint64_t> SearchStatistics::* counter)
+		: counter(statistics ? &(statistics->*counter) : nullptr), start(statistics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point())
+	{
+	}
+
+	~SearchTimer()
+	{
+		if (counter)
+			*counter += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	std::atomic<uint64_t>* counter;
+	std::chrono::steady_clock::time_point start;
+};
+
+// Lock-free set of file content hashes that have no matches; once the set is full, new hashes are dropped
+class ContentHashSet
+{
+public:
+	ContentHashSet(size_t capacity): capacity(capacity), data(new (std::nothrow) std::atomic<uint64_t>[capacity])
+	{
+		assert((capacity & (capacity - 1)) == 0);
+
+		if (data)
+			for (size_t i = 0; i < capacity; ++i)
+				data[i] = 0;
+	}
+
+	bool contains(uint64_t hash) const
+	{
+		if (!data)
+			return false;
+
+		for (size_t i = 0; i < kProbeCount; ++i)
+		{
+			uint64_t value = data[(hash + i) & (capacity - 1)].load(std::memory_order_relaxed);
+
+			if (value == hash)
+				return true;
+			if (value == 0)
+				return false;
+		}
+
+		return false;
+	}
+
+	void insert(uint64_t hash)
+	{
+		if (!data)
+			return;
+
+		for (size_t i = 0; i < kProbeCount; ++i)
+		{
+			uint64_t expected = 0;
+
+			if (data[(hash + i) & (capacity - 1)].compare_exchange_strong(expected, hash, std::memory_order_relaxed) || expected == hash)
+				return;
+		}
+	}
+
+private:
+	static const size_t kProbeCount = 8;
+
+	size_t capacity;
+	std::unique_ptr<std::atomic<uint64_t>[]> data;
+};
+
+// Separators around line and column numbers of matches, with highlighting and Visual Studio formatting applied; they only depend on the
+// search options, so they are prepared once per search instead of for every match
+struct MatchFormat
+{
+	std::string lineBegin;
+	std::string column;
+	std::string lineEnd;
+
+	explicit MatchFormat(unsigned int options)
+	{
+		const char* highlightSeparator = (options & SO_HIGHLIGHT) ? kHighlightSeparator : "";
+		const char* highlightNumber = (options & SO_HIGHLIGHT) ? kHighlightNumber : "";
+
+		const char* sepbeg = (options & SO_VISUALSTUDIO) ? "(" : ":";
+		const char* sepmid = (options & SO_VISUALSTUDIO) ? "," : ":";
+		const char* sepend = (options & SO_VISUALSTUDIO) ? "):" : ":";
+
+		lineBegin = std::string(highlightSeparator) + sepbeg + highlightNumber;
+		column = std::string(highlightSeparator) + sepmid + highlightNumber;
+		lineEnd = std::string(highlightSeparator) + sepend + ((options & SO_HIGHLIGHT) ? kHighlightEnd : "");
+	}
+};
 
 struct SearchOutput
 {
-	SearchOutput(Output* output, unsigned int options, unsigned int limit): options(options), limit(limit), output(output, kMaxBufferedOutput, kBufferedOutputFlushThreshold, limit)
+	SearchOutput(Output* output, unsigned int options, unsigned int limit, RegexSet* patterns = nullptr, const std::vector<unsigned int>* patternLines = nullptr, SearchStatistics* statistics = nullptr)
+		: options(options), limit(limit), format(options), patterns(patterns), patternLines(patternLines), statistics(statistics), target(output), output(output, kMaxBufferedOutput, kBufferedOutputFlushThreshold, limit, kBufferedOutputWindow)
+		, emptyContents(kSearchContentSetSize)
 	{
 	}
 
+	// cancelled searches are treated as searches that reached the limit, so that all stages stop as soon as possible
 	bool isLimitReached(OrderedOutput::Chunk* outputChunk = nullptr) const
 	{
-		return (outputChunk && outputChunk->lines >= limit) || output.getLineCount() >= limit;
+		return (outputChunk && outputChunk->lines >= limit) || output.getLineCount() >= limit || target->isCancelled();
 	}
 
 	unsigned int options;
 	unsigned int limit;
+
+	MatchFormat format;
+
+	// multi-pattern searches tag each match with pattern file lines of all patterns that match the line
+	RegexSet* patterns;
+	const std::vector<unsigned int>* patternLines;
+
+	SearchStatistics* statistics;
+
+	Output* target;
 	OrderedOutput output;
+
+	// contents of the files that were searched without matches; copies of these files are skipped
+	ContentHashSet emptyContents;
 };
 
 struct HighlightBuffer
 {
 	std::vector<HighlightRange> ranges;
+	std::vector<int> patterns;
+
+	// output prefix for matches in the current file (path with highlighting and formatting applied)
+	std::string pathPrefix;
+
+	// index of the database chunk that stores the current file; changed files are searched on disk or in the side pack instead
+	size_t dataChunk = ~size_t(0);
+
+	// per-file counters are added to search statistics once per chunk so that worker threads don't contend on them
+	uint64_t filesSearched = 0;
+	uint64_t filesSkipped = 0;
+	uint64_t filesDeduplicated = 0;
+	uint64_t regexCalls = 0;
+
+	// in file list and count modes, matches in the parts of a file that continues in the next chunk of the task
+	unsigned int fileMatches = 0;
 };
 
+static void flushCounters(SearchOutput* output, HighlightBuffer& hlbuf)
+{
+	if (output->statistics)
+	{
+		output->statistics->filesSearched += hlbuf.filesSearched;
+		output->statistics->filesSkipped += hlbuf.filesSkipped;
+		output->statistics->filesDeduplicated += hlbuf.filesDeduplicated;
+		output->statistics->regexCalls += hlbuf.regexCalls;
+	}
+
+	hlbuf.filesSearched = hlbuf.filesSkipped = hlbuf.filesDeduplicated = hlbuf.regexCalls = 0;
+}
+
 static char* printString(char* dest, const char* src)
 {
 	while (*src) *dest++ = *src++;
@@ -65,88 +217,278 @@ static char* printNumber(char* dest, unsigned int value)
 	return printString(dest, end);
 }
 
-static size_t printMatchLineColumn(unsigned int line, size_t matchOffset, size_t matchLength, unsigned int options, char (&buf)[256])
+// Match ranges refer to the entire line, but only the [begin, end) part of it is printed; ranges that start outside of it are dropped,
+// except the first one which the part is centered on
+static void printHighlightMatch(std::string& result, HighlightBuffer& hlbuf, const char* line, size_t begin, size_t end)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < hlbuf.ranges.size(); ++i)
+	{
+		HighlightRange range = hlbuf.ranges[i];
+
+		if (i == 0 || (range.first >= begin && range.first < end))
+			hlbuf.ranges[count++] = HighlightRange(range.first - begin, std::min(range.second, end - range.first));
+	}
+
+	highlight(result, line + begin, end - begin, count ? &hlbuf.ranges[0] : nullptr, count, kHighlightMatch);
+}
+
+static void appendNumber(std::string& result, size_t value)
+{
+	char buf[32];
+	*printNumber(buf, static_cast<unsigned int>(value)) = 0;
+
+	result += buf;
+}
+
+static void printPatternTags(std::string& result, SearchOutput* output, HighlightBuffer& hlbuf, const char* line, size_t lineLength)
+{
+	output->patterns->match(line, lineLength, hlbuf.patterns);
+
+	result += '[';
+
+	for (size_t i = 0; i < hlbuf.patterns.size(); ++i)
+	{
+		if (i != 0) result += ',';
+
+		appendNumber(result, (*output->patternLines)[hlbuf.patterns[i]]);
+	}
+
+	result += "]:";
+}
+
+static void appendJsonString(std::string& result, const char* data, size_t size)
+{
+	static const char kHexDigits[] = "0123456789abcdef";
+
+	result += '"';
+
+	// bytes outside of ASCII are copied as is, so output is valid JSON as long as the source files are UTF-8
+	for (size_t i = 0; i < size; ++i)
+	{
+		unsigned char ch = static_cast<unsigned char>(data[i]);
+
+		if (ch == '"' || ch == '\\')
+		{
+			result += '\\';
+			result += ch;
+		}
+		else if (ch == '\t')
+			result += "\\t";
+		else if (ch < 32 || ch == 127)
+		{
+			result += "\\u00";
+			result += kHexDigits[ch >> 4];
+			result += kHexDigits[ch & 15];
+		}
+		else
+			result += ch;
+	}
+
+	result += '"';
+}
+
+// Prints one JSON object per line with byte ranges of all matches in the line, for example
+// {"path":"src/main.cpp","chunk":3,"line":42,"ranges":[[4,9]],"text":"int main()"}
+// The chunk is omitted for changed files, since they are not read from the database
+static void processMatchJson(SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
+	const char* line, size_t lineLength, unsigned int lineNumber)
 {
-	char* pos = buf;
+	std::string& result = outputChunk->result;
+
+	result += hlbuf.pathPrefix;
+
+	if (hlbuf.dataChunk != ~size_t(0))
+	{
+		result += ",\"chunk\":";
+		appendNumber(result, hlbuf.dataChunk);
+	}
+
+	result += ",\"line\":";
+	appendNumber(result, lineNumber);
 
-	size_t matchStartColumn = matchOffset + 1;
-	size_t matchEndColumn = matchStartColumn + matchLength;
+	result += ",\"ranges\":[";
 
-	const char* sepbeg = (options & SO_VISUALSTUDIO) ? "(" : ":";
-	const char* sepmid = (options & SO_VISUALSTUDIO) ? "," : ":";
-	const char* sepend = (options & SO_VISUALSTUDIO) ? "):" : ":";
+	for (size_t i = 0; i < hlbuf.ranges.size(); ++i)
+	{
+		if (i != 0) result += ',';
 
-	if (options & SO_HIGHLIGHT) pos = printString(pos, kHighlightSeparator);
-	pos = printString(pos, sepbeg);
+		result += '[';
+		appendNumber(result, hlbuf.ranges[i].first);
+		result += ',';
+		appendNumber(result, hlbuf.ranges[i].first + hlbuf.ranges[i].second);
+		result += ']';
+	}
 
-	if (options & SO_HIGHLIGHT) pos = printString(pos, kHighlightNumber);
-	pos = printNumber(pos, line);
+	result += ']';
 
-	if (options & SO_COLUMNNUMBER)
+	if (output->patterns)
 	{
-		if (options & SO_HIGHLIGHT) pos = printString(pos, kHighlightSeparator);
-		pos = printString(pos, sepmid);
+		output->patterns->match(line, lineLength, hlbuf.patterns);
 
-		if (options & SO_HIGHLIGHT) pos = printString(pos, kHighlightNumber);
-		pos = printNumber(pos, matchStartColumn);
+		result += ",\"patterns\":[";
 
-		if (options & SO_COLUMNNUMBEREND)
+		for (size_t i = 0; i < hlbuf.patterns.size(); ++i)
 		{
-			if (options & SO_HIGHLIGHT) pos = printString(pos, kHighlightSeparator);
-			pos = printString(pos, sepmid);
+			if (i != 0) result += ',';
 
-			if (options & SO_HIGHLIGHT) pos = printString(pos, kHighlightNumber);
-			pos = printNumber(pos, matchEndColumn);
+			appendNumber(result, (*output->patternLines)[hlbuf.patterns[i]]);
 		}
+
+		result += ']';
+	}
+
+	result += ",\"text\":";
+	appendJsonString(result, line, lineLength);
+
+	result += "}\n";
+
+	output->output.write(outputChunk);
+}
+
+static void preparePathPrefix(std::string& result, SearchOutput* output, const char* path, size_t pathLength)
+{
+	result.clear();
+
+	if (output->options & SO_JSON)
+	{
+		result += "{\"path\":";
+		appendJsonString(result, path, pathLength);
+		return;
 	}
 
-	if (options & SO_HIGHLIGHT) pos = printString(pos, kHighlightSeparator);
-	pos = printString(pos, sepend);
+	if (output->options & SO_HIGHLIGHT) result += kHighlightPath;
+
+	if (output->options & SO_VISUALSTUDIO)
+		std::transform(path, path + pathLength, std::back_inserter(result), BackSlashTransformer());
+	else
+		result.append(path, pathLength);
+}
 
-	assert(pos <= buf + sizeof(buf));
-	return pos - buf;
+static bool isUTF8Continuation(char ch)
+{
+	return (static_cast<unsigned char>(ch) & 0xc0) == 0x80;
 }
 
-static void printHighlightMatch(std::string& result, Regex* re, HighlightBuffer& hlbuf, const char* line, size_t lineLength, const char* preparedRange, size_t matchOffset, size_t matchLength)
+// Cuts the line to the context around the match, without splitting UTF-8 sequences
+static void getMatchWindow(const char* line, size_t lineLength, size_t matchOffset, size_t matchLength, size_t& begin, size_t& end)
 {
-	hlbuf.ranges.clear();
-	hlbuf.ranges.push_back(HighlightRange(matchOffset, matchLength));
-	highlightRegex(hlbuf.ranges, re, line, lineLength, preparedRange, matchOffset + matchLength);
+	size_t matchEnd = matchOffset + std::min(matchLength, kMatchWindowMaxMatch);
+
+	begin = matchOffset > kMatchWindowContext ? matchOffset - kMatchWindowContext : 0;
+	end = std::min(lineLength, matchEnd + kMatchWindowContext);
 
-	highlight(result, line, lineLength, hlbuf.ranges.empty() ? nullptr : &hlbuf.ranges[0], hlbuf.ranges.size(), kHighlightMatch);
+	while (begin > 0 && begin < matchOffset && isUTF8Continuation(line[begin]))
+		begin++;
+
+	while (end < lineLength && end > matchOffset && isUTF8Continuation(line[end]))
+		end--;
 }
 
-static void processMatch(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
-	const char* path, size_t pathLength, const char* line, size_t lineLength, unsigned int lineNumber,
-	const char* preparedRange, size_t matchOffset, size_t matchLength)
+// Matching lines are printed as text, as text with all matches in the line highlighted, or as JSON objects; the kind is chosen once per file
+// so that the line loop and match formatting are compiled separately for each kind
+enum MatchKind
 {
-	if (output->options & SO_VISUALSTUDIO)
+	MK_TEXT,
+	MK_HIGHLIGHT,
+	MK_JSON
+};
+
+static MatchKind getMatchKind(unsigned int options)
+{
+	return (options & SO_JSON) ? MK_JSON : (options & SO_HIGHLIGHT_MATCHES) ? MK_HIGHLIGHT : MK_TEXT;
+}
+
+// For MK_HIGHLIGHT and MK_JSON, hlbuf.ranges has all matches in the line, starting with the one at matchOffset
+template <MatchKind Kind> static void processMatch(SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
+	const char* line, size_t lineLength, unsigned int lineNumber, size_t matchOffset, size_t matchLength)
+{
+	SearchTimer timer(output->statistics, &SearchStatistics::outputTime);
+
+	if (Kind == MK_JSON)
+		return processMatchJson(output, outputChunk, hlbuf, line, lineLength, lineNumber);
+
+	const MatchFormat& format = output->format;
+	std::string& result = outputChunk->result;
+
+	result += hlbuf.pathPrefix;
+	result += format.lineBegin;
+	appendNumber(result, lineNumber);
+
+	if (output->options & SO_COLUMNNUMBER)
 	{
-		char* buffer = static_cast<char*>(alloca(pathLength));
-		
-		std::transform(path, path + pathLength, buffer, BackSlashTransformer());
-		path = buffer;
+		result += format.column;
+		appendNumber(result, matchOffset + 1);
+
+		if (output->options & SO_COLUMNNUMBEREND)
+		{
+			result += format.column;
+			appendNumber(result, matchOffset + 1 + matchLength);
+		}
 	}
 
-	char linecolumn[256];
-	size_t linecolumnsize = printMatchLineColumn(lineNumber, matchOffset, matchLength, output->options, linecolumn);
+	result += format.lineEnd;
 
-	if (output->options & SO_HIGHLIGHT) outputChunk->result += kHighlightPath;
-	outputChunk->result.append(path, pathLength);
-	outputChunk->result.append(linecolumn, linecolumnsize);
-	if (output->options & SO_HIGHLIGHT) outputChunk->result += kHighlightEnd;
+	if (output->patterns)
+		printPatternTags(result, output, hlbuf, line, lineLength);
 
-	if (output->options & SO_HIGHLIGHT_MATCHES)
-		printHighlightMatch(outputChunk->result, re, hlbuf, line, lineLength, preparedRange, matchOffset, matchLength);
+	// column numbers and pattern tags refer to the entire line, but only the part of it around the match is printed
+	size_t begin = 0, end = lineLength;
+
+	if (output->options & SO_MATCHWINDOW)
+		getMatchWindow(line, lineLength, matchOffset, matchLength, begin, end);
+
+	if (begin > 0) result += "...";
+
+	if (Kind == MK_HIGHLIGHT)
+		printHighlightMatch(result, hlbuf, line, begin, end);
 	else
-		outputChunk->result.append(line, lineLength);
+		result.append(line + begin, end - begin);
+
+	if (end < lineLength) result += "...";
 
-	outputChunk->result += '\n';
+	result += '\n';
 
 	output->output.write(outputChunk);
 }
 
-static void processFileData(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
+// Counts matching lines without extracting or formatting them; file list mode only needs to know that there is a match
+static unsigned int countFileMatches(Regex* re, SearchOutput* output, HighlightBuffer& hlbuf, const char* data, size_t size)
+{
+	const char* range = re->rangePrepare(data, size);
+
+	const char* begin = range;
+	const char* end = begin + size;
+
+	unsigned int count = 0;
+
+	hlbuf.filesSearched++;
+	hlbuf.regexCalls++;
+
+	while (RegexMatch match = re->rangeSearch(begin, end - begin))
+	{
+		// discard zero-length matches at the end (.* results in an extra line for every file part otherwise)
+		if (match.data == end) break;
+
+		count++;
+
+		if (output->options & SO_FILESWITHMATCHES) break;
+
+		// move to next line
+		const char* lend = findLineEnd(match.data + match.size, end);
+		if (lend == end) break;
+		begin = lend + 1;
+
+		hlbuf.regexCalls++;
+	}
+
+	re->rangeFinalize(range);
+
+	return count;
+}
+
+template <MatchKind Kind> static unsigned int processFileLines(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
 	const char* path, size_t pathLength, const char* data, size_t size, unsigned int startLine)
 {
 	const char* range = re->rangePrepare(data, size);
@@ -155,8 +497,18 @@ static void processFileData(Regex* re, SearchOutput* output, OrderedOutput::Chun
 	const char* end = begin + size;
 
 	unsigned int line = startLine;
+	unsigned int matches = 0;
 
-	while (RegexMatch match = re->rangeSearch(begin, end - begin))
+	// highlighting and JSON need all matches in the line; the search continues after the first match instead of moving to the next line,
+	// and the first match that is past the end of the line is the match in the next matching line
+	const bool collectRanges = Kind != MK_TEXT;
+
+	hlbuf.filesSearched++;
+	hlbuf.regexCalls++;
+
+	RegexMatch match = re->rangeSearch(begin, end - begin);
+
+	while (match)
 	{
 		// discard zero-length matches at the end (.* results in an extra line for every file part otherwise)
 		if (match.data == end) break;
@@ -164,10 +516,42 @@ static void processFileData(Regex* re, SearchOutput* output, OrderedOutput::Chun
 		// update line counter
 		line += 1 + countLines(begin, match.data);
 		
-		// print match
+		// the path prefix is shared by all matches in the file
+		if (matches == 0)
+			preparePathPrefix(hlbuf.pathPrefix, output, path, pathLength);
+
 		const char* lbeg = findLineStart(begin, match.data);
 		const char* lend = findLineEnd(match.data + match.size, end);
-		processMatch(re, output, outputChunk, hlbuf, path, pathLength, (lbeg - range) + data, lend - lbeg, line, lbeg, match.data - lbeg, match.size);
+
+		RegexMatch next;
+
+		if (collectRanges)
+		{
+			hlbuf.ranges.clear();
+			hlbuf.ranges.push_back(HighlightRange(match.data - lbeg, match.size));
+
+			const char* from = match.data + match.size;
+
+			while (from <= end)
+			{
+				next = re->rangeSearch(from, end - from);
+				hlbuf.regexCalls++;
+
+				if (!next || next.data > lend)
+					break;
+
+				// zero-length matches are not highlighted, and the search skips over them
+				if (next.size)
+					hlbuf.ranges.push_back(HighlightRange(next.data - lbeg, next.size));
+
+				from = next.data + (next.size ? next.size : 1);
+				next = RegexMatch();
+			}
+		}
+
+		// print match
+		processMatch<Kind>(output, outputChunk, hlbuf, (lbeg - range) + data, lend - lbeg, line, match.data - lbeg, match.size);
+		matches++;
 		
 		// early-out for big matches
 		if (output->isLimitReached(outputChunk)) break;
@@ -175,9 +559,81 @@ static void processFileData(Regex* re, SearchOutput* output, OrderedOutput::Chun
 		// move to next line
 		if (lend == end) break;
 		begin = lend + 1;
+
+		if (collectRanges)
+			match = next;
+		else
+		{
+			match = re->rangeSearch(begin, end - begin);
+			hlbuf.regexCalls++;
+		}
 	}
 
 	re->rangeFinalize(range);
+
+	return matches;
+}
+
+// Returns the number of matching lines; in file list and count modes matches are only counted, see processFileMatches
+static unsigned int processFileData(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
+	const char* path, size_t pathLength, const char* data, size_t size, unsigned int startLine)
+{
+	if (output->options & (SO_FILESWITHMATCHES | SO_COUNT))
+		return countFileMatches(re, output, hlbuf, data, size);
+
+	switch (getMatchKind(output->options))
+	{
+	case MK_HIGHLIGHT:
+		return processFileLines<MK_HIGHLIGHT>(re, output, outputChunk, hlbuf, path, pathLength, data, size, startLine);
+
+	case MK_JSON:
+		return processFileLines<MK_JSON>(re, output, outputChunk, hlbuf, path, pathLength, data, size, startLine);
+
+	default:
+		return processFileLines<MK_TEXT>(re, output, outputChunk, hlbuf, path, pathLength, data, size, startLine);
+	}
+}
+
+// Prints the path of a file with matches in file list mode, and the path with the number of matching lines in count mode
+static void processFileMatches(SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf, const char* path, size_t pathLength, unsigned int count)
+{
+	if (count == 0 || (output->options & (SO_FILESWITHMATCHES | SO_COUNT)) == 0)
+		return;
+
+	SearchTimer timer(output->statistics, &SearchStatistics::outputTime);
+
+	preparePathPrefix(hlbuf.pathPrefix, output, path, pathLength);
+
+	std::string& result = outputChunk->result;
+
+	result += hlbuf.pathPrefix;
+
+	if (output->options & SO_JSON)
+	{
+		if (output->options & SO_COUNT)
+		{
+			result += ",\"count\":";
+			appendNumber(result, count);
+		}
+
+		result += "}\n";
+	}
+	else
+	{
+		if (output->options & SO_COUNT)
+		{
+			if (output->options & SO_HIGHLIGHT) result += kHighlightSeparator;
+			result += ':';
+
+			if (output->options & SO_HIGHLIGHT) result += kHighlightNumber;
+			appendNumber(result, count);
+		}
+
+		if (output->options & SO_HIGHLIGHT) result += kHighlightEnd;
+		result += '\n';
+	}
+
+	output->output.write(outputChunk);
 }
 
 static int comparePath(const std::string& path, const char* data, size_t size)
@@ -196,121 +652,121 @@ static bool ignorePath(const char* path, size_t size, Regex* includeRe, Regex* e
 	return false;
 }
 
-static size_t normalizeEOL(char* data, size_t size)
+// Contents of changed files from the side pack written by watch
+struct SearchSidePack
 {
-	// replace \r\n with \n, replace stray \r with \n
-	size_t result = 0;
-
-	for (size_t i = 0; i < size; ++i)
+	struct File
 	{
-		if (data[i] == '\r')
-		{
-			data[result++] = '\n';
-			if (i + 1 < size && data[i + 1] == '\n') i++;
-		}
-		else
-			data[result++] = data[i];
-	}
+		bool valid;
+		size_t offset;
+		size_t size;
 
-	return result;
-}
+		// large files are split between several chunks
+		unsigned int firstChunk;
+		unsigned int lastChunk;
+	};
+
+	struct Chunk
+	{
+		size_t indexOffset;
+		unsigned int indexSize;
+		unsigned int indexHashIterations;
+		unsigned int indexType;
+	};
+
+	// indexed like the change list; files that are not in the side pack have to be read from disk
+	std::vector<File> files;
+	std::vector<char> data;
+
+	std::vector<Chunk> chunks;
+	std::vector<unsigned char> index;
+};
 
-static void processChangedFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf, const std::string& path, Regex* includeRe, Regex* excludeRe)
+struct SearchChanges
 {
-	if (ignorePath(path.c_str(), path.size(), includeRe, excludeRe))
-		return;
+	const std::string* paths;
+	size_t count;
+	const SearchSidePack* sidePack;
 
-	std::unique_ptr<FILE, int(*)(FILE*)> file(openFile(path.c_str(), "rb"), fclose);
-	if (!file)
-		return;
+	// side pack chunks that can have matches according to their indices; empty if the query doesn't use indices
+	std::vector<char> chunkMatches;
+};
 
-	fseek(file.get(), 0, SEEK_END);
-	size_t length = ftell(file.get());
-	fseek(file.get(), 0, SEEK_SET);
+static bool processSidePackFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf, const std::string& path, const SearchChanges* changes, size_t index)
+{
+	if (index >= changes->sidePack->files.size() || !changes->sidePack->files[index].valid)
+		return false;
 
-	std::unique_ptr<char[]> data(new (std::nothrow) char[length]);
-	if (!data)
-		return;
+	const SearchSidePack::File& file = changes->sidePack->files[index];
 
-	if (fread(data.get(), 1, length, file.get()) != length)
-		return;
+	// every match is in one of the file parts, so the file can't match if none of its chunks can
+	bool possible = changes->chunkMatches.empty();
 
-	if (ferror(file.get()) != 0)
-		return;
+	for (unsigned int i = file.firstChunk; i <= file.lastChunk && !possible; ++i)
+		possible = changes->chunkMatches[i] != 0;
 
-	size_t nlength = normalizeEOL(data.get(), length);
+	if (possible)
+		processFileMatches(output, outputChunk, hlbuf, path.c_str(), path.size(),
+			processFileData(re, output, outputChunk, hlbuf, path.c_str(), path.size(), changes->sidePack->data.data() + file.offset, file.size, 0));
 
-	processFileData(re, output, outputChunk, hlbuf, path.c_str(), path.size(), data.get(), nlength, 0);
+	return true;
 }
 
-static void processChunkFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
-	const char* path, size_t pathLength, const char* data, size_t size, unsigned int startLine, Regex* includeRe, Regex* excludeRe)
+// Stored files of hot tier chunks are looked up in the entire change list since the changes are only merged with the rest of the chunks
+static bool isChangedPath(const SearchChanges* changes, const char* path, size_t length)
 {
-	if (ignorePath(path, pathLength, includeRe, excludeRe))
-		return;
+	const std::string* it = std::lower_bound(changes->paths, changes->paths + changes->count, std::make_pair(path, length),
+		[](const std::string& l, const std::pair<const char*, size_t>& r) { return comparePath(l, r.first, r.second) < 0; });
 
-	processFileData(re, output, outputChunk, hlbuf, path, pathLength, data, size, startLine);
+	return it != changes->paths + changes->count && comparePath(*it, path, length) == 0;
 }
 
-static void processChunk(Regex* re, SearchOutput* output, unsigned int chunkIndex, const DataChunkHeader& chunk, char* buffer, Regex* includeRe, Regex* excludeRe, const std::string* changes, size_t changeBegin, size_t changeEnd)
+static void processChangedFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf, const SearchChanges* changes, size_t index, Regex* includeRe, Regex* excludeRe)
 {
-	char* data = buffer + chunk.compressedSize;
+	const std::string& path = changes->paths[index];
 
-	decompress(data, chunk.uncompressedSize, buffer, chunk.compressedSize);
+	hlbuf.dataChunk = ~size_t(0);
 
-	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+	if (ignorePath(path.c_str(), path.size(), includeRe, excludeRe))
+		return;
 
-	OrderedOutput::Chunk* outputChunk = output->output.begin(chunkIndex);
+	if (processSidePackFile(re, output, outputChunk, hlbuf, path, changes, index))
+		return;
 
-	HighlightBuffer hlbuf;
+	std::unique_ptr<char[]> data;
+	size_t length = 0;
 
-	size_t changeIndex = changeBegin;
-
-	for (size_t i = 0; i < chunk.fileCount; ++i)
 	{
-		// early-out for big matches
-		if (output->isLimitReached(outputChunk))
-			break;
+		SearchTimer timer(output->statistics, &SearchStatistics::changeReadTime);
 
-		const DataChunkFileHeader& f = files[i];
+		std::unique_ptr<FILE, int(*)(FILE*)> file(openFile(path.c_str(), "rb"), fclose);
+		if (!file)
+			return;
 
-		while (changeIndex < changeEnd && comparePath(changes[changeIndex], data + f.nameOffset, f.nameLength) < 0)
-		{
-			processChangedFile(re, output, outputChunk, hlbuf, changes[changeIndex], includeRe, excludeRe);
-			changeIndex++;
-		}
+		fseek(file.get(), 0, SEEK_END);
+		length = ftell(file.get());
+		fseek(file.get(), 0, SEEK_SET);
 
-		if (changeIndex < changeEnd && comparePath(changes[changeIndex], data + f.nameOffset, f.nameLength) == 0)
-		{
-			processChangedFile(re, output, outputChunk, hlbuf, changes[changeIndex], includeRe, excludeRe);
-			changeIndex++;
-		}
-		else if (f.startLine > 0 && changeIndex > 0 && comparePath(changes[changeIndex-1], data + f.nameOffset, f.nameLength) == 0)
-		{
-			// This is a suffix of a file that started in the last chunk. This means if it was present in the change lists it has to be right before
-			// our change range (due to how getNextChange works), and this means we should have processed the changed file in the previous chunk - so
-			// here we should just skip it.
-		}
-		else
-		{
-			processChunkFile(re, output, outputChunk, hlbuf, data + f.nameOffset, f.nameLength, data + f.dataOffset, f.dataSize, f.startLine, includeRe, excludeRe);
-		}
+		data.reset(new (std::nothrow) char[length]);
+		if (!data)
+			return;
+
+		if (fread(data.get(), 1, length, file.get()) != length)
+			return;
+
+		if (ferror(file.get()) != 0)
+			return;
 	}
 
-	while (changeIndex < changeEnd)
+	if (output->statistics)
 	{
-		processChangedFile(re, output, outputChunk, hlbuf, changes[changeIndex], includeRe, excludeRe);
-		changeIndex++;
+		output->statistics->changesRead++;
+		output->statistics->changeBytesRead += length;
 	}
 
-	output->output.end(outputChunk);
-}
+	size_t nlength = normalizeEOL(data.get(), length);
 
-unsigned int getRegexOptions(unsigned int options)
-{
-	return
-		(options & SO_IGNORECASE ? RO_IGNORECASE : 0) |
-		(options & SO_LITERAL ? RO_LITERAL : 0);
+	processFileMatches(output, outputChunk, hlbuf, path.c_str(), path.size(), processFileData(re, output, outputChunk, hlbuf, path.c_str(), path.size(), data.get(), nlength, 0));
 }
 
 typedef std::vector<unsigned int> NgramString;
@@ -329,15 +785,52 @@ NgramString ngramExtract(const std::string& string)
 	return result;
 }
 
-bool ngramExists(const std::vector<unsigned char>& index, unsigned int iterations, const NgramString& search)
+NgramString bigramExtract(const std::string& string)
+{
+	NgramString result;
+
+	for (size_t i = 1; i < string.length(); ++i)
+		result.push_back(bigram(casefold(string[i - 1]), casefold(string[i])));
+
+	return result;
+}
+
+bool bigramExists(const unsigned char* filter, const NgramString& search)
+{
+	for (size_t i = 0; i < search.size(); ++i)
+		if (!bigramFilterExists(filter, search[i]))
+			return false;
+
+	return true;
+}
+
+template <bool (*exists)(const unsigned char*, unsigned int, unsigned int, unsigned int)>
+bool ngramExists(const unsigned char* index, size_t indexSize, unsigned int iterations, const NgramString& search)
 {
 	for (size_t i = 0; i < search.size(); ++i)
-		if (!bloomFilterExists(&index[0], index.size(), search[i], iterations))
+		if (!exists(index, indexSize, search[i], iterations))
 			return false;
 
 	return true;
 }
 
+bool ngramExists(const unsigned char* index, size_t indexSize, unsigned int iterations, unsigned int type, const NgramString& search)
+{
+	switch (type)
+	{
+	case IT_BLOOM:
+		return ngramExists<bloomFilterExists>(index, indexSize, iterations, search);
+
+	case IT_BLOOMBLOCKED:
+	case IT_BLOOMBLOCKED_BIGRAMS:
+		return ngramExists<bloomBlockedFilterExists>(index, indexSize, iterations, search);
+
+	default:
+		// unknown index type, can't reject the chunk
+		return true;
+	}
+}
+
 class NgramRegex
 {
 public:
@@ -348,22 +841,46 @@ public:
 		std::vector<std::string> atomstr = re->prefilterPrepare();
 
 		for (size_t i = 0; i < atomstr.size(); ++i)
+		{
 			atoms.push_back(ngramExtract(atomstr[i]));
+			trigramAtoms.push_back(trigramExtract(atomstr[i]));
+
+			// atoms that are too short for the bloom filter can still be checked against the bigram filter
+			bigramAtoms.push_back(atoms.back().empty() ? bigramExtract(atomstr[i]) : NgramString());
+		}
 	}
 
-	bool match(const std::vector<unsigned char>& index, unsigned int iterations) const
+	bool match(const unsigned char* index, size_t indexSize, unsigned int iterations, unsigned int type) const
 	{
 		if (atoms.empty()) return true;
 
+		const unsigned char* bigrams = nullptr;
+
+		if (type == IT_BLOOMBLOCKED_BIGRAMS)
+		{
+			// malformed index, can't reject the chunk
+			if (indexSize < kBigramFilterSize + kBloomBlockSize)
+				return true;
+
+			indexSize -= kBigramFilterSize;
+			bigrams = index + indexSize;
+		}
+
 		std::vector<int> matched;
 
 		for (size_t i = 0; i < atoms.size(); ++i)
-			if (ngramExists(index, iterations, atoms[i]))
+			if (ngramExists(index, indexSize, iterations, type, atoms[i]) && (!bigrams || bigramExists(bigrams, bigramAtoms[i])))
 				matched.push_back(i);
 
 		return re->prefilterMatch(matched);
 	}
 
+	// Marks chunks that may match using the project posting index; returns false if the index can't be used
+	bool matchPostings(const PostingIndex& postings, size_t chunkCount, std::vector<bool>& candidates) const
+	{
+		return postings.match(re, trigramAtoms, chunkCount, candidates);
+	}
+
 	bool empty() const
 	{
 		return atoms.empty();
@@ -371,9 +888,151 @@ public:
 
 private:
 	std::vector<NgramString> atoms;
+	std::vector<NgramString> trigramAtoms;
+	std::vector<NgramString> bigramAtoms;
 	Regex* re;
 };
 
+static bool matchFileSummary(const NgramRegex* ngregex, const char* data, size_t size, const DataChunkFileHeader& f)
+{
+	if (!ngregex || f.summaryOffset == 0)
+		return true;
+
+	DataChunkFileSummary summary;
+	if (f.summaryOffset > size || size - f.summaryOffset < sizeof(summary))
+		return true;
+
+	memcpy(&summary, data + f.summaryOffset, sizeof(summary));
+
+	if (summary.size > size - f.summaryOffset - sizeof(summary))
+		return true;
+
+	return ngregex->match(reinterpret_cast<const unsigned char*>(data + f.summaryOffset + sizeof(summary)), summary.size, summary.hashIterations, summary.type);
+}
+
+// Returns true if any file data stored in the chunk matched; continues is set if the last file continues in the next chunk processed with the same buffer
+// included has path filter results for all files in the chunk if they were checked before reading the chunk
+// Hot tier chunks have no change range; stored copies of changed files are skipped in them instead
+static bool processChunk(Regex* re, SearchOutput* output, unsigned int chunkIndex, size_t dataChunk, const DataChunkHeader& chunk, const char* data, Regex* includeRe, Regex* excludeRe, const NgramRegex* ngregex,
+	const SearchChanges* changes, size_t changeBegin, size_t changeEnd, bool hotTier, HighlightBuffer& hlbuf, bool continues, const char* included)
+{
+	SearchTimer timer(output->statistics, &SearchStatistics::searchTime);
+
+	if (output->statistics)
+	{
+		output->statistics->chunksSearched++;
+		output->statistics->bytesSearched += chunk.uncompressedSize;
+	}
+
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+
+	OrderedOutput::Chunk* outputChunk = output->output.begin(chunkIndex);
+
+	size_t changeIndex = changeBegin;
+	bool matched = false;
+
+	for (size_t i = 0; i < chunk.fileCount; ++i)
+	{
+		// early-out for big matches
+		if (output->isLimitReached(outputChunk))
+			break;
+
+		const DataChunkFileHeader& f = files[i];
+
+		while (changeIndex < changeEnd && comparePath(changes->paths[changeIndex], data + f.nameOffset, f.nameLength) < 0)
+		{
+			processChangedFile(re, output, outputChunk, hlbuf, changes, changeIndex, includeRe, excludeRe);
+			changeIndex++;
+		}
+
+		// in file list and count modes, matches in the parts of a file that is split between chunks are added up and printed after the last part
+		unsigned int fileMatches = (i == 0 && f.startLine > 0) ? hlbuf.fileMatches : 0;
+		hlbuf.fileMatches = 0;
+
+		if (changeIndex < changeEnd && comparePath(changes->paths[changeIndex], data + f.nameOffset, f.nameLength) == 0)
+		{
+			processChangedFile(re, output, outputChunk, hlbuf, changes, changeIndex, includeRe, excludeRe);
+			changeIndex++;
+		}
+		else if (f.startLine > 0 && changeIndex > 0 && comparePath(changes->paths[changeIndex-1], data + f.nameOffset, f.nameLength) == 0)
+		{
+			// This is a suffix of a file that started in the last chunk. This means if it was present in the change lists it has to be right before
+			// our change range (due to how getNextChange works), and this means we should have processed the changed file in the previous chunk - so
+			// here we should just skip it.
+		}
+		else if (hotTier && isChangedPath(changes, data + f.nameOffset, f.nameLength))
+		{
+			// changed files are searched along with the chunks of the cold tier
+		}
+		else if (included ? !included[i] : ignorePath(data + f.nameOffset, f.nameLength, includeRe, excludeRe))
+		{
+			// paths are filtered before the content checks so that only the contents of searched files are remembered as empty
+		}
+		else if (f.contentHash && output->emptyContents.contains(f.contentHash))
+		{
+			hlbuf.filesDeduplicated++;
+		}
+		else if (matchFileSummary(ngregex, data, chunk.uncompressedSize, f))
+		{
+			hlbuf.dataChunk = dataChunk;
+
+			unsigned int matches = processFileData(re, output, outputChunk, hlbuf, data + f.nameOffset, f.nameLength, data + f.dataOffset, f.dataSize, f.startLine);
+
+			// files that were cut short by the output limit can't be remembered as empty
+			if (matches == 0 && f.contentHash && !output->isLimitReached(outputChunk))
+				output->emptyContents.insert(f.contentHash);
+
+			matched |= matches > 0;
+			fileMatches += matches;
+		}
+		else
+		{
+			hlbuf.filesSkipped++;
+		}
+
+		if (continues && i + 1 == chunk.fileCount)
+			hlbuf.fileMatches = fileMatches;
+		else
+			processFileMatches(output, outputChunk, hlbuf, data + f.nameOffset, f.nameLength, fileMatches);
+	}
+
+	while (changeIndex < changeEnd && !output->isLimitReached(outputChunk))
+	{
+		processChangedFile(re, output, outputChunk, hlbuf, changes, changeIndex, includeRe, excludeRe);
+		changeIndex++;
+	}
+
+	flushCounters(output, hlbuf);
+
+	output->output.end(outputChunk);
+
+	return matched;
+}
+
+static void skipChunk(SearchOutput* output, unsigned int chunkIndex)
+{
+	// output chunks are ordered, so skipped chunks still need to be completed
+	output->output.end(output->output.begin(chunkIndex));
+}
+
+unsigned int getRegexOptions(unsigned int options)
+{
+	return
+		(options & SO_IGNORECASE ? RO_IGNORECASE : 0) |
+		(options & SO_LITERAL ? RO_LITERAL : 0);
+}
+
+static bool isLiteralQuery(const char* query, unsigned int options)
+{
+	return (options & SO_LITERAL) || strpbrk(query, "\\^$.|?*+()[]{}") == nullptr;
+}
+
+bool isQueryRefinement(const char* previous, const char* query, unsigned int options)
+{
+	// any line that contains the new string also contains the previous one
+	return isLiteralQuery(previous, options) && isLiteralQuery(query, options) && strstr(query, previous) != nullptr;
+}
+
 size_t getNextChange(const std::vector<std::string>& changes, size_t changeIt, const char* data, size_t size)
 {
 	while (changeIt < changes.size() && comparePath(changes[changeIt], data, size) <= 0)
@@ -382,123 +1041,1100 @@ size_t getNextChange(const std::vector<std::string>& changes, size_t changeIt, c
 	return changeIt;
 }
 
-template <typename T> static bool readVector(FileStream& in, std::vector<T>& data, size_t size)
+struct SearchProjectData
 {
-	try
+	SearchProjectData(): generation(0), indexBlock(nullptr)
 	{
-		data.resize(size);
+		lastSearch.valid = false;
 	}
-	catch (const std::bad_alloc&)
+
+	// unique for every opened data file; identifies chunk data in the chunk cache
+	uint64_t generation;
+
+	std::pair<uint64_t, uint64_t> dataStamp;
+	std::pair<uint64_t, uint64_t> changesStamp;
+	std::pair<uint64_t, uint64_t> sidePackStamp;
+
+	DataFileReader in;
+
+	std::vector<char> indexStorage;
+	const char* indexBlock;
+
+	std::vector<char> postingStorage;
+	PostingIndex postings;
+
+	std::vector<std::string> changes;
+	SearchSidePack sidePack;
+
+	// Chunks that matched the last search in this project; used to narrow down searches for refined queries
+	struct LastSearch
 	{
-		return false;
-	}
+		bool valid;
+		std::string query;
+		unsigned int options;
+		std::string include;
+		std::string exclude;
+		std::vector<char> chunks;
+	};
+
+	LastSearch lastSearch;
+};
+
+static void readSidePackChunk(SearchSidePack& pack, const std::vector<std::string>& changes, size_t& changeIt, unsigned int chunkIndex, const char* data, size_t fileCount)
+{
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
 
-	if (size && !read(in, &data[0], size * sizeof(T)))
+	for (size_t i = 0; i < fileCount; ++i)
 	{
+		const DataChunkFileHeader& f = files[i];
+
+		// the rest of a file from the previous chunk
+		if (f.startLine > 0 && changeIt > 0 && comparePath(changes[changeIt - 1], data + f.nameOffset, f.nameLength) == 0)
+		{
+			SearchSidePack::File& file = pack.files[changeIt - 1];
+
+			if (file.valid)
+			{
+				pack.data.insert(pack.data.end(), data + f.dataOffset, data + f.dataOffset + f.dataSize);
+				file.size += f.dataSize;
+				file.lastChunk = chunkIndex;
+			}
+
+			continue;
+		}
+
+		// both lists are sorted; side pack might not have some of the files in the change list
+		while (changeIt < changes.size() && comparePath(changes[changeIt], data + f.nameOffset, f.nameLength) < 0)
+			changeIt++;
+
+		if (changeIt < changes.size() && comparePath(changes[changeIt], data + f.nameOffset, f.nameLength) == 0)
+		{
+			SearchSidePack::File& file = pack.files[changeIt];
+
+			file.valid = true;
+			file.offset = pack.data.size();
+			file.size = f.dataSize;
+			file.firstChunk = file.lastChunk = chunkIndex;
+
+			pack.data.insert(pack.data.end(), data + f.dataOffset, data + f.dataOffset + f.dataSize);
+
+			changeIt++;
+		}
+	}
+}
+
+static bool readSidePack(SearchSidePack& pack, const char* path, const std::vector<std::string>& changes)
+{
+	DataFileReader in;
+	if (!in.open(path) || in.readTable() != DataFileReader::Table_Ok)
+		return false;
+
+	const DataFileHeader& header = in.getHeader();
+
+	std::vector<char> indexStorage;
+	const char* indexBlock = in.read(header.indexOffset, header.indexSize, indexStorage);
+
+	if (!indexBlock && header.indexSize)
 		return false;
+
+	pack.files.resize(changes.size());
+	pack.index.assign(indexBlock, indexBlock + header.indexSize);
+
+	std::vector<char> storage;
+	size_t changeIt = 0;
+
+	for (size_t i = 0; i < in.getChunkCount(); ++i)
+	{
+		const DataChunkTableEntry& entry = in.getChunk(i);
+		const DataChunkHeader& chunk = entry.header;
+
+		if (chunk.indexSize && (entry.indexOffset < header.indexOffset || entry.indexOffset - header.indexOffset + chunk.indexSize > header.indexSize))
+			return false;
+
+		SearchSidePack::Chunk pc = { size_t(entry.indexOffset - header.indexOffset), chunk.indexSize, chunk.indexHashIterations, chunk.indexType };
+		pack.chunks.push_back(pc);
+
+		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.uncompressedSize]);
+		const char* compressed = in.read(entry.dataOffset, chunk.compressedSize, storage);
+
+		if (!data || !compressed)
+			return false;
+
+		decompress(data.get(), chunk.uncompressedSize, compressed, chunk.compressedSize, chunk.codec, in.getDictionary(), in.getDictionarySize());
+
+		readSidePackChunk(pack, changes, changeIt, i, data.get(), chunk.fileCount);
 	}
 
 	return true;
 }
 
-unsigned int searchProject(Output* output_, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude)
+static std::shared_ptr<SearchProjectData> openProject(Output* output, const char* file, bool needIndex)
 {
-	SearchOutput output(output_, options, limit);
-	std::unique_ptr<Regex> regex(createRegex(string, getRegexOptions(options)));
-	std::unique_ptr<Regex> includeRe(include ? createRegex(include, RO_IGNORECASE) : 0);
-	std::unique_ptr<Regex> excludeRe(exclude ? createRegex(exclude, RO_IGNORECASE) : 0);
-	NgramRegex ngregex((options & SO_BRUTEFORCE) ? nullptr : regex.get());
+	static std::atomic<uint64_t> generation(0);
+
+	std::shared_ptr<SearchProjectData> project(new SearchProjectData());
+
+	project->generation = ++generation;
 
-	std::vector<std::string> changes = readChanges(file);
-	size_t changeIt = 0;
-	
 	std::string dataPath = replaceExtension(file, ".qgd");
-	FileStream in(dataPath.c_str(), "rb");
-	if (!in)
+	std::string changesPath = replaceExtension(file, ".qgc");
+
+	project->dataStamp = SearchContext::getFileStamp(dataPath);
+	std::string sidePackPath = replaceExtension(file, ".qgs");
+
+	project->changesStamp = SearchContext::getFileStamp(changesPath);
+	project->sidePackStamp = SearchContext::getFileStamp(sidePackPath);
+
+	project->changes = readChanges(file);
+
+	// side pack is optional; changed files are read from disk if it's missing or malformed
+	if (!project->changes.empty() && !readSidePack(project->sidePack, sidePackPath.c_str(), project->changes))
+		project->sidePack = SearchSidePack();
+
+	DataFileReader& in = project->in;
+	if (!in.open(dataPath.c_str()))
 	{
-		output_->error("Error reading data file %s\n", dataPath.c_str());
-		return 0;
+		output->error("Error reading data file %s\n", dataPath.c_str());
+		return std::shared_ptr<SearchProjectData>();
 	}
 	
-	DataFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+	DataFileReader::TableStatus status = in.readTable();
+
+	if (status != DataFileReader::Table_Ok)
 	{
-		output_->error("Error reading data file %s: file format is out of date, update the project to fix\n", dataPath.c_str());
-		return 0;
+		output->error(status == DataFileReader::Table_OutOfDate
+			? "Error reading data file %s: file format is out of date, update the project to fix\n"
+			: "Error reading data file %s: malformed chunk table\n", dataPath.c_str());
+		return std::shared_ptr<SearchProjectData>();
 	}
 
+	// All bloom indices are stored in one block; this reads it in one go if the file is not mapped
+	const DataFileHeader& header = in.getHeader();
+
+	project->indexBlock = needIndex ? in.read(header.indexOffset, header.indexSize, project->indexStorage) : nullptr;
+
+	if (needIndex && !project->indexBlock && header.indexSize)
 	{
-		unsigned int chunkIndex = 0;
+		output->error("Error reading data file %s: malformed chunk index\n", dataPath.c_str());
+		return std::shared_ptr<SearchProjectData>();
+	}
 
-		// Assume 50% compression ratio (it's usually much better)
-		BlockPool chunkPool(kChunkSize * 3 / 2);
+	// Posting index, if present, lets us find candidate chunks without looking at every chunk index
+	if (needIndex && header.postingSize)
+	{
+		const char* postingData = in.read(header.postingOffset, header.postingSize, project->postingStorage);
 
-		std::vector<char> extra;
-		std::vector<unsigned char> index;
-		DataChunkHeader chunk;
+		if (!postingData || !project->postings.open(postingData, header.postingSize))
+			project->postings = PostingIndex();
+	}
 
-		WorkQueue queue(WorkQueue::getIdealWorkerCount(), kMaxQueuedChunkData);
+	return project;
+}
 
-		while (!output.isLimitReached() && read(in, chunk))
-		{
-			if (!readVector(in, extra, chunk.extraSize))
-			{
-				output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
-				return 0;
-			}
+SearchContext::SearchContext(bool numa): numa(numa), shardIndex(0), shardCount(1)
+{
+}
 
-			size_t changeNext = getNextChange(changes, changeIt, extra.data(), extra.size());
+SearchContext::~SearchContext()
+{
+}
 
-			if (ngregex.empty() || chunk.indexSize == 0 || changeNext != changeIt)
-			{
-				in.skip(chunk.indexSize);
-			}
-			else
-			{
-				if (!readVector(in, index, chunk.indexSize))
-				{
-					output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
-					return 0;
-				}
+WorkQueue* SearchContext::getQueue()
+{
+	if (!queue)
+		queue.reset(new WorkQueue(WorkQueue::getIdealWorkerCount(), kMaxQueuedChunkData, numa));
 
-				if (!ngregex.match(index, chunk.indexHashIterations))
-				{
-					in.skip(chunk.compressedSize);
-					continue;
-				}
-			}
+	return queue.get();
+}
 
-			std::shared_ptr<char> data = chunkPool.allocate(chunk.compressedSize + chunk.uncompressedSize, std::nothrow);
+BlockPool* SearchContext::getChunkPool(unsigned int node)
+{
+	WorkQueue* queue = getQueue();
 
-			if (!data || !read(in, data.get(), chunk.compressedSize))
-			{
-				output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
-				return 0;
-			}
+	if (chunkPools.empty())
+		chunkPools.resize(queue->getNodeCount());
 
-			queue.push([=, &regex, &output, &includeRe, &excludeRe, &changes]() {
-				processChunk(regex.get(), &output, chunkIndex, chunk, data.get(), includeRe.get(), excludeRe.get(), changes.data(), changeIt, changeNext);
-			}, chunk.compressedSize + chunk.uncompressedSize);
+	assert(node < chunkPools.size());
 
-			chunkIndex++;
-			changeIt = changeNext;
-		}
+	if (!chunkPools[node])
+		chunkPools[node].reset(new BlockPool(kChunkSize * 3 / 2, /* largePages= */ true, queue->getNumaNode(node)));
 
-		if (changeIt < changes.size())
-		{
-			OrderedOutput::Chunk* chunk = output.output.begin(chunkIndex);
+	return chunkPools[node].get();
+}
 
-			HighlightBuffer hlbuf;
+void SearchContext::setShard(unsigned int index, unsigned int count)
+{
+	assert(index < count);
 
-			while (changeIt < changes.size())
-			{
-				processChangedFile(regex.get(), &output, chunk, hlbuf, changes[changeIt], includeRe.get(), excludeRe.get());
-				changeIt++;
-			}
+	shardIndex = index;
+	shardCount = count;
+}
 
-			output.output.end(chunk);
-		}
-	}
+std::pair<unsigned int, unsigned int> SearchContext::getShard() const
+{
+	return std::make_pair(shardIndex, shardCount);
+}
+
+ChunkCache* SearchContext::getChunkCache()
+{
+	if (!chunkCache)
+		chunkCache.reset(new ChunkCache(kChunkCacheSize));
+
+	return chunkCache.get();
+}
+
+void SearchContext::printStatistics(Output* output)
+{
+	ChunkCache::Statistics stats = getChunkCache()->getStatistics();
+
+	output->print("Chunk cache: %d chunks (%d Mb out of %d Mb), %llu hits, %llu misses, %llu evictions\n",
+		int(stats.count), int(stats.size / 1024 / 1024), int(stats.sizeLimit / 1024 / 1024), stats.hits, stats.misses, stats.evictions);
+
+	BlockPool::Statistics poolStats = {};
+
+	for (unsigned int node = 0; node < getQueue()->getNodeCount(); ++node)
+	{
+		BlockPool::Statistics nodeStats = getChunkPool(node)->getStatistics();
+
+		poolStats.liveBlocks += nodeStats.liveBlocks;
+		poolStats.freeBlocks += nodeStats.freeBlocks;
+		poolStats.slabSize += nodeStats.slabSize;
+		poolStats.allocations += nodeStats.allocations;
+		poolStats.heapAllocations += nodeStats.heapAllocations;
+	}
+
+	output->print("Chunk pool: %d blocks in use, %d free (%d Mb in slabs), %llu allocations, %llu oversized allocations\n",
+		int(poolStats.liveBlocks), int(poolStats.freeBlocks), int(poolStats.slabSize / 1024 / 1024), poolStats.allocations, poolStats.heapAllocations);
+
+	if (getQueue()->getNodeCount() > 1)
+		output->print("NUMA: %d nodes\n", getQueue()->getNodeCount());
+}
+
+std::shared_ptr<SearchProjectData> SearchContext::getProject(Output* output, const char* file)
+{
+	std::shared_ptr<SearchProjectData>& project = projects[file];
+
+	if (!project || project->dataStamp != getFileStamp(replaceExtension(file, ".qgd")) || project->changesStamp != getFileStamp(replaceExtension(file, ".qgc")) ||
+		project->sidePackStamp != getFileStamp(replaceExtension(file, ".qgs")))
+		project = openProject(output, file, /* needIndex= */ true);
+
+	return project;
+}
+
+std::pair<uint64_t, uint64_t> SearchContext::getFileStamp(const std::string& path)
+{
+	uint64_t mtime = 0, size = 0;
+
+	if (!getFileAttributes(path.c_str(), &mtime, &size))
+		return std::make_pair(0, 0);
+
+	return std::make_pair(mtime, size);
+}
+
+static bool readPatternFile(Output* output, const char* path, std::vector<std::string>& patterns, std::vector<unsigned int>& lines)
+{
+	std::unique_ptr<FILE, int(*)(FILE*)> file(openFile(path, "rb"), fclose);
+	if (!file)
+	{
+		output->error("Error opening pattern file %s\n", path);
+		return false;
+	}
+
+	std::string data;
+	char buffer[65536];
+	size_t readsize;
+
+	while ((readsize = fread(buffer, 1, sizeof(buffer), file.get())) > 0)
+		data.append(buffer, readsize);
+
+	data.resize(normalizeEOL(&data[0], data.size()));
+
+	// every non-empty line is a pattern; patterns are identified by line numbers in the output
+	unsigned int line = 0;
+
+	for (size_t offset = 0; offset < data.size(); )
+	{
+		size_t end = data.find('\n', offset);
+		if (end == std::string::npos) end = data.size();
+
+		line++;
+
+		if (end > offset)
+		{
+			patterns.push_back(data.substr(offset, end - offset));
+			lines.push_back(line);
+		}
+
+		offset = end + 1;
+	}
+
+	if (patterns.empty())
+	{
+		output->error("Error reading pattern file %s: file has no patterns\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+// Per-project state of a search; chunk tasks refer to it, so it has to live until the queue is drained
+struct SearchProjectState
+{
+	std::string file;
+	std::shared_ptr<SearchProjectData> project;
+
+	SearchChanges changes;
+
+	// chunks with matches are remembered for refined queries if the project is kept in a search context
+	bool refine;
+	std::vector<char> matchedChunks;
+};
+
+// Shared state of a search over one or more projects
+struct SearchQuery
+{
+	SearchOutput* output;
+	Regex* regex;
+	Regex* includeRe;
+	Regex* excludeRe;
+	const NgramRegex* ngregex;
+
+	WorkQueue* queue;
+	ChunkCache* chunkCache;
+	SearchStatistics* statistics;
+
+	// one pool per node of the queue; chunk groups alternate between nodes, and are read into the pool of the node that searches them
+	std::vector<BlockPool*> chunkPools;
+	unsigned int nextNode;
+
+	// output chunk ids continue across projects, so that the output of all projects is ordered and shares the line limit
+	unsigned int chunkIndex;
+
+	unsigned int shardIndex;
+	unsigned int shardCount;
+};
+
+// Chunk that is searched by a task, along with the changed files that come before its last file
+struct SearchChunk
+{
+	unsigned int outputIndex;
+	size_t index;
+	DataChunkHeader header;
+	uint64_t dataOffset;
+
+	// uncompressed data for cached chunks; otherwise compressed data (unless it's read from the mapping) followed by uncompressed data
+	std::shared_ptr<char> data;
+	size_t dataSize;
+	const char* compressed;
+	bool cached;
+
+	size_t changeBegin;
+	size_t changeEnd;
+	bool hotTier;
+
+	// the last file of the chunk continues in the next chunk of the task
+	bool continues;
+
+	// path filter results for all files in the chunk; empty if the chunk has no path table or the search has no path filters
+	std::vector<char> included;
+};
+
+// Matches paths from the chunk path table against include/exclude filters; returns false if the table is malformed
+static bool matchChunkPaths(const char* paths, size_t size, size_t fileCount, Regex* includeRe, Regex* excludeRe, std::vector<char>& included)
+{
+	included.reserve(fileCount);
+
+	const char* end = paths + size;
+
+	for (const char* path = paths; path < end; )
+	{
+		const char* pathEnd = static_cast<const char*>(memchr(path, '\n', end - path));
+		if (!pathEnd)
+			return false;
+
+		included.push_back(!ignorePath(path, pathEnd - path, includeRe, excludeRe));
+
+		path = pathEnd + 1;
+	}
+
+	return included.size() == fileCount;
+}
+
+// Returns true if the last file of the chunk continues in the next chunk
+static bool isChunkSplit(const DataFileReader& in, size_t index)
+{
+	if (index + 1 >= in.getChunkCount())
+		return false;
+
+	size_t lastNameLength = in.getChunk(index).header.extraSize;
+
+	return in.getChunk(index + 1).firstNameLength == lastNameLength && memcmp(in.getChunkFirstName(index + 1), in.getChunkLastName(index), lastNameLength) == 0;
+}
+
+// Chunks are split between shards evenly, and every boundary is moved past the chunks that continue a file from the previous shard
+static size_t getShardBoundary(const DataFileReader& in, unsigned int shard, unsigned int shardCount)
+{
+	size_t result = size_t(uint64_t(in.getChunkCount()) * shard / shardCount);
+
+	while (result > 0 && result < in.getChunkCount() && isChunkSplit(in, result - 1))
+		result++;
+
+	return result;
+}
+
+// Queues tasks for all project chunks that may have matches; returns false if the data file is malformed
+static bool searchProjectChunks(Output* output_, SearchQuery& query, SearchProjectState& state)
+{
+	SearchOutput& output = *query.output;
+	SearchStatistics* statistics = query.statistics;
+	const NgramRegex& ngregex = *query.ngregex;
+
+	SearchProjectData* project = state.project.get();
+
+	DataFileReader& in = project->in;
+	const DataFileHeader& header = in.getHeader();
+	const std::vector<std::string>& changes = project->changes;
+	size_t changeIt = 0;
+
+	// hot tier chunks precede the rest of the chunks and are sorted separately, so changes are only merged with the chunks after them
+	size_t hotChunkCount = header.hotChunkCount;
+
+	// changed files are searched by the shard that has the chunk they'd be stored in, or by the last shard if they go after all chunks
+	size_t chunkBegin = getShardBoundary(in, query.shardIndex, query.shardCount);
+	size_t chunkEnd = getShardBoundary(in, query.shardIndex + 1, query.shardCount);
+	bool lastShard = query.shardIndex + 1 == query.shardCount;
+
+	if (chunkBegin > hotChunkCount)
+		changeIt = getNextChange(changes, changeIt, in.getChunkLastName(chunkBegin - 1), in.getChunk(chunkBegin - 1).header.extraSize);
+
+	if (!ngregex.empty())
+		for (auto& chunk: project->sidePack.chunks)
+			state.changes.chunkMatches.push_back(chunk.indexSize == 0 || ngregex.match(&project->sidePack.index[chunk.indexOffset], chunk.indexSize, chunk.indexHashIterations, chunk.indexType));
+
+	std::string dataPath = replaceExtension(state.file.c_str(), ".qgd");
+
+	const char* indexBlock = ngregex.empty() ? nullptr : project->indexBlock;
+
+	std::vector<bool> postingCandidates;
+	bool postingMatch = false;
+
+	{
+		SearchTimer timer(statistics, &SearchStatistics::prefilterTime);
+
+		postingMatch = !ngregex.empty() && !project->postings.empty() && ngregex.matchPostings(project->postings, in.getChunkCount(), postingCandidates);
+	}
+
+	const SearchProjectData::LastSearch& lastSearch = project->lastSearch;
+
+	// Decompressed chunks are kept between searches if possible
+	ChunkCache* chunkCache = query.chunkCache;
+	uint64_t generation = project->generation;
+
+	const char* dictionary = in.getDictionary();
+	size_t dictionarySize = in.getDictionarySize();
+
+	Regex* regex = query.regex;
+	Regex* includeRe = query.includeRe;
+	Regex* excludeRe = query.excludeRe;
+	const NgramRegex* chunkNgregex = ngregex.empty() ? nullptr : &ngregex;
+	const SearchChanges* searchChanges = &state.changes;
+	std::vector<char>& matchedChunks = state.matchedChunks;
+
+	// In file list and count modes, chunks that share a file are searched by one task so that the matches in all parts of the file can be added up
+	bool mergeSplitFiles = (output.options & (SO_FILESWITHMATCHES | SO_COUNT)) != 0;
+
+	// set if the last file of the last queued chunk continues in the chunks that follow
+	bool splitOpen = false;
+
+	std::shared_ptr<std::vector<SearchChunk>> group;
+	size_t groupSize = 0;
+	unsigned int groupNode = 0;
+
+	std::vector<char> pathStorage;
+
+	// Index results: 0 if the chunk wasn't checked yet, otherwise one of the values below
+	enum { Index_Match = 1, Index_Skip, Index_Malformed };
+
+	std::vector<char> indexResults(indexBlock ? in.getChunkCount() : 0);
+
+	auto checkIndex = [&](size_t i) -> char {
+		char& result = indexResults[i];
+
+		if (result == 0)
+		{
+			const DataChunkTableEntry& entry = in.getChunk(i);
+			uint64_t indexOffset = entry.indexOffset - header.indexOffset;
+
+			if (entry.indexOffset < header.indexOffset || indexOffset + entry.header.indexSize > header.indexSize)
+				result = Index_Malformed;
+			else
+				result = ngregex.match(reinterpret_cast<const unsigned char*>(indexBlock + indexOffset), entry.header.indexSize, entry.header.indexHashIterations, entry.header.indexType)
+					? Index_Match : Index_Skip;
+		}
+
+		return result;
+	};
+
+	// Chunks ahead of the one being read are checked against the indices early, and the data of the ones that pass is prefetched,
+	// so that storage with high latency has many reads in flight instead of one; chunks with changes or filtered paths may be missed
+	size_t prefetchNext = 0;
+	uint64_t prefetchSize = 0;
+	std::vector<char> prefetched(in.getChunkCount());
+
+	auto prefetchChunks = [&](size_t current) {
+		SearchTimer timer(statistics, &SearchStatistics::prefilterTime);
+
+		if (prefetched[current])
+			prefetchSize -= in.getChunk(current).header.compressedSize;
+
+		prefetchNext = std::max(prefetchNext, current + 1);
+
+		// adjacent chunks are prefetched with one request
+		uint64_t rangeBegin = 0, rangeEnd = 0;
+
+		while (prefetchNext < chunkEnd && prefetchSize < kMaxPrefetchedChunkData)
+		{
+			size_t i = prefetchNext++;
+			const DataChunkTableEntry& entry = in.getChunk(i);
+
+			if ((postingMatch && !postingCandidates[i]) || (state.refine && !lastSearch.chunks[i]) || (indexBlock && entry.header.indexSize != 0 && checkIndex(i) == Index_Skip))
+				continue;
+
+			if (rangeEnd != entry.dataOffset)
+			{
+				if (rangeEnd > rangeBegin)
+					in.prefetch(rangeBegin, rangeEnd - rangeBegin);
+
+				rangeBegin = entry.dataOffset;
+			}
+
+			rangeEnd = entry.dataOffset + entry.header.compressedSize;
+
+			prefetched[i] = true;
+			prefetchSize += entry.header.compressedSize;
+		}
+
+		if (rangeEnd > rangeBegin)
+			in.prefetch(rangeBegin, rangeEnd - rangeBegin);
+	};
+
+	auto pushGroup = [&]() {
+		if (!group)
+			return;
+
+		std::shared_ptr<std::vector<SearchChunk>> chunks;
+		chunks.swap(group);
+
+		SearchTimer timer(statistics, &SearchStatistics::queueWaitTime);
+
+		query.queue->push([=, &output, &matchedChunks]() {
+			HighlightBuffer hlbuf;
+
+			for (const SearchChunk& c: *chunks)
+			{
+				// once the output has enough lines in order, queued chunks can't contribute to it anymore
+				if (output.isLimitReached())
+				{
+					skipChunk(&output, c.outputIndex);
+					continue;
+				}
+
+				const char* data = c.data.get();
+
+				if (!c.cached)
+				{
+					char* uncompressed = c.data.get() + (c.dataSize - c.header.uncompressedSize);
+
+					{
+						SearchTimer timer(output.statistics, &SearchStatistics::decompressTime);
+
+						decompress(uncompressed, c.header.uncompressedSize, c.compressed ? c.compressed : c.data.get(), c.header.compressedSize, c.header.codec, dictionary, dictionarySize);
+					}
+
+					if (output.statistics)
+						output.statistics->chunksDecompressed++;
+
+					if (chunkCache)
+						chunkCache->insert(generation, c.dataOffset, std::shared_ptr<char>(c.data, uncompressed), c.dataSize);
+
+					data = uncompressed;
+				}
+
+				if (processChunk(regex, &output, c.outputIndex, c.index, c.header, data, includeRe, excludeRe, chunkNgregex, searchChanges, c.changeBegin, c.changeEnd, c.hotTier, hlbuf, c.continues,
+						c.included.empty() ? nullptr : c.included.data()) &&
+					!matchedChunks.empty())
+					matchedChunks[c.index] = true;
+			}
+		}, groupSize, groupNode);
+
+		groupSize = 0;
+	};
+
+	for (size_t i = chunkBegin; i < chunkEnd && !output.isLimitReached(); ++i)
+	{
+		const DataChunkTableEntry& entry = in.getChunk(i);
+		const DataChunkHeader& chunk = entry.header;
+
+		prefetchChunks(i);
+
+		bool hotTier = i < hotChunkCount;
+		size_t changeNext = hotTier ? changeIt : getNextChange(changes, changeIt, in.getChunkLastName(i), chunk.extraSize);
+
+		bool split = mergeSplitFiles && isChunkSplit(in, i);
+		bool skip = (postingMatch && !postingCandidates[i] && changeNext == changeIt) || (state.refine && !lastSearch.chunks[i] && changeNext == changeIt);
+
+		if (!skip && indexBlock && chunk.indexSize != 0 && changeNext == changeIt)
+		{
+			SearchTimer timer(statistics, &SearchStatistics::prefilterTime);
+
+			char result = checkIndex(i);
+
+			if (result == Index_Malformed)
+			{
+				output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+				pushGroup();
+				return false;
+			}
+
+			skip = result == Index_Skip;
+		}
+
+		std::vector<char> included;
+
+		if (!skip && (includeRe || excludeRe) && entry.pathSize != 0)
+		{
+			SearchTimer timer(statistics, &SearchStatistics::prefilterTime);
+
+			const char* paths = in.read(entry.pathOffset, entry.pathSize, pathStorage);
+
+			if (!paths || !matchChunkPaths(paths, entry.pathSize, chunk.fileCount, includeRe, excludeRe, included))
+			{
+				output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+				pushGroup();
+				return false;
+			}
+
+			// chunks with changed files have to be searched for them even if all stored files are filtered out
+			skip = changeNext == changeIt && std::find(included.begin(), included.end(), 1) == included.end();
+		}
+
+		if (skip)
+		{
+			if (statistics) statistics->chunksSkipped++;
+
+			// a skipped chunk that only has a middle part of the split file keeps it open
+			splitOpen = splitOpen && chunk.fileCount == 1 && split;
+			continue;
+		}
+
+		SearchChunk c = {};
+		c.outputIndex = query.chunkIndex;
+		c.index = i;
+		c.header = chunk;
+		c.dataOffset = entry.dataOffset;
+		c.changeBegin = changeIt;
+		c.changeEnd = changeNext;
+		c.hotTier = hotTier;
+		c.included.swap(included);
+
+		c.data = chunkCache ? chunkCache->find(generation, entry.dataOffset) : std::shared_ptr<char>();
+		c.cached = c.data != nullptr;
+
+		// chunks that continue the current group are searched on its node
+		unsigned int node = (group && splitOpen) ? groupNode : query.nextNode++ % query.chunkPools.size();
+
+		if (c.cached)
+		{
+			if (statistics) statistics->chunksCached++;
+		}
+		else
+		{
+			// Mapped chunks are decompressed straight from the mapping; otherwise we read compressed data in front of the uncompressed data
+			c.compressed = in.isMapped() ? in.view(entry.dataOffset, chunk.compressedSize) : nullptr;
+
+			if (in.isMapped() && !c.compressed)
+			{
+				output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+				pushGroup();
+				return false;
+			}
+
+			c.dataSize = c.compressed ? chunk.uncompressedSize : chunk.compressedSize + chunk.uncompressedSize;
+			c.data = query.chunkPools[node]->allocate(c.dataSize, std::nothrow);
+
+			bool dataRead = false;
+
+			{
+				SearchTimer timer(statistics, &SearchStatistics::readTime);
+
+				dataRead = c.data && (c.compressed || in.read(entry.dataOffset, c.data.get(), chunk.compressedSize));
+			}
+
+			if (!dataRead)
+			{
+				output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+				pushGroup();
+				return false;
+			}
+		}
+
+		if (group && splitOpen)
+			group->back().continues = true;
+		else
+			pushGroup();
+
+		if (!group)
+		{
+			group = std::make_shared<std::vector<SearchChunk>>();
+			groupNode = node;
+		}
+
+		group->push_back(c);
+		groupSize += c.dataSize;
+
+		// chunks are searched as soon as possible unless they have to be merged with the next one
+		if (!split)
+			pushGroup();
+
+		splitOpen = split;
+
+		query.chunkIndex++;
+		changeIt = changeNext;
+	}
+
+	pushGroup();
+
+	if (lastShard && changeIt < changes.size() && !output.isLimitReached())
+	{
+		OrderedOutput::Chunk* chunk = output.output.begin(query.chunkIndex++);
+
+		HighlightBuffer hlbuf;
+
+		while (changeIt < changes.size() && !output.isLimitReached(chunk))
+		{
+			processChangedFile(regex, &output, chunk, hlbuf, searchChanges, changeIt, includeRe, excludeRe);
+			changeIt++;
+		}
+
+		flushCounters(&output, hlbuf);
+
+		output.output.end(chunk);
+	}
+
+	return true;
+}
+
+static unsigned int searchProjectsImpl(Output* output_, const std::vector<std::string>& files, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude,
+	SearchContext* context, SearchStatistics* statistics)
+{
+	// with a pattern file, the query is the path to a file with one pattern per line
+	std::vector<std::string> patterns;
+	std::vector<unsigned int> patternLines;
+
+	if ((options & SO_PATTERNFILE) && !readPatternFile(output_, string, patterns, patternLines))
+		return 0;
+
+	std::unique_ptr<RegexSet> regexSet((options & SO_PATTERNFILE) ? createRegexSet(patterns, getRegexOptions(options)) : 0);
+
+	SearchOutput output(output_, options, limit, regexSet.get(), &patternLines, statistics);
+	std::unique_ptr<Regex> regex((options & SO_PATTERNFILE) ? createRegex(patterns, getRegexOptions(options)) : createRegex(string, getRegexOptions(options)));
+	std::unique_ptr<Regex> includeRe(include ? createRegex(include, RO_IGNORECASE) : 0);
+	std::unique_ptr<Regex> excludeRe(exclude ? createRegex(exclude, RO_IGNORECASE) : 0);
+	NgramRegex ngregex((options & SO_BRUTEFORCE) ? nullptr : regex.get());
+
+	std::vector<std::unique_ptr<SearchProjectState>> states;
+
+	// When the data file is mapped, we only need to allocate space for uncompressed data
+	// Otherwise assume 50% compression ratio (it's usually much better)
+	size_t blockSize = 0;
+
+	for (auto& file: files)
+	{
+		std::shared_ptr<SearchProjectData> project = context ? context->getProject(output_, file.c_str()) : openProject(output_, file.c_str(), !ngregex.empty());
+		if (!project)
+			continue;
+
+		DataFileReader& in = project->in;
+		size_t chunkSize = in.getHeader().chunkSize ? in.getHeader().chunkSize : kChunkSize;
+
+		blockSize = std::max(blockSize, in.isMapped() ? chunkSize : chunkSize * 3 / 2);
+
+		// If the query is a refinement of the last one, only chunks that matched last time can match
+		const SearchProjectData::LastSearch& lastSearch = project->lastSearch;
+
+		std::unique_ptr<SearchProjectState> state(new SearchProjectState());
+
+		state->file = file;
+		state->changes.paths = project->changes.data();
+		state->changes.count = project->changes.size();
+		state->changes.sidePack = &project->sidePack;
+		state->refine = context && lastSearch.valid && lastSearch.options == options && !(options & SO_PATTERNFILE) &&
+			lastSearch.include == (include ? include : "") && lastSearch.exclude == (exclude ? exclude : "") &&
+			isQueryRefinement(lastSearch.query.c_str(), string, options);
+		state->matchedChunks.resize(context ? in.getChunkCount() : 0);
+		state->project = std::move(project);
+
+		states.push_back(std::move(state));
+	}
+
+	{
+		std::unique_ptr<BlockPool> localChunkPool(context || blockSize == 0 ? nullptr : new BlockPool(blockSize));
+		std::unique_ptr<WorkQueue> localQueue(context || states.empty() ? nullptr : new WorkQueue(WorkQueue::getIdealWorkerCount(), kMaxQueuedChunkData));
+
+		if (states.empty())
+			return 0;
+
+		SearchQuery query = {};
+		query.output = &output;
+		query.regex = regex.get();
+		query.includeRe = includeRe.get();
+		query.excludeRe = excludeRe.get();
+		query.ngregex = &ngregex;
+		query.queue = context ? context->getQueue() : localQueue.get();
+		query.chunkCache = context ? context->getChunkCache() : nullptr;
+
+		for (unsigned int node = 0; node < query.queue->getNodeCount(); ++node)
+			query.chunkPools.push_back(context ? context->getChunkPool(node) : localChunkPool.get());
+		query.statistics = statistics;
+		std::tie(query.shardIndex, query.shardCount) = context ? context->getShard() : std::make_pair(0u, 1u);
+
+		// Chunk tasks refer to the state of this function, so we need to wait for them to finish before returning if the queue is shared
+		struct QueueWait { WorkQueue& queue; ~QueueWait() { queue.wait(); } } queueWait = { *query.queue };
+
+		// Projects are queued one after another, so workers move on to the next project while the last chunks of the previous one are searched
+		for (auto& state: states)
+		{
+			if (output.isLimitReached())
+				break;
+
+			// a malformed data file doesn't stop the search in other projects, but the matched chunk list is incomplete
+			if (!searchProjectChunks(output_, query, *state))
+				state->matchedChunks.clear();
+		}
+	}
+
+	// Matched chunk list is only complete if the search didn't stop early
+	if (context)
+		for (auto& state: states)
+		{
+			SearchProjectData::LastSearch& lastSearch = state->project->lastSearch;
+
+			lastSearch.valid = !output.isLimitReached() && !state->matchedChunks.empty();
+			lastSearch.query = string;
+			lastSearch.options = options;
+			lastSearch.include = include ? include : "";
+			lastSearch.exclude = exclude ? exclude : "";
+			lastSearch.chunks.swap(state->matchedChunks);
+		}
+
+	if (statistics)
+		statistics->matches += output.output.getLineCount();
 
 	return output.output.getLineCount();
 }
+
+// Forwards the output and records it for the result cache; outputs with errors or that were cancelled are not cached
+class ResultCacheOutput: public Output
+{
+public:
+	ResultCacheOutput(Output* output): output(output), cacheable(true)
+	{
+	}
+
+	virtual void rawprint(const char* data, size_t size)
+	{
+		output->rawprint(data, size);
+		record(data, size);
+	}
+
+	virtual void print(const char* message, ...)
+	{
+		std::string buf;
+
+		va_list l;
+		va_start(l, message);
+		strprintf(buf, message, l);
+		va_end(l);
+
+		output->print("%s", buf.c_str());
+		record(buf.data(), buf.size());
+	}
+
+	virtual void error(const char* message, ...)
+	{
+		std::string buf;
+
+		va_list l;
+		va_start(l, message);
+		strprintf(buf, message, l);
+		va_end(l);
+
+		output->error("%s", buf.c_str());
+
+		std::unique_lock<std::mutex> lock(mutex);
+		cacheable = false;
+	}
+
+	virtual bool isTTY()
+	{
+		return output->isTTY();
+	}
+
+	virtual bool isInteractive()
+	{
+		return output->isInteractive();
+	}
+
+	virtual bool isCancelled()
+	{
+		if (!output->isCancelled())
+			return false;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		cacheable = false;
+		return true;
+	}
+
+	bool getResult(std::string& data)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if (!cacheable)
+			return false;
+
+		data.swap(result);
+		return true;
+	}
+
+private:
+	Output* output;
+
+	std::mutex mutex;
+	std::string result;
+	bool cacheable;
+
+	void record(const char* data, size_t size)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if (!cacheable)
+			return;
+
+		if (result.size() + size > kMaxCachedResultSize)
+		{
+			cacheable = false;
+			std::string().swap(result);
+			return;
+		}
+
+		result.append(data, size);
+	}
+};
+
+unsigned int searchProjects(Output* output, const std::vector<std::string>& files, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude,
+	SearchContext* context, SearchStatistics* statistics)
+{
+	// Long-running processes keep project data in memory and people rarely repeat queries verbatim, so only searches from scripts are cached;
+	// pattern files can change without changing the query, and statistics describe the search rather than the result
+	bool cached = !context && !statistics && !files.empty() && !output->isInteractive() && !(options & (SO_PATTERNFILE | SO_STATISTICS)) &&
+		isResultCacheEnabled(files[0].c_str());
+
+	if (!cached)
+		return searchProjectsImpl(output, files, string, options, limit, include, exclude, context, statistics);
+
+	bool recent = false;
+	std::string key = getResultCacheKey(files, string, options, limit, include, exclude, recent);
+	std::string result;
+	unsigned int matchCount = 0;
+
+	if (readResultCache(files[0].c_str(), key, result, matchCount))
+	{
+		output->rawprint(result.data(), result.size());
+		return matchCount;
+	}
+
+	ResultCacheOutput cacheOutput(output);
+
+	matchCount = searchProjectsImpl(&cacheOutput, files, string, options, limit, include, exclude, context, statistics);
+
+	// the cache is an optimization, so failing to write it is not an error
+	if (!recent && cacheOutput.getResult(result))
+		writeResultCache(files[0].c_str(), key, result, matchCount);
+
+	return matchCount;
+}
+
+unsigned int searchProject(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchContext* context,
+	SearchStatistics* statistics)
+{
+	return searchProjects(output, std::vector<std::string>(1, file), string, options, limit, include, exclude, context, statistics);
+}
+
+unsigned int searchProject(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchContext* context)
+{
+	return searchProject(output, file, string, options, limit, include, exclude, context, nullptr);
+}
+
+bool getChunkCandidates(Output* output, const char* file, const char* string, unsigned int options, std::vector<char>& candidates)
+{
+	std::unique_ptr<Regex> regex(createRegex(string, getRegexOptions(options)));
+	NgramRegex ngregex(regex.get());
+
+	std::shared_ptr<SearchProjectData> project = openProject(output, file, true);
+	if (!project)
+		return false;
+
+	DataFileReader& in = project->in;
+	const DataFileHeader& header = in.getHeader();
+
+	candidates.assign(in.getChunkCount(), true);
+
+	if (ngregex.empty() || !project->indexBlock)
+		return true;
+
+	for (size_t i = 0; i < in.getChunkCount(); ++i)
+	{
+		const DataChunkTableEntry& entry = in.getChunk(i);
+		const DataChunkHeader& chunk = entry.header;
+
+		if (chunk.indexSize == 0)
+			continue;
+
+		uint64_t indexOffset = entry.indexOffset - header.indexOffset;
+
+		if (entry.indexOffset < header.indexOffset || indexOffset + chunk.indexSize > header.indexSize)
+		{
+			output->error("Error reading data file %s: malformed chunk\n", replaceExtension(file, ".qgd").c_str());
+			return false;
+		}
+
+		const unsigned char* index = reinterpret_cast<const unsigned char*>(project->indexBlock + indexOffset);
+
+		candidates[i] = ngregex.match(index, chunk.indexSize, chunk.indexHashIterations, chunk.indexType);
+	}
+
+	return true;
+}
+
+void printSearchStatistics(Output* output, const SearchStatistics& statistics, unsigned int options)
+{
+	const char* format = (options & SO_JSON)
+		? "{\"statistics\":{\"chunks\":{\"searched\":%llu,\"skipped\":%llu,\"cached\":%llu,\"decompressed\":%llu},\"bytes\":%llu,"
+			"\"files\":{\"searched\":%llu,\"skipped\":%llu,\"duplicates\":%llu,\"changed\":%llu,\"changedBytes\":%llu},\"regexCalls\":%llu,\"matches\":%llu,"
+			"\"time\":{\"prefilter\":%.3f,\"read\":%.3f,\"decompress\":%.3f,\"search\":%.3f,\"output\":%.3f,\"changeRead\":%.3f,\"queueWait\":%.3f}}}\n"
+		: "Statistics: %llu chunks searched, %llu skipped, %llu cached, %llu decompressed, %llu bytes scanned\n"
+			"            %llu files searched, %llu skipped by summaries, %llu duplicates, %llu changed files read from disk (%llu bytes), %llu regex calls, %llu matches\n"
+			"Time (ms):  prefilter %.3f, read %.3f, decompress %.3f, search %.3f, output %.3f, changed file reads %.3f, queue wait %.3f\n";
+
+	auto n = [](const std::atomic<uint64_t>& value) { return static_cast<unsigned long long>(value.load()); };
+	auto ms = [](const std::atomic<uint64_t>& value) { return double(value.load()) / 1e6; };
+
+	output->print(format,
+		n(statistics.chunksSearched), n(statistics.chunksSkipped),
+		n(statistics.chunksCached), n(statistics.chunksDecompressed), n(statistics.bytesSearched),
+		n(statistics.filesSearched), n(statistics.filesSkipped), n(statistics.filesDeduplicated),
+		n(statistics.changesRead), n(statistics.changeBytesRead),
+		n(statistics.regexCalls), n(statistics.matches),
+		ms(statistics.prefilterTime), ms(statistics.readTime), ms(statistics.decompressTime), ms(statistics.searchTime), ms(statistics.outputTime),
+		ms(statistics.changeReadTime), ms(statistics.queueWaitTime));
+}
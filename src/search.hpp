@@ -1,7 +1,20 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
 class Output;
+class WorkQueue;
+class BlockPool;
+class ChunkCache;
+
+struct SearchProjectData;
+struct FilesProjectData;
 
 enum SearchOptions
 {
@@ -21,9 +34,110 @@ enum SearchOptions
 	SO_HIGHLIGHT = 1 << 10,
 	SO_HIGHLIGHT_MATCHES = 1 << 11,
 
-	SO_SUMMARY = 1 << 12
+	SO_SUMMARY = 1 << 12,
+
+	SO_PATTERNFILE = 1 << 13,
+
+	SO_JSON = 1 << 14,
+
+	SO_STATISTICS = 1 << 15,
+
+	SO_FILESWITHMATCHES = 1 << 16,
+	SO_COUNT = 1 << 17,
+
+	SO_MATCHWINDOW = 1 << 18
 };
 
 unsigned int getRegexOptions(unsigned int options);
 
-unsigned int searchProject(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude);
+// Returns true if every line that matches the query is guaranteed to match the previous query
+bool isQueryRefinement(const char* previous, const char* query, unsigned int options);
+
+// State that is kept between searches by long-running processes: a running thread pool and opened project data,
+// which is reopened when project files change on disk. The context can only be used by one search at a time.
+// With numa set, workers are pinned to NUMA nodes and every node searches chunks that are read into its own memory.
+class SearchContext
+{
+public:
+	explicit SearchContext(bool numa = false);
+	~SearchContext();
+
+	SearchContext(const SearchContext&) = delete;
+	SearchContext& operator=(const SearchContext&) = delete;
+
+	WorkQueue* getQueue();
+	BlockPool* getChunkPool(unsigned int node = 0);
+	ChunkCache* getChunkCache();
+
+	// Restricts searches to one of shardCount path ranges of every project; the rest is searched by other servers
+	void setShard(unsigned int index, unsigned int count);
+	std::pair<unsigned int, unsigned int> getShard() const;
+
+	std::shared_ptr<SearchProjectData> getProject(Output* output, const char* file);
+	std::shared_ptr<FilesProjectData> getFiles(Output* output, const char* file);
+
+	void printStatistics(Output* output);
+
+	// Identifies file contents for cache invalidation; returns modification time and size (zeroes for missing files)
+	static std::pair<uint64_t, uint64_t> getFileStamp(const std::string& path);
+
+private:
+	bool numa;
+
+	unsigned int shardIndex;
+	unsigned int shardCount;
+
+	std::unique_ptr<WorkQueue> queue;
+	std::vector<std::unique_ptr<BlockPool>> chunkPools;
+	std::unique_ptr<ChunkCache> chunkCache;
+
+	std::map<std::string, std::shared_ptr<SearchProjectData>> projects;
+	std::map<std::string, std::shared_ptr<FilesProjectData>> files;
+};
+
+// Time spent in search stages in nanoseconds, summed over all threads; chunk search time includes the time to format the output
+// and to read changed files. Queue wait time is the time the reading thread spent waiting for workers to free up queue space.
+struct SearchStatistics
+{
+	std::atomic<uint64_t> prefilterTime;
+	std::atomic<uint64_t> readTime;
+	std::atomic<uint64_t> decompressTime;
+	std::atomic<uint64_t> searchTime;
+	std::atomic<uint64_t> outputTime;
+	std::atomic<uint64_t> changeReadTime;
+	std::atomic<uint64_t> queueWaitTime;
+
+	std::atomic<uint64_t> chunksSkipped;
+	std::atomic<uint64_t> chunksCached;
+	std::atomic<uint64_t> chunksDecompressed;
+	std::atomic<uint64_t> chunksSearched;
+	std::atomic<uint64_t> bytesSearched;
+
+	std::atomic<uint64_t> filesSearched;
+	std::atomic<uint64_t> filesSkipped;
+	std::atomic<uint64_t> filesDeduplicated;
+	std::atomic<uint64_t> changesRead;
+	std::atomic<uint64_t> changeBytesRead;
+
+	std::atomic<uint64_t> regexCalls;
+	std::atomic<uint64_t> matches;
+
+	SearchStatistics();
+};
+
+// Prints statistics as a footer, or as a JSON object with SO_JSON
+void printSearchStatistics(Output* output, const SearchStatistics& statistics, unsigned int options);
+
+unsigned int searchProject(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchContext* context = nullptr);
+
+// Same as above, but also collects the time spent in search stages
+unsigned int searchProject(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchContext* context,
+	SearchStatistics* statistics);
+
+// Searches several projects at once; chunks of all projects are searched by the same worker threads, and the output is ordered by project
+unsigned int searchProjects(Output* output, const std::vector<std::string>& files, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude,
+	SearchContext* context = nullptr, SearchStatistics* statistics = nullptr);
+
+// Checks the query against chunk indices of the data file without searching chunk contents; candidates has one element per chunk,
+// which is set if the chunk might contain a match
+bool getChunkCandidates(Output* output, const char* file, const char* string, unsigned int options, std::vector<char>& candidates);
@@ -0,0 +1,299 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "server.hpp"
+
+#include "output.hpp"
+#include "localsocket.hpp"
+#include "stringutil.hpp"
+#include "orderedoutput.hpp"
+#include "constants.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+
+#include <stdarg.h>
+#include <string.h>
+
+static const size_t kMaxCommandSize = 64 * 1024;
+
+class ConnectionOutput: public Output
+{
+public:
+	ConnectionOutput(LocalSocket* socket): socket(socket), failed(false), lastCheck(0)
+	{
+	}
+
+	virtual void rawprint(const char* data, size_t size)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		write(data, size);
+	}
+
+	virtual void print(const char* message, ...)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		va_list l;
+		va_start(l, message);
+		buffer.clear();
+		strprintf(buffer, message, l);
+		va_end(l);
+
+		write(buffer.c_str(), buffer.size());
+	}
+
+	virtual void error(const char* message, ...)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		va_list l;
+		va_start(l, message);
+		buffer.clear();
+		strprintf(buffer, message, l);
+		va_end(l);
+
+		write(buffer.c_str(), buffer.size());
+	}
+
+	virtual bool isCancelled()
+	{
+		// a search can run for a long time without output, so waiting for a write to fail isn't enough to notice that the client went away
+		if (!failed)
+		{
+			unsigned long long now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+			unsigned long long last = lastCheck;
+
+			// isCancelled is called by all search threads for every file, so only one of them checks the connection now and then
+			if (now - last >= kServerDisconnectCheckInterval && lastCheck.compare_exchange_strong(last, now) && localIsClosed(socket))
+				failed = true;
+		}
+
+		return failed;
+	}
+
+private:
+	LocalSocket* socket;
+	std::atomic<bool> failed;
+	std::atomic<unsigned long long> lastCheck;
+
+	std::mutex mutex;
+	std::string buffer;
+
+	void write(const char* data, size_t size)
+	{
+		// once the client goes away the rest of the output is discarded
+		if (!failed && !localWrite(socket, data, size))
+			failed = true;
+	}
+};
+
+static bool readCommand(LocalSocket* socket, std::vector<std::string>& args)
+{
+	std::string command;
+	char buf[4096];
+
+	while (command.find('\n') == std::string::npos)
+	{
+		ptrdiff_t size = localRead(socket, buf, sizeof(buf));
+
+		if (size <= 0 || command.size() + size > kMaxCommandSize)
+			return false;
+
+		command.insert(command.end(), buf, buf + size);
+	}
+
+	command.erase(command.find('\n'));
+
+	if (!command.empty() && command.back() == '\r')
+		command.pop_back();
+
+	args.clear();
+
+	for (size_t last = 0; ; )
+	{
+		size_t next = command.find('\t', last);
+
+		args.push_back(command.substr(last, next == std::string::npos ? std::string::npos : next - last));
+
+		if (next == std::string::npos)
+			break;
+
+		last = next + 1;
+	}
+
+	return true;
+}
+
+bool serveCommands(Output* output, const char* address, const ServerCommandHandler& handler)
+{
+	LocalSocket* server = localListen(address);
+	if (!server)
+	{
+		output->error("Error listening on %s\n", address);
+		return false;
+	}
+
+	output->print("Listening on %s\n", address);
+
+	std::vector<std::string> args;
+
+	while (LocalSocket* socket = localAccept(server))
+	{
+		if (readCommand(socket, args))
+		{
+			ConnectionOutput connection(socket);
+
+			handler(&connection, args);
+		}
+
+		localClose(socket);
+	}
+
+	output->error("Error accepting connection on %s\n", address);
+
+	localClose(server);
+
+	return false;
+}
+
+static bool formatCommand(Output* output, const std::vector<std::string>& args, std::string& command)
+{
+	command.clear();
+
+	for (size_t i = 0; i < args.size(); ++i)
+	{
+		if (args[i].find_first_of("\t\n") != std::string::npos)
+		{
+			output->error("Error: command arguments can't contain tabs or newlines\n");
+			return false;
+		}
+
+		if (i != 0) command += '\t';
+		command += args[i];
+	}
+
+	command += '\n';
+
+	return true;
+}
+
+static LocalSocket* connectCommand(Output* output, const char* address, const std::string& command)
+{
+	LocalSocket* socket = localConnect(address);
+	if (!socket)
+	{
+		output->error("Error connecting to %s\n", address);
+		return nullptr;
+	}
+
+	if (!localWrite(socket, command.c_str(), command.size()))
+	{
+		output->error("Error sending command to %s\n", address);
+		localClose(socket);
+		return nullptr;
+	}
+
+	return socket;
+}
+
+bool sendCommand(Output* output, const char* address, const std::vector<std::string>& args)
+{
+	std::string command;
+	if (!formatCommand(output, args, command))
+		return false;
+
+	LocalSocket* socket = connectCommand(output, address, command);
+	if (!socket)
+		return false;
+
+	char buf[65536];
+
+	while (true)
+	{
+		ptrdiff_t size = localRead(socket, buf, sizeof(buf));
+
+		if (size <= 0)
+		{
+			if (size < 0)
+				output->error("Error reading response from %s\n", address);
+
+			localClose(socket);
+			return size == 0;
+		}
+
+		output->rawprint(buf, size);
+	}
+}
+
+// Reads the output of one shard into its output chunk line by line; stops early once enough lines are printed
+static bool receiveShard(Output* output, const char* address, const std::string& command, OrderedOutput& ordered, OrderedOutput::Chunk* chunk, unsigned int lineLimit)
+{
+	LocalSocket* socket = connectCommand(output, address, command);
+	if (!socket)
+		return false;
+
+	char buf[65536];
+	ptrdiff_t size = 0;
+
+	while (ordered.getLineCount() < lineLimit && (size = localRead(socket, buf, sizeof(buf))) > 0)
+	{
+		for (const char* data = buf; data < buf + size; )
+		{
+			const char* eol = static_cast<const char*>(memchr(data, '\n', buf + size - data));
+			const char* end = eol ? eol + 1 : buf + size;
+
+			chunk->result.append(data, end);
+
+			if (eol)
+				ordered.write(chunk);
+
+			data = end;
+		}
+	}
+
+	// the last line may not be terminated
+	if (chunk->lineEnds.empty() ? !chunk->result.empty() : chunk->lineEnds.back() != chunk->result.size())
+	{
+		chunk->result += '\n';
+		ordered.write(chunk);
+	}
+
+	// closing the connection early stops the search on the server
+	localClose(socket);
+
+	if (size < 0)
+		output->error("Error reading response from %s\n", address);
+
+	return size >= 0;
+}
+
+bool sendShardedCommand(Output* output, const std::vector<std::string>& addresses, const std::vector<std::string>& args, unsigned int lineLimit)
+{
+	std::string command;
+	if (!formatCommand(output, args, command))
+		return false;
+
+	// every shard gets one output chunk, in the order of shards
+	OrderedOutput ordered(output, kMaxBufferedOutput, kBufferedOutputFlushThreshold, lineLimit, addresses.size());
+
+	std::vector<char> results(addresses.size());
+	std::vector<std::thread> threads;
+
+	for (size_t i = 0; i < addresses.size(); ++i)
+		threads.emplace_back([&, i]() {
+			OrderedOutput::Chunk* chunk = ordered.begin(i);
+
+			results[i] = receiveShard(output, addresses[i].c_str(), command, ordered, chunk, lineLimit);
+
+			ordered.end(chunk);
+		});
+
+	for (auto& t: threads)
+		t.join();
+
+	return std::find(results.begin(), results.end(), 0) == results.end();
+}
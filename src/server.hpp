@@ -0,0 +1,18 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+
+class Output;
+
+// Each connection carries one command: a line with tab-separated arguments, followed by command output from the server until the connection is closed
+typedef std::function<void (Output* output, const std::vector<std::string>& args)> ServerCommandHandler;
+
+bool serveCommands(Output* output, const char* address, const ServerCommandHandler& handler);
+bool sendCommand(Output* output, const char* address, const std::vector<std::string>& args);
+
+// Sends the command to servers that search consecutive shards of the projects, and prints their output in shard order
+// Output of the first unfinished shard is printed as it arrives; once lineLimit lines are printed, the remaining shards are cancelled
+bool sendShardedCommand(Output* output, const std::vector<std::string>& addresses, const std::vector<std::string>& args, unsigned int lineLimit);
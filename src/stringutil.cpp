@@ -2,6 +2,19 @@
 #include "common.hpp"
 #include "stringutil.hpp"
 
+#include "casefold.hpp"
+#include "cpufeatures.hpp"
+
+#include <algorithm>
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+#include "charsimd.hpp"
+#endif
+
+#ifdef USE_SSE2
+#include <immintrin.h>
+#endif
+
 void strprintf(std::string& result, const char* format, va_list args)
 {
 	// copy arglist before use so that we can use it again below
@@ -23,3 +36,175 @@ void strprintf(std::string& result, const char* format, va_list args)
 		result.resize(offset + count);
 	}
 }
+
+#ifdef USE_SSE2
+TARGET_AVX2 static unsigned int countLinesAVX2(const char* begin, const char* end, const char** tail)
+{
+	__m256i newline = _mm256_set1_epi8('\n');
+	__m256i total = _mm256_setzero_si256();
+
+	const char* s = begin;
+
+	while (end - s >= 32)
+	{
+		// per-byte counters overflow after 255 iterations
+		size_t blocks = std::min<size_t>((end - s) / 32, 255);
+		__m256i counts = _mm256_setzero_si256();
+
+		for (size_t i = 0; i < blocks; ++i, s += 32)
+			counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(s)), newline));
+
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+	}
+
+	__m128i sum = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+
+	*tail = s;
+
+	return static_cast<unsigned int>(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum)));
+}
+
+TARGET_AVX2 static const char* casefoldRangeAVX2(char* dest, const char* begin, const char* end)
+{
+	// Shift 'A'..'Z' range ([65..90]) to [102..127] to use one signed comparison insn
+	__m256i shiftAmount = _mm256_set1_epi8(127 - 'Z');
+	__m256i lowerBound = _mm256_set1_epi8(127 - ('Z' - 'A') - 1);
+	__m256i upperBit = _mm256_set1_epi8(0x20);
+
+	const char* i = begin;
+
+	for (; i + 32 <= end; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(i));
+		__m256i upperMask = _mm256_cmpgt_epi8(_mm256_add_epi8(v, shiftAmount), lowerBound);
+		__m256i cfv = _mm256_or_si256(v, _mm256_and_si256(upperMask, upperBit));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + (i - begin)), cfv);
+	}
+
+	return i;
+}
+#endif
+
+unsigned int countLines(const char* begin, const char* end)
+{
+	unsigned int res = 0;
+
+	const char* s = begin;
+
+#ifdef USE_SSE2
+	if (end - s >= 64 && getCpuFeatures().avx2)
+		res += countLinesAVX2(s, end, &s);
+#endif
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+	simd16 newline = simd_dup('\n');
+	simd16 one = simd_dup(1);
+
+	while (end - s >= 16)
+	{
+		// per-byte counters overflow after 255 iterations
+		size_t blocks = std::min<size_t>((end - s) / 16, 255);
+		simd16 counts = simd_dup(0);
+
+		for (size_t i = 0; i < blocks; ++i, s += 16)
+			counts = simd_add(counts, simd_and(simd_cmpeq(simd_load(s), newline), one));
+
+		unsigned char lanes[16];
+		simd_store(lanes, counts);
+
+		for (size_t i = 0; i < 16; ++i)
+			res += lanes[i];
+	}
+#endif
+
+	for (; s != end; ++s)
+		res += (*s == '\n');
+
+	return res;
+}
+
+size_t normalizeEOL(char* data, size_t size)
+{
+	// fast path: no \r in the file
+	const char* first = static_cast<const char*>(memchr(data, '\r', size));
+	if (!first)
+		return size;
+
+	// replace \r\n with \n, replace stray \r with \n
+	size_t result = first - data;
+	size_t i = result;
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+	simd16 cr = simd_dup('\r');
+#endif
+
+	while (i < size)
+	{
+	#if defined(USE_SSE2) || defined(USE_NEON)
+		if (i + 16 <= size)
+		{
+			simd16 v = simd_load(data + i);
+			int mask = simd_movemask(simd_cmpeq(v, cr));
+
+			if (mask == 0)
+			{
+				// the output never overtakes the input, so the store only overwrites bytes that were already processed or loaded
+				simd_store(data + result, v);
+				result += 16;
+				i += 16;
+				continue;
+			}
+
+			size_t skip = countTrailingZeros(mask);
+
+			memmove(data + result, data + i, skip);
+			result += skip;
+			i += skip;
+		}
+	#endif
+
+		if (data[i] == '\r')
+		{
+			data[result++] = '\n';
+			if (i + 1 < size && data[i + 1] == '\n') i++;
+		}
+		else
+			data[result++] = data[i];
+
+		i++;
+	}
+
+	return result;
+}
+
+void casefoldRange(char* dest, const char* begin, const char* end)
+{
+	const char* i = begin;
+
+	if (end - begin >= 64)
+	{
+	#ifdef USE_SSE2
+		if (getCpuFeatures().avx2)
+			i = casefoldRangeAVX2(dest, begin, end);
+	#endif
+
+	#if defined(USE_SSE2) || defined(USE_NEON)
+		// Shift 'A'..'Z' range ([65..90]) to [102..127] to use one signed comparison insn
+		simd16 shiftAmount = simd_dup(127 - 'Z');
+		simd16 lowerBound = simd_dup(127 - ('Z' - 'A') - 1);
+		simd16 upperBit = simd_dup(0x20);
+
+		for (; i + 16 <= end; i += 16)
+		{
+			simd16 v = simd_load(i);
+			simd16 upperMask = simd_cmpgt(simd_add(v, shiftAmount), lowerBound);
+			simd16 cfv = simd_or(v, simd_and(upperMask, upperBit));
+			simd_store(dest + (i - begin), cfv);
+		}
+	#endif
+	}
+
+	// short strings and tails are processed one character at a time
+	for (; i != end; ++i)
+		dest[i - begin] = casefold(*i);
+}
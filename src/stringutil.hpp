@@ -33,15 +33,13 @@ inline const char* findLineEnd(const char* pos, const char* end)
 	return end;
 }
 
-inline unsigned int countLines(const char* begin, const char* end)
-{
-	unsigned int res = 0;
-	
-	for (const char* s = begin; s != end; ++s)
-		res += (*s == '\n');
-		
-	return res;
-}
+unsigned int countLines(const char* begin, const char* end);
+
+// Replaces \r\n and stray \r with \n in place, returns the new size
+size_t normalizeEOL(char* data, size_t size);
+
+// Folds ASCII letters to lower case; dest may be equal to begin
+void casefoldRange(char* dest, const char* begin, const char* end);
 
 template <typename Pred> inline std::vector<std::string> split(const char* str, Pred sep)
 {
@@ -0,0 +1,10 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <vector>
+
+// Returns system numbers of NUMA nodes that have processors; systems that don't report NUMA topology have no nodes
+std::vector<unsigned int> getNumaNodes();
+
+// Restricts the calling thread to the processors of the node
+bool setThreadNumaNode(unsigned int node);
@@ -0,0 +1,88 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#ifndef _WIN32
+
+#include "common.hpp"
+#include "topology.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <sched.h>
+
+// Parses lists like 0-15,32-47
+static std::vector<unsigned int> parseList(const char* list)
+{
+	std::vector<unsigned int> result;
+
+	while (*list)
+	{
+		char* end;
+		unsigned long first = strtoul(list, &end, 10);
+		unsigned long last = first;
+
+		if (end == list)
+			break;
+
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+
+		for (unsigned long i = first; i <= last; ++i)
+			result.push_back(i);
+
+		list = (*end == ',') ? end + 1 : end;
+	}
+
+	return result;
+}
+
+static std::vector<unsigned int> readList(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if (!file)
+		return std::vector<unsigned int>();
+
+	char list[4096] = {};
+	bool read = fgets(list, sizeof(list), file) != nullptr;
+
+	fclose(file);
+
+	return read ? parseList(list) : std::vector<unsigned int>();
+}
+#endif
+
+std::vector<unsigned int> getNumaNodes()
+{
+#ifdef __linux__
+	// node numbers can have gaps, and nodes that only have memory are not listed
+	return readList("/sys/devices/system/node/has_cpu");
+#else
+	return std::vector<unsigned int>();
+#endif
+}
+
+bool setThreadNumaNode(unsigned int node)
+{
+#ifdef __linux__
+	char path[256];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+
+	std::vector<unsigned int> processors = readList(path);
+
+	if (processors.empty())
+		return false;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+
+	for (unsigned int cpu: processors)
+		if (cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	(void)node;
+	return false;
+#endif
+}
+#endif
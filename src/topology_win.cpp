@@ -0,0 +1,39 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#ifdef _WIN32
+
+#include "common.hpp"
+#include "topology.hpp"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+std::vector<unsigned int> getNumaNodes()
+{
+	std::vector<unsigned int> result;
+
+	ULONG highest = 0;
+	if (!GetNumaHighestNodeNumber(&highest))
+		return result;
+
+	// nodes that only have memory have an empty processor mask
+	for (ULONG node = 0; node <= highest; ++node)
+	{
+		GROUP_AFFINITY affinity = {};
+
+		if (GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity) && affinity.Mask != 0)
+			result.push_back(node);
+	}
+
+	return result;
+}
+
+bool setThreadNumaNode(unsigned int node)
+{
+	GROUP_AFFINITY affinity = {};
+
+	if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity) || affinity.Mask == 0)
+		return false;
+
+	return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+}
+#endif
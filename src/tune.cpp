@@ -0,0 +1,353 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "tune.hpp"
+
+#include "output.hpp"
+#include "project.hpp"
+#include "build.hpp"
+#include "search.hpp"
+#include "datafile.hpp"
+#include "compression.hpp"
+#include "fileutil.hpp"
+#include "filestream.hpp"
+#include "constants.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <ctype.h>
+
+struct TuneSettings
+{
+	unsigned int chunkSize;
+	int compressionLevel;
+	unsigned int indexRatio;
+	unsigned int codec;
+};
+
+struct TuneResult
+{
+	uint64_t packSize;
+	uint64_t indexSize;
+
+	double buildTime;
+	double searchTime;
+
+	// chunks that don't contain the query, and chunks among them that still passed the index check
+	unsigned long long negatives;
+	unsigned long long falsePositives;
+};
+
+static double getSeconds(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static std::vector<FileInfo> sampleFiles(const std::vector<FileInfo>& files, uint64_t budget)
+{
+	uint64_t totalSize = 0;
+
+	for (auto& f: files)
+		totalSize += f.fileSize;
+
+	// files are taken evenly from the sorted list so that the sample covers all parts of the project
+	double ratio = totalSize <= budget ? 1.0 : double(budget) / double(totalSize);
+	double credit = 0;
+
+	std::vector<FileInfo> result;
+
+	for (auto& f: files)
+	{
+		credit += double(f.fileSize) * ratio;
+
+		if (credit >= double(f.fileSize))
+		{
+			result.push_back(f);
+			credit -= double(f.fileSize);
+		}
+	}
+
+	return result;
+}
+
+static bool isIdentifierChar(char ch)
+{
+	return isalnum(static_cast<unsigned char>(ch)) || ch == '_';
+}
+
+static std::string findQuery(const char* data, size_t size)
+{
+	// start in the middle of the file to skip license headers and includes that are shared between many files
+	size_t offset = size / 2;
+
+	while (offset < size && isIdentifierChar(data[offset]))
+		offset++;
+
+	while (offset < size)
+	{
+		while (offset < size && !isIdentifierChar(data[offset]))
+			offset++;
+
+		size_t begin = offset;
+
+		while (offset < size && isIdentifierChar(data[offset]))
+			offset++;
+
+		size_t length = offset - begin;
+
+		if (length >= kTuneQueryMinLength && length <= kTuneQueryMaxLength && !isdigit(static_cast<unsigned char>(data[begin])))
+			return std::string(data + begin, length);
+	}
+
+	return std::string();
+}
+
+static std::vector<std::string> getQueries(const std::vector<FileInfo>& files)
+{
+	std::vector<std::string> result;
+
+	size_t step = std::max<size_t>(1, files.size() / kTuneQueryCount);
+
+	for (size_t i = 0; i < files.size() && result.size() < kTuneQueryCount; i += step)
+	{
+		FileStream in(files[i].path.c_str(), "rb");
+		if (!in)
+			continue;
+
+		std::vector<char> data;
+		char buffer[65536];
+
+		while (size_t size = in.read(buffer, sizeof(buffer)))
+			data.insert(data.end(), buffer, buffer + size);
+
+		std::string query = findQuery(data.data(), data.size());
+
+		if (!query.empty() && std::find(result.begin(), result.end(), query) == result.end())
+			result.push_back(query);
+	}
+
+	return result;
+}
+
+// Finds chunks that contain each query by scanning the file data in every chunk
+static bool getChunkMatches(Output* output, const char* path, const std::vector<std::string>& queries, std::vector<std::vector<char>>& matches, uint64_t& indexSize)
+{
+	DataFileReader in;
+	if (!in.open(path) || in.readTable() != DataFileReader::Table_Ok)
+	{
+		output->error("Error reading data file %s\n", path);
+		return false;
+	}
+
+	indexSize = in.getHeader().indexSize;
+
+	matches.assign(queries.size(), std::vector<char>(in.getChunkCount()));
+
+	std::vector<char> storage;
+
+	for (size_t i = 0; i < in.getChunkCount(); ++i)
+	{
+		const DataChunkTableEntry& entry = in.getChunk(i);
+		const DataChunkHeader& chunk = entry.header;
+
+		const char* compressed = in.read(entry.dataOffset, chunk.compressedSize, storage);
+		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.uncompressedSize]);
+
+		if (!compressed || !data || chunk.fileCount * sizeof(DataChunkFileHeader) > chunk.uncompressedSize)
+		{
+			output->error("Error reading data file %s: malformed chunk\n", path);
+			return false;
+		}
+
+		decompress(data.get(), chunk.uncompressedSize, compressed, chunk.compressedSize, chunk.codec, in.getDictionary(), in.getDictionarySize());
+
+		const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data.get());
+
+		for (size_t fi = 0; fi < chunk.fileCount; ++fi)
+		{
+			const DataChunkFileHeader& f = files[fi];
+
+			if (f.dataOffset > chunk.uncompressedSize || f.dataSize > chunk.uncompressedSize - f.dataOffset)
+			{
+				output->error("Error reading data file %s: malformed chunk\n", path);
+				return false;
+			}
+
+			const char* fileData = data.get() + f.dataOffset;
+
+			for (size_t qi = 0; qi < queries.size(); ++qi)
+				if (!matches[qi][i] && std::search(fileData, fileData + f.dataSize, queries[qi].begin(), queries[qi].end()) != fileData + f.dataSize)
+					matches[qi][i] = true;
+		}
+	}
+
+	return true;
+}
+
+static bool tuneSettings(Output* output, const char* path, const ProjectOptions& projectOptions, const TuneSettings& settings, const std::vector<FileInfo>& files,
+	const std::string& dictionary, const std::vector<std::string>& queries, TuneResult& result)
+{
+	std::string dataPath = replaceExtension(path, ".qgd");
+
+	ProjectOptions options = projectOptions;
+	options.chunkSize = settings.chunkSize;
+	options.compressionLevel = settings.compressionLevel;
+	options.indexRatio = settings.indexRatio;
+	options.codec = settings.codec;
+
+	ErrorOutput silentOutput(output);
+
+	auto buildStartTime = std::chrono::high_resolution_clock::now();
+
+	BuildContext* builder = buildStart(&silentOutput, dataPath.c_str(), options, files.size(), settings.codec == CC_LZ4DICT ? dictionary : std::string());
+	if (!builder)
+		return false;
+
+	for (auto& f: files)
+		buildAppendFile(builder, f.path.c_str(), f.timeStamp, f.fileSize);
+
+	buildFinish(builder);
+
+	result.buildTime = getSeconds(buildStartTime);
+
+	uint64_t mtime;
+	if (!getFileAttributes(dataPath.c_str(), &mtime, &result.packSize))
+	{
+		output->error("Error reading data file %s\n", dataPath.c_str());
+		return false;
+	}
+
+	std::vector<std::vector<char>> matches;
+	if (!getChunkMatches(output, dataPath.c_str(), queries, matches, result.indexSize))
+		return false;
+
+	result.negatives = 0;
+	result.falsePositives = 0;
+
+	for (size_t qi = 0; qi < queries.size(); ++qi)
+	{
+		std::vector<char> candidates;
+		if (!getChunkCandidates(output, path, queries[qi].c_str(), SO_LITERAL, candidates))
+			return false;
+
+		for (size_t i = 0; i < candidates.size() && i < matches[qi].size(); ++i)
+			if (!matches[qi][i])
+			{
+				result.negatives++;
+				result.falsePositives += candidates[i] != 0;
+			}
+	}
+
+	// the pack was just written so it's likely in the file cache; the fastest of several runs reduces the noise further
+	result.searchTime = 0;
+
+	for (int run = 0; run < kTuneSearchRuns; ++run)
+	{
+		auto searchStartTime = std::chrono::high_resolution_clock::now();
+
+		for (auto& q: queries)
+			searchProject(&silentOutput, path, q.c_str(), SO_LITERAL, ~0u, nullptr, nullptr);
+
+		double time = getSeconds(searchStartTime);
+
+		result.searchTime = (run == 0) ? time : std::min(result.searchTime, time);
+	}
+
+	return true;
+}
+
+static void addSettings(std::vector<TuneSettings>& list, const TuneSettings& settings)
+{
+	for (auto& s: list)
+		if (s.chunkSize == settings.chunkSize && s.compressionLevel == settings.compressionLevel && s.indexRatio == settings.indexRatio && s.codec == settings.codec)
+			return;
+
+	list.push_back(settings);
+}
+
+static std::vector<TuneSettings> getSettingsList(const ProjectOptions& options)
+{
+	const unsigned int chunkSizes[] = { 128, 256, 512, 1024, 2048 }; // KB
+	const int compressionLevels[] = { 0, 3, 6, 9, 12 };
+	const unsigned int indexRatios[] = { 25, 50, 100, 200 };
+	const unsigned int codecs[] = { CC_LZ4, CC_LZ4DICT };
+
+	TuneSettings current = { options.chunkSize, options.compressionLevel, options.indexRatio, options.codec };
+
+	std::vector<TuneSettings> result;
+	addSettings(result, current);
+
+	// settings mostly affect different parts of the pack, so they are varied one at a time around the current ones
+	for (auto v: chunkSizes)
+		addSettings(result, { v * 1024, current.compressionLevel, current.indexRatio, current.codec });
+
+	for (auto v: compressionLevels)
+		addSettings(result, { current.chunkSize, v, current.indexRatio, current.codec });
+
+	for (auto v: indexRatios)
+		addSettings(result, { current.chunkSize, current.compressionLevel, v, current.codec });
+
+	// dictionaries help the most with small chunks
+	for (auto v: codecs)
+		for (auto c: chunkSizes)
+			if (c <= 256 || c * 1024 == current.chunkSize)
+				addSettings(result, { c * 1024, current.compressionLevel, current.indexRatio, v });
+
+	return result;
+}
+
+void tuneProject(Output* output, const char* path)
+{
+	output->print("Tuning %s:\n", path);
+
+	std::unique_ptr<ProjectGroup> group = parseProject(output, path);
+	if (!group)
+		return;
+
+	std::vector<FileInfo> files = sampleFiles(getProjectGroupFiles(output, group.get()), kTuneSampleSize);
+	std::vector<std::string> queries = getQueries(files);
+
+	uint64_t sampleSize = 0;
+
+	for (auto& f: files)
+		sampleSize += f.fileSize;
+
+	output->print("Sample: %d files, %.1f MB, %d queries\n", int(files.size()), double(sampleSize) / (1024 * 1024), int(queries.size()));
+
+	if (files.empty())
+		return;
+
+	std::string dictionary = buildDictionary(files);
+
+	// sample packs use a separate project path so that the project data is not affected
+	std::string tunePath = replaceExtension(path, ".tune.cfg");
+
+	output->print("  Chunk size  Compression  Index ratio    Codec    Pack size   Index size      Build     Search  False positives\n");
+
+	std::vector<TuneSettings> settingsList = getSettingsList(group->options);
+
+	for (size_t i = 0; i < settingsList.size(); ++i)
+	{
+		const TuneSettings& s = settingsList[i];
+
+		TuneResult result;
+		bool ok = tuneSettings(output, tunePath.c_str(), group->options, s, files, dictionary, queries, result);
+
+		removeFile(replaceExtension(tunePath.c_str(), ".qgd").c_str());
+
+		if (!ok)
+			return;
+
+		output->print("%c %7d KB  %11d  %11d  %7s  %8.1f MB  %8.1f MB  %8.2f s  %7.1f ms  %14.1f%%\n", i == 0 ? '*' : ' ',
+			s.chunkSize / 1024, s.compressionLevel, s.indexRatio, s.codec == CC_LZ4DICT ? "lz4dict" : "lz4",
+			double(result.packSize) / (1024 * 1024), double(result.indexSize) / (1024 * 1024), result.buildTime,
+			queries.empty() ? 0.0 : result.searchTime * 1000 / queries.size(),
+			result.negatives ? double(result.falsePositives) * 100 / double(result.negatives) : 0.0);
+	}
+
+	output->print("* - current settings; search time is the average time per query, false positives are chunks without matches\n"
+		"that pass the index check\n");
+}
@@ -0,0 +1,7 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+class Output;
+
+// Builds sample packs from a subset of project files at several data file settings and prints pack size, search time and index false positive rate for each
+void tuneProject(Output* output, const char* path);
@@ -7,16 +7,25 @@
 #include "format.hpp"
 #include "fileutil.hpp"
 #include "filestream.hpp"
+#include "datafile.hpp"
 #include "project.hpp"
 #include "files.hpp"
 #include "compression.hpp"
+#include "constants.hpp"
+#include "changes.hpp"
+#include "workqueue.hpp"
 
 #include <memory>
 #include <vector>
 #include <string>
 #include <chrono>
+#include <deque>
+#include <unordered_set>
+#include <future>
+#include <algorithm>
 
 #include <string.h>
+#include <stdint.h>
 
 struct UpdateStatistics
 {
@@ -24,6 +33,11 @@ struct UpdateStatistics
 	unsigned int filesRemoved;
 	unsigned int filesChanged;
 	unsigned int chunksPreserved;
+
+	// files that move between tiers are removed from one tier and added to the other; these are matched up once the update is done
+	bool trackMoves;
+	std::vector<FileInfo> addedFiles;
+	std::vector<FileInfo> removedFiles;
 };
 
 struct UpdateFileIterator
@@ -73,49 +87,146 @@ static bool isFileCurrent(const FileInfo& info, const DataChunkFileHeader& file,
 	return info.timeStamp == file.timeStamp && info.fileSize == file.fileSize;
 }
 
-static bool isChunkCurrent(UpdateFileIterator& fileit, const DataChunkHeader& chunk, const DataChunkFileHeader* files, const char* data, bool firstFileIsSuffix)
+// Returns the index of the file list entry that the chunk starts with if all files in the chunk are current, or SIZE_MAX otherwise
+// If the first file in the chunk is not the first file part, the chunk starts with the file that was added with the previous chunk
+static size_t findCurrentChunkPosition(const std::vector<FileInfo>& fileList, const DataChunkHeader& chunk, const DataChunkFileHeader* files, const char* data)
 {
-	// if first file in the chunk is not the first file part, then the chunk is current iff we added this file before and the rest is current
-	// so we can just start comparison 1 entry before
-	size_t back = firstFileIsSuffix ? 1 : 0;
-	if (fileit.index < back || fileit.index - back + chunk.fileCount > fileit.files.size()) return false;
+	assert(chunk.fileCount > 0);
+
+	const DataChunkFileHeader& first = files[0];
+
+	size_t position = std::lower_bound(fileList.begin(), fileList.end(), first,
+		[&](const FileInfo& info, const DataChunkFileHeader& f) { return comparePath(info, f, data) < 0; }) - fileList.begin();
+
+	if (position + chunk.fileCount > fileList.size())
+		return SIZE_MAX;
 
 	for (size_t i = 0; i < chunk.fileCount; ++i)
 	{
 		const DataChunkFileHeader& f = files[i];
-		const FileInfo& info = fileit.files[fileit.index - back + i];
+		const FileInfo& info = fileList[position + i];
 
 		if (comparePath(info, f, data) != 0 || !isFileCurrent(info, f, data))
-			return false;
+			return SIZE_MAX;
 	}
 
-	return true;
+	return position;
+}
+
+static void appendAddedFile(BuildContext* builder, UpdateStatistics& stats, const FileInfo& info)
+{
+	buildAppendFile(builder, info.path.c_str(), info.timeStamp, info.fileSize);
+	stats.filesAdded++;
+
+	if (stats.trackMoves)
+		stats.addedFiles.push_back(info);
+}
+
+static void recordRemovedFile(UpdateStatistics& stats, const DataChunkFileHeader& file, const char* data)
+{
+	stats.filesRemoved++;
+
+	if (stats.trackMoves)
+		stats.removedFiles.push_back({ std::string(data + file.nameOffset, file.nameLength), file.timeStamp, file.fileSize });
+}
+
+// Files that were removed from one tier and added to the other are only counted as changed, and only if their contents did change
+static void countMovedFiles(UpdateStatistics& stats)
+{
+	auto comparePaths = [](const FileInfo& l, const FileInfo& r) { return l.path < r.path; };
+
+	std::sort(stats.addedFiles.begin(), stats.addedFiles.end(), comparePaths);
+	std::sort(stats.removedFiles.begin(), stats.removedFiles.end(), comparePaths);
+
+	auto ait = stats.addedFiles.begin();
+	auto rit = stats.removedFiles.begin();
+
+	while (ait != stats.addedFiles.end() && rit != stats.removedFiles.end())
+	{
+		if (ait->path < rit->path)
+			++ait;
+		else if (rit->path < ait->path)
+			++rit;
+		else
+		{
+			stats.filesAdded--;
+			stats.filesRemoved--;
+
+			if (ait->timeStamp != rit->timeStamp || ait->fileSize != rit->fileSize)
+				stats.filesChanged++;
+
+			++ait;
+			++rit;
+		}
+	}
 }
 
-static void processChunkData(Output* output, BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats,
-	const DataChunkHeader& chunk, char* buffer, std::unique_ptr<char[]>& compressed, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra)
+struct UpdateChunk
+{
+	DataChunkHeader header;
+	uint64_t dataOffset;
+	std::string firstFile;
+	std::string paths;
+
+	std::unique_ptr<char[]> extra;
+	std::unique_ptr<char[]> index;
+	std::unique_ptr<char[]> data; // compressed data followed by uncompressed data, or just uncompressed data if compressed data is mapped
+
+	// compressed data points into the mapped data file for chunks that may stay in place, so that current chunks are never read in full
+	const char* compressed;
+	char* uncompressed;
+	bool decompressed;
+
+	// dictionary of the data file the chunk was read from
+	const char* dictionary;
+	size_t dictionarySize;
+
+	size_t currentPosition;
+};
+
+static void prepareChunk(UpdateChunk& chunk, const std::vector<FileInfo>& fileList)
 {
-	const char* data = buffer;
+	const DataChunkHeader& header = chunk.header;
 
 	// decompress the file table part of the chunk; this allows us to skip full chunk decompression if chunk is fully up-to-date
-	decompressPartial(buffer, chunk.uncompressedSize, compressed.get(), chunk.compressedSize, chunk.fileTableSize);
+	decompressPartial(chunk.uncompressed, header.uncompressedSize, chunk.compressed, header.compressedSize, header.fileTableSize, header.codec, chunk.dictionary, chunk.dictionarySize);
 
-	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(chunk.uncompressed);
 
-	// if chunk is fully up-to-date, we can try adding it directly and skipping chunk recompression
-	assert(chunk.fileCount > 0);
+	chunk.currentPosition = findCurrentChunkPosition(fileList, header, files, chunk.uncompressed);
+
+	// chunks that are not current have to be split into files; this decompresses the file table redundantly but the performance cost of that is negligible
+	if (chunk.currentPosition == SIZE_MAX)
+	{
+		decompress(chunk.uncompressed, header.uncompressedSize, chunk.compressed, header.compressedSize, header.codec, chunk.dictionary, chunk.dictionarySize);
+		chunk.decompressed = true;
+	}
+}
+
+static void processChunkData(Output* output, BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats, UpdateChunk& uchunk)
+{
+	const DataChunkHeader& chunk = uchunk.header;
+	const char* data = uchunk.uncompressed;
+
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
 
 	bool firstFileIsSuffix = files[0].startLine > 0;
 
-	if (isChunkCurrent(fileit, chunk, files, data, firstFileIsSuffix) && buildAppendChunk(builder, chunk, compressed, index, extra, firstFileIsSuffix))
+	// mapped chunks stay where they are, so the builder doesn't get their data
+	std::unique_ptr<char[]> noData;
+	std::unique_ptr<char[]>& compressedData = (uchunk.compressed == uchunk.data.get()) ? uchunk.data : noData;
+
+	// if chunk is fully up-to-date and all files before it were added, we can try adding it directly and skipping chunk recompression
+	if (uchunk.currentPosition != SIZE_MAX && uchunk.currentPosition + firstFileIsSuffix == fileit.index &&
+		buildAppendChunk(builder, chunk, compressedData, uchunk.index, uchunk.extra, uchunk.firstFile, firstFileIsSuffix, uchunk.paths, uchunk.dataOffset))
 	{
 		fileit += chunk.fileCount - firstFileIsSuffix;
 		stats.chunksPreserved++;
 		return;
 	}
 
-	// decompress the chunk completely. this decompresses the file table redundantly but the performance cost of that is negligible
-	decompress(buffer, chunk.uncompressedSize, compressed.get(), chunk.compressedSize);
+	if (!uchunk.decompressed)
+		decompress(uchunk.uncompressed, chunk.uncompressedSize, uchunk.compressed, chunk.compressedSize, chunk.codec, uchunk.dictionary, uchunk.dictionarySize);
 
 	// as a special case, first file in the chunk can be a part of an existing file
 	bool skipFirstFile = false;
@@ -140,9 +251,8 @@ static void processChunkData(Output* output, BuildContext* builder, UpdateFileIt
 		// add all files before the file
 		while (fileit && comparePath(*fileit, f, data) < 0)
 		{
-			buildAppendFile(builder, fileit->path.c_str(), fileit->timeStamp, fileit->fileSize);
+			appendAddedFile(builder, stats, *fileit);
 			++fileit;
-			stats.filesAdded++;
 		}
 
 		// check if file exists
@@ -163,48 +273,241 @@ static void processChunkData(Output* output, BuildContext* builder, UpdateFileIt
 		}
 		else if (f.startLine == 0)
 		{
-			stats.filesRemoved++;
+			recordRemovedFile(stats, f, data);
 		}
 	}
 }
 
-static bool processFile(Output* output, BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats, const char* path)
+// Chunks of a mapped file that is updated in place reference compressed data in the mapping unless the builder needs it to rebuild postings
+static bool readChunk(DataFileReader& in, size_t i, UpdateChunk& chunk, bool inPlace, bool postings)
+{
+	const DataChunkTableEntry& entry = in.getChunk(i);
+	const DataChunkHeader& header = entry.header;
+
+	chunk.header = header;
+	chunk.dataOffset = inPlace ? entry.dataOffset : 0;
+	chunk.firstFile.assign(in.getChunkFirstName(i), entry.firstNameLength);
+	chunk.paths.resize(entry.pathSize);
+
+	chunk.extra.reset(new (std::nothrow) char[header.extraSize]);
+	chunk.index.reset(new (std::nothrow) char[header.indexSize]);
+
+	const char* mapped = (inPlace && !postings) ? in.view(entry.dataOffset, header.compressedSize) : nullptr;
+
+	size_t uncompressedOffset = mapped ? 0 : (header.compressedSize + 7) & ~7; // make sure uncompressed data is aligned
+
+	chunk.data.reset(new (std::nothrow) char[uncompressedOffset + header.uncompressedSize]);
+	chunk.compressed = mapped ? mapped : chunk.data.get();
+
+	if (!chunk.extra || !chunk.index || !chunk.data || header.fileCount == 0 ||
+		!in.read(entry.indexOffset, chunk.index.get(), header.indexSize) || (!mapped && !in.read(entry.dataOffset, chunk.data.get(), header.compressedSize)) ||
+		(entry.pathSize && !in.read(entry.pathOffset, &chunk.paths[0], entry.pathSize)))
+		return false;
+
+	memcpy(chunk.extra.get(), in.getChunkLastName(i), header.extraSize);
+
+	chunk.uncompressed = chunk.data.get() + uncompressedOffset;
+	chunk.decompressed = false;
+
+	chunk.dictionary = in.getDictionary();
+	chunk.dictionarySize = in.getDictionarySize();
+	chunk.currentPosition = SIZE_MAX;
+
+	return true;
+}
+
+static bool isDataFileSettingsCurrent(const DataFileHeader& header, const ProjectOptions& options)
+{
+	return header.chunkSize == options.chunkSize && int(header.compressionLevel) == options.compressionLevel && header.indexRatio == options.indexRatio && header.codec == options.codec &&
+		header.maxFileSize == options.maxFileSize && header.maxLineLength == options.maxLineLength && (header.skipBinary != 0) == options.skipBinary;
+}
+
+// Opens the existing data file if its chunks can be reused; returns false if the file is malformed
+static bool openDataFile(Output* output, std::unique_ptr<DataFileReader>& result, const char* path, const ProjectOptions& options)
 {
-	FileStream in(path, "rb");
-	if (!in) return true;
+	std::unique_ptr<DataFileReader> in(new DataFileReader());
+	if (!in->open(path)) return true;
 
-	DataFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+	DataFileReader::TableStatus status = in->readTable();
+
+	if (status == DataFileReader::Table_OutOfDate)
 	{
 		output->error("Warning: data file %s has an out of date format, rebuilding\n", path);
 		return true;
 	}
 
-	DataChunkHeader chunk;
+	if (status != DataFileReader::Table_Ok)
+	{
+		output->error("Error reading data file %s: malformed chunk table\n", path);
+		return false;
+	}
 
-	while (read(in, chunk))
+	if (!isDataFileSettingsCurrent(in->getHeader(), options))
 	{
-		std::unique_ptr<char[]> extra(new (std::nothrow) char[chunk.extraSize]);
-		std::unique_ptr<char[]> index(new (std::nothrow) char[chunk.indexSize]);
+		output->print("Data file settings changed, rebuilding\n");
+		return true;
+	}
 
-		size_t uncompressedOffset = (chunk.compressedSize + 7) & ~7; // make sure uncompressed data is aligned
+	result = std::move(in);
+	return true;
+}
 
-		std::unique_ptr<char[]> data(new (std::nothrow) char[uncompressedOffset + chunk.uncompressedSize]);
+// Merges chunks [begin, end) of the existing data file with the files that go to the same tier, and adds the remaining files after them
+// When updating in place, chunks that are current stay where they are in the data file
+static bool processChunks(Output* output, BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats, DataFileReader* in, size_t begin, size_t end,
+	const char* path, bool inPlace, bool postings)
+{
+	// Chunks are read in order and checked/decompressed on worker threads; results are consumed in order since appending to the build is serial
+	WorkQueue queue(WorkQueue::getIdealWorkerCount(), 0);
 
-		if (!extra || !index || !data || !read(in, extra.get(), chunk.extraSize) || !read(in, index.get(), chunk.indexSize) || !read(in, data.get(), chunk.compressedSize))
+	std::deque<std::pair<std::shared_ptr<UpdateChunk>, std::future<void>>> pending;
+	size_t pendingSize = 0;
+
+	for (size_t i = begin; i < end || !pending.empty(); )
+	{
+		// limit the read-ahead window by the amount of decompressed data
+		if (i < end && (pending.empty() || pendingSize + in->getChunk(i).header.uncompressedSize <= kMaxQueuedReadData))
 		{
-			output->error("Error reading data file %s: malformed chunk\n", path);
-			return false;
+			std::shared_ptr<UpdateChunk> chunk(new UpdateChunk());
+
+			if (!readChunk(*in, i, *chunk, inPlace, postings))
+			{
+				output->error("Error reading data file %s: malformed chunk\n", path);
+				queue.wait();
+				return false;
+			}
+
+			std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+			const std::vector<FileInfo>* fileList = &fileit.files;
+
+			queue.push([=] {
+				prepareChunk(*chunk, *fileList);
+				promise->set_value();
+			});
+
+			pending.emplace_back(chunk, promise->get_future());
+			pendingSize += chunk->header.uncompressedSize;
+			i++;
 		}
+		else
+		{
+			std::shared_ptr<UpdateChunk> chunk = pending.front().first;
+			pending.front().second.wait();
+			pending.pop_front();
 
-		char* uncompressed = data.get() + uncompressedOffset;
+			assert(pendingSize >= chunk->header.uncompressedSize);
+			pendingSize -= chunk->header.uncompressedSize;
+
+			processChunkData(output, builder, fileit, stats, *chunk);
+		}
+	}
 
-		processChunkData(output, builder, fileit, stats, chunk, uncompressed, data, index, extra);
+	// update all unprocessed files
+	while (fileit)
+	{
+		appendAddedFile(builder, stats, *fileit);
+		++fileit;
 	}
 
 	return true;
 }
 
+// Paths of the files in the hot tier of the data file
+static std::unordered_set<std::string> getHotTierPaths(DataFileReader& in)
+{
+	std::unordered_set<std::string> result;
+	std::vector<char> storage;
+
+	for (size_t i = 0; i < in.getHeader().hotChunkCount; ++i)
+	{
+		const DataChunkTableEntry& entry = in.getChunk(i);
+		const char* paths = entry.pathSize ? in.read(entry.pathOffset, entry.pathSize, storage) : nullptr;
+
+		for (const char* path = paths; path && path < paths + entry.pathSize; )
+		{
+			const char* eol = static_cast<const char*>(memchr(path, '\n', paths + entry.pathSize - path));
+			if (!eol) break;
+
+			result.emplace(path, eol);
+			path = eol + 1;
+		}
+	}
+
+	return result;
+}
+
+// Splits the files into the tiers, keeping the path order; files that got older than the age limit of the hot tier stay in it until they make up
+// kHotTierMaxStalePercent of its data, and then all of them move to the cold tier at once, so that the cold tier is only rewritten once in a while
+static void splitTiers(std::vector<FileInfo>& files, std::vector<FileInfo>& hotFiles, std::vector<FileInfo>& coldFiles, DataFileReader* in, const ProjectOptions& options)
+{
+	uint64_t hotTierTime = buildGetHotTierTime(options);
+	std::unordered_set<std::string> hotPaths = (in && options.hotTierDays) ? getHotTierPaths(*in) : std::unordered_set<std::string>();
+
+	uint64_t hotSize = 0;
+	uint64_t staleSize = 0;
+
+	for (auto& f: files)
+		if (f.timeStamp >= hotTierTime)
+			hotSize += f.fileSize;
+		else if (hotPaths.count(f.path))
+		{
+			hotSize += f.fileSize;
+			staleSize += f.fileSize;
+		}
+
+	bool keepStale = staleSize * 100 <= hotSize * kHotTierMaxStalePercent;
+
+	for (auto& f: files)
+	{
+		bool hot = f.timeStamp >= hotTierTime || (keepStale && hotPaths.count(f.path));
+
+		(hot ? hotFiles : coldFiles).push_back(std::move(f));
+	}
+
+	files.clear();
+}
+
+// Returns the size of the existing data file if it can be updated by appending new chunks to it
+// Chunks replaced by previous updates stay in the file as unused space, so the file is rewritten once there's too much of it
+// The rewrite goes to a temporary file that replaces the data file when it's complete; servers and watchers that have the old
+// file open or mapped keep reading its contents, and reopen the project once the data file stamp changes
+static uint64_t getInPlaceDataSize(const char* path, const ProjectOptions& options)
+{
+	uint64_t mtime, size;
+	if (!getFileAttributes(path, &mtime, &size))
+		return 0;
+
+	DataFileReader in;
+	if (!in.open(path) || in.readTable() != DataFileReader::Table_Ok)
+		return 0;
+
+	const DataFileHeader& header = in.getHeader();
+
+	// all chunks have to be rebuilt, so the file would be mostly unused space
+	if (!isDataFileSettingsCurrent(header, options))
+		return 0;
+
+	uint64_t usedSize = kDataFileHeaderSlots * sizeof(DataFileHeader) + header.dictionarySize + header.indexSize + header.pathSize + header.postingSize + header.tableSize;
+
+	for (size_t i = 0; i < in.getChunkCount(); ++i)
+		usedSize += in.getChunk(i).header.compressedSize;
+
+	if (usedSize > size || (size - usedSize) * 100 > size * kDataFileMaxUnusedPercent)
+		return 0;
+
+	return size;
+}
+
+// Chunks of the existing data file are copied as is, so a new data file has to use the same dictionary
+static std::string getDictionary(const char* path, const ProjectOptions& options, const std::vector<FileInfo>& files)
+{
+	DataFileReader in;
+	if (in.open(path) && in.readTable() == DataFileReader::Table_Ok && isDataFileSettingsCurrent(in.getHeader(), options))
+		return in.getDictionarySize() ? std::string(in.getDictionary(), in.getDictionarySize()) : std::string();
+
+	return (options.codec == CC_LZ4DICT) ? buildDictionary(files) : std::string();
+}
+
 static void printStatistics(Output* output, const UpdateStatistics& stats, unsigned int totalChunks, double time)
 {
 	if (stats.filesAdded) output->print("+%d ", stats.filesAdded);
@@ -216,7 +519,7 @@ static void printStatistics(Output* output, const UpdateStatistics& stats, unsig
 		totalChunks - stats.chunksPreserved, totalChunks, time);
 }
 
-bool updateProject(Output* output, const char* path)
+bool updateProject(Output* output, const char* path, bool keepChanges)
 {
 	auto start = std::chrono::high_resolution_clock::now();
 
@@ -226,11 +529,12 @@ bool updateProject(Output* output, const char* path)
 	if (!group)
 		return false;
 
-	removeFile(replaceExtension(path, ".qgc").c_str());
+	if (!keepChanges)
+		removeChanges(path);
 
 	output->print("Scanning project...\r");
 
-	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get());
+	std::vector<FileInfo> files = getProjectFiles(output, path, group.get(), true);
 
 	output->print("Building file table...\r");
 
@@ -240,41 +544,64 @@ bool updateProject(Output* output, const char* path)
 	std::string targetPath = replaceExtension(path, ".qgd");
 	std::string tempPath = targetPath + "_";
 
+	std::unique_ptr<DataFileReader> in;
+	if (!openDataFile(output, in, targetPath.c_str(), group->options))
+		return false;
+
+	// Updating in place only writes new chunks and the chunk table; otherwise all chunks are copied to a new file
+	uint64_t inPlaceSize = getInPlaceDataSize(targetPath.c_str(), group->options);
+
 	UpdateStatistics stats = {};
 	unsigned int totalChunks = 0;
 
 	{
-		BuildContext* builder = buildStart(output, tempPath.c_str(), files.size());
+		BuildContext* builder = inPlaceSize
+			? buildStartAppend(output, targetPath.c_str(), group->options, files.size(), inPlaceSize)
+			: buildStart(output, tempPath.c_str(), group->options, files.size(), getDictionary(targetPath.c_str(), group->options, files));
 		if (!builder)
 			return false;
 
-		UpdateFileIterator fileit = {files, 0};
+		std::vector<FileInfo> hotFiles, coldFiles;
+		splitTiers(files, hotFiles, coldFiles, in.get(), group->options);
 
-		// update contents using existing database (if any)
-		if (!processFile(output, builder, fileit, stats, targetPath.c_str()))
+		size_t chunkCount = in ? in->getChunkCount() : 0;
+		size_t hotChunkCount = in ? in->getHeader().hotChunkCount : 0;
+
+		stats.trackMoves = group->options.hotTierDays || hotChunkCount;
+
+		UpdateFileIterator hotit = {hotFiles, 0};
+		UpdateFileIterator coldit = {coldFiles, 0};
+
+		// update contents of both tiers using existing database (if any)
+		if (!processChunks(output, builder, hotit, stats, in.get(), 0, hotChunkCount, targetPath.c_str(), inPlaceSize != 0, group->options.postings))
 		{
-			buildFinish(builder);
+			buildAbort(builder);
 			return false;
 		}
 
-		// update all unprocessed files
-		while (fileit)
+		if (group->options.hotTierDays)
+			buildEndHotTier(builder, hotFiles.size());
+
+		if (!processChunks(output, builder, coldit, stats, in.get(), hotChunkCount, chunkCount, targetPath.c_str(), inPlaceSize != 0, group->options.postings))
 		{
-			buildAppendFile(builder, fileit->path.c_str(), fileit->timeStamp, fileit->fileSize);
-			++fileit;
-			stats.filesAdded++;
+			buildAbort(builder);
+			return false;
 		}
 
+		in.reset();
+
 		totalChunks = buildFinish(builder);
 	}
 
+	countMovedFiles(stats);
+
 	output->print("\n");
 
 	auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
 
 	printStatistics(output, stats, totalChunks, time.count() / 1e3);
 	
-	if (!renameFile(tempPath.c_str(), targetPath.c_str()))
+	if (!inPlaceSize && !renameFile(tempPath.c_str(), targetPath.c_str()))
 	{
 		output->error("Error saving data file %s\n", targetPath.c_str());
 		return false;
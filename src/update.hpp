@@ -3,4 +3,6 @@
 
 class Output;
 
-bool updateProject(Output* output, const char* path);
+// The change list is removed before updating unless keepChanges is set; this lets searches use it while the update is running,
+// but the caller has to remove it once the update finishes
+bool updateProject(Output* output, const char* path, bool keepChanges = false);
@@ -5,14 +5,19 @@
 #include "project.hpp"
 #include "fileutil.hpp"
 #include "filestream.hpp"
+#include "datafile.hpp"
 #include "output.hpp"
 #include "format.hpp"
 #include "compression.hpp"
 #include "constants.hpp"
 #include "update.hpp"
 #include "changes.hpp"
+#include "priority.hpp"
+#include "workqueue.hpp"
+#include "pathtable.hpp"
 
-#include <set>
+#include <algorithm>
+#include <iterator>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -27,7 +32,9 @@ struct WatchContext
 	std::thread updateThread;
 	std::vector<std::thread> watchingThreads;
 
-	std::set<std::string> changedFiles;
+	// sorted list without duplicates
+	std::vector<std::string> changedFiles;
+	unsigned int changeGeneration;
 	std::mutex changedFilesMutex;
 	std::condition_variable changedFilesChanged;
 
@@ -41,17 +48,33 @@ struct WatchContext
 	}
 };
 
-static void fileChanged(WatchContext* context, ProjectGroup* group, const char* path, const char* file)
+static void insertChangedFiles(std::vector<std::string>& changedFiles, std::vector<std::string>& files)
 {
-	if (isFileAcceptable(group, file))
-	{
-		std::string npath = normalizePath(path, file);
+	std::sort(files.begin(), files.end());
 
-		std::unique_lock<std::mutex> lock(context->changedFilesMutex);
+	size_t middle = changedFiles.size();
+	changedFiles.insert(changedFiles.end(), std::make_move_iterator(files.begin()), std::make_move_iterator(files.end()));
 
-		context->changedFiles.insert(npath);
-		context->changedFilesChanged.notify_one();
-	}
+	std::inplace_merge(changedFiles.begin(), changedFiles.begin() + middle, changedFiles.end());
+	changedFiles.erase(std::unique(changedFiles.begin(), changedFiles.end()), changedFiles.end());
+}
+
+static void filesChanged(WatchContext* context, ProjectGroup* group, const char* path, const std::vector<std::string>& files)
+{
+	std::vector<std::string> npaths;
+
+	for (auto& file: files)
+		if (isFileAcceptable(group, file.c_str()))
+			npaths.push_back(normalizePath(path, file.c_str()));
+
+	if (npaths.empty())
+		return;
+
+	std::unique_lock<std::mutex> lock(context->changedFilesMutex);
+
+	insertChangedFiles(context->changedFiles, npaths);
+	context->changeGeneration++;
+	context->changedFilesChanged.notify_one();
 }
 
 static void startWatchingRec(WatchContext* context, ProjectGroup* group)
@@ -62,7 +85,7 @@ static void startWatchingRec(WatchContext* context, ProjectGroup* group)
 
 		context->watchingThreads.emplace_back([=]
 		{
-			if (!watchDirectory(path.c_str(), [=](const char* file) { fileChanged(context, group, path.c_str(), file); }))
+			if (!watchDirectory(path.c_str(), [=](const std::vector<std::string>& files) { filesChanged(context, group, path.c_str(), files); }))
 				context->output->error("Error watching folder %s\n", path.c_str());
 
 			context->output->print("No longer watching folder %s\n", path.c_str());
@@ -73,7 +96,16 @@ static void startWatchingRec(WatchContext* context, ProjectGroup* group)
 		startWatchingRec(context, child.get());
 }
 
-static void processChunk(std::vector<FileInfo>& result, const char* data, size_t fileCount)
+// Files of a data file tier in chunk order, which is sorted by path
+struct PackFileList
+{
+	PathTable paths;
+
+	std::vector<uint64_t> timeStamps;
+	std::vector<uint64_t> fileSizes;
+};
+
+static void processChunk(PackFileList& result, const char* data, size_t fileCount)
 {
 	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
 
@@ -82,85 +114,117 @@ static void processChunk(std::vector<FileInfo>& result, const char* data, size_t
 		const DataChunkFileHeader& file = files[i];
 
 		if (file.startLine == 0)
-			result.push_back({ std::string(data + file.nameOffset, file.nameLength), file.timeStamp, file.fileSize });
+		{
+			result.paths.push_back(data + file.nameOffset, file.nameLength);
+			result.timeStamps.push_back(file.timeStamp);
+			result.fileSizes.push_back(file.fileSize);
+		}
 	}
 }
 
-static bool getDataFileList(Output* output, const char* path, std::vector<FileInfo>& result)
+static bool getDataFileList(Output* output, const char* path, std::vector<PackFileList>& result)
 {
-	FileStream in(path, "rb");
-	if (!in)
+	DataFileReader in;
+	if (!in.open(path))
 	{
 		output->error("Error reading data file %s\n", path);
 		return false;
 	}
 
-	DataFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+	if (in.readTable() != DataFileReader::Table_Ok)
 	{
 		output->error("Error reading data file %s: file format is out of date, update the project to fix\n", path);
 		return false;
 	}
 
-	DataChunkHeader chunk;
+	std::vector<char> storage;
+
+	// hot tier files precede the rest of the files and are sorted separately
+	size_t hotChunkCount = in.getHeader().hotChunkCount;
 
-	while (read(in, chunk))
+	result.resize(hotChunkCount ? 2 : 1);
+
+	for (size_t i = 0; i < in.getChunkCount(); ++i)
 	{
-		in.skip(chunk.extraSize);
-		in.skip(chunk.indexSize);
+		const DataChunkTableEntry& entry = in.getChunk(i);
+		const DataChunkHeader& chunk = entry.header;
 
-		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.compressedSize + chunk.uncompressedSize]);
+		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.uncompressedSize]);
+		const char* compressed = in.read(entry.dataOffset, chunk.compressedSize, storage);
 
-		if (!data || !read(in, data.get(), chunk.compressedSize))
+		if (!data || !compressed)
 		{
 			output->error("Error reading data file %s: malformed chunk\n", path);
 			return false;
 		}
 
-		char* uncompressed = data.get() + chunk.compressedSize;
-		decompressPartial(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize, chunk.fileTableSize);
-		processChunk(result, uncompressed, chunk.fileCount);
+		decompressPartial(data.get(), chunk.uncompressedSize, compressed, chunk.compressedSize, chunk.fileTableSize, chunk.codec, in.getDictionary(), in.getDictionarySize());
+		processChunk(result[hotChunkCount && i >= hotChunkCount], data.get(), chunk.fileCount);
 	}
 
 	return true;
 }
 
-static std::vector<std::string> getChanges(const std::vector<FileInfo>& files, const std::vector<FileInfo>& packFiles)
+static std::vector<std::string> getChanges(const std::vector<FileInfo>& files, const std::vector<PackFileList>& packFiles)
 {
 	std::vector<std::string> result;
+	std::vector<bool> packed(files.size());
 
-	size_t fileIt = 0;
-
-	for (const FileInfo& pf: packFiles)
+	for (const PackFileList& pl: packFiles)
 	{
-		// files that aren't in the pack were added
-		while (fileIt < files.size() && files[fileIt].path < pf.path)
-		{
-			result.push_back(files[fileIt].path);
-			fileIt++;
-		}
+		PathTable::Reader reader(pl.paths);
+		size_t fileIt = 0;
 
-		if (files[fileIt].path == pf.path)
+		for (size_t i = 0; reader.next(); ++i)
 		{
-			// files that were in the pack might have changed
-			if (files[fileIt].timeStamp != pf.timeStamp || files[fileIt].fileSize != pf.fileSize)
-				result.push_back(files[fileIt].path);
+			const std::string& path = reader.path();
 
-			fileIt++;
-		}
-		else
-		{
-			// files that were in the pack were removed
-			result.push_back(pf.path);
+			while (fileIt < files.size() && files[fileIt].path < path)
+				fileIt++;
+
+			if (fileIt < files.size() && files[fileIt].path == path)
+			{
+				// files that were in the pack might have changed
+				if (files[fileIt].timeStamp != pl.timeStamps[i] || files[fileIt].fileSize != pl.fileSizes[i])
+					result.push_back(path);
+
+				packed[fileIt] = true;
+				fileIt++;
+			}
+			else
+			{
+				// files that were in the pack were removed
+				result.push_back(path);
+			}
 		}
 	}
 
 	// files that aren't in the pack were added
-	while (fileIt < files.size())
-	{
-		result.push_back(files[fileIt].path);
-		fileIt++;
-	}
+	for (size_t i = 0; i < files.size(); ++i)
+		if (!packed[i])
+			result.push_back(files[i].path);
+
+	std::sort(result.begin(), result.end());
+
+	return result;
+}
+
+// Update runs on a separate thread so that the priority and thread limits only apply to the update and the threads it starts
+// Searches keep using the old data file until the update switches to the new one
+static bool updateProjectInBackground(Output* output, const char* path, const ProjectOptions& options)
+{
+	bool result = false;
+
+	std::thread([&]() {
+		bool background = options.watchUpdateBackground && enterBackgroundMode();
+
+		WorkQueue::setWorkerLimit(options.watchUpdateThreads);
+
+		result = updateProject(output, path, /* keepChanges= */ true);
+
+		if (background)
+			leaveBackgroundMode();
+	}).join();
 
 	return result;
 }
@@ -183,30 +247,39 @@ void watchProject(Output* output, const char* path, bool interactive)
 
 	startWatchingRec(&context, group.get());
 
-	output->print("Scanning project...%s", lineEnd);
+	std::vector<std::string> changedFiles;
 
-	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get());
+	// file lists are only needed to find the initial changes, so they don't stay around while watching
+	{
+		output->print("Scanning project...%s", lineEnd);
 
-	output->print("Reading data pack...%s", lineEnd);
+		std::vector<FileInfo> files = getProjectFiles(output, path, group.get(), true);
 
-	std::vector<FileInfo> packFiles;
-	if (!getDataFileList(output, replaceExtension(path, ".qgd").c_str(), packFiles))
-		return;
+		output->print("Reading data pack...%s", lineEnd);
+
+		std::vector<PackFileList> packFiles;
+		if (!getDataFileList(output, replaceExtension(path, ".qgd").c_str(), packFiles))
+			return;
 
-	removeFile(replaceExtension(path, ".qgc").c_str());
+		changedFiles = getChanges(files, packFiles);
+	}
 
-	std::vector<std::string> changedFiles = getChanges(files, packFiles);
+	removeChanges(path);
 
 	{
 		std::unique_lock<std::mutex> lock(context.changedFilesMutex);
 
-		context.changedFiles.insert(changedFiles.begin(), changedFiles.end());
+		std::vector<std::string> files = changedFiles;
+		insertChangedFiles(context.changedFiles, files);
 	}
 
 	output->print("Listening for changes\n");
 
-	bool updateNeeded = changedFiles.size() > size_t(kWatchUpdateThresholdFiles);
+	const ProjectOptions& options = group->options;
+
+	bool updateNeeded = changedFiles.size() > options.watchUpdateFiles;
 	bool writeNeeded = true; // write initial state
+	unsigned int changeGeneration = 0;
 	auto writeDeadline = std::chrono::steady_clock::now();
 
 	for (;;)
@@ -227,7 +300,7 @@ void watchProject(Output* output, const char* path, bool interactive)
 			}
 			else if (updateNeeded)
 			{
-				if (context.changedFilesChanged.wait_for(lock, std::chrono::seconds(kWatchUpdateTimeout)) == std::cv_status::timeout)
+				if (context.changedFilesChanged.wait_for(lock, std::chrono::seconds(options.watchUpdateDelay)) == std::cv_status::timeout)
 				{
 					// we've reached steady state, update
 					updateNow = true;
@@ -238,9 +311,11 @@ void watchProject(Output* output, const char* path, bool interactive)
 				context.changedFilesChanged.wait(lock);
 			}
 
-			if (context.changedFiles.size() != changedFiles.size())
+			// files that are already in the change list need to be written again since the side pack has their old contents
+			if (context.changeGeneration != changeGeneration)
 			{
-				changedFiles.assign(context.changedFiles.begin(), context.changedFiles.end());
+				changedFiles = context.changedFiles;
+				changeGeneration = context.changeGeneration;
 
 				if (!writeNeeded)
 				{
@@ -248,7 +323,7 @@ void watchProject(Output* output, const char* path, bool interactive)
 					writeDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(kWatchWriteDeadline);
 				}
 
-				if (changedFiles.size() > size_t(kWatchUpdateThresholdFiles))
+				if (changedFiles.size() > options.watchUpdateFiles)
 				{
 					updateNeeded = true;
 				}
@@ -265,9 +340,11 @@ void watchProject(Output* output, const char* path, bool interactive)
 				context.changedFiles.clear();
 			}
 
-			// this removes the current changes file and updates the pack
-			if (updateProject(output, path))
+			// searches use the current change list until the update finishes; files changed during the update will be written to a new list
+			if (updateProjectInBackground(output, path, options))
 			{
+				removeChanges(path);
+
 				updateNeeded = false;
 			}
 			else
@@ -276,10 +353,11 @@ void watchProject(Output* output, const char* path, bool interactive)
 				{
 					std::unique_lock<std::mutex> lock(context.changedFilesMutex);
 
-					context.changedFiles.insert(changedFiles.begin(), changedFiles.end());
+					std::vector<std::string> files = changedFiles;
+					insertChangedFiles(context.changedFiles, files);
 				}
 
-				// update may have removed the change list so we'll need to restore that as well
+				// change list might be out of date after a partial update, so we'll need to rewrite that as well
 				writeNeeded = true;
 			}
 		}
@@ -290,6 +368,14 @@ void watchProject(Output* output, const char* path, bool interactive)
 			if (!interactive)
 				printStatistics(output, path, changedFiles.size());
 
+			if (!writeSidePack(output, path, group->options, changedFiles))
+			{
+				output->error("Error saving changed files to %s\n", replaceExtension(path, ".qgs").c_str());
+
+				// searches read changed files from disk without the side pack
+				removeFile(replaceExtension(path, ".qgs").c_str());
+			}
+
 			if (writeChanges(path, changedFiles))
 			{
 				writeNeeded = false;
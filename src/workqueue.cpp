@@ -2,38 +2,335 @@
 #include "common.hpp"
 #include "workqueue.hpp"
 
-#include <functional>
-#include <thread>
+#include "topology.hpp"
+
+#include <algorithm>
+
+static const size_t kWorkerQueueSize = 256; // must be a power of two
+
+static thread_local WorkQueue* gCurrentQueue;
+static thread_local size_t gCurrentWorker;
+static thread_local unsigned int gWorkerLimit;
 
 unsigned int WorkQueue::getIdealWorkerCount()
 {
-	return std::max(std::thread::hardware_concurrency(), 1u);
+	unsigned int count = std::max(std::thread::hardware_concurrency(), 1u);
+
+	return gWorkerLimit ? std::min(count, gWorkerLimit) : count;
+}
+
+void WorkQueue::setWorkerLimit(unsigned int limit)
+{
+	gWorkerLimit = limit;
 }
 
-static void workerThreadFun(BlockingQueue<std::function<void()>>& queue)
+unsigned int WorkQueue::getWorkerLimit()
 {
-	while (std::function<void()> fun = queue.pop())
+	return gWorkerLimit;
+}
+
+WorkQueue::WorkQueue(size_t workerCount, size_t memoryLimit, bool numa)
+	: workers(new Worker[workerCount]), workerCount(workerCount), memoryLimit(memoryLimit), memoryUsed(0)
+	, pendingTasks(0), activeTasks(0), nextWorker(0), sleepingWorkers(0), waitingProducers(0), stopping(false)
+{
+	// splitting workers only makes sense if every node gets at least one
+	if (numa)
+		numaNodes = getNumaNodes();
+
+	if (numaNodes.size() < 2 || numaNodes.size() > workerCount)
+		numaNodes.clear();
+
+	// consecutive workers belong to the same node
+	size_t nodeCount = std::max<size_t>(numaNodes.size(), 1);
+
+	for (size_t i = 0; i <= nodeCount; ++i)
+		nodeWorkers.push_back(i * workerCount / nodeCount);
+
+	for (size_t i = 0; i < workerCount; ++i)
 	{
-		fun();
+		Worker& worker = workers[i];
+
+		worker.node = std::upper_bound(nodeWorkers.begin(), nodeWorkers.end(), i) - nodeWorkers.begin() - 1;
+
+		size_t nodeBegin = nodeWorkers[worker.node], nodeEnd = nodeWorkers[worker.node + 1];
+
+		for (size_t j = 0; j < nodeEnd - nodeBegin; ++j)
+			worker.victims.push_back(nodeBegin + (i - nodeBegin + j) % (nodeEnd - nodeBegin));
+
+		for (size_t j = 0; j < workerCount; ++j)
+			if (j < nodeBegin || j >= nodeEnd)
+				worker.victims.push_back(j);
+
+		worker.cells.reset(new Cell[kWorkerQueueSize]);
+
+		for (size_t j = 0; j < kWorkerQueueSize; ++j)
+			worker.cells[j].sequence.store(j, std::memory_order_relaxed);
+
+		worker.enqueuePos.store(0, std::memory_order_relaxed);
+		worker.dequeuePos.store(0, std::memory_order_relaxed);
 	}
+
+	for (size_t i = 0; i < workerCount; ++i)
+		threads.emplace_back(&WorkQueue::workerThreadFun, this, i);
 }
 
-WorkQueue::WorkQueue(size_t workerCount, size_t memoryLimit): queue(memoryLimit)
+WorkQueue::~WorkQueue()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	wakeup.notify_all();
+
+	// workers drain all queued tasks before exiting
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
+
+unsigned int WorkQueue::getNodeCount() const
+{
+	return nodeWorkers.size() - 1;
+}
+
+int WorkQueue::getNumaNode(unsigned int node) const
+{
+	assert(node < getNodeCount());
+
+	return numaNodes.empty() ? -1 : int(numaNodes[node]);
+}
+
+void WorkQueue::pushTask(Task& task, size_t size, unsigned int node)
+{
+	assert(workerCount > 0);
+	assert(node == kAnyNode || node < getNodeCount());
+
+	reserveMemory(size);
+
+	activeTasks.fetch_add(1);
+
+	// count the task before it's visible so that workers don't go to sleep while it's being enqueued
+	pendingTasks.fetch_add(1);
+
+	// tasks pushed from a worker go to its own queue; external tasks are spread between workers of the requested node
+	size_t start = (gCurrentQueue == this) ? gCurrentWorker : nextWorker.fetch_add(1, std::memory_order_relaxed);
+
+	if (gCurrentQueue != this && node != kAnyNode)
+		start = nodeWorkers[node] + start % (nodeWorkers[node + 1] - nodeWorkers[node]);
+
+	// if the queue is full, the task goes to the next worker with space, which is usually on the same node
+	for (size_t attempt = 0; !enqueue(workers[(start + attempt) % workerCount], task, size); ++attempt)
+	{
+		// all queues are full; wait for workers to catch up
+		if (attempt % workerCount == workerCount - 1)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			waitingProducers++;
+
+			// workers check for waiting producers after taking a task; the queues are checked after registering so that a task
+			// that was taken before that can't be missed
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			spaceAvailable.wait(lock, [&]() { return hasQueueSpace(); });
+			waitingProducers--;
+		}
+	}
+
+	if (sleepingWorkers.load() > 0)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+		}
+
+		wakeup.notify_one();
+	}
+}
+
+void WorkQueue::wait()
+{
+	assert(gCurrentQueue != this);
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	tasksFinished.wait(lock, [&]() { return activeTasks.load() == 0; });
+}
+
+void WorkQueue::reserveMemory(size_t size)
+{
+	if (size == 0)
+		return;
+
+	size_t current = memoryUsed.load();
+
+	for (;;)
+	{
+		if (current != 0 && current + size > memoryLimit)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			waitingProducers++;
+			spaceAvailable.wait(lock, [&]() { current = memoryUsed.load(); return current == 0 || current + size <= memoryLimit; });
+			waitingProducers--;
+		}
+		else if (memoryUsed.compare_exchange_weak(current, current + size))
+			break;
+	}
+}
+
+void WorkQueue::releaseMemory(size_t size)
+{
+	if (size > 0)
+	{
+		assert(memoryUsed.load() >= size);
+		memoryUsed.fetch_sub(size);
+	}
+
+	// the queue cell is freed before the check; pairs with the fence in pushTask
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (waitingProducers.load() > 0)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+		}
+
+		spaceAvailable.notify_all();
+	}
+}
+
+bool WorkQueue::enqueue(Worker& worker, Task& task, size_t size)
+{
+	size_t pos = worker.enqueuePos.load(std::memory_order_relaxed);
+
+	for (;;)
+	{
+		Cell& cell = worker.cells[pos & (kWorkerQueueSize - 1)];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		ptrdiff_t diff = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos);
+
+		if (diff == 0)
+		{
+			if (worker.enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				cell.task.take(task);
+				cell.size = size;
+				cell.sequence.store(pos + 1, std::memory_order_release);
+
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = worker.enqueuePos.load(std::memory_order_relaxed);
+	}
+}
+
+bool WorkQueue::hasQueueSpace()
 {
 	for (size_t i = 0; i < workerCount; ++i)
-		workers.emplace_back(std::bind(workerThreadFun, std::ref(queue)));
+	{
+		Worker& worker = workers[i];
+
+		size_t pos = worker.enqueuePos.load(std::memory_order_relaxed);
+		size_t sequence = worker.cells[pos & (kWorkerQueueSize - 1)].sequence.load(std::memory_order_acquire);
+
+		// the cell is free, or it was just filled and the producer position is moving on
+		if (static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos) >= 0)
+			return true;
+	}
+
+	return false;
 }
 
-WorkQueue::~WorkQueue()
+bool WorkQueue::dequeue(Worker& worker, Task& task, size_t& size)
 {
-	for (size_t i = 0; i < workers.size(); ++i)
-		queue.push(std::function<void()>());
+	size_t pos = worker.dequeuePos.load(std::memory_order_relaxed);
+
+	for (;;)
+	{
+		Cell& cell = worker.cells[pos & (kWorkerQueueSize - 1)];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		ptrdiff_t diff = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos + 1);
 
-	for (size_t i = 0; i < workers.size(); ++i)
-		workers[i].join();
+		if (diff == 0)
+		{
+			if (worker.dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				task.take(cell.task);
+				size = cell.size;
+				cell.sequence.store(pos + kWorkerQueueSize, std::memory_order_release);
+
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = worker.dequeuePos.load(std::memory_order_relaxed);
+	}
 }
 
-void WorkQueue::push(std::function<void()> fun, size_t size)
+bool WorkQueue::pop(size_t index, Task& task)
 {
-	queue.push(std::move(fun), size);
+	size_t size = 0;
+
+	// own queue first, then steal from other workers on the same node, then from the rest
+	for (size_t victim: workers[index].victims)
+		if (dequeue(workers[victim], task, size))
+		{
+			pendingTasks.fetch_sub(1);
+			releaseMemory(size);
+
+			return true;
+		}
+
+	return false;
+}
+
+void WorkQueue::workerThreadFun(size_t index)
+{
+	gCurrentQueue = this;
+	gCurrentWorker = index;
+
+	if (!numaNodes.empty())
+		setThreadNumaNode(numaNodes[workers[index].node]);
+
+	Task task;
+
+	for (;;)
+	{
+		if (pop(index, task))
+		{
+			task.run();
+			task.reset();
+
+			if (activeTasks.fetch_sub(1) == 1)
+			{
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+				}
+
+				tasksFinished.notify_all();
+			}
+
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+
+		// a task is being enqueued or was just taken by another worker
+		if (pendingTasks.load() > 0)
+			continue;
+
+		if (stopping)
+			break;
+
+		sleepingWorkers++;
+		wakeup.wait(lock, [&]() { return pendingTasks.load() > 0 || stopping; });
+		sleepingWorkers--;
+	}
+
+	gCurrentQueue = nullptr;
 }
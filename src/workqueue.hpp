@@ -3,21 +3,206 @@
 
 #include <vector>
 #include <thread>
-#include <functional>
-
-#include "blockingqueue.hpp"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cassert>
 
+// Thread pool with per-worker task queues; idle workers steal tasks from other workers' queues
+// Pushing blocks while the total size of queued tasks exceeds memoryLimit (tasks with zero size are not limited)
+// Workers can be split between NUMA nodes and pinned to their processors; tasks can be pushed to the workers of a node,
+// and idle workers steal from other workers on the same node first
 class WorkQueue
 {
 public:
 	static unsigned int getIdealWorkerCount();
 
-	WorkQueue(size_t workerCount, size_t memoryLimit);
+	// Limits the worker count returned by getIdealWorkerCount on the calling thread, e.g. for background work; 0 removes the limit
+	static void setWorkerLimit(unsigned int limit);
+	static unsigned int getWorkerLimit();
+
+	static const unsigned int kAnyNode = ~0u;
+
+	WorkQueue(size_t workerCount, size_t memoryLimit, bool numa = false);
 	~WorkQueue();
 
-	void push(std::function<void()> fun, size_t size = 0);
+	// Nodes are indexed from 0 to getNodeCount() - 1; a queue that isn't split between NUMA nodes has one node
+	unsigned int getNodeCount() const;
+
+	// Returns the system number of the NUMA node, or -1 if the queue isn't split between NUMA nodes
+	int getNumaNode(unsigned int node) const;
+
+	template <typename F> void push(F&& fun, size_t size = 0, unsigned int node = kAnyNode)
+	{
+		Task task;
+		task.set(std::forward<F>(fun));
+
+		pushTask(task, size, node);
+	}
+
+	// Waits until all pushed tasks finish running; can't be called from worker threads
+	void wait();
 
 private:
-	BlockingQueue<std::function<void()>> queue;
-	std::vector<std::thread> workers;
+	// Type-erased function object; small functions are stored inline to avoid allocating memory for every task
+	class Task
+	{
+	public:
+		Task(): manager(nullptr)
+		{
+		}
+
+		~Task()
+		{
+			reset();
+		}
+
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+
+		template <typename F> void set(F&& fun)
+		{
+			typedef typename std::decay<F>::type T;
+
+			assert(!manager);
+			setImpl<T>(std::forward<F>(fun), std::integral_constant<bool, sizeof(T) <= sizeof(Storage) && std::alignment_of<T>::value <= std::alignment_of<Storage>::value>());
+		}
+
+		void take(Task& other)
+		{
+			assert(!manager && other.manager);
+
+			other.manager(Action_Move, &storage, &other.storage);
+			manager = other.manager;
+			other.manager = nullptr;
+		}
+
+		void run()
+		{
+			assert(manager);
+			manager(Action_Run, &storage, nullptr);
+		}
+
+		void reset()
+		{
+			if (manager)
+			{
+				manager(Action_Destroy, &storage, nullptr);
+				manager = nullptr;
+			}
+		}
+
+	private:
+		enum Action
+		{
+			Action_Run,
+			Action_Move,
+			Action_Destroy
+		};
+
+		typedef std::aligned_storage<192>::type Storage;
+
+		Storage storage;
+		void (*manager)(Action action, void* self, void* other);
+
+		template <typename T, typename F> void setImpl(F&& fun, std::true_type)
+		{
+			new (&storage) T(std::forward<F>(fun));
+			manager = inlineManager<T>;
+		}
+
+		template <typename T, typename F> void setImpl(F&& fun, std::false_type)
+		{
+			*reinterpret_cast<T**>(&storage) = new T(std::forward<F>(fun));
+			manager = heapManager<T>;
+		}
+
+		template <typename T> static void inlineManager(Action action, void* self, void* other)
+		{
+			T* fun = static_cast<T*>(self);
+
+			switch (action)
+			{
+			case Action_Run: (*fun)(); break;
+			case Action_Move: new (self) T(std::move(*static_cast<T*>(other))); static_cast<T*>(other)->~T(); break;
+			case Action_Destroy: fun->~T(); break;
+			}
+		}
+
+		template <typename T> static void heapManager(Action action, void* self, void* other)
+		{
+			T*& fun = *static_cast<T**>(self);
+
+			switch (action)
+			{
+			case Action_Run: (*fun)(); break;
+			case Action_Move: fun = *static_cast<T**>(other); break;
+			case Action_Destroy: delete fun; break;
+			}
+		}
+	};
+
+	// Bounded multi-producer multi-consumer ring; every cell has a sequence number that tells producers and consumers whether the cell is ready for them
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		size_t size;
+		Task task;
+	};
+
+	struct Worker
+	{
+		std::unique_ptr<Cell[]> cells;
+
+		unsigned int node;
+
+		// workers to take tasks from, starting with this one and followed by other workers on the same node
+		std::vector<size_t> victims;
+
+		// keep producer and consumer positions on separate cache lines
+		std::atomic<size_t> enqueuePos;
+		char padding[64];
+		std::atomic<size_t> dequeuePos;
+	};
+
+	std::unique_ptr<Worker[]> workers;
+	size_t workerCount;
+	std::vector<std::thread> threads;
+
+	// system node numbers and the first worker of every node, followed by workerCount
+	std::vector<unsigned int> numaNodes;
+	std::vector<size_t> nodeWorkers;
+
+	size_t memoryLimit;
+	std::atomic<size_t> memoryUsed;
+
+	std::atomic<size_t> pendingTasks;
+	std::atomic<size_t> activeTasks;
+	std::atomic<size_t> nextWorker;
+
+	std::mutex mutex;
+	std::condition_variable wakeup;
+
+	// signalled by workers after taking a task if producers are waiting for a queue cell or for queued memory to go down
+	std::condition_variable spaceAvailable;
+	std::condition_variable tasksFinished;
+	std::atomic<unsigned int> sleepingWorkers;
+	std::atomic<unsigned int> waitingProducers;
+	bool stopping;
+
+	void pushTask(Task& task, size_t size, unsigned int node);
+
+	void reserveMemory(size_t size);
+	void releaseMemory(size_t size);
+
+	bool enqueue(Worker& worker, Task& task, size_t size);
+	bool hasQueueSpace();
+	bool dequeue(Worker& worker, Task& task, size_t& size);
+	bool pop(size_t index, Task& task);
+
+	void workerThreadFun(size_t index);
 };